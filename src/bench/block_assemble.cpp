@@ -0,0 +1,98 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <bench/chain_setup.h>
+#include <chainparams.h>
+#include <consensus/consensus.h>
+#include <miner.h>
+#include <txmempool.h>
+#include <validation.h>
+
+#include <vector>
+
+// Number of mature coinbases spent by the mempool transactions, and the
+// number of children of each of their spends.
+static const int NUM_PARENTS = 100;
+static const int NUM_CHILDREN = 20;
+
+static const CScript SCRIPT_PUB = CScript() << OP_TRUE;
+
+/**
+ * A mempool of about 2000 transactions on a regtest chain, and one more
+ * spendable coinbase.
+ */
+class BlockAssembleSetup : public RegtestChainSetup
+{
+public:
+    std::vector<CTransactionRef> m_coinbases;
+    CTransactionRef m_spare;
+
+    BlockAssembleSetup()
+    {
+        for (int i = 0; i < COINBASE_MATURITY + NUM_PARENTS + 1; ++i) {
+            m_coinbases.push_back(MineBlock(SCRIPT_PUB).vtx[0]);
+        }
+
+        // Parents fan out to children paying a spread of feerates.
+        for (int i = 0; i < NUM_PARENTS; ++i) {
+            CMutableTransaction parent;
+            parent.vin.emplace_back(COutPoint(m_coinbases[i]->GetHash(), 0));
+            CAmount fee = 1000 + 100 * i;
+            for (int j = 0; j < NUM_CHILDREN; ++j) {
+                parent.vout.emplace_back((m_coinbases[i]->vout[0].nValue - fee) / NUM_CHILDREN, SCRIPT_PUB);
+            }
+            CTransactionRef parent_ref = MakeTransactionRef(std::move(parent));
+            Accept(parent_ref);
+            for (int j = 0; j < NUM_CHILDREN; ++j) {
+                CMutableTransaction child;
+                child.vin.emplace_back(COutPoint(parent_ref->GetHash(), j));
+                child.vout.emplace_back(parent_ref->vout[j].nValue - 1000 - 50 * j, SCRIPT_PUB);
+                Accept(MakeTransactionRef(std::move(child)));
+            }
+        }
+
+        CMutableTransaction spare;
+        spare.vin.emplace_back(COutPoint(m_coinbases[NUM_PARENTS]->GetHash(), 0));
+        spare.vout.emplace_back(m_coinbases[NUM_PARENTS]->vout[0].nValue - 5000, SCRIPT_PUB);
+        m_spare = MakeTransactionRef(std::move(spare));
+    }
+};
+
+// Each iteration adds or removes one transaction, as happens between two
+// getblocktemplate calls, and then assembles a block.
+
+static void AssembleBlock(benchmark::State& state)
+{
+    BlockAssembleSetup setup;
+    bool in_mempool = false;
+    while (state.KeepRunning()) {
+        if (in_mempool) {
+            mempool.removeRecursive(*setup.m_spare, MemPoolRemovalReason::CONFLICT);
+        } else {
+            setup.Accept(setup.m_spare);
+        }
+        in_mempool = !in_mempool;
+        BlockAssembler(Params()).CreateNewBlock(SCRIPT_PUB);
+    }
+}
+
+static void AssembleBlockIncremental(benchmark::State& state)
+{
+    BlockAssembleSetup setup;
+    BlockTemplateManager manager(Params());
+    bool in_mempool = false;
+    while (state.KeepRunning()) {
+        if (in_mempool) {
+            mempool.removeRecursive(*setup.m_spare, MemPoolRemovalReason::CONFLICT);
+        } else {
+            setup.Accept(setup.m_spare);
+        }
+        in_mempool = !in_mempool;
+        manager.GetBlockTemplate(SCRIPT_PUB);
+    }
+}
+
+BENCHMARK(AssembleBlock, 30);
+BENCHMARK(AssembleBlockIncremental, 3000);
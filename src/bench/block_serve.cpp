@@ -0,0 +1,129 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <bench/chain_setup.h>
+#include <chainparams.h>
+#include <consensus/consensus.h>
+#include <crypto/sha256.h>
+#include <net.h>
+#include <netmessagemaker.h>
+#include <protocol.h>
+#include <validation.h>
+#include <version.h>
+
+#include <utility>
+#include <vector>
+
+// Number of blocks served per iteration, and the number of transactions with
+// a witness in each of them.
+static const int NUM_BLOCKS = 4;
+static const int NUM_BLOCK_TXS = 2000;
+
+/** A regtest chain with a few blocks full of segwit spends, as served to a peer in IBD */
+class BlockServeSetup : public RegtestChainSetup
+{
+public:
+    std::vector<std::pair<CDiskBlockPos, uint256>> m_blocks;
+
+    BlockServeSetup()
+    {
+        const CScript witness_script = CScript() << OP_TRUE;
+        uint256 script_hash;
+        CSHA256().Write(witness_script.data(), witness_script.size()).Finalize(script_hash.begin());
+        const CScript script_pub = CScript() << OP_0 << ToByteVector(script_hash);
+        const std::vector<unsigned char> witness(witness_script.begin(), witness_script.end());
+
+        CTransactionRef coinbase;
+        for (int i = 0; i < COINBASE_MATURITY + 1; ++i) {
+            CBlock block = MineBlock(script_pub);
+            if (!coinbase) coinbase = block.vtx[0];
+        }
+
+        // Fan a coinbase out, and then spend each output again in every block.
+        CMutableTransaction fanout;
+        fanout.vin.emplace_back(COutPoint(coinbase->GetHash(), 0));
+        fanout.vin[0].scriptWitness.stack.push_back(witness);
+        for (int i = 0; i < NUM_BLOCK_TXS; ++i) {
+            fanout.vout.emplace_back((coinbase->vout[0].nValue - 100000) / NUM_BLOCK_TXS, script_pub);
+        }
+        CTransactionRef fanout_ref = MakeTransactionRef(std::move(fanout));
+        Accept(fanout_ref);
+        MineBlock(script_pub);
+
+        std::vector<CTxOut> outputs = fanout_ref->vout;
+        std::vector<COutPoint> outpoints;
+        for (int i = 0; i < NUM_BLOCK_TXS; ++i) {
+            outpoints.emplace_back(fanout_ref->GetHash(), i);
+        }
+        for (int b = 0; b < NUM_BLOCKS; ++b) {
+            for (int i = 0; i < NUM_BLOCK_TXS; ++i) {
+                CMutableTransaction tx;
+                tx.vin.emplace_back(outpoints[i]);
+                tx.vin[0].scriptWitness.stack.push_back(witness);
+                tx.vout.emplace_back(outputs[i].nValue - 1000, script_pub);
+                CTransactionRef tx_ref = MakeTransactionRef(std::move(tx));
+                Accept(tx_ref);
+                outputs[i] = tx_ref->vout[0];
+                outpoints[i] = COutPoint(tx_ref->GetHash(), 0);
+            }
+            CBlock block = MineBlock(script_pub);
+            assert(block.vtx.size() == NUM_BLOCK_TXS + 1);
+            LOCK(cs_main);
+            m_blocks.emplace_back(chainActive.Tip()->GetBlockPos(), block.GetHash());
+        }
+    }
+};
+
+// Each iteration reads the blocks from disk and builds the block messages to
+// send them to a peer asking for blocks with witnesses.
+
+static void ServeBlocks(benchmark::State& state, bool raw, bool mmap)
+{
+    BlockServeSetup setup;
+    const CChainParams& chainparams = Params();
+    const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
+    fBlockMmap = mmap;
+    while (state.KeepRunning()) {
+        for (const auto& block : setup.m_blocks) {
+            CSerializedNetMsg msg;
+            if (raw) {
+                bool read = ReadRawBlockFromDisk(msg.data, block.first, block.second, chainparams.MessageStart());
+                assert(read);
+                msg.command = NetMsgType::BLOCK;
+            } else {
+                CBlock read;
+                bool ok = ReadBlockFromDisk(read, block.first, chainparams.GetConsensus()) && read.GetHash() == block.second;
+                assert(ok);
+                msg = msgMaker.Make(NetMsgType::BLOCK, read);
+            }
+        }
+    }
+    fBlockMmap = DEFAULT_BLOCK_MMAP;
+}
+
+static void ServeBlocksDeserialize(benchmark::State& state)
+{
+    ServeBlocks(state, false, false);
+}
+
+static void ServeBlocksDeserializeMapped(benchmark::State& state)
+{
+    ServeBlocks(state, false, true);
+}
+
+static void ServeBlocksRaw(benchmark::State& state)
+{
+    ServeBlocks(state, true, false);
+}
+
+static void ServeBlocksRawMapped(benchmark::State& state)
+{
+    ServeBlocks(state, true, true);
+}
+
+BENCHMARK(ServeBlocksDeserialize, 20);
+BENCHMARK(ServeBlocksDeserializeMapped, 20);
+BENCHMARK(ServeBlocksRaw, 200);
+BENCHMARK(ServeBlocksRawMapped, 200);
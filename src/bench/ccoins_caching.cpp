@@ -5,8 +5,10 @@
 #include <bench/bench.h>
 #include <coins.h>
 #include <policy/policy.h>
+#include <random.h>
 #include <wallet/crypter.h>
 
+#include <unordered_map>
 #include <vector>
 
 // FIXME: Dedup with SetupDummyInputs in test/transaction_tests.cpp.
@@ -85,3 +87,64 @@ static void CCoinsCaching(benchmark::State& state)
 }
 
 BENCHMARK(CCoinsCaching, 170 * 1000);
+
+// Add a batch of new coins to a cache and spend them again, as happens to
+// most coins during initial block download. Allocating and freeing the map's
+// nodes makes up much of the work.
+static void CCoinsCachingAddSpend(benchmark::State& state)
+{
+    FastRandomContext rng(true);
+    std::vector<COutPoint> outpoints;
+    for (int i = 0; i < 1000; ++i) {
+        outpoints.emplace_back(rng.rand256(), i % 4);
+    }
+    CCoinsView coinsDummy;
+    CCoinsViewCache coins(&coinsDummy);
+
+    while (state.KeepRunning()) {
+        for (const COutPoint& outpoint : outpoints) {
+            coins.AddCoin(outpoint, Coin(CTxOut(1, CScript() << OP_TRUE), 1, false), false);
+        }
+        for (const COutPoint& outpoint : outpoints) {
+            coins.SpendCoin(outpoint);
+        }
+    }
+}
+
+// Compare a CCoinsMap with its pool allocator to the same map using the
+// default allocator.
+template <typename Map>
+static void CCoinsMapFillErase(benchmark::State& state, Map& map)
+{
+    FastRandomContext rng(true);
+    std::vector<COutPoint> outpoints;
+    for (int i = 0; i < 1000; ++i) {
+        outpoints.emplace_back(rng.rand256(), i % 4);
+    }
+
+    while (state.KeepRunning()) {
+        for (const COutPoint& outpoint : outpoints) {
+            map.emplace(outpoint, CCoinsCacheEntry(Coin(CTxOut(1, CScript() << OP_TRUE), 1, false)));
+        }
+        for (const COutPoint& outpoint : outpoints) {
+            map.erase(outpoint);
+        }
+    }
+}
+
+static void CCoinsMapPoolAllocator(benchmark::State& state)
+{
+    CCoinsMapMemoryResource resource;
+    CCoinsMap map(0, SaltedOutpointHasher(), CCoinsMap::key_equal(), &resource);
+    CCoinsMapFillErase(state, map);
+}
+
+static void CCoinsMapStdAllocator(benchmark::State& state)
+{
+    std::unordered_map<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher> map;
+    CCoinsMapFillErase(state, map);
+}
+
+BENCHMARK(CCoinsCachingAddSpend, 1000);
+BENCHMARK(CCoinsMapPoolAllocator, 1000);
+BENCHMARK(CCoinsMapStdAllocator, 1000);
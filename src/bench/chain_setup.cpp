@@ -0,0 +1,90 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/chain_setup.h>
+
+#include <chainparams.h>
+#include <consensus/validation.h>
+#include <miner.h>
+#include <pow.h>
+#include <random.h>
+#include <script/sigcache.h>
+#include <txdb.h>
+#include <txmempool.h>
+#include <util.h>
+#include <utiltime.h>
+#include <validation.h>
+#include <validationinterface.h>
+
+RegtestChainSetup::RegtestChainSetup(int script_check_threads)
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    const CChainParams& chainparams = Params();
+    ClearDatadirCache();
+    m_path = fs::temp_directory_path() / strprintf("bench_bitcoin_%lu_%i", (unsigned long)GetTime(), (int)GetRandInt(100000));
+    fs::create_directories(m_path);
+    gArgs.ForceSetArg("-datadir", m_path.string());
+    fRequireStandard = false;
+    InitSignatureCache();
+    InitScriptExecutionCache();
+
+    m_threads.create_thread(boost::bind(&CScheduler::serviceQueue, &m_scheduler));
+    GetMainSignals().RegisterBackgroundSignalScheduler(m_scheduler);
+
+    pblocktree.reset(new CBlockTreeDB(1 << 20, true));
+    pcoinsdbview.reset(new CCoinsViewDB(1 << 23, true));
+    pcoinsTip.reset(new CCoinsViewCache(pcoinsdbview.get()));
+    bool loaded = LoadGenesisBlock(chainparams);
+    assert(loaded);
+    CValidationState state;
+    bool activated = ActivateBestChain(state, chainparams);
+    assert(activated);
+
+    nScriptCheckThreads = script_check_threads;
+    for (int i = 0; i < nScriptCheckThreads - 1; ++i) {
+        m_threads.create_thread(&ThreadScriptCheck);
+        m_threads.create_thread(&ThreadTxScriptCheck);
+    }
+}
+
+RegtestChainSetup::~RegtestChainSetup()
+{
+    mempool.clear();
+    m_threads.interrupt_all();
+    m_threads.join_all();
+    nScriptCheckThreads = 0;
+    GetMainSignals().FlushBackgroundCallbacks();
+    GetMainSignals().UnregisterBackgroundSignalScheduler();
+    UnloadBlockIndex();
+    pcoinsTip.reset();
+    pcoinsdbview.reset();
+    pblocktree.reset();
+    fs::remove_all(m_path);
+    SelectParams(CBaseChainParams::MAIN);
+    fRequireStandard = true;
+}
+
+CBlock RegtestChainSetup::MineBlock(const CScript& scriptPubKey)
+{
+    const CChainParams& chainparams = Params();
+    std::unique_ptr<CBlockTemplate> pblocktemplate = BlockAssembler(chainparams).CreateNewBlock(scriptPubKey);
+    CBlock& block = pblocktemplate->block;
+    unsigned int extraNonce = 0;
+    {
+        LOCK(cs_main);
+        IncrementExtraNonce(&block, chainActive.Tip(), extraNonce);
+    }
+    while (!CheckProofOfWork(block.GetHash(), block.nBits, chainparams.GetConsensus())) ++block.nNonce;
+    bool processed = ProcessNewBlock(chainparams, std::make_shared<const CBlock>(block), true, nullptr);
+    assert(processed);
+    return block;
+}
+
+void RegtestChainSetup::Accept(const CTransactionRef& tx)
+{
+    LOCK(cs_main);
+    CValidationState state;
+    bool accepted = AcceptToMemoryPool(mempool, state, tx, nullptr, nullptr, false, 0);
+    assert(accepted);
+}
@@ -0,0 +1,39 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BENCH_CHAIN_SETUP_H
+#define BITCOIN_BENCH_CHAIN_SETUP_H
+
+#include <fs.h>
+#include <primitives/block.h>
+#include <primitives/transaction.h>
+#include <scheduler.h>
+#include <script/script.h>
+
+#include <boost/thread.hpp>
+
+/**
+ * A regtest chain in a temporary data directory, set up like the node sets up
+ * its chainstate, for benchmarks that need blocks or a mempool. Standardness
+ * rules are not enforced, as on regtest by default.
+ */
+class RegtestChainSetup
+{
+private:
+    fs::path m_path;
+    CScheduler m_scheduler;
+    boost::thread_group m_threads;
+
+public:
+    /** Start with the genesis block and the given number of script check threads per queue */
+    explicit RegtestChainSetup(int script_check_threads = 0);
+    ~RegtestChainSetup();
+
+    /** Mine a block with transactions from the mempool and the coinbase paying to scriptPubKey */
+    CBlock MineBlock(const CScript& scriptPubKey);
+    /** Add a transaction to the mempool, which must accept it */
+    void Accept(const CTransactionRef& tx);
+};
+
+#endif // BITCOIN_BENCH_CHAIN_SETUP_H
@@ -6,7 +6,9 @@
 #include <util.h>
 #include <validation.h>
 #include <checkqueue.h>
+#include <crypto/sha256.h>
 #include <prevector.h>
+#include <uint256.h>
 #include <vector>
 #include <boost/thread/thread.hpp>
 #include <random.h>
@@ -17,6 +19,7 @@ static const size_t BATCHES = 101;
 static const size_t BATCH_SIZE = 30;
 static const int PREVECTOR_SIZE = 28;
 static const unsigned int QUEUE_BATCH_SIZE = 128;
+static const size_t SCALING_CHECKS = 5000;
 
 // This Benchmark tests the CheckQueue with a slightly realistic workload,
 // where checks all contain a prevector that is indirect 50% of the time
@@ -60,3 +63,48 @@ static void CCheckQueueSpeedPrevectorJob(benchmark::State& state)
     tg.join_all();
 }
 BENCHMARK(CCheckQueueSpeedPrevectorJob, 1400);
+
+// This Benchmark measures how the CheckQueue scales with the number of
+// threads, with checks that take about a microsecond each and are added one
+// at a time, as ConnectBlock adds those of each transaction.
+static void CCheckQueueScaling(benchmark::State& state, int threads)
+{
+    struct HashJob {
+        uint256 hash;
+        bool operator()()
+        {
+            for (int i = 0; i < 4; ++i)
+                CSHA256().Write(hash.begin(), hash.size()).Finalize(hash.begin());
+            return true;
+        }
+        void swap(HashJob& x){std::swap(hash, x.hash);};
+    };
+    CCheckQueue<HashJob> queue {QUEUE_BATCH_SIZE};
+    boost::thread_group tg;
+    for (auto x = 1; x < threads; ++x) {
+       tg.create_thread([&]{queue.Thread();});
+    }
+    while (state.KeepRunning()) {
+        CCheckQueueControl<HashJob> control(&queue);
+        for (size_t x = 0; x < SCALING_CHECKS; ++x) {
+            std::vector<HashJob> vChecks(1);
+            control.Add(vChecks);
+        }
+        control.Wait();
+    }
+    tg.interrupt_all();
+    tg.join_all();
+}
+
+// Register CCheckQueueScaling with 1, 2, 4, ... threads, up to the number of cores.
+static struct CCheckQueueScalingBenchmarks {
+    CCheckQueueScalingBenchmarks()
+    {
+        const int cores = std::max(1, GetNumCores());
+        for (int threads = 1;; threads = std::min(threads * 2, cores)) {
+            benchmark::BenchRunner(strprintf("CCheckQueueScaling%03dThreads", threads),
+                [threads](benchmark::State& state) { CCheckQueueScaling(state, threads); }, 150);
+            if (threads == cores) break;
+        }
+    }
+} checkqueue_scaling_benchmarks;
@@ -0,0 +1,120 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <bench/chain_setup.h>
+#include <consensus/consensus.h>
+#include <consensus/validation.h>
+#include <key.h>
+#include <keystore.h>
+#include <script/sigcache.h>
+#include <script/sign.h>
+#include <script/standard.h>
+#include <txmempool.h>
+#include <util.h>
+#include <validation.h>
+
+#include <vector>
+
+// Number of transactions arriving together, each spending two P2PKH outputs
+// to two new ones.
+static const int NUM_TXS = 200;
+
+/** A regtest chain with confirmed P2PKH outputs, and signed transactions spending them. */
+class MempoolAcceptSetup : public RegtestChainSetup
+{
+public:
+    std::vector<CTransactionRef> m_txs;
+
+    MempoolAcceptSetup() : RegtestChainSetup(std::max(2, GetNumCores()))
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        CBasicKeyStore keystore;
+        keystore.AddKey(key);
+        const CScript script_pub = GetScriptForDestination(key.GetPubKey().GetID());
+
+        std::vector<CTransactionRef> coinbases;
+        for (int i = 0; i < COINBASE_MATURITY + 2; ++i) {
+            coinbases.push_back(MineBlock(script_pub).vtx[0]);
+        }
+
+        // Split two coinbases into outputs for the transactions to spend.
+        std::vector<CTransactionRef> fanouts;
+        for (int i = 0; i < 2; ++i) {
+            CMutableTransaction fanout;
+            fanout.vin.emplace_back(COutPoint(coinbases[i]->GetHash(), 0));
+            for (int j = 0; j < NUM_TXS; ++j) {
+                fanout.vout.emplace_back((coinbases[i]->vout[0].nValue - 100000) / NUM_TXS, script_pub);
+            }
+            bool signed_ok = SignSignature(keystore, *coinbases[i], fanout, 0, SIGHASH_ALL);
+            assert(signed_ok);
+            fanouts.push_back(MakeTransactionRef(std::move(fanout)));
+            Accept(fanouts.back());
+        }
+        MineBlock(script_pub);
+
+        for (int i = 0; i < NUM_TXS; ++i) {
+            CMutableTransaction tx;
+            tx.vin.emplace_back(COutPoint(fanouts[0]->GetHash(), i));
+            tx.vin.emplace_back(COutPoint(fanouts[1]->GetHash(), i));
+            CAmount value = fanouts[0]->vout[i].nValue + fanouts[1]->vout[i].nValue - 10000;
+            tx.vout.emplace_back(value / 2, script_pub);
+            tx.vout.emplace_back(value - value / 2, script_pub);
+            for (int j = 0; j < 2; ++j) {
+                bool signed_ok = SignSignature(keystore, *fanouts[j], tx, j, SIGHASH_ALL);
+                assert(signed_ok);
+            }
+            m_txs.push_back(MakeTransactionRef(std::move(tx)));
+        }
+
+        // Keep the signature caches small, as they are emptied on every iteration.
+        gArgs.ForceSetArg("-maxsigcachesize", "4");
+    }
+
+    ~MempoolAcceptSetup()
+    {
+        gArgs.ForceSetArg("-maxsigcachesize", std::to_string(DEFAULT_MAX_SIG_CACHE_SIZE));
+    }
+
+    /** Forget the transactions, so that they are validated from scratch again */
+    void Reset()
+    {
+        mempool.clear();
+        LOCK(cs_main);
+        // Like most transactions relayed to a node, their inputs aren't cached.
+        pcoinsTip->Flush();
+        InitSignatureCache();
+        InitScriptExecutionCache();
+    }
+};
+
+static void MempoolAccept(benchmark::State& state)
+{
+    MempoolAcceptSetup setup;
+    while (state.KeepRunning()) {
+        setup.Reset();
+        for (const CTransactionRef& tx : setup.m_txs) {
+            setup.Accept(tx);
+        }
+    }
+}
+
+static void MempoolAcceptPreVerified(benchmark::State& state)
+{
+    MempoolAcceptSetup setup;
+    while (state.KeepRunning()) {
+        setup.Reset();
+        std::vector<COutPoint> coins_to_uncache;
+        PreVerifyTransactions(setup.m_txs, coins_to_uncache);
+        for (const CTransactionRef& tx : setup.m_txs) {
+            setup.Accept(tx);
+        }
+        LOCK(cs_main);
+        UncacheUnspentCoins(coins_to_uncache);
+    }
+}
+
+BENCHMARK(MempoolAccept, 30);
+BENCHMARK(MempoolAcceptPreVerified, 60);
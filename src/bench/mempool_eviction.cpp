@@ -111,4 +111,77 @@ static void MempoolEviction(benchmark::State& state)
     }
 }
 
+// Number of independent chains of unconfirmed transactions, and the number
+// of transactions in each, the default ancestor limit.
+static const int NUM_CHAINS = 40;
+static const int CHAIN_LENGTH = 25;
+
+static std::vector<std::vector<CTransactionRef>> CreateChains()
+{
+    std::vector<std::vector<CTransactionRef>> chains(NUM_CHAINS);
+    for (int i = 0; i < NUM_CHAINS; ++i) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << i;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        tx.vout[0].nValue = 10 * COIN;
+        for (int j = 0; j < CHAIN_LENGTH; ++j) {
+            chains[i].push_back(MakeTransactionRef(tx));
+            tx.vin[0].prevout = COutPoint(chains[i].back()->GetHash(), 0);
+            tx.vin[0].scriptSig = CScript() << OP_1;
+        }
+    }
+    return chains;
+}
+
+// Every transaction added walks all of its ancestors, and every one removed
+// from the bottom of a chain walks its descendants and then, for each of
+// them, their ancestors.
+static void MempoolAncestorChains(benchmark::State& state)
+{
+    const std::vector<std::vector<CTransactionRef>> chains = CreateChains();
+    CTxMemPool pool;
+
+    while (state.KeepRunning()) {
+        for (const auto& chain : chains) {
+            for (const CTransactionRef& tx : chain) {
+                AddTx(*tx, 1000LL, pool);
+            }
+        }
+        pool.TrimToSize(0);
+    }
+}
+
+// A reorg returns the first half of every chain to the mempool, after the
+// second half that was already there, which then has to be reattached.
+static void MempoolReorgChains(benchmark::State& state)
+{
+    const std::vector<std::vector<CTransactionRef>> chains = CreateChains();
+    std::vector<uint256> block_hashes;
+    for (const auto& chain : chains) {
+        for (int j = 0; j < CHAIN_LENGTH / 2; ++j) {
+            block_hashes.push_back(chain[j]->GetHash());
+        }
+    }
+    CTxMemPool pool;
+
+    while (state.KeepRunning()) {
+        for (const auto& chain : chains) {
+            for (int j = CHAIN_LENGTH / 2; j < CHAIN_LENGTH; ++j) {
+                AddTx(*chain[j], 1000LL, pool);
+            }
+        }
+        for (const auto& chain : chains) {
+            for (int j = 0; j < CHAIN_LENGTH / 2; ++j) {
+                AddTx(*chain[j], 1000LL, pool);
+            }
+        }
+        pool.UpdateTransactionsFromBlock(block_hashes);
+        pool.clear();
+    }
+}
+
 BENCHMARK(MempoolEviction, 41000);
+BENCHMARK(MempoolAncestorChains, 20);
+BENCHMARK(MempoolReorgChains, 20);
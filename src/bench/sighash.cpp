@@ -0,0 +1,55 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <primitives/transaction.h>
+#include <script/interpreter.h>
+#include <script/script.h>
+#include <uint256.h>
+
+// Number of inputs of the transaction, each of which is signed with
+// SIGHASH_ALL by a P2PKH script.
+static const int NUM_INPUTS = 1000;
+
+// The legacy signature hash of every input of a transaction with many inputs.
+// Each of these hashes most of the transaction, so the time taken grows with
+// the square of the number of inputs.
+static void LegacySighash(benchmark::State& state, bool precomputed)
+{
+    const CScript script_code = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0) << OP_EQUALVERIFY << OP_CHECKSIG;
+    CMutableTransaction mtx;
+    for (int i = 0; i < NUM_INPUTS; ++i) {
+        mtx.vin.emplace_back(COutPoint(uint256(), i));
+        // A signature and a compressed public key
+        mtx.vin.back().scriptSig = CScript() << std::vector<unsigned char>(72, 0) << std::vector<unsigned char>(33, 0);
+    }
+    mtx.vout.emplace_back(1000, script_code);
+    const CTransaction tx(mtx);
+
+    while (state.KeepRunning()) {
+        if (precomputed) {
+            PrecomputedTransactionData txdata(tx);
+            for (unsigned int i = 0; i < tx.vin.size(); ++i) {
+                SignatureHash(script_code, tx, i, SIGHASH_ALL, 0, SIGVERSION_BASE, &txdata);
+            }
+        } else {
+            for (unsigned int i = 0; i < tx.vin.size(); ++i) {
+                SignatureHash(script_code, tx, i, SIGHASH_ALL, 0, SIGVERSION_BASE);
+            }
+        }
+    }
+}
+
+static void LegacySighashManyInputs(benchmark::State& state)
+{
+    LegacySighash(state, false);
+}
+
+static void LegacySighashManyInputsPrecomputed(benchmark::State& state)
+{
+    LegacySighash(state, true);
+}
+
+BENCHMARK(LegacySighashManyInputs, 10);
+BENCHMARK(LegacySighashManyInputsPrecomputed, 50);
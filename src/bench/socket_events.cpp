@@ -0,0 +1,74 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <compat.h>
+#include <socketevents.h>
+
+#include <assert.h>
+#include <set>
+#include <vector>
+
+#ifndef WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// Measures one iteration of the socket handler's readiness loop: declaring
+// interest in every peer socket and waiting (without blocking) for events,
+// with one in ten peers having data ready.
+static void SocketEventsLoop(benchmark::State& state, SocketEventsMode mode, int peers)
+{
+#ifndef WIN32
+    std::vector<int> local, remote;
+    for (int i = 0; i < peers; ++i) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) break;
+        local.push_back(fds[0]);
+        remote.push_back(fds[1]);
+        if (i % 10 == 0) {
+            char c = 0;
+            ssize_t sent = send(fds[1], &c, 1, 0);
+            assert(sent == 1);
+        }
+    }
+
+    SocketEvents events(mode);
+    std::set<SOCKET> recv_set, send_set, error_set;
+    while (state.KeepRunning()) {
+        events.BeginUpdate();
+        for (size_t i = 0; i < local.size(); ++i) {
+            events.Update(local[i], i, true, false);
+        }
+        events.EndUpdate();
+        events.Wait(0, recv_set, send_set, error_set);
+        assert(recv_set.size() == (local.size() + 9) / 10);
+    }
+
+    for (int fd : local) close(fd);
+    for (int fd : remote) close(fd);
+#else
+    while (state.KeepRunning()) {}
+#endif
+}
+
+static void SocketEventsSelect10(benchmark::State& state) { SocketEventsLoop(state, SocketEventsMode::SELECT, 10); }
+static void SocketEventsSelect100(benchmark::State& state) { SocketEventsLoop(state, SocketEventsMode::SELECT, 100); }
+static void SocketEventsSelect400(benchmark::State& state) { SocketEventsLoop(state, SocketEventsMode::SELECT, 400); }
+static void SocketEventsPoll10(benchmark::State& state) { SocketEventsLoop(state, SocketEventsMode::POLL, 10); }
+static void SocketEventsPoll100(benchmark::State& state) { SocketEventsLoop(state, SocketEventsMode::POLL, 100); }
+static void SocketEventsPoll400(benchmark::State& state) { SocketEventsLoop(state, SocketEventsMode::POLL, 400); }
+static void SocketEventsEpoll10(benchmark::State& state) { SocketEventsLoop(state, SocketEventsMode::EPOLL, 10); }
+static void SocketEventsEpoll100(benchmark::State& state) { SocketEventsLoop(state, SocketEventsMode::EPOLL, 100); }
+static void SocketEventsEpoll400(benchmark::State& state) { SocketEventsLoop(state, SocketEventsMode::EPOLL, 400); }
+
+BENCHMARK(SocketEventsSelect10, 800 * 1000);
+BENCHMARK(SocketEventsSelect100, 130 * 1000);
+BENCHMARK(SocketEventsSelect400, 36 * 1000);
+BENCHMARK(SocketEventsPoll10, 1600 * 1000);
+BENCHMARK(SocketEventsPoll100, 190 * 1000);
+BENCHMARK(SocketEventsPoll400, 45 * 1000);
+BENCHMARK(SocketEventsEpoll10, 1700 * 1000);
+BENCHMARK(SocketEventsEpoll100, 280 * 1000);
+BENCHMARK(SocketEventsEpoll400, 90 * 1000);
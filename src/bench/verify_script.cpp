@@ -3,16 +3,24 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <bench/bench.h>
+#include <checkqueue.h>
+#include <consensus/consensus.h>
+#include <consensus/validation.h>
 #include <key.h>
 #if defined(HAVE_CONSENSUS_LIB)
 #include <script/bitcoinconsensus.h>
 #endif
 #include <script/script.h>
+#include <script/sigcache.h>
 #include <script/sign.h>
 #include <streams.h>
+#include <util.h>
+#include <validation.h>
 
 #include <array>
 
+#include <boost/thread/thread.hpp>
+
 // FIXME: Dedup with BuildCreditingTransaction in test/script_tests.cpp.
 static CMutableTransaction BuildCreditingTransaction(const CScript& scriptPubKey)
 {
@@ -106,3 +114,63 @@ static void VerifyScriptBench(benchmark::State& state)
 }
 
 BENCHMARK(VerifyScriptBench, 6300);
+
+// Verification of the scripts of a block filled with P2WPKH spends, the way
+// ConnectBlock does it: one CScriptCheck per input, run on a CCheckQueue with
+// a worker per additional core, and none of the signatures in the cache.
+static void VerifyScriptBlockBench(benchmark::State& state)
+{
+    const int flags = SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_P2SH;
+    const CAmount amount = 1000;
+
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    uint160 pubkeyHash;
+    CHash160().Write(pubkey.begin(), pubkey.size()).Finalize(pubkeyHash.begin());
+    const CTxOut txout(amount, CScript() << 0 << ToByteVector(pubkeyHash));
+    const CScript witScriptPubkey = CScript() << OP_DUP << OP_HASH160 << ToByteVector(pubkeyHash) << OP_EQUALVERIFY << OP_CHECKSIG;
+
+    std::vector<CTransactionRef> txs;
+    int64_t weight = 0;
+    while (true) {
+        CMutableTransaction tx;
+        tx.vin.emplace_back(COutPoint(uint256(), txs.size()));
+        tx.vout.emplace_back(amount, txout.scriptPubKey);
+        CScriptWitness& witness = tx.vin[0].scriptWitness;
+        witness.stack.emplace_back();
+        key.Sign(SignatureHash(witScriptPubkey, tx, 0, SIGHASH_ALL, amount, SIGVERSION_WITNESS_V0), witness.stack.back());
+        witness.stack.back().push_back(static_cast<unsigned char>(SIGHASH_ALL));
+        witness.stack.push_back(ToByteVector(pubkey));
+        CTransactionRef tx_ref = MakeTransactionRef(std::move(tx));
+        weight += GetTransactionWeight(*tx_ref);
+        if (weight > MAX_BLOCK_WEIGHT) break;
+        txs.push_back(tx_ref);
+    }
+    std::vector<PrecomputedTransactionData> txdata;
+    txdata.reserve(txs.size());
+    for (const CTransactionRef& tx : txs) {
+        txdata.emplace_back(*tx);
+    }
+
+    InitSignatureCache();
+    CCheckQueue<CScriptCheck> queue(128);
+    boost::thread_group tg;
+    for (int i = 1; i < GetNumCores(); ++i) {
+        tg.create_thread([&]{queue.Thread();});
+    }
+    while (state.KeepRunning()) {
+        CCheckQueueControl<CScriptCheck> control(&queue);
+        for (size_t i = 0; i < txs.size(); ++i) {
+            std::vector<CScriptCheck> vChecks;
+            vChecks.emplace_back(txout, *txs[i], 0, flags, false, &txdata[i]);
+            control.Add(vChecks);
+        }
+        bool success = control.Wait();
+        assert(success);
+    }
+    tg.interrupt_all();
+    tg.join_all();
+}
+
+BENCHMARK(VerifyScriptBlockBench, 2);
@@ -0,0 +1,180 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockrelaycache.h>
+
+#include <blockencodings.h>
+#include <protocol.h>
+#include <streams.h>
+#include <version.h>
+
+template <typename T>
+static std::shared_ptr<const CSharedNetPayload> SerializePayload(const T& obj, bool witness)
+{
+    std::vector<unsigned char> data;
+    CVectorWriter(SER_NETWORK, PROTOCOL_VERSION | (witness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS), data, 0, obj);
+    return std::make_shared<const CSharedNetPayload>(std::move(data));
+}
+
+BlockRelayCache::BlockRelayCache(size_t max_blocks, size_t max_blocktxn_bytes) :
+    m_max_blocks(max_blocks), m_max_blocktxn_bytes(max_blocktxn_bytes), m_blocktxn_bytes(0) {}
+
+BlockRelayCache::Entry* BlockRelayCache::Find(const uint256& hash)
+{
+    AssertLockHeld(cs);
+    for (Entry& entry : m_entries) {
+        if (entry.hash == hash) return &entry;
+    }
+    return nullptr;
+}
+
+bool BlockRelayCache::GetPayload(const uint256& hash, const std::function<Payload*(Entry&)>& slot,
+                                 const std::function<Payload(const CBlock&)>& build, Payload& payload)
+{
+    std::shared_ptr<const CBlock> block;
+    {
+        LOCK(cs);
+        Entry* entry = Find(hash);
+        if (!entry) return false;
+        Payload* cached = slot(*entry);
+        if (cached && *cached) {
+            payload = *cached;
+            return true;
+        }
+        block = entry->block;
+    }
+
+    payload = build(*block);
+
+    // Another peer may have built the same message in the meantime, in which
+    // case theirs is kept so that only one copy is shared.
+    LOCK(cs);
+    Entry* entry = Find(hash);
+    if (entry) {
+        Payload* cached = slot(*entry);
+        if (cached) {
+            if (*cached) {
+                payload = *cached;
+            } else {
+                *cached = payload;
+            }
+        }
+    }
+    return true;
+}
+
+CSerializedNetMsg BlockRelayCache::MakeMsg(const std::string& command, const Payload& payload)
+{
+    CSerializedNetMsg msg;
+    msg.command = command;
+    msg.shared_payload = payload;
+    return msg;
+}
+
+void BlockRelayCache::Add(const std::shared_ptr<const CBlock>& block)
+{
+    LOCK(cs);
+    const uint256 hash = block->GetHash();
+    if (Find(hash)) return;
+    while (!m_entries.empty() && m_entries.size() >= m_max_blocks) {
+        for (const auto& msgs : m_entries.front().blocktxn_msgs) {
+            for (const auto& cached : msgs) {
+                m_blocktxn_bytes -= cached.second->data.size();
+            }
+        }
+        m_entries.pop_front();
+    }
+    m_entries.emplace_back();
+    m_entries.back().hash = hash;
+    m_entries.back().block = block;
+}
+
+std::shared_ptr<const CBlock> BlockRelayCache::GetBlock(const uint256& hash) const
+{
+    LOCK(cs);
+    for (const Entry& entry : m_entries) {
+        if (entry.hash == hash) return entry.block;
+    }
+    return nullptr;
+}
+
+std::shared_ptr<const CBlock> BlockRelayCache::GetLatestBlock() const
+{
+    LOCK(cs);
+    return m_entries.empty() ? nullptr : m_entries.back().block;
+}
+
+bool BlockRelayCache::GetBlockMsg(const uint256& hash, bool witness, CSerializedNetMsg& msg)
+{
+    Payload payload;
+    if (!GetPayload(hash,
+            [witness](Entry& entry) { return &entry.block_msgs[witness]; },
+            [witness](const CBlock& block) { return SerializePayload(block, witness); },
+            payload)) {
+        return false;
+    }
+    msg = MakeMsg(NetMsgType::BLOCK, payload);
+    return true;
+}
+
+bool BlockRelayCache::GetCompactBlockMsg(const uint256& hash, bool witness, CSerializedNetMsg& msg)
+{
+    Payload payload;
+    if (!GetPayload(hash,
+            [witness](Entry& entry) { return &entry.cmpct_msgs[witness]; },
+            [witness](const CBlock& block) { return SerializePayload(CBlockHeaderAndShortTxIDs(block, witness), witness); },
+            payload)) {
+        return false;
+    }
+    msg = MakeMsg(NetMsgType::CMPCTBLOCK, payload);
+    return true;
+}
+
+bool BlockRelayCache::GetBlockTxnMsg(const BlockTransactionsRequest& req, bool witness, CSerializedNetMsg& msg, bool& out_of_bounds)
+{
+    out_of_bounds = false;
+    std::shared_ptr<const CBlock> block;
+    Payload payload;
+    {
+        LOCK(cs);
+        Entry* entry = Find(req.blockhash);
+        if (!entry) return false;
+        block = entry->block;
+        auto it = entry->blocktxn_msgs[witness].find(req.indexes);
+        if (it != entry->blocktxn_msgs[witness].end()) {
+            payload = it->second;
+        }
+    }
+
+    if (!payload) {
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block->vtx.size()) {
+                out_of_bounds = true;
+                return false;
+            }
+            resp.txn[i] = block->vtx[req.indexes[i]];
+        }
+        payload = SerializePayload(resp, witness);
+
+        // Keep the response while the total size allows, so that peers asking
+        // for many different sets of transactions can't make the cache hold
+        // on to a lot of memory. Once it is full, responses are built every
+        // time.
+        LOCK(cs);
+        Entry* entry = Find(req.blockhash);
+        if (entry) {
+            std::map<std::vector<uint16_t>, Payload>& msgs = entry->blocktxn_msgs[witness];
+            auto it = msgs.find(req.indexes);
+            if (it != msgs.end()) {
+                payload = it->second;
+            } else if (m_blocktxn_bytes + payload->data.size() <= m_max_blocktxn_bytes) {
+                msgs.emplace(req.indexes, payload);
+                m_blocktxn_bytes += payload->data.size();
+            }
+        }
+    }
+    msg = MakeMsg(NetMsgType::BLOCKTXN, payload);
+    return true;
+}
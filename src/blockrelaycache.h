@@ -0,0 +1,97 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKRELAYCACHE_H
+#define BITCOIN_BLOCKRELAYCACHE_H
+
+#include <net.h>
+#include <primitives/block.h>
+#include <sync.h>
+#include <uint256.h>
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+class BlockTransactionsRequest;
+
+/** Number of recent blocks kept in the block relay cache */
+static const size_t MAX_RELAY_CACHE_BLOCKS = 3;
+/** Total size in bytes of the blocktxn responses kept in the block relay cache */
+static const size_t MAX_RELAY_CACHE_BLOCKTXN_BYTES = 1000000;
+
+/**
+ * The most recently announced blocks, together with the messages relaying
+ * them in each encoding peers ask for: full blocks with and without
+ * witnesses, compact blocks, and blocktxn responses for the sets of
+ * transactions peers requested. Each message is serialized once, when it is
+ * first needed, and its payload is then queued for all peers it is sent to
+ * without being copied. As peers choose which transactions they ask for,
+ * blocktxn responses are only kept up to a total size across all blocks.
+ */
+class BlockRelayCache
+{
+private:
+    typedef std::shared_ptr<const CSharedNetPayload> Payload;
+
+    struct Entry
+    {
+        uint256 hash;
+        std::shared_ptr<const CBlock> block;
+        //! Messages indexed by whether they include witnesses
+        Payload block_msgs[2];
+        Payload cmpct_msgs[2];
+        std::map<std::vector<uint16_t>, Payload> blocktxn_msgs[2];
+    };
+
+    const size_t m_max_blocks;
+    const size_t m_max_blocktxn_bytes;
+    mutable CCriticalSection cs;
+    //! Cached blocks, oldest first
+    std::deque<Entry> m_entries;
+    //! Total size of the cached blocktxn responses
+    size_t m_blocktxn_bytes;
+
+    Entry* Find(const uint256& hash);
+
+    /**
+     * Return the payload that slot selects in the entry for hash, building it
+     * from the block with build if it isn't cached yet. Messages are built
+     * without holding the lock, so that peers asking for other messages don't
+     * wait. Returns false if the block isn't cached.
+     */
+    bool GetPayload(const uint256& hash, const std::function<Payload*(Entry&)>& slot,
+                    const std::function<Payload(const CBlock&)>& build, Payload& payload);
+
+    static CSerializedNetMsg MakeMsg(const std::string& command, const Payload& payload);
+
+public:
+    explicit BlockRelayCache(size_t max_blocks = MAX_RELAY_CACHE_BLOCKS, size_t max_blocktxn_bytes = MAX_RELAY_CACHE_BLOCKTXN_BYTES);
+
+    /** Add a new block, evicting the oldest one if the cache is full */
+    void Add(const std::shared_ptr<const CBlock>& block);
+
+    /** Return the block with the given hash, or nullptr if it isn't cached */
+    std::shared_ptr<const CBlock> GetBlock(const uint256& hash) const;
+
+    /** Return the block added last, or nullptr if the cache is empty */
+    std::shared_ptr<const CBlock> GetLatestBlock() const;
+
+    /** Get a block message for the block with the given hash. Returns false if it isn't cached. */
+    bool GetBlockMsg(const uint256& hash, bool witness, CSerializedNetMsg& msg);
+
+    /** Get a cmpctblock message for the block with the given hash. Returns false if it isn't cached. */
+    bool GetCompactBlockMsg(const uint256& hash, bool witness, CSerializedNetMsg& msg);
+
+    /**
+     * Get the blocktxn message answering req. Returns false if the block isn't
+     * cached, or if req asks for transactions the block doesn't have, in which
+     * case out_of_bounds is set.
+     */
+    bool GetBlockTxnMsg(const BlockTransactionsRequest& req, bool witness, CSerializedNetMsg& msg, bool& out_of_bounds);
+};
+
+#endif // BITCOIN_BLOCKRELAYCACHE_H
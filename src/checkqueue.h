@@ -8,9 +8,13 @@
 #include <sync.h>
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <vector>
 
 #include <boost/thread/condition_variable.hpp>
+#include <boost/thread/exceptions.hpp>
 #include <boost/thread/mutex.hpp>
 
 template <typename T>
@@ -25,12 +29,35 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every worker, and the master, has its own queue of verifications. The
+  * master spreads the verifications it adds over these queues, and workers
+  * that run out of verifications of their own steal them from the others,
+  * so workers don't contend on a single lock to get their work.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
-    //! Mutex to protect the inner state
+    /**
+     * The verifications queued for one worker. The worker takes them from the
+     * back, and other workers steal them from the front.
+     */
+    struct WorkerQueue
+    {
+        boost::mutex mutex;
+        std::deque<T> checks;
+        //! The size of checks, which can be read without locking the mutex
+        std::atomic<size_t> nChecks{0};
+        //! The next worker's queue. The list of queues starts with the
+        //! master's, and workers are appended when they start.
+        std::atomic<WorkerQueue*> next{nullptr};
+        //! Whether the worker owning this queue has exited (protected by mutex).
+        //! The queue stays in the list, for the next worker that starts.
+        bool fExited{false};
+    };
+
+    //! Mutex for workers and the master to wait for work
     boost::mutex mutex;
 
     //! Worker threads block on this when out of work
@@ -39,87 +66,156 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! The master's queue, at the start of the list of queues
+    WorkerQueue masterQueue;
+
+    //! The queues of the worker threads that have started (protected by mutex)
+    std::vector<std::unique_ptr<WorkerQueue>> vWorkerQueues;
 
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
+    //! The number of queues with a running worker, including the master's.
+    std::atomic<unsigned int> nQueues;
 
-    //! The total number of workers (including the master).
-    int nTotal;
+    //! The queue the next verifications that are added go to. Only used by the master.
+    WorkerQueue* pAddQueue;
+
+    //! The number of workers that are waiting for work.
+    std::atomic<int> nIdle;
 
     //! The temporary evaluation result.
-    bool fAllOk;
+    std::atomic<bool> fAllOk;
 
     /**
      * Number of verifications that haven't completed yet.
      * This includes elements that are no longer queued, but still in the
      * worker's own batches.
      */
-    unsigned int nTodo;
+    std::atomic<unsigned int> nTodo;
 
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    //! The queue following queue in the list, wrapping around to the master's
+    WorkerQueue* Next(WorkerQueue* queue)
+    {
+        WorkerQueue* next = queue->next.load();
+        return next ? next : &masterQueue;
+    }
+
+    /**
+     * Move up to half of the verifications in queue, but at least one and at
+     * most nBatchSize, to vChecks. A worker takes the most recently added ones
+     * from its own queue, and the oldest ones from those of others.
+     */
+    bool Take(WorkerQueue& queue, bool fOwn, std::vector<T>& vChecks)
+    {
+        if (queue.nChecks == 0)
+            return false;
+        boost::unique_lock<boost::mutex> lock(queue.mutex);
+        if (queue.checks.empty())
+            return false;
+        size_t nNow = std::max<size_t>(1, std::min<size_t>(nBatchSize, queue.checks.size() / 2));
+        vChecks.resize(nNow);
+        for (size_t i = 0; i < nNow; i++) {
+            // Swap jobs from the queue to the local batch vector instead of copying.
+            if (fOwn) {
+                vChecks[i].swap(queue.checks.back());
+                queue.checks.pop_back();
+            } else {
+                vChecks[i].swap(queue.checks.front());
+                queue.checks.pop_front();
+            }
+        }
+        queue.nChecks = queue.checks.size();
+        return true;
+    }
+
+    /** Get a batch of work from the worker's own queue, or else steal one from another queue */
+    bool GetWork(WorkerQueue& own, std::vector<T>& vChecks)
+    {
+        if (Take(own, true, vChecks))
+            return true;
+        for (WorkerQueue* queue = Next(&own); queue != &own; queue = Next(queue)) {
+            if (Take(*queue, false, vChecks))
+                return true;
+        }
+        return false;
+    }
+
+    /**
+     * Stop adding verifications to an exiting worker's queue, and move the
+     * ones it still has to the master's queue, for Wait() to pick up.
+     */
+    void Exit(WorkerQueue& queue)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        boost::unique_lock<boost::mutex> lockQueue(queue.mutex);
+        queue.fExited = true;
+        nQueues--;
+        if (queue.checks.empty())
+            return;
+        boost::unique_lock<boost::mutex> lockMaster(masterQueue.mutex);
+        for (T& check : queue.checks) {
+            masterQueue.checks.emplace_back();
+            check.swap(masterQueue.checks.back());
+        }
+        masterQueue.nChecks = masterQueue.checks.size();
+        queue.checks.clear();
+        queue.nChecks = 0;
+    }
+
+    bool HaveWork()
+    {
+        WorkerQueue* queue = &masterQueue;
+        do {
+            if (queue->nChecks != 0)
+                return true;
+            queue = Next(queue);
+        } while (queue != &masterQueue);
+        return false;
+    }
+
     /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    bool Loop(WorkerQueue& own, bool fMaster = false)
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
         do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
+            if (GetWork(own, vChecks)) {
+                unsigned int nNow = vChecks.size();
+                // Once a verification has failed, the remaining ones are skipped
+                for (T& check : vChecks)
+                    if (fAllOk && !check())
+                        fAllOk = false;
+                vChecks.clear();
+                if (nTodo.fetch_sub(nNow) == nNow && !fMaster) {
+                    // We processed the last element; inform the master it can exit and return the result
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    condMaster.notify_one();
                 }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if (fMaster && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+                continue;
+            }
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (fMaster) {
+                // Nothing is queued anymore, so wait for the workers to
+                // finish the batches they have taken.
+                while (nTodo != 0)
+                    condMaster.wait(lock);
+                bool fRet = fAllOk;
+                // reset the status for new work later
+                fAllOk = true;
+                // return the current status
+                return fRet;
             }
-            // execute work
-            for (T& check : vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
+            nIdle++;
+            // Work added before nIdle was increased didn't wake anyone up
+            try {
+                if (!HaveWork())
+                    condWorker.wait(lock);
+            } catch (const boost::thread_interrupted&) {
+                nIdle--;
+                throw;
+            }
+            nIdle--;
         } while (true);
     }
 
@@ -128,33 +224,77 @@ public:
     boost::mutex ControlMutex;
 
     //! Create a new check queue
-    explicit CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), nBatchSize(nBatchSizeIn) {}
+    explicit CCheckQueue(unsigned int nBatchSizeIn) : nQueues(1), pAddQueue(&masterQueue), nIdle(0), fAllOk(true), nTodo(0), nBatchSize(nBatchSizeIn) {}
 
     //! Worker thread
     void Thread()
     {
-        Loop();
+        WorkerQueue* queue = nullptr;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            // Take over the queue of a worker that has exited, if any
+            for (const auto& exited : vWorkerQueues) {
+                boost::unique_lock<boost::mutex> lockQueue(exited->mutex);
+                if (exited->fExited) {
+                    exited->fExited = false;
+                    queue = exited.get();
+                    break;
+                }
+            }
+            if (!queue) {
+                vWorkerQueues.emplace_back(new WorkerQueue);
+                queue = vWorkerQueues.back().get();
+                WorkerQueue* last = vWorkerQueues.size() > 1 ? vWorkerQueues[vWorkerQueues.size() - 2].get() : &masterQueue;
+                last->next = queue;
+            }
+            nQueues++;
+        }
+        try {
+            Loop(*queue);
+        } catch (const boost::thread_interrupted&) {
+            Exit(*queue);
+            throw;
+        }
     }
 
     //! Wait until execution finishes, and return whether all evaluations were successful.
     bool Wait()
     {
-        return Loop(true);
+        return Loop(masterQueue, true);
     }
 
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        for (T& check : vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
-        }
+        if (vChecks.empty())
+            return;
         nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            condWorker.notify_one();
-        else if (vChecks.size() > 1)
-            condWorker.notify_all();
+        // Spread the checks over the queues, starting where the previous batch
+        // left off, so that each worker gets a share of small batches too.
+        size_t nPerQueue = (vChecks.size() + nQueues - 1) / nQueues;
+        for (size_t i = 0; i < vChecks.size(); i += nPerQueue) {
+            // Skip the queues of workers that have exited; the master's is
+            // always used.
+            WorkerQueue* queue;
+            boost::unique_lock<boost::mutex> lock;
+            do {
+                queue = pAddQueue;
+                pAddQueue = Next(pAddQueue);
+                lock = boost::unique_lock<boost::mutex>(queue->mutex);
+            } while (queue->fExited);
+            for (size_t j = i; j < std::min(i + nPerQueue, vChecks.size()); j++) {
+                queue->checks.emplace_back();
+                vChecks[j].swap(queue->checks.back());
+            }
+            queue->nChecks = queue->checks.size();
+        }
+        if (nIdle > 0) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (vChecks.size() == 1)
+                condWorker.notify_one();
+            else
+                condWorker.notify_all();
+        }
     }
 
     ~CCheckQueue()
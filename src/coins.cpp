@@ -10,7 +10,7 @@
 bool CCoinsView::GetCoin(const COutPoint &outpoint, Coin &coin) const { return false; }
 uint256 CCoinsView::GetBestBlock() const { return uint256(); }
 std::vector<uint256> CCoinsView::GetHeadBlocks() const { return std::vector<uint256>(); }
-bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return false; }
+bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool partial) { return false; }
 CCoinsViewCursor *CCoinsView::Cursor() const { return nullptr; }
 
 bool CCoinsView::HaveCoin(const COutPoint &outpoint) const
@@ -25,13 +25,16 @@ bool CCoinsViewBacked::HaveCoin(const COutPoint &outpoint) const { return base->
 uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
 std::vector<uint256> CCoinsViewBacked::GetHeadBlocks() const { return base->GetHeadBlocks(); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
+bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool partial) { return base->BatchWrite(mapCoins, hashBlock, partial); }
 CCoinsViewCursor *CCoinsViewBacked::Cursor() const { return base->Cursor(); }
 size_t CCoinsViewBacked::EstimateSize() const { return base->EstimateSize(); }
 
 SaltedOutpointHasher::SaltedOutpointHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), cachedCoinsUsage(0) {}
+CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn),
+    m_cache_coins_memory_resource(new CCoinsMapMemoryResource()),
+    cacheCoins(0, SaltedOutpointHasher(), CCoinsMap::key_equal(), m_cache_coins_memory_resource.get()),
+    cachedCoinsUsage(0) {}
 
 size_t CCoinsViewCache::DynamicMemoryUsage() const {
     return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage;
@@ -132,6 +135,16 @@ bool CCoinsViewCache::HaveCoinInCache(const COutPoint &outpoint) const {
     return (it != cacheCoins.end() && !it->second.coin.IsSpent());
 }
 
+void CCoinsViewCache::AddFetchedCoin(const COutPoint &outpoint, Coin&& coin) {
+    if (coin.IsSpent()) return;
+    CCoinsMap::iterator it;
+    bool inserted;
+    std::tie(it, inserted) = cacheCoins.emplace(std::piecewise_construct, std::forward_as_tuple(outpoint), std::forward_as_tuple(std::move(coin)));
+    if (inserted) {
+        cachedCoinsUsage += it->second.coin.DynamicMemoryUsage();
+    }
+}
+
 uint256 CCoinsViewCache::GetBestBlock() const {
     if (hashBlock.IsNull())
         hashBlock = base->GetBestBlock();
@@ -142,7 +155,7 @@ void CCoinsViewCache::SetBestBlock(const uint256 &hashBlockIn) {
     hashBlock = hashBlockIn;
 }
 
-bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn) {
+bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn, bool partial) {
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it = mapCoins.erase(it)) {
         // Ignore non-dirty entries (optimization).
         if (!(it->second.flags & CCoinsCacheEntry::DIRTY)) {
@@ -196,17 +209,154 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
             }
         }
     }
-    hashBlock = hashBlockIn;
+    if (!partial) {
+        hashBlock = hashBlockIn;
+    }
     return true;
 }
 
 bool CCoinsViewCache::Flush() {
-    bool fOk = base->BatchWrite(cacheCoins, hashBlock);
+    bool fOk = base->BatchWrite(cacheCoins, hashBlock, false);
     cacheCoins.clear();
     cachedCoinsUsage = 0;
+    // Clearing the map only returns its nodes to the pool.
+    ReallocateCache();
     return fOk;
 }
 
+void CCoinsViewCache::ReallocateCache() {
+    // This copies every remaining entry while cs_main is held, so only do it
+    // when the pool can shrink by at least a quarter. Trim() evicts half of
+    // the cache, so the copy is at most as large as what was evicted, and
+    // after Flush() there is nothing to copy.
+    const size_t chunk_bytes = m_cache_coins_memory_resource->ChunkSizeBytes();
+    const size_t needed_chunks = (cacheCoins.size() * COINS_MAP_NODE_BYTES + chunk_bytes - 1) / chunk_bytes;
+    if (needed_chunks * 4 > m_cache_coins_memory_resource->NumAllocatedChunks() * 3) return;
+
+    // Move the remaining entries out of the pool first, so that the old map
+    // and its memory are released before the new map is built, instead of
+    // keeping both pools alive at once.
+    std::vector<std::pair<COutPoint, CCoinsCacheEntry>> entries;
+    entries.reserve(cacheCoins.size());
+    for (auto& entry : cacheCoins) {
+        entries.emplace_back(entry.first, std::move(entry.second));
+    }
+    std::unique_ptr<CCoinsMapMemoryResource> resource(new CCoinsMapMemoryResource());
+    // The hasher can't be assigned, so the map is rebuilt in place.
+    cacheCoins.~CCoinsMap();
+    m_cache_coins_memory_resource = std::move(resource);
+    ::new (&cacheCoins) CCoinsMap(0, SaltedOutpointHasher(), CCoinsMap::key_equal(), m_cache_coins_memory_resource.get());
+    cacheCoins.reserve(entries.size());
+    for (auto& entry : entries) {
+        cacheCoins.emplace(entry.first, std::move(entry.second));
+    }
+}
+
+//! Number of modified entries Sync() hands to the base view at a time
+static const size_t SYNC_BATCH_ENTRIES = 100000;
+
+CCoinsMap::iterator CCoinsViewCache::TakeModified(CCoinsMap::iterator it, CCoinsMap& batch)
+{
+    if (it->second.coin.IsSpent()) {
+        // The base must forget about it, and so can we.
+        cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+        batch.emplace(it->first, std::move(it->second));
+        return cacheCoins.erase(it);
+    }
+    // Once written, the base has the coin, so it is no longer FRESH either.
+    batch.emplace(it->first, it->second);
+    it->second.flags = 0;
+    return ++it;
+}
+
+bool CCoinsViewCache::Sync(size_t* written) {
+    CCoinsMapMemoryResource resource;
+    CCoinsMap batch(0, SaltedOutpointHasher(), CCoinsMap::key_equal(), &resource);
+    size_t count = 0;
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY)) {
+            ++it;
+            continue;
+        }
+        it = TakeModified(it, batch);
+        ++count;
+        if (batch.size() >= SYNC_BATCH_ENTRIES && !base->BatchWrite(batch, hashBlock, true)) {
+            return false;
+        }
+    }
+    if (written) *written = count;
+    return base->BatchWrite(batch, hashBlock, false);
+}
+
+bool CCoinsViewCache::SyncPartial(size_t max_entries, int max_height, size_t& written) {
+    CCoinsMapMemoryResource resource;
+    CCoinsMap batch(0, SaltedOutpointHasher(), CCoinsMap::key_equal(), &resource);
+    std::vector<COutPoint> spent;
+    written = 0;
+    // Walk the hash table bucket by bucket, so that successive calls cover
+    // the whole cache without rescanning it. A rehash in between calls just
+    // moves entries around; anything missed is picked up by the next Sync().
+    size_t buckets = cacheCoins.bucket_count();
+    size_t visited = 0;
+    for (; visited < buckets && written < max_entries; ++visited) {
+        size_t bucket = m_sync_bucket++ % buckets;
+        for (auto it = cacheCoins.begin(bucket); it != cacheCoins.end(bucket); ++it) {
+            if (!(it->second.flags & CCoinsCacheEntry::DIRTY)) continue;
+            if (!it->second.coin.IsSpent() && (int)it->second.coin.nHeight > max_height) continue;
+            if (it->second.coin.IsSpent()) {
+                spent.push_back(it->first);
+            } else {
+                batch.emplace(it->first, it->second);
+                it->second.flags = 0;
+            }
+            ++written;
+        }
+        // Spent entries are moved out only after leaving the bucket, as that
+        // invalidates its iterators.
+        for (const COutPoint& outpoint : spent) {
+            TakeModified(cacheCoins.find(outpoint), batch);
+        }
+        spent.clear();
+    }
+    m_sync_bucket %= buckets;
+    if (written == 0) return true;
+    return base->BatchWrite(batch, hashBlock, true);
+}
+
+void CCoinsViewCache::Trim(size_t target_usage) {
+    size_t usage = DynamicMemoryUsage();
+    if (usage <= target_usage || cacheCoins.empty()) return;
+
+    // Count unmodified entries per height to find the height up to which
+    // they need to go, assuming all entries take about the same memory. The
+    // bucket array is left out, as it shrinks with the cache.
+    size_t entries_usage = usage - memusage::MallocUsage(sizeof(void*) * cacheCoins.bucket_count());
+    std::vector<size_t> count_at_height;
+    for (const auto& entry : cacheCoins) {
+        if (entry.second.flags != 0) continue;
+        size_t height = entry.second.coin.nHeight;
+        if (height >= count_at_height.size()) count_at_height.resize(height + 1);
+        count_at_height[height]++;
+    }
+    size_t to_remove = (usage - target_usage) / (entries_usage / cacheCoins.size()) + 1;
+    size_t removable = 0;
+    size_t max_height = 0;
+    for (; max_height < count_at_height.size(); ++max_height) {
+        removable += count_at_height[max_height];
+        if (removable >= to_remove) break;
+    }
+
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+        if (it->second.flags == 0 && it->second.coin.nHeight <= max_height) {
+            cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+            it = cacheCoins.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    ReallocateCache();
+}
+
 void CCoinsViewCache::Uncache(const COutPoint& hash)
 {
     CCoinsMap::iterator it = cacheCoins.find(hash);
@@ -12,11 +12,14 @@
 #include <hash.h>
 #include <memusage.h>
 #include <serialize.h>
+#include <support/allocators/pool.h>
 #include <uint256.h>
 
 #include <assert.h>
 #include <stdint.h>
 
+#include <functional>
+#include <memory>
 #include <unordered_map>
 
 /**
@@ -119,7 +122,16 @@ struct CCoinsCacheEntry
     explicit CCoinsCacheEntry(Coin&& coin_) : coin(std::move(coin_)), flags(0) {}
 };
 
-typedef std::unordered_map<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher> CCoinsMap;
+/**
+ * The nodes of a CCoinsMap are allocated from a PoolResource. The exact size
+ * of an unordered_map node is implementation defined; it holds the key/value
+ * pair and usually one or two pointers or a cached hash, so allowing for four
+ * extra pointers makes sure they fit in the pool's blocks.
+ */
+static constexpr size_t COINS_MAP_NODE_BYTES = sizeof(std::pair<const COutPoint, CCoinsCacheEntry>) + sizeof(void*) * 4;
+typedef PoolAllocator<std::pair<const COutPoint, CCoinsCacheEntry>, COINS_MAP_NODE_BYTES, alignof(void*)> CCoinsMapAllocator;
+typedef std::unordered_map<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher, std::equal_to<COutPoint>, CCoinsMapAllocator> CCoinsMap;
+typedef CCoinsMapAllocator::ResourceType CCoinsMapMemoryResource;
 
 /** Cursor for iterating over CoinsView state */
 class CCoinsViewCursor
@@ -165,7 +177,10 @@ public:
 
     //! Do a bulk modification (multiple Coin changes + BestBlock change).
     //! The passed mapCoins can be modified.
-    virtual bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    //! With partial set, the changes are only part of the transition to
+    //! hashBlock, and the view is left in an intermediate state (reported by
+    //! GetHeadBlocks) until a write without partial completes it.
+    virtual bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool partial);
 
     //! Get a cursor to iterate over the whole state
     virtual CCoinsViewCursor *Cursor() const;
@@ -191,7 +206,7 @@ public:
     uint256 GetBestBlock() const override;
     std::vector<uint256> GetHeadBlocks() const override;
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) override;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool partial) override;
     CCoinsViewCursor *Cursor() const override;
     size_t EstimateSize() const override;
 };
@@ -206,6 +221,8 @@ protected:
      * declared as "const".  
      */
     mutable uint256 hashBlock;
+    /* Memory the nodes of cacheCoins are allocated from; it is declared first so it outlives the map. */
+    std::unique_ptr<CCoinsMapMemoryResource> m_cache_coins_memory_resource;
     mutable CCoinsMap cacheCoins;
 
     /* Cached dynamic memory usage for the inner Coin objects. */
@@ -224,7 +241,7 @@ public:
     bool HaveCoin(const COutPoint &outpoint) const override;
     uint256 GetBestBlock() const override;
     void SetBestBlock(const uint256 &hashBlock);
-    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) override;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool partial) override;
     CCoinsViewCursor* Cursor() const override {
         throw std::logic_error("CCoinsViewCache cursor iteration not supported.");
     }
@@ -236,6 +253,12 @@ public:
      */
     bool HaveCoinInCache(const COutPoint &outpoint) const;
 
+    /**
+     * Add a coin that was read from the base view ahead of its use, unless
+     * the outpoint is in the cache already. Spent coins are ignored.
+     */
+    void AddFetchedCoin(const COutPoint &outpoint, Coin&& coin);
+
     /**
      * Return a reference to Coin in the cache, or a pruned one if not found. This is
      * more efficient than GetCoin.
@@ -268,6 +291,33 @@ public:
      */
     bool Flush();
 
+    /**
+     * Push the modifications applied to this cache to its base, like Flush(),
+     * but keep the cache. Unspent entries stay cached as unmodified entries
+     * and spent ones are removed. Entries are handed to the base in bounded
+     * batches, so this never holds a second copy of the modified entries.
+     * If written is given, it is set to the number of entries written.
+     */
+    bool Sync(size_t* written = nullptr);
+
+    /**
+     * Push up to max_entries modified entries to the base, skipping unspent
+     * coins created above max_height, and keep them cached like Sync(). Each
+     * call continues where the previous one left off. The base is left
+     * partially written (see CCoinsView::BatchWrite) until the next Flush()
+     * or Sync().
+     */
+    bool SyncPartial(size_t max_entries, int max_height, size_t& written);
+
+    /**
+     * Remove unmodified entries until the memory usage of the cache is at most
+     * target_usage, or no unmodified entries are left. Coins created at lower
+     * heights are removed first, as recently created coins are the most likely
+     * to be spent soon. The remaining entries are then moved to fresh memory,
+     * so that the memory of the removed ones is released.
+     */
+    void Trim(size_t target_usage);
+
     /**
      * Removes the UTXO with the given outpoint from the cache, if it is
      * not modified.
@@ -295,6 +345,13 @@ public:
 
 private:
     CCoinsMap::iterator FetchCoin(const COutPoint &outpoint) const;
+    //! Add a copy of a modified entry to batch, and mark it unmodified or remove it
+    CCoinsMap::iterator TakeModified(CCoinsMap::iterator it, CCoinsMap& batch);
+    //! Move the entries of cacheCoins to a new memory resource and release the old one, if that frees a good part of it
+    void ReallocateCache();
+
+    //! Bucket of cacheCoins at which the next SyncPartial() starts
+    size_t m_sync_bucket = 0;
 };
 
 //! Utility function to add all of a transaction's outputs to a cache.
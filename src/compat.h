@@ -86,11 +86,12 @@ typedef int32_t ssize_t;
 size_t strnlen( const char *start, size_t max_len);
 #endif // HAVE_DECL_STRNLEN
 
-bool static inline IsSelectableSocket(const SOCKET& s) {
+/** Whether a socket can be waited on. Only select() limits descriptors to FD_SETSIZE. */
+bool static inline IsSelectableSocket(const SOCKET& s, bool uses_select = true) {
 #ifdef WIN32
     return true;
 #else
-    return (s < FD_SETSIZE);
+    return !uses_select || (s < FD_SETSIZE);
 #endif
 }
 
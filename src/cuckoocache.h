@@ -197,6 +197,11 @@ private:
      * Should be set to log2(n)*/
     uint8_t depth_limit;
 
+    /** evicted counts the elements that were dropped or allowed to be
+     * replaced to make room for new ones, without having been erased.
+     */
+    uint64_t evicted;
+
     /** hash_function is a const instance of the hash function. It cannot be
      * static or initialized at call time as it may have internal state (such as
      * a nonce).
@@ -306,8 +311,10 @@ private:
             for (uint32_t i = 0; i < size; ++i)
                 if (epoch_flags[i])
                     epoch_flags[i] = false;
-                else
+                else if (!collection_flags.bit_is_set(i)) {
                     allow_erase(i);
+                    ++evicted;
+                }
             epoch_heuristic_counter = epoch_size;
         } else
             // reset the epoch_heuristic_counter to next do a scan when worst
@@ -325,7 +332,7 @@ public:
      * call to setup or setup_bytes, otherwise operations may segfault.
      */
     cache() : table(), size(), collection_flags(0), epoch_flags(),
-    epoch_heuristic_counter(), epoch_size(), depth_limit(0), hash_function()
+    epoch_heuristic_counter(), epoch_size(), depth_limit(0), evicted(0), hash_function()
     {
     }
 
@@ -437,6 +444,36 @@ public:
             // Recompute the locs -- unfortunately happens one too many times!
             locs = compute_hashes(e);
         }
+        ++evicted;
+    }
+
+    /** evictions returns the number of elements that were evicted to make
+     * room for new ones. Threadsafe without any concurrent insert.
+     */
+    uint64_t evictions() const
+    {
+        return evicted;
+    }
+
+    /** resize changes the number of elements the container can store,
+     * keeping the elements that have not been erased. Unlike setup, it may
+     * be called on a cache that is in use, but not concurrently with any
+     * other method.
+     * @param new_size the desired number of elements to store
+     * @returns the maximum number of elements storable
+     */
+    uint32_t resize(uint32_t new_size)
+    {
+        std::vector<Element> kept;
+        for (uint32_t i = 0; i < size; ++i)
+            if (!collection_flags.bit_is_set(i))
+                kept.push_back(std::move(table[i]));
+        table.clear();
+        epoch_flags.clear();
+        uint32_t n = setup(new_size);
+        for (Element& e : kept)
+            insert(std::move(e));
+        return n;
     }
 
     /* contains iterates through the hash locations for a given element
@@ -0,0 +1,331 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <map>
+#include <vector>
+
+#include <chainparams.h>
+#include <clientversion.h>
+#include <dbwrapper.h>
+#include <hash.h>
+#include <index/blockfilterindex.h>
+#include <streams.h>
+#include <util.h>
+#include <validation.h>
+
+/* The index database stores two kinds of entries:
+ *
+ * 1. The next position in the filter files at which a filter will be written,
+ *    stored under the key DB_FILTER_POS.
+ *
+ * 2. For each indexed block, the filter hash, filter header and position of
+ *    the filter in the flat files, keyed by DB_BLOCK_HASH and the block hash.
+ *
+ * Both are updated in the same batch for each block, so the filter position
+ * always points past the last filter referenced by the database.
+ */
+constexpr char DB_BLOCK_HASH = 's';
+constexpr char DB_FILTER_POS = 'P';
+
+constexpr unsigned int MAX_FLTR_FILE_SIZE = 0x1000000; // 16 MiB
+/** The pre-allocation chunk size for fltr?????.dat files */
+constexpr unsigned int FLTR_FILE_CHUNK_SIZE = 0x100000; // 1 MiB
+
+namespace {
+
+struct DBVal {
+    uint256 hash;
+    uint256 header;
+    CDiskBlockPos pos;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(hash);
+        READWRITE(header);
+        READWRITE(pos);
+    }
+};
+
+} // namespace
+
+static std::map<BlockFilterType, BlockFilterIndex> g_filter_indexes;
+
+BlockFilterIndex::BlockFilterIndex(BlockFilterType filter_type,
+                                   size_t n_cache_size, bool f_memory, bool f_wipe)
+    : m_filter_type(filter_type)
+{
+    const std::string& filter_name = BlockFilterTypeName(filter_type);
+    if (filter_name.empty()) throw std::invalid_argument("unknown filter_type");
+
+    m_filter_dir = GetDataDir() / "indexes" / "blockfilter" / filter_name;
+    fs::create_directories(m_filter_dir);
+
+    m_name = filter_name + " block filter index";
+    m_db = MakeUnique<BaseIndex::DB>(m_filter_dir / "db", n_cache_size, f_memory, f_wipe);
+}
+
+bool BlockFilterIndex::Init()
+{
+    if (!m_db->Read(DB_FILTER_POS, m_next_filter_pos)) {
+        // Check that the cause of the read failure is that the key does not exist. Any other errors
+        // indicate database corruption or a disk failure, and starting the index would cause
+        // further corruption.
+        if (m_db->Exists(DB_FILTER_POS)) {
+            return error("%s: Cannot read current %s state; index may be corrupted",
+                         __func__, GetName());
+        }
+
+        // If the DB_FILTER_POS is not set, then initialize to the first location.
+        m_next_filter_pos.nFile = 0;
+        m_next_filter_pos.nPos = 0;
+    }
+    return BaseIndex::Init();
+}
+
+FILE* BlockFilterIndex::OpenFilterFile(const CDiskBlockPos& pos, bool read_only) const
+{
+    if (pos.IsNull()) {
+        return nullptr;
+    }
+    fs::path path = m_filter_dir / strprintf("fltr%05u.dat", pos.nFile);
+    FILE* file = fsbridge::fopen(path, read_only ? "rb" : "rb+");
+    if (!file && !read_only) {
+        file = fsbridge::fopen(path, "wb+");
+    }
+    if (!file) {
+        LogPrintf("Unable to open file %s\n", path.string());
+        return nullptr;
+    }
+    if (pos.nPos && fseek(file, pos.nPos, SEEK_SET)) {
+        LogPrintf("Unable to seek to position %u of %s\n", pos.nPos, path.string());
+        fclose(file);
+        return nullptr;
+    }
+    return file;
+}
+
+bool BlockFilterIndex::Commit()
+{
+    // Flush the filter file being appended to, so that the best block locator
+    // written after this never refers to filters that are not yet on disk.
+    if (m_next_filter_pos.nPos == 0) {
+        return true;
+    }
+    CAutoFile file(OpenFilterFile(m_next_filter_pos), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        return error("%s: Failed to open filter file %d", __func__, m_next_filter_pos.nFile);
+    }
+    FileCommit(file.Get());
+    return true;
+}
+
+bool BlockFilterIndex::ReadFilterFromDisk(const CDiskBlockPos& pos, const uint256& filter_hash,
+                                          BlockFilter& filter) const
+{
+    CAutoFile filein(OpenFilterFile(pos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) {
+        return false;
+    }
+
+    uint256 block_hash;
+    std::vector<unsigned char> encoded_filter;
+    try {
+        filein >> block_hash >> encoded_filter;
+        if (Hash(encoded_filter.begin(), encoded_filter.end()) != filter_hash) {
+            return error("%s: Checksum mismatch in filter decode", __func__);
+        }
+        filter = BlockFilter(GetFilterType(), block_hash, std::move(encoded_filter));
+    }
+    catch (const std::exception& e) {
+        return error("%s: Failed to deserialize block filter from disk: %s", __func__, e.what());
+    }
+
+    return true;
+}
+
+size_t BlockFilterIndex::WriteFilterToDisk(CDiskBlockPos& pos, const BlockFilter& filter)
+{
+    assert(filter.GetFilterType() == GetFilterType());
+
+    size_t data_size =
+        GetSerializeSize(filter.GetBlockHash(), SER_DISK, CLIENT_VERSION) +
+        GetSerializeSize(filter.GetEncodedFilter(), SER_DISK, CLIENT_VERSION);
+
+    // If writing the filter would overflow the file, flush and move to the next one.
+    if (pos.nPos + data_size > MAX_FLTR_FILE_SIZE) {
+        CAutoFile last_file(OpenFilterFile(pos), SER_DISK, CLIENT_VERSION);
+        if (last_file.IsNull()) {
+            LogPrintf("%s: Failed to open filter file %d\n", __func__, pos.nFile);
+            return 0;
+        }
+        if (!TruncateFile(last_file.Get(), pos.nPos)) {
+            LogPrintf("%s: Failed to truncate filter file %d\n", __func__, pos.nFile);
+            return 0;
+        }
+        FileCommit(last_file.Get());
+
+        pos.nFile++;
+        pos.nPos = 0;
+    }
+
+    CAutoFile fileout(OpenFilterFile(pos), SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull()) {
+        LogPrintf("%s: Failed to open filter file %d\n", __func__, pos.nFile);
+        return 0;
+    }
+
+    // Pre-allocate sufficient space for filter data.
+    unsigned int old_chunks = (pos.nPos + FLTR_FILE_CHUNK_SIZE - 1) / FLTR_FILE_CHUNK_SIZE;
+    unsigned int new_chunks = (pos.nPos + data_size + FLTR_FILE_CHUNK_SIZE - 1) / FLTR_FILE_CHUNK_SIZE;
+    if (new_chunks > old_chunks) {
+        if (!CheckDiskSpace(new_chunks * FLTR_FILE_CHUNK_SIZE - pos.nPos)) {
+            LogPrintf("%s: out of disk space\n", __func__);
+            return 0;
+        }
+        AllocateFileRange(fileout.Get(), pos.nPos, new_chunks * FLTR_FILE_CHUNK_SIZE - pos.nPos);
+        if (fseek(fileout.Get(), pos.nPos, SEEK_SET)) {
+            LogPrintf("%s: Failed to seek in filter file %d\n", __func__, pos.nFile);
+            return 0;
+        }
+    }
+
+    fileout << filter.GetBlockHash() << filter.GetEncodedFilter();
+    return data_size;
+}
+
+bool BlockFilterIndex::WriteFilter(const CBlock& block, const CBlockIndex* pindex,
+                                   const uint256& prev_header, uint256& header_out)
+{
+    CBlockUndo block_undo;
+    if (pindex->nHeight > 0 && !UndoReadFromDisk(block_undo, pindex)) {
+        return false;
+    }
+
+    BlockFilter filter(m_filter_type, block, block_undo);
+
+    CDiskBlockPos pos = m_next_filter_pos;
+    size_t bytes_written = WriteFilterToDisk(pos, filter);
+    if (bytes_written == 0) return false;
+
+    DBVal value;
+    value.hash = filter.GetHash();
+    value.header = filter.ComputeHeader(prev_header);
+    value.pos = pos;
+
+    pos.nPos += bytes_written;
+
+    CDBBatch batch(*m_db);
+    batch.Write(std::make_pair(DB_BLOCK_HASH, pindex->GetBlockHash()), value);
+    batch.Write(DB_FILTER_POS, pos);
+    if (!m_db->WriteBatch(batch)) {
+        return false;
+    }
+
+    m_next_filter_pos = pos;
+    header_out = value.header;
+    return true;
+}
+
+bool BlockFilterIndex::WriteMissingAncestors(const CBlockIndex* pindex, uint256& header_out)
+{
+    // Walk back to the most recent ancestor that has an entry, then index
+    // the blocks after it in order.
+    std::vector<const CBlockIndex*> missing;
+    DBVal entry;
+    while (pindex && !m_db->Read(std::make_pair(DB_BLOCK_HASH, pindex->GetBlockHash()), entry)) {
+        missing.push_back(pindex);
+        pindex = pindex->pprev;
+    }
+
+    LogPrintf("%s: %s is missing %u filters ending at block %s; rebuilding them from height %d\n",
+              __func__, GetName(), missing.size(), missing.front()->GetBlockHash().ToString(),
+              missing.back()->nHeight);
+
+    uint256 header = pindex ? entry.header : uint256();
+    const Consensus::Params& consensus_params = Params().GetConsensus();
+    for (auto it = missing.rbegin(); it != missing.rend(); ++it) {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, *it, consensus_params)) {
+            return error("%s: Failed to read block %s from disk",
+                         __func__, (*it)->GetBlockHash().ToString());
+        }
+        if (!WriteFilter(block, *it, header, header)) {
+            return error("%s: Failed to write filter for block %s",
+                         __func__, (*it)->GetBlockHash().ToString());
+        }
+    }
+
+    header_out = header;
+    return true;
+}
+
+bool BlockFilterIndex::WriteBlock(const CBlock& block, const CBlockIndex* pindex)
+{
+    uint256 prev_header;
+
+    if (pindex->nHeight > 0) {
+        // The previous entry may be missing if the locator got ahead of the
+        // indexed data, e.g. after an unclean shutdown. Rebuild the gap rather
+        // than failing on every restart.
+        DBVal prev_entry;
+        if (m_db->Read(std::make_pair(DB_BLOCK_HASH, pindex->pprev->GetBlockHash()), prev_entry)) {
+            prev_header = prev_entry.header;
+        } else if (!WriteMissingAncestors(pindex->pprev, prev_header)) {
+            return error("%s: Failed to rebuild filter headers before block %s",
+                         __func__, pindex->GetBlockHash().ToString());
+        }
+    }
+
+    uint256 header;
+    return WriteFilter(block, pindex, prev_header, header);
+}
+
+bool BlockFilterIndex::LookupFilter(const CBlockIndex* block_index, BlockFilter& filter_out) const
+{
+    DBVal entry;
+    if (!m_db->Read(std::make_pair(DB_BLOCK_HASH, block_index->GetBlockHash()), entry)) {
+        return false;
+    }
+
+    return ReadFilterFromDisk(entry.pos, entry.hash, filter_out);
+}
+
+bool BlockFilterIndex::LookupFilterHeader(const CBlockIndex* block_index, uint256& header_out) const
+{
+    DBVal entry;
+    if (!m_db->Read(std::make_pair(DB_BLOCK_HASH, block_index->GetBlockHash()), entry)) {
+        return false;
+    }
+
+    header_out = entry.header;
+    return true;
+}
+
+BlockFilterIndex* GetBlockFilterIndex(BlockFilterType filter_type)
+{
+    auto it = g_filter_indexes.find(filter_type);
+    return it != g_filter_indexes.end() ? &it->second : nullptr;
+}
+
+void ForEachBlockFilterIndex(std::function<void (BlockFilterIndex&)> fn)
+{
+    for (auto& entry : g_filter_indexes) fn(entry.second);
+}
+
+bool InitBlockFilterIndex(BlockFilterType filter_type,
+                          size_t n_cache_size, bool f_memory, bool f_wipe)
+{
+    auto result = g_filter_indexes.emplace(std::piecewise_construct,
+                                           std::forward_as_tuple(filter_type),
+                                           std::forward_as_tuple(filter_type,
+                                                                 n_cache_size, f_memory, f_wipe));
+    return result.second;
+}
+
+void DestroyAllBlockFilterIndexes()
+{
+    g_filter_indexes.clear();
+}
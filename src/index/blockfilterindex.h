@@ -0,0 +1,96 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_INDEX_BLOCKFILTERINDEX_H
+#define BITCOIN_INDEX_BLOCKFILTERINDEX_H
+
+#include <blockfilter.h>
+#include <chain.h>
+#include <fs.h>
+#include <index/base.h>
+
+#include <functional>
+
+static const char* const DEFAULT_BLOCKFILTERINDEX = "0";
+
+/**
+ * BlockFilterIndex is used to store and retrieve block filters, hashes, and
+ * headers for a range of blocks by hash.
+ *
+ * Filters are appended to a sequence of flat files (fltr?????.dat), and a
+ * LevelDB database maps each block hash to the filter hash, the filter
+ * header and the position of the filter in the flat files. Entries are never
+ * removed, so filters for blocks which are reorganized out of the active
+ * chain remain available.
+ */
+class BlockFilterIndex final : public BaseIndex
+{
+private:
+    BlockFilterType m_filter_type;
+    std::string m_name;
+    std::unique_ptr<BaseIndex::DB> m_db;
+    fs::path m_filter_dir;
+
+    /// Position at which the next filter will be appended. Only accessed by
+    /// the thread writing to the index.
+    CDiskBlockPos m_next_filter_pos;
+
+    FILE* OpenFilterFile(const CDiskBlockPos& pos, bool read_only = false) const;
+    bool ReadFilterFromDisk(const CDiskBlockPos& pos, const uint256& filter_hash, BlockFilter& filter) const;
+    size_t WriteFilterToDisk(CDiskBlockPos& pos, const BlockFilter& filter);
+
+    /// Compute and store the filter for a block whose predecessor has the
+    /// given filter header, returning the new filter header in header_out.
+    bool WriteFilter(const CBlock& block, const CBlockIndex* pindex,
+                     const uint256& prev_header, uint256& header_out);
+
+    /// Rebuild the entries for pindex and any of its ancestors that are not
+    /// in the database, returning the filter header of pindex in header_out.
+    bool WriteMissingAncestors(const CBlockIndex* pindex, uint256& header_out);
+
+protected:
+    bool Init() override;
+
+    bool WriteBlock(const CBlock& block, const CBlockIndex* pindex) override;
+
+    bool Commit() override;
+
+    BaseIndex::DB& GetDB() const override { return *m_db; }
+
+    const char* GetName() const override { return m_name.c_str(); }
+
+public:
+    /** Constructs the index, which becomes available to be queried. */
+    explicit BlockFilterIndex(BlockFilterType filter_type,
+                              size_t n_cache_size, bool f_memory = false, bool f_wipe = false);
+
+    BlockFilterType GetFilterType() const { return m_filter_type; }
+
+    /** Get a single filter by block. */
+    bool LookupFilter(const CBlockIndex* block_index, BlockFilter& filter_out) const;
+
+    /** Get a single filter header by block. */
+    bool LookupFilterHeader(const CBlockIndex* block_index, uint256& header_out) const;
+};
+
+/**
+ * Get a block filter index by type. Returns nullptr if index has not been initialized or was
+ * already destroyed.
+ */
+BlockFilterIndex* GetBlockFilterIndex(BlockFilterType filter_type);
+
+/** Iterate over all running block filter indexes, invoking fn on each. */
+void ForEachBlockFilterIndex(std::function<void (BlockFilterIndex&)> fn);
+
+/**
+ * Initialize a block filter index for the given type if one does not already exist. Returns true if
+ * a new index is created and false if one has already been initialized.
+ */
+bool InitBlockFilterIndex(BlockFilterType filter_type,
+                          size_t n_cache_size, bool f_memory = false, bool f_wipe = false);
+
+/** Destroy all open block filter indexes. */
+void DestroyAllBlockFilterIndexes();
+
+#endif // BITCOIN_INDEX_BLOCKFILTERINDEX_H
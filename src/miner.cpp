@@ -30,6 +30,8 @@
 #include <queue>
 #include <utility>
 
+#include <boost/bind.hpp>
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // BitcoinMiner
@@ -93,8 +95,6 @@ BlockAssembler::BlockAssembler(const CChainParams& params) : BlockAssembler(para
 
 void BlockAssembler::resetBlock()
 {
-    inBlock.clear();
-
     // Reserve space for coinbase tx
     nBlockWeight = 4000;
     nBlockSigOpsCost = 400;
@@ -103,6 +103,9 @@ void BlockAssembler::resetBlock()
     // These counters do not include coinbase tx
     nBlockTx = 0;
     nFees = 0;
+
+    lowestPackageFeeRate = CFeeRate();
+    fPackagesLeftOut = false;
 }
 
 std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn, bool fMineWitnessTx)
@@ -149,8 +152,7 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     fIncludeWitness = IsWitnessEnabled(pindexPrev, chainparams.GetConsensus()) && fMineWitnessTx;
 
     int nPackagesSelected = 0;
-    int nDescendantsUpdated = 0;
-    addPackageTxs(nPackagesSelected, nDescendantsUpdated);
+    addPackageTxs(nPackagesSelected);
 
     int64_t nTime1 = GetTimeMicros();
 
@@ -184,24 +186,11 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     }
     int64_t nTime2 = GetTimeMicros();
 
-    LogPrint(BCLog::BENCH, "CreateNewBlock() packages: %.2fms (%d packages, %d updated descendants), validity: %.2fms (total %.2fms)\n", 0.001 * (nTime1 - nTimeStart), nPackagesSelected, nDescendantsUpdated, 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
+    LogPrint(BCLog::BENCH, "CreateNewBlock() packages: %.2fms (%d packages), validity: %.2fms (total %.2fms)\n", 0.001 * (nTime1 - nTimeStart), nPackagesSelected, 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
 
     return std::move(pblocktemplate);
 }
 
-void BlockAssembler::onlyUnconfirmed(CTxMemPool::setEntries& testSet)
-{
-    for (CTxMemPool::setEntries::iterator iit = testSet.begin(); iit != testSet.end(); ) {
-        // Only test txs not already in the block
-        if (inBlock.count(*iit)) {
-            testSet.erase(iit++);
-        }
-        else {
-            iit++;
-        }
-    }
-}
-
 bool BlockAssembler::TestPackage(uint64_t packageSize, int64_t packageSigOpsCost) const
 {
     // TODO: switch to weight-based accounting for packages instead of vsize-based accounting.
@@ -216,7 +205,7 @@ bool BlockAssembler::TestPackage(uint64_t packageSize, int64_t packageSigOpsCost
 // - transaction finality (locktime)
 // - premature witness (in case segwit transactions are added to mempool before
 //   segwit activation)
-bool BlockAssembler::TestPackageTransactions(const CTxMemPool::setEntries& package)
+bool BlockAssembler::TestPackageTransactions(const std::vector<CTxMemPool::txiter>& package)
 {
     for (const CTxMemPool::txiter it : package) {
         if (!IsFinalTx(it->GetTx(), nHeight, nLockTimeCutoff))
@@ -236,7 +225,6 @@ void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
     ++nBlockTx;
     nBlockSigOpsCost += iter->GetSigOpCost();
     nFees += iter->GetFee();
-    inBlock.insert(iter);
 
     bool fPrintPriority = gArgs.GetBoolArg("-printpriority", DEFAULT_PRINTPRIORITY);
     if (fPrintPriority) {
@@ -246,83 +234,19 @@ void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
     }
 }
 
-int BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded,
-        indexed_modified_transaction_set &mapModifiedTx)
+// This transaction selection algorithm takes the chunks of the mempool's
+// clusters in order of feerate. A cluster is linearized so that transactions
+// follow their in-mempool ancestors and its chunks don't increase in feerate,
+// so taking the best next chunk of any cluster each time adds transactions
+// together with the ancestors they pay for, in a valid order. Once a chunk of
+// a cluster doesn't fit, the rest of the cluster is not considered, as it may
+// depend on that chunk.
+void BlockAssembler::addPackageTxs(int &nPackagesSelected)
 {
-    int nDescendantsUpdated = 0;
-    for (const CTxMemPool::txiter it : alreadyAdded) {
-        CTxMemPool::setEntries descendants;
-        mempool.CalculateDescendants(it, descendants);
-        // Insert all descendants (not yet in block) into the modified set
-        for (CTxMemPool::txiter desc : descendants) {
-            if (alreadyAdded.count(desc))
-                continue;
-            ++nDescendantsUpdated;
-            modtxiter mit = mapModifiedTx.find(desc);
-            if (mit == mapModifiedTx.end()) {
-                CTxMemPoolModifiedEntry modEntry(desc);
-                modEntry.nSizeWithAncestors -= it->GetTxSize();
-                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
-                modEntry.nSigOpCostWithAncestors -= it->GetSigOpCost();
-                mapModifiedTx.insert(modEntry);
-            } else {
-                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
-            }
-        }
+    std::priority_queue<ClusterChunkRef, std::vector<ClusterChunkRef>, CompareClusterChunkByFee> queue;
+    for (const CTxMemPool::Cluster* cluster : mempool.GetClusters()) {
+        queue.push(ClusterChunkRef{cluster, 0});
     }
-    return nDescendantsUpdated;
-}
-
-// Skip entries in mapTx that are already in a block or are present
-// in mapModifiedTx (which implies that the mapTx ancestor state is
-// stale due to ancestor inclusion in the block)
-// Also skip transactions that we've already failed to add. This can happen if
-// we consider a transaction in mapModifiedTx and it fails: we can then
-// potentially consider it again while walking mapTx.  It's currently
-// guaranteed to fail again, but as a belt-and-suspenders check we put it in
-// failedTx and avoid re-evaluation, since the re-evaluation would be using
-// cached size/sigops/fee values that are not actually correct.
-bool BlockAssembler::SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set &mapModifiedTx, CTxMemPool::setEntries &failedTx)
-{
-    assert (it != mempool.mapTx.end());
-    return mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it);
-}
-
-void BlockAssembler::SortForBlock(const CTxMemPool::setEntries& package, CTxMemPool::txiter entry, std::vector<CTxMemPool::txiter>& sortedEntries)
-{
-    // Sort package by ancestor count
-    // If a transaction A depends on transaction B, then A's ancestor count
-    // must be greater than B's.  So this is sufficient to validly order the
-    // transactions for block inclusion.
-    sortedEntries.clear();
-    sortedEntries.insert(sortedEntries.begin(), package.begin(), package.end());
-    std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
-}
-
-// This transaction selection algorithm orders the mempool based
-// on feerate of a transaction including all unconfirmed ancestors.
-// Since we don't remove transactions from the mempool as we select them
-// for block inclusion, we need an alternate method of updating the feerate
-// of a transaction with its not-yet-selected ancestors as we go.
-// This is accomplished by walking the in-mempool descendants of selected
-// transactions and storing a temporary modified state in mapModifiedTxs.
-// Each time through the loop, we compare the best transaction in
-// mapModifiedTxs with the next transaction in the mempool to decide what
-// transaction package to work on next.
-void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpdated)
-{
-    // mapModifiedTx will store sorted packages after they are modified
-    // because some of their txs are already in the block
-    indexed_modified_transaction_set mapModifiedTx;
-    // Keep track of entries that failed inclusion, to avoid duplicate work
-    CTxMemPool::setEntries failedTx;
-
-    // Start by adding all descendants of previously added txs to mapModifiedTx
-    // and modifying them for their already included ancestors
-    UpdatePackagesForAdded(inBlock, mapModifiedTx);
-
-    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
-    CTxMemPool::txiter iter;
 
     // Limit the number of attempts to add transactions to the block when it is
     // close to full; this is just a simple heuristic to finish quickly if the
@@ -330,68 +254,18 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
     const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
     int64_t nConsecutiveFailed = 0;
 
-    while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty())
-    {
-        // First try to find a new transaction in mapTx to evaluate.
-        if (mi != mempool.mapTx.get<ancestor_score>().end() &&
-                SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx, failedTx)) {
-            ++mi;
-            continue;
-        }
+    while (!queue.empty()) {
+        const ClusterChunkRef next = queue.top();
+        queue.pop();
+        const CTxMemPool::ClusterChunk& chunk = next.GetChunk();
 
-        // Now that mi is not stale, determine which transaction to evaluate:
-        // the next entry from mapTx, or the best from mapModifiedTx?
-        bool fUsingModified = false;
-
-        modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
-        if (mi == mempool.mapTx.get<ancestor_score>().end()) {
-            // We're out of entries in mapTx; use the entry from mapModifiedTx
-            iter = modit->iter;
-            fUsingModified = true;
-        } else {
-            // Try to compare the mapTx entry to the mapModifiedTx entry
-            iter = mempool.mapTx.project<0>(mi);
-            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
-                    CompareTxMemPoolEntryByAncestorFee()(*modit, CTxMemPoolModifiedEntry(iter))) {
-                // The best entry in mapModifiedTx has higher score
-                // than the one from mapTx.
-                // Switch which transaction (package) to consider
-                iter = modit->iter;
-                fUsingModified = true;
-            } else {
-                // Either no entry in mapModifiedTx, or it's worse than mapTx.
-                // Increment mi for the next loop iteration.
-                ++mi;
-            }
-        }
-
-        // We skip mapTx entries that are inBlock, and mapModifiedTx shouldn't
-        // contain anything that is inBlock.
-        assert(!inBlock.count(iter));
-
-        uint64_t packageSize = iter->GetSizeWithAncestors();
-        CAmount packageFees = iter->GetModFeesWithAncestors();
-        int64_t packageSigOpsCost = iter->GetSigOpCostWithAncestors();
-        if (fUsingModified) {
-            packageSize = modit->nSizeWithAncestors;
-            packageFees = modit->nModFeesWithAncestors;
-            packageSigOpsCost = modit->nSigOpCostWithAncestors;
-        }
-
-        if (packageFees < blockMinFeeRate.GetFee(packageSize)) {
+        if (chunk.nModFees < blockMinFeeRate.GetFee(chunk.nSize)) {
             // Everything else we might consider has a lower fee rate
             return;
         }
 
-        if (!TestPackage(packageSize, packageSigOpsCost)) {
-            if (fUsingModified) {
-                // Since we always look at the best entry in mapModifiedTx,
-                // we must erase failed entries so that we can consider the
-                // next best entry on the next loop iteration
-                mapModifiedTx.get<ancestor_score>().erase(modit);
-                failedTx.insert(iter);
-            }
-
+        if (!TestPackage(chunk.nSize, chunk.nSigOpCost)) {
+            fPackagesLeftOut = true;
             ++nConsecutiveFailed;
 
             if (nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockWeight >
@@ -402,43 +276,284 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
             continue;
         }
 
-        CTxMemPool::setEntries ancestors;
-        uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
-        std::string dummy;
-        mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
-
-        onlyUnconfirmed(ancestors);
-        ancestors.insert(iter);
+        const std::vector<CTxMemPool::txiter>& vTxs = next.cluster->vTxs;
+        std::vector<CTxMemPool::txiter> package(vTxs.begin() + next.cluster->ChunkBegin(next.nChunk), vTxs.begin() + chunk.nEnd);
 
         // Test if all tx's are Final
-        if (!TestPackageTransactions(ancestors)) {
-            if (fUsingModified) {
-                mapModifiedTx.get<ancestor_score>().erase(modit);
-                failedTx.insert(iter);
-            }
+        if (!TestPackageTransactions(package)) {
             continue;
         }
 
         // This transaction will make it in; reset the failed counter.
         nConsecutiveFailed = 0;
 
-        // Package can be added. Sort the entries in a valid order.
-        std::vector<CTxMemPool::txiter> sortedEntries;
-        SortForBlock(ancestors, iter, sortedEntries);
-
-        for (size_t i=0; i<sortedEntries.size(); ++i) {
-            AddToBlock(sortedEntries[i]);
-            // Erase from the modified set, if present
-            mapModifiedTx.erase(sortedEntries[i]);
+        for (CTxMemPool::txiter it : package) {
+            AddToBlock(it);
         }
 
+        CFeeRate packageFeeRate(chunk.nModFees, chunk.nSize);
+        if (nPackagesSelected == 0 || packageFeeRate < lowestPackageFeeRate) {
+            lowestPackageFeeRate = packageFeeRate;
+        }
         ++nPackagesSelected;
 
-        // Update transactions that depend on each of these
-        nDescendantsUpdated += UpdatePackagesForAdded(ancestors, mapModifiedTx);
+        if (next.nChunk + 1 < next.cluster->vChunks.size()) {
+            queue.push(ClusterChunkRef{next.cluster, next.nChunk + 1});
+        }
+    }
+}
+
+std::unique_ptr<BlockTemplateManager> g_block_template_manager;
+
+// Mempool changes to queue for the selection before giving up on updating it
+// and assembling it anew, so an unused selection doesn't hold on to memory.
+static const size_t MAX_PENDING_TEMPLATE_CHANGES = 10000;
+
+BlockTemplateManager::BlockTemplateManager(const CChainParams& params) : chainparams(params), fRebuild(false), fSelectionValid(false)
+{
+    BlockAssembler::Options options = DefaultOptions(params);
+    // Same limits as BlockAssembler
+    nBlockMaxWeight = std::max<size_t>(4000, std::min<size_t>(MAX_BLOCK_WEIGHT - 4000, options.nBlockMaxWeight));
+    blockMinFeeRate = options.blockMinFeeRate;
+
+    mempool.NotifyEntryAdded.connect(boost::bind(&BlockTemplateManager::TransactionAdded, this, _1));
+    mempool.NotifyEntryRemoved.connect(boost::bind(&BlockTemplateManager::TransactionRemoved, this, _1, _2));
+    mempool.NotifyEntryPrioritised.connect(boost::bind(&BlockTemplateManager::TransactionPrioritised, this, _1));
+}
+
+BlockTemplateManager::~BlockTemplateManager()
+{
+    mempool.NotifyEntryAdded.disconnect(boost::bind(&BlockTemplateManager::TransactionAdded, this, _1));
+    mempool.NotifyEntryRemoved.disconnect(boost::bind(&BlockTemplateManager::TransactionRemoved, this, _1, _2));
+    mempool.NotifyEntryPrioritised.disconnect(boost::bind(&BlockTemplateManager::TransactionPrioritised, this, _1));
+}
+
+// The notifications are sent with mempool.cs held, so they only queue the
+// change to be applied by the next GetBlockTemplate() call.
+
+void BlockTemplateManager::TransactionAdded(CTransactionRef tx)
+{
+    LOCK(cs);
+    if (!pselection || fRebuild) return;
+    if (vAdded.size() >= MAX_PENDING_TEMPLATE_CHANGES) {
+        fRebuild = true;
+        vAdded.clear();
+        setRemoved.clear();
+        return;
+    }
+    vAdded.push_back(std::move(tx));
+}
+
+void BlockTemplateManager::TransactionRemoved(CTransactionRef tx, MemPoolRemovalReason reason)
+{
+    LOCK(cs);
+    if (!pselection || fRebuild) return;
+    if (setSelected.count(tx->GetHash())) {
+        setRemoved.insert(tx->GetHash());
     }
 }
 
+void BlockTemplateManager::TransactionPrioritised(const uint256& hash)
+{
+    LOCK(cs);
+    fRebuild = true;
+}
+
+void BlockTemplateManager::Rebuild(const CBlockIndex* pindexPrev, bool fMineWitnessTx)
+{
+    BlockAssembler assembler(chainparams);
+    pselection = assembler.CreateNewBlock(CScript(), fMineWitnessTx);
+    const CBlock& block = pselection->block;
+
+    pindexSelection = pindexPrev;
+    fMineWitness = fMineWitnessTx;
+    fIncludeWitness = IsWitnessEnabled(pindexPrev, chainparams.GetConsensus()) && fMineWitnessTx;
+    nHeight = pindexPrev->nHeight + 1;
+    nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+                       ? pindexPrev->GetMedianTimePast()
+                       : GetAdjustedTime();
+
+    setSelected.clear();
+    nBlockWeight = 4000;
+    nBlockSigOpsCost = 400;
+    nFees = 0;
+    for (size_t i = 1; i < block.vtx.size(); ++i) {
+        setSelected.insert(block.vtx[i]->GetHash());
+        nBlockWeight += GetTransactionWeight(*block.vtx[i]);
+        nBlockSigOpsCost += pselection->vTxSigOpsCost[i];
+        nFees += pselection->vTxFees[i];
+    }
+    lowestPackageFeeRate = assembler.GetLowestPackageFeeRate();
+    fFull = assembler.PackagesLeftOut();
+    // CreateNewBlock checked it already.
+    fSelectionValid = true;
+
+    vAdded.clear();
+    setRemoved.clear();
+    fRebuild = false;
+}
+
+bool BlockTemplateManager::RemoveSelected()
+{
+    CBlock& block = pselection->block;
+    std::set<uint256> setDropped;
+    size_t j = 1;
+    for (size_t i = 1; i < block.vtx.size(); ++i) {
+        const uint256& hash = block.vtx[i]->GetHash();
+        bool fDrop = setRemoved.count(hash);
+        for (const CTxIn& txin : block.vtx[i]->vin) {
+            fDrop |= setDropped.count(txin.prevout.hash) > 0;
+        }
+        if (!fDrop) {
+            block.vtx[j] = std::move(block.vtx[i]);
+            pselection->vTxFees[j] = pselection->vTxFees[i];
+            pselection->vTxSigOpsCost[j] = pselection->vTxSigOpsCost[i];
+            ++j;
+            continue;
+        }
+        // A descendant that is still in the mempool would have to be
+        // selected again.
+        if (!setRemoved.count(hash) && mempool.exists(hash)) return false;
+        setDropped.insert(hash);
+        setSelected.erase(hash);
+        fSelectionValid = false;
+        nBlockWeight -= GetTransactionWeight(*block.vtx[i]);
+        nBlockSigOpsCost -= pselection->vTxSigOpsCost[i];
+        nFees -= pselection->vTxFees[i];
+    }
+    block.vtx.resize(j);
+    pselection->vTxFees.resize(j);
+    pselection->vTxSigOpsCost.resize(j);
+    return true;
+}
+
+bool BlockTemplateManager::AddPackage(CTxMemPool::txiter iter)
+{
+    // Take the chunks of the transaction's cluster in order, as
+    // BlockAssembler would, and append what isn't selected yet.
+    const CTxMemPool::Cluster& cluster = mempool.GetCluster(iter);
+    for (size_t i = 0; i < cluster.vChunks.size(); ++i) {
+        const CTxMemPool::ClusterChunk& chunk = cluster.vChunks[i];
+        std::vector<CTxMemPool::txiter> package;
+        uint64_t packageSize = 0;
+        int64_t packageSigOpsCost = 0;
+        for (size_t j = cluster.ChunkBegin(i); j < chunk.nEnd; ++j) {
+            CTxMemPool::txiter it = cluster.vTxs[j];
+            if (setSelected.count(it->GetTx().GetHash())) continue;
+            // Same transaction level checks as BlockAssembler::TestPackageTransactions
+            if (!IsFinalTx(it->GetTx(), nHeight, nLockTimeCutoff)) return true;
+            if (!fIncludeWitness && it->GetTx().HasWitness()) return true;
+            package.push_back(it);
+            packageSize += it->GetTxSize();
+            packageSigOpsCost += it->GetSigOpCost();
+        }
+        if (package.empty()) continue;
+
+        // Not worth mining yet; it may be once the cluster grows.
+        if (chunk.nModFees < blockMinFeeRate.GetFee(chunk.nSize)) return true;
+
+        CFeeRate packageFeeRate(chunk.nModFees, chunk.nSize);
+        if (nBlockWeight + WITNESS_SCALE_FACTOR * packageSize >= nBlockMaxWeight ||
+            nBlockSigOpsCost + packageSigOpsCost >= MAX_BLOCK_SIGOPS_COST) {
+            fFull = true;
+            // A better package than some of the selected ones needs a rebuild.
+            return !(lowestPackageFeeRate < packageFeeRate);
+        }
+
+        for (CTxMemPool::txiter entry : package) {
+            pselection->block.vtx.emplace_back(entry->GetSharedTx());
+            pselection->vTxFees.push_back(entry->GetFee());
+            pselection->vTxSigOpsCost.push_back(entry->GetSigOpCost());
+            setSelected.insert(entry->GetTx().GetHash());
+            fSelectionValid = false;
+            nBlockWeight += entry->GetTxWeight();
+            nBlockSigOpsCost += entry->GetSigOpCost();
+            nFees += entry->GetFee();
+        }
+        if (setSelected.size() == package.size() || packageFeeRate < lowestPackageFeeRate) {
+            lowestPackageFeeRate = packageFeeRate;
+        }
+    }
+    return true;
+}
+
+bool BlockTemplateManager::Update()
+{
+    if (!setRemoved.empty()) {
+        // Space freed in a full block goes to the best package left out.
+        if (fFull || !RemoveSelected()) return false;
+    }
+    for (const CTransactionRef& tx : vAdded) {
+        CTxMemPool::txiter it = mempool.mapTx.find(tx->GetHash());
+        if (it == mempool.mapTx.end() || setSelected.count(tx->GetHash())) continue;
+        if (!AddPackage(it)) return false;
+    }
+    vAdded.clear();
+    setRemoved.clear();
+    return true;
+}
+
+std::unique_ptr<CBlockTemplate> BlockTemplateManager::GetBlockTemplate(const CScript& scriptPubKeyIn, bool fMineWitnessTx)
+{
+    int64_t nTimeStart = GetTimeMicros();
+
+    LOCK2(cs_main, mempool.cs);
+    LOCK(cs);
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    assert(pindexPrev != nullptr);
+
+    bool fRebuilt = false;
+    if (!pselection || fRebuild || pindexSelection != pindexPrev || fMineWitness != fMineWitnessTx || !Update()) {
+        Rebuild(pindexPrev, fMineWitnessTx);
+        fRebuilt = true;
+    }
+    int64_t nTime1 = GetTimeMicros();
+
+    std::unique_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate(*pselection));
+    CBlock* pblock = &pblocktemplate->block;
+
+    nLastBlockTx = pblock->vtx.size() - 1;
+    nLastBlockWeight = nBlockWeight;
+
+    // Create coinbase transaction.
+    CMutableTransaction coinbaseTx;
+    coinbaseTx.vin.resize(1);
+    coinbaseTx.vin[0].prevout.SetNull();
+    coinbaseTx.vout.resize(1);
+    coinbaseTx.vout[0].scriptPubKey = scriptPubKeyIn;
+    coinbaseTx.vout[0].nValue = nFees + GetBlockSubsidy(nHeight, chainparams.GetConsensus());
+    coinbaseTx.vin[0].scriptSig = CScript() << nHeight << OP_0;
+    pblock->vtx[0] = MakeTransactionRef(std::move(coinbaseTx));
+    pblocktemplate->vchCoinbaseCommitment = GenerateCoinbaseCommitment(*pblock, pindexPrev, chainparams.GetConsensus());
+    pblocktemplate->vTxFees[0] = -nFees;
+
+    // Fill in header
+    pblock->nTime = GetAdjustedTime();
+    UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev);
+    pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, chainparams.GetConsensus());
+    pblock->nNonce         = 0;
+    pblocktemplate->vTxSigOpsCost[0] = WITNESS_SCALE_FACTOR * GetLegacySigOpCount(*pblock->vtx[0]);
+
+    // Only the coinbase and header differ from the last template made from an
+    // unchanged selection, so check the block once per selection change.
+    if (!fSelectionValid) {
+        CValidationState state;
+        if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
+            // Don't trust the incremental updates any further; assemble the
+            // selection from scratch, which checks the block again.
+            LogPrintf("%s: TestBlockValidity failed on updated selection: %s, rebuilding\n", __func__, FormatStateMessage(state));
+            fRebuild = true;
+            return GetBlockTemplate(scriptPubKeyIn, fMineWitnessTx);
+        }
+        fSelectionValid = true;
+    }
+    int64_t nTime2 = GetTimeMicros();
+
+    LogPrint(BCLog::BENCH, "GetBlockTemplate() %s: %.2fms, coinbase and validity: %.2fms (total %.2fms)\n", fRebuilt ? "rebuild" : "update", 0.001 * (nTime1 - nTimeStart), 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
+
+    return pblocktemplate;
+}
+
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -7,12 +7,13 @@
 #define BITCOIN_MINER_H
 
 #include <primitives/block.h>
+#include <sync.h>
 #include <txmempool.h>
 
 #include <stdint.h>
 #include <memory>
-#include <boost/multi_index_container.hpp>
-#include <boost/multi_index/ordered_index.hpp>
+#include <set>
+#include <vector>
 
 class CBlockIndex;
 class CChainParams;
@@ -30,93 +31,26 @@ struct CBlockTemplate
     std::vector<unsigned char> vchCoinbaseCommitment;
 };
 
-// Container for tracking updates to ancestor feerate as we include (parent)
-// transactions in a block
-struct CTxMemPoolModifiedEntry {
-    explicit CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
-    {
-        iter = entry;
-        nSizeWithAncestors = entry->GetSizeWithAncestors();
-        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
-        nSigOpCostWithAncestors = entry->GetSigOpCostWithAncestors();
-    }
-
-    int64_t GetModifiedFee() const { return iter->GetModifiedFee(); }
-    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
-    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
-    size_t GetTxSize() const { return iter->GetTxSize(); }
-    const CTransaction& GetTx() const { return iter->GetTx(); }
-
-    CTxMemPool::txiter iter;
-    uint64_t nSizeWithAncestors;
-    CAmount nModFeesWithAncestors;
-    int64_t nSigOpCostWithAncestors;
-};
-
-/** Comparator for CTxMemPool::txiter objects.
- *  It simply compares the internal memory address of the CTxMemPoolEntry object
- *  pointed to. This means it has no meaning, and is only useful for using them
- *  as key in other indexes.
- */
-struct CompareCTxMemPoolIter {
-    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
-    {
-        return &(*a) < &(*b);
-    }
-};
+// A chunk of a mempool cluster, considered for the block once the chunks
+// before it in the cluster are in it
+struct ClusterChunkRef {
+    const CTxMemPool::Cluster* cluster;
+    size_t nChunk;
 
-struct modifiedentry_iter {
-    typedef CTxMemPool::txiter result_type;
-    result_type operator() (const CTxMemPoolModifiedEntry &entry) const
-    {
-        return entry.iter;
-    }
-};
-
-// A comparator that sorts transactions based on number of ancestors.
-// This is sufficient to sort an ancestor package in an order that is valid
-// to appear in a block.
-struct CompareTxIterByAncestorCount {
-    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b) const
-    {
-        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
-            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
-        return CTxMemPool::CompareIteratorByHash()(a, b);
-    }
+    const CTxMemPool::ClusterChunk& GetChunk() const { return cluster->vChunks[nChunk]; }
+    CTxMemPool::txiter GetFirstTx() const { return cluster->vTxs[cluster->ChunkBegin(nChunk)]; }
 };
 
-typedef boost::multi_index_container<
-    CTxMemPoolModifiedEntry,
-    boost::multi_index::indexed_by<
-        boost::multi_index::ordered_unique<
-            modifiedentry_iter,
-            CompareCTxMemPoolIter
-        >,
-        // sorted by modified ancestor fee rate
-        boost::multi_index::ordered_non_unique<
-            // Reuse same tag from CTxMemPool's similar index
-            boost::multi_index::tag<ancestor_score>,
-            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
-            CompareTxMemPoolEntryByAncestorFee
-        >
-    >
-> indexed_modified_transaction_set;
-
-typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
-typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
-
-struct update_for_parent_inclusion
-{
-    explicit update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
-
-    void operator() (CTxMemPoolModifiedEntry &e)
+// A comparator for a priority queue of chunks, which puts the chunk paying
+// the highest feerate on top. Ties go to the chunk whose first transaction has
+// the lowest hash, so that the selection is deterministic.
+struct CompareClusterChunkByFee {
+    bool operator()(const ClusterChunkRef& a, const ClusterChunkRef& b) const
     {
-        e.nModFeesWithAncestors -= iter->GetFee();
-        e.nSizeWithAncestors -= iter->GetTxSize();
-        e.nSigOpCostWithAncestors -= iter->GetSigOpCost();
+        if (b.GetChunk().HigherFeeRate(a.GetChunk())) return true;
+        if (a.GetChunk().HigherFeeRate(b.GetChunk())) return false;
+        return CTxMemPool::CompareIteratorByHash()(b.GetFirstTx(), a.GetFirstTx());
     }
-
-    CTxMemPool::txiter iter;
 };
 
 /** Generate a new block, without valid proof-of-work */
@@ -138,7 +72,8 @@ private:
     uint64_t nBlockTx;
     uint64_t nBlockSigOpsCost;
     CAmount nFees;
-    CTxMemPool::setEntries inBlock;
+    CFeeRate lowestPackageFeeRate;
+    bool fPackagesLeftOut;
 
     // Chain context for the block
     int nHeight;
@@ -158,6 +93,11 @@ public:
     /** Construct a new block template with coinbase to scriptPubKeyIn */
     std::unique_ptr<CBlockTemplate> CreateNewBlock(const CScript& scriptPubKeyIn, bool fMineWitnessTx=true);
 
+    /** Lowest feerate of the cluster chunks selected by the last CreateNewBlock() */
+    CFeeRate GetLowestPackageFeeRate() const { return lowestPackageFeeRate; }
+    /** Whether the last CreateNewBlock() left out packages that did not fit */
+    bool PackagesLeftOut() const { return fPackagesLeftOut; }
+
 private:
     // utility functions
     /** Clear the block's state and prepare for assembling a new block */
@@ -166,32 +106,94 @@ private:
     void AddToBlock(CTxMemPool::txiter iter);
 
     // Methods for how to add transactions to a block.
-    /** Add transactions based on feerate including unconfirmed ancestors
-      * Increments nPackagesSelected / nDescendantsUpdated with corresponding
-      * statistics from the package selection (for logging statistics). */
-    void addPackageTxs(int &nPackagesSelected, int &nDescendantsUpdated);
+    /** Add transactions a chunk of a mempool cluster at a time, by feerate.
+      * Increments nPackagesSelected with the number of chunks selected (for
+      * logging statistics). */
+    void addPackageTxs(int &nPackagesSelected);
 
     // helper functions for addPackageTxs()
-    /** Remove confirmed (inBlock) entries from given set */
-    void onlyUnconfirmed(CTxMemPool::setEntries& testSet);
     /** Test if a new package would "fit" in the block */
     bool TestPackage(uint64_t packageSize, int64_t packageSigOpsCost) const;
     /** Perform checks on each transaction in a package:
       * locktime, premature-witness, serialized size (if necessary)
       * These checks should always succeed, and they're here
       * only as an extra check in case of suboptimal node configuration */
-    bool TestPackageTransactions(const CTxMemPool::setEntries& package);
-    /** Return true if given transaction from mapTx has already been evaluated,
-      * or if the transaction's cached data in mapTx is incorrect. */
-    bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set &mapModifiedTx, CTxMemPool::setEntries &failedTx);
-    /** Sort the package in an order that is valid to appear in a block */
-    void SortForBlock(const CTxMemPool::setEntries& package, CTxMemPool::txiter entry, std::vector<CTxMemPool::txiter>& sortedEntries);
-    /** Add descendants of given transactions to mapModifiedTx with ancestor
-      * state updated assuming given transactions are inBlock. Returns number
-      * of updated descendants. */
-    int UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set &mapModifiedTx);
+    bool TestPackageTransactions(const std::vector<CTxMemPool::txiter>& package);
 };
 
+/**
+ * Keeps the transaction selection of a block template up to date as
+ * transactions enter and leave the mempool, so that a new template doesn't
+ * have to be assembled from the whole mempool on every request.
+ *
+ * When a transaction enters the mempool, the chunks of its cluster that are
+ * not selected yet are appended to the selection in order, as long as they
+ * pay the minimum block feerate and fit, and transactions leaving the mempool
+ * are dropped from the selection. As
+ * long as everything eligible fits in the block, this selects the same
+ * transactions BlockAssembler would. The selection is assembled from scratch
+ * with BlockAssembler when the tip changes or fees are prioritised, and when
+ * the block is full and either a selected transaction is removed or a package
+ * pays a higher feerate than the lowest selected one, so that a full block
+ * still gets the best packages.
+ *
+ * Only a rebuilt selection goes through TestBlockValidity. Transactions added
+ * later were accepted to the mempool on top of the same tip, and the block
+ * limits are tracked while adding them.
+ */
+class BlockTemplateManager
+{
+private:
+    const CChainParams& chainparams;
+    unsigned int nBlockMaxWeight;
+    CFeeRate blockMinFeeRate;
+
+    CCriticalSection cs;
+
+    // Mempool changes not yet applied to the selection
+    std::vector<CTransactionRef> vAdded;
+    std::set<uint256> setRemoved;
+    bool fRebuild;
+
+    // The selected transactions; the coinbase is filled in for each request
+    std::unique_ptr<CBlockTemplate> pselection;
+    std::set<uint256> setSelected;
+    const CBlockIndex* pindexSelection;
+    bool fMineWitness;
+    bool fIncludeWitness;
+    int nHeight;
+    int64_t nLockTimeCutoff;
+    uint64_t nBlockWeight;
+    int64_t nBlockSigOpsCost;
+    CAmount nFees;
+    CFeeRate lowestPackageFeeRate;
+    bool fFull;
+    // Whether the selection passed TestBlockValidity since it last changed
+    bool fSelectionValid;
+
+    void TransactionAdded(CTransactionRef tx);
+    void TransactionRemoved(CTransactionRef tx, MemPoolRemovalReason reason);
+    void TransactionPrioritised(const uint256& hash);
+
+    /** Assemble the selection from scratch with BlockAssembler */
+    void Rebuild(const CBlockIndex* pindexPrev, bool fMineWitnessTx);
+    /** Apply pending mempool changes. Returns false if the selection needs a rebuild instead. */
+    bool Update();
+    /** Drop removed transactions and their selected descendants */
+    bool RemoveSelected();
+    /** Append the unselected chunks of a transaction's cluster, if eligible */
+    bool AddPackage(CTxMemPool::txiter iter);
+
+public:
+    explicit BlockTemplateManager(const CChainParams& params);
+    ~BlockTemplateManager();
+
+    /** Construct a new block template with coinbase to scriptPubKeyIn, like BlockAssembler::CreateNewBlock */
+    std::unique_ptr<CBlockTemplate> GetBlockTemplate(const CScript& scriptPubKeyIn, bool fMineWitnessTx=true);
+};
+
+extern std::unique_ptr<BlockTemplateManager> g_block_template_manager;
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
@@ -72,6 +72,9 @@ enum BindFlags {
 
 const static std::string NET_MESSAGE_COMMAND_OTHER = "*other*";
 
+/** Maximum number of queued buffers handed to the kernel in one call when sending */
+static const int MAX_SEND_BUFFERS = 64;
+
 static const uint64_t RANDOMIZER_ID_NETGROUP = 0x6c0edd8036ef4036ULL; // SHA256("netgroup")[0:8]
 static const uint64_t RANDOMIZER_ID_LOCALHOSTNONCE = 0xd93e69e2bbfa5735ULL; // SHA256("localhostnonce")[0:8]
 //
@@ -448,6 +451,11 @@ CNode* CConnman::ConnectNode(CAddress addrConnect, const char *pszDest, bool fCo
         CloseSocket(hSocket);
         return nullptr;
     }
+    if (!IsSelectableSocket(hSocket, m_socket_events_mode == SocketEventsMode::SELECT)) {
+        LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
+        CloseSocket(hSocket);
+        return nullptr;
+    }
 
     // Add node
     NodeId id = GetNewNodeId();
@@ -884,27 +892,56 @@ size_t CConnman::SocketSendData(CNode *pnode) const
     size_t nSentSize = 0;
 
     while (it != pnode->vSendMsg.end()) {
-        const auto &data = *it;
-        assert(data.size() > pnode->nSendOffset);
+        assert((*it)->size() > pnode->nSendOffset);
+        size_t nOffered = 0;
         int nBytes = 0;
         {
             LOCK(pnode->cs_hSocket);
             if (pnode->hSocket == INVALID_SOCKET)
                 break;
-            nBytes = send(pnode->hSocket, reinterpret_cast<const char*>(data.data()) + pnode->nSendOffset, data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#ifdef WIN32
+            const auto &data = **it;
+            nOffered = data.size() - pnode->nSendOffset;
+            nBytes = send(pnode->hSocket, reinterpret_cast<const char*>(data.data()) + pnode->nSendOffset, nOffered, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+            // Gather the headers and payloads of several messages into one
+            // call, without copying them into a contiguous buffer.
+            struct iovec iov[MAX_SEND_BUFFERS];
+            int nBuffers = 0;
+            size_t nOffset = pnode->nSendOffset;
+            for (auto it2 = it; it2 != pnode->vSendMsg.end() && nBuffers < MAX_SEND_BUFFERS; ++it2, ++nBuffers) {
+                iov[nBuffers].iov_base = const_cast<unsigned char*>((*it2)->data()) + nOffset;
+                iov[nBuffers].iov_len = (*it2)->size() - nOffset;
+                nOffered += iov[nBuffers].iov_len;
+                nOffset = 0;
+            }
+            struct msghdr msg = {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = nBuffers;
+            nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         }
         if (nBytes > 0) {
             pnode->nLastSend = GetSystemTimeInSeconds();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             nSentSize += nBytes;
-            if (pnode->nSendOffset == data.size()) {
+            // Drop the buffers that were sent completely
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                const auto &data = **it;
+                size_t nRemaining = data.size() - pnode->nSendOffset;
+                if (nLeft < nRemaining) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nRemaining;
                 pnode->nSendOffset = 0;
                 pnode->nSendSize -= data.size();
-                pnode->fPauseSend = pnode->nSendSize > nSendBufferMaxSize;
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            pnode->fPauseSend = pnode->nSendSize > nSendBufferMaxSize;
+            if ((size_t)nBytes < nOffered) {
+                // could not send everything offered; stop sending more
                 break;
             }
         } else {
@@ -1103,7 +1140,7 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (!IsSelectableSocket(hSocket, m_socket_events_mode == SocketEventsMode::SELECT))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -1151,6 +1188,9 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
 void CConnman::ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    SocketEvents socket_events(m_socket_events_mode);
+    std::set<SOCKET> recv_set, send_set, error_set;
+    LogPrint(BCLog::NET, "Using %s for socket events\n", SocketEventsModeToString(socket_events.GetMode()));
     while (!interruptNet)
     {
         //
@@ -1217,23 +1257,11 @@ void CConnman::ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
+        const int64_t timeout_ms = 50; // frequency to poll pnode->vSend
 
+        socket_events.BeginUpdate();
         for (const ListenSocket& hListenSocket : vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = std::max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
+            socket_events.Update(hListenSocket.socket, -1, true, false);
         }
 
         {
@@ -1241,15 +1269,16 @@ void CConnman::ThreadSocketHandler()
             for (CNode* pnode : vNodes)
             {
                 // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
+                // * If there is data to send, wait for the socket to become writable. As
+                //   this only happens when optimistic write failed, we choose to first drain
+                //   the write buffer in this case before receiving more. This avoids
                 //   needlessly queueing received data, if the remote peer is not themselves
                 //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is space left in the receive buffer, select() for
-                //   receiving data.
+                // * Otherwise, if there is space left in the receive buffer, wait for the
+                //   socket to become readable.
                 // * Hand off all complete messages to the processor, to be handled without
                 //   blocking here.
+                // Errors are reported for every registered socket.
 
                 bool select_recv = !pnode->fPauseRecv;
                 bool select_send;
@@ -1262,37 +1291,31 @@ void CConnman::ThreadSocketHandler()
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
 
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = std::max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                if (select_send) {
-                    FD_SET(pnode->hSocket, &fdsetSend);
-                    continue;
-                }
-                if (select_recv) {
-                    FD_SET(pnode->hSocket, &fdsetRecv);
-                }
+                socket_events.Update(pnode->hSocket, pnode->GetId(), select_recv && !select_send, select_send);
             }
         }
+        socket_events.EndUpdate();
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        bool wait_ok = socket_events.Wait(timeout_ms, recv_set, send_set, error_set);
         if (interruptNet)
             return;
 
-        if (nSelect == SOCKET_ERROR)
+        if (!wait_ok)
         {
-            if (have_fds)
+            // Try receiving from everything; sockets that are not ready will
+            // simply report that the operation would block.
+            recv_set.clear();
+            for (const ListenSocket& hListenSocket : vhListenSocket)
+                recv_set.insert(hListenSocket.socket);
             {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                LOCK(cs_vNodes);
+                for (CNode* pnode : vNodes) {
+                    LOCK(pnode->cs_hSocket);
+                    if (pnode->hSocket != INVALID_SOCKET)
+                        recv_set.insert(pnode->hSocket);
+                }
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            if (!interruptNet.sleep_for(std::chrono::milliseconds(timeout.tv_usec/1000)))
+            if (!interruptNet.sleep_for(std::chrono::milliseconds(timeout_ms)))
                 return;
         }
 
@@ -1301,7 +1324,7 @@ void CConnman::ThreadSocketHandler()
         //
         for (const ListenSocket& hListenSocket : vhListenSocket)
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            if (hListenSocket.socket != INVALID_SOCKET && recv_set.count(hListenSocket.socket))
             {
                 AcceptConnection(hListenSocket);
             }
@@ -1332,9 +1355,9 @@ void CConnman::ThreadSocketHandler()
                 LOCK(pnode->cs_hSocket);
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
-                recvSet = FD_ISSET(pnode->hSocket, &fdsetRecv);
-                sendSet = FD_ISSET(pnode->hSocket, &fdsetSend);
-                errorSet = FD_ISSET(pnode->hSocket, &fdsetError);
+                recvSet = recv_set.count(pnode->hSocket) > 0;
+                sendSet = send_set.count(pnode->hSocket) > 0;
+                errorSet = error_set.count(pnode->hSocket) > 0;
             }
             if (recvSet || errorSet)
             {
@@ -1450,7 +1473,7 @@ void CConnman::WakeMessageHandler()
         std::lock_guard<std::mutex> lock(mutexMsgProc);
         fMsgProcWake = true;
     }
-    condMsgProc.notify_one();
+    condMsgProc.notify_all();
 }
 
 
@@ -1999,7 +2022,7 @@ void CConnman::OpenNetworkConnection(const CAddress& addrConnect, bool fCountFai
     }
 }
 
-void CConnman::ThreadMessageHandler()
+void CConnman::ThreadMessageHandler(int worker)
 {
     while (!flagInterruptMsgProc)
     {
@@ -2014,11 +2037,21 @@ void CConnman::ThreadMessageHandler()
 
         bool fMoreWork = false;
 
-        for (CNode* pnode : vNodesCopy)
+        // Each worker starts at a different offset so that workers spread
+        // out over the nodes instead of contending for the same ones.
+        const size_t nNodes = vNodesCopy.size();
+        const size_t nStart = nNodes * worker / m_msgproc_threads;
+        for (size_t i = 0; i < nNodes; ++i)
         {
+            CNode* pnode = vNodesCopy[(nStart + i) % nNodes];
             if (pnode->fDisconnect)
                 continue;
 
+            // Skip nodes another worker is busy with; it re-checks for
+            // remaining work for that node when it is done.
+            if (pnode->fProcessingMessages.exchange(true))
+                continue;
+
             // Receive messages
             bool fMoreNodeWork = m_msgproc->ProcessMessages(pnode, flagInterruptMsgProc);
             fMoreWork |= (fMoreNodeWork && !pnode->fPauseSend);
@@ -2029,6 +2062,15 @@ void CConnman::ThreadMessageHandler()
                 LOCK(pnode->cs_sendProcessing);
                 m_msgproc->SendMessages(pnode, flagInterruptMsgProc);
             }
+            pnode->fProcessingMessages = false;
+
+            // Another worker that skipped this node while we were busy with
+            // it may have consumed the wakeup for messages that arrived in the
+            // meantime, so check for them after releasing the node.
+            {
+                LOCK(pnode->cs_vProcessMsg);
+                fMoreWork |= (!pnode->vProcessMsg.empty() && !pnode->fPauseSend);
+            }
 
             if (flagInterruptMsgProc)
                 return;
@@ -2075,6 +2117,13 @@ bool CConnman::BindListenPort(const CService &addrBind, std::string& strError, b
         LogPrintf("%s\n", strError);
         return false;
     }
+    if (!IsSelectableSocket(hListenSocket, m_socket_events_mode == SocketEventsMode::SELECT))
+    {
+        strError = "Error: Couldn't open socket for incoming connections (non-selectable socket created)";
+        LogPrintf("%s\n", strError);
+        CloseSocket(hListenSocket);
+        return false;
+    }
 #ifndef WIN32
     // Allow binding if the port is still in TIME_WAIT state after
     // the program was closed and restarted.
@@ -2363,7 +2412,10 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
         threadOpenConnections = std::thread(&TraceThread<std::function<void()> >, "opencon", std::function<void()>(std::bind(&CConnman::ThreadOpenConnections, this, connOptions.m_specified_outgoing)));
 
     // Process messages
-    threadMessageHandler = std::thread(&TraceThread<std::function<void()> >, "msghand", std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this)));
+    LogPrintf("Using %d message handler threads\n", m_msgproc_threads);
+    for (int i = 0; i < m_msgproc_threads; ++i) {
+        threadMessageHandlers.emplace_back(&TraceThread<std::function<void()> >, "msghand", std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this, i)));
+    }
 
     // Dump network addresses
     scheduler.scheduleEvery(std::bind(&CConnman::DumpData, this), DUMP_ADDRESSES_INTERVAL * 1000);
@@ -2412,8 +2464,11 @@ void CConnman::Interrupt()
 
 void CConnman::Stop()
 {
-    if (threadMessageHandler.joinable())
-        threadMessageHandler.join();
+    for (std::thread& thread : threadMessageHandlers) {
+        if (thread.joinable())
+            thread.join();
+    }
+    threadMessageHandlers.clear();
     if (threadOpenConnections.joinable())
         threadOpenConnections.join();
     if (threadOpenAddedConnections.joinable())
@@ -2748,6 +2803,7 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     nextSendTimeFeeFilter = 0;
     fPauseRecv = false;
     fPauseSend = false;
+    fProcessingMessages = false;
     nProcessQueueSize = 0;
 
     for (const std::string &msg : getAllNetMessageTypes())
@@ -2805,19 +2861,28 @@ bool CConnman::NodeFullyConnected(const CNode* pnode)
     return pnode && pnode->fSuccessfullyConnected && !pnode->fDisconnect;
 }
 
+CSharedNetPayload::CSharedNetPayload(std::vector<unsigned char>&& dataIn) :
+    data(std::move(dataIn)), hash(Hash(data.data(), data.data() + data.size()))
+{
+}
+
 void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
 {
-    size_t nMessageSize = msg.data.size();
+    // The payload is moved, not copied, into a buffer the send queue can share
+    std::shared_ptr<const CSharedNetPayload> payload = msg.shared_payload;
+    if (!payload) {
+        payload = std::make_shared<const CSharedNetPayload>(std::move(msg.data));
+    }
+    size_t nMessageSize = payload->data.size();
     size_t nTotalSize = nMessageSize + CMessageHeader::HEADER_SIZE;
     LogPrint(BCLog::NET, "sending %s (%d bytes) peer=%d\n",  SanitizeString(msg.command.c_str()), nMessageSize, pnode->GetId());
 
-    std::vector<unsigned char> serializedHeader;
-    serializedHeader.reserve(CMessageHeader::HEADER_SIZE);
-    uint256 hash = Hash(msg.data.data(), msg.data.data() + nMessageSize);
+    std::shared_ptr<std::vector<unsigned char>> serializedHeader = std::make_shared<std::vector<unsigned char>>();
+    serializedHeader->reserve(CMessageHeader::HEADER_SIZE);
     CMessageHeader hdr(Params().MessageStart(), msg.command.c_str(), nMessageSize);
-    memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+    memcpy(hdr.pchChecksum, payload->hash.begin(), CMessageHeader::CHECKSUM_SIZE);
 
-    CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, serializedHeader, 0, hdr};
+    CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, *serializedHeader, 0, hdr};
 
     size_t nBytesSent = 0;
     {
@@ -2832,7 +2897,7 @@ void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
             pnode->fPauseSend = true;
         pnode->vSendMsg.push_back(std::move(serializedHeader));
         if (nMessageSize)
-            pnode->vSendMsg.push_back(std::move(msg.data));
+            pnode->vSendMsg.emplace_back(payload, &payload->data);
 
         // If write queue empty, attempt "optimistic write"
         if (optimisticSend == true)
@@ -17,6 +17,7 @@
 #include <policy/feerate.h>
 #include <protocol.h>
 #include <random.h>
+#include <socketevents.h>
 #include <streams.h>
 #include <sync.h>
 #include <uint256.h>
@@ -79,6 +80,12 @@ static const bool DEFAULT_BLOCKSONLY = false;
 static const bool DEFAULT_FORCEDNSSEED = false;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
 static const size_t DEFAULT_MAXSENDBUFFER    = 1 * 1000;
+/** Number of message handler threads, 0 = one per core up to MAX_AUTO_MSGHANDLER_THREADS */
+static const int DEFAULT_MSGHANDLER_THREADS = 0;
+/** Most message handler threads to use when picking the number automatically */
+static const int MAX_AUTO_MSGHANDLER_THREADS = 4;
+/** Maximum number of message handler threads */
+static const int MAX_MSGHANDLER_THREADS = 16;
 
 // NOTE: When adjusting this, update rpcnet:setban's help ("24h")
 static const unsigned int DEFAULT_MISBEHAVING_BANTIME = 60 * 60 * 24;  // Default 24-hour ban
@@ -96,6 +103,19 @@ struct AddedNodeInfo
 class CNodeStats;
 class CClientUIInterface;
 
+/**
+ * An immutable message payload, which can be queued for sending to any
+ * number of peers without copying it. The checksum for the message header is
+ * computed once, when the payload is created.
+ */
+struct CSharedNetPayload
+{
+    explicit CSharedNetPayload(std::vector<unsigned char>&& dataIn);
+
+    const std::vector<unsigned char> data;
+    const uint256 hash;
+};
+
 struct CSerializedNetMsg
 {
     CSerializedNetMsg() = default;
@@ -107,6 +127,14 @@ struct CSerializedNetMsg
 
     std::vector<unsigned char> data;
     std::string command;
+    //! Payload shared with other messages, sent instead of data if set
+    std::shared_ptr<const CSharedNetPayload> shared_payload;
+
+    /** The payload that is sent */
+    const std::vector<unsigned char>& GetPayload() const
+    {
+        return shared_payload ? shared_payload->data : data;
+    }
 };
 
 class NetEventsInterface;
@@ -141,6 +169,8 @@ public:
         bool m_use_addrman_outgoing = true;
         std::vector<std::string> m_specified_outgoing;
         std::vector<std::string> m_added_nodes;
+        SocketEventsMode m_socket_events_mode = DefaultSocketEventsMode();
+        int m_msgproc_threads = 1;
     };
 
     void Init(const Options& connOptions) {
@@ -154,6 +184,8 @@ public:
         m_msgproc = connOptions.m_msgproc;
         nSendBufferMaxSize = connOptions.nSendBufferMaxSize;
         nReceiveFloodSize = connOptions.nReceiveFloodSize;
+        m_socket_events_mode = connOptions.m_socket_events_mode;
+        m_msgproc_threads = std::max(1, std::min(connOptions.m_msgproc_threads, MAX_MSGHANDLER_THREADS));
         {
             LOCK(cs_totalBytesSent);
             nMaxOutboundTimeframe = connOptions.nMaxOutboundTimeframe;
@@ -325,7 +357,7 @@ private:
     void AddOneShot(const std::string& strDest);
     void ProcessOneShot();
     void ThreadOpenConnections(std::vector<std::string> connect);
-    void ThreadMessageHandler();
+    void ThreadMessageHandler(int worker);
     void AcceptConnection(const ListenSocket& hListenSocket);
     void ThreadSocketHandler();
     void ThreadDNSAddressSeed();
@@ -382,6 +414,9 @@ private:
     unsigned int nSendBufferMaxSize;
     unsigned int nReceiveFloodSize;
 
+    /** Readiness mechanism used by ThreadSocketHandler */
+    SocketEventsMode m_socket_events_mode;
+
     std::vector<ListenSocket> vhListenSocket;
     std::atomic<bool> fNetworkActive;
     banmap_t setBanned;
@@ -421,13 +456,16 @@ private:
     std::mutex mutexMsgProc;
     std::atomic<bool> flagInterruptMsgProc;
 
+    /** Number of threads running ThreadMessageHandler */
+    int m_msgproc_threads;
+
     CThreadInterrupt interruptNet;
 
     std::thread threadDNSAddressSeed;
     std::thread threadSocketHandler;
     std::thread threadOpenAddedConnections;
     std::thread threadOpenConnections;
-    std::thread threadMessageHandler;
+    std::vector<std::thread> threadMessageHandlers;
 
     /** flag for deciding to connect to an extra outbound peer,
      *  in excess of nMaxOutbound
@@ -606,7 +644,8 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<std::vector<unsigned char>> vSendMsg;
+    //! Message headers and payloads to send. Payloads may be shared with other peers' queues.
+    std::deque<std::shared_ptr<const std::vector<unsigned char>>> vSendMsg;
     CCriticalSection cs_vSend;
     CCriticalSection cs_hSocket;
     CCriticalSection cs_vRecv;
@@ -617,6 +656,11 @@ public:
 
     CCriticalSection cs_sendProcessing;
 
+    /** Set while a message handler thread is processing messages for this
+     *  node, so that a node's messages are handled by one thread at a time
+     *  and in order. */
+    std::atomic_bool fProcessingMessages;
+
     std::deque<CInv> vRecvGetData;
     uint64_t nRecvBytes;
     std::atomic<int> nRecvVersion;
@@ -668,8 +712,10 @@ public:
     std::atomic<int> nStartingHeight;
 
     // flood relay
-    std::vector<CAddress> vAddrToSend;
-    CRollingBloomFilter addrKnown;
+    // Addresses can be queued by other nodes' message handler threads.
+    CCriticalSection cs_addrSend;
+    std::vector<CAddress> vAddrToSend GUARDED_BY(cs_addrSend);
+    CRollingBloomFilter addrKnown GUARDED_BY(cs_addrSend);
     bool fGetAddr;
     std::set<uint256> setKnown;
     int64_t nNextAddrSend;
@@ -790,11 +836,13 @@ public:
 
     void AddAddressKnown(const CAddress& _addr)
     {
+        LOCK(cs_addrSend);
         addrKnown.insert(_addr.GetKey());
     }
 
     void PushAddress(const CAddress& _addr, FastRandomContext &insecure_rand)
     {
+        LOCK(cs_addrSend);
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
@@ -8,6 +8,7 @@
 #include <addrman.h>
 #include <arith_uint256.h>
 #include <blockencodings.h>
+#include <blockrelaycache.h>
 #include <chainparams.h>
 #include <consensus/validation.h>
 #include <hash.h>
@@ -112,6 +113,7 @@ namespace {
         const CBlockIndex* pindex;                               //!< Optional.
         bool fValidatedHeaders;                                  //!< Whether this block has validated headers at the time of request.
         std::unique_ptr<PartiallyDownloadedBlock> partialBlock;  //!< Optional, used for CMPCTBLOCK downloads
+        int64_t nTimeRequested;                                  //!< When the block was requested, in microseconds.
     };
     std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -137,6 +139,35 @@ namespace {
     std::deque<std::pair<int64_t, MapRelay::iterator>> vRelayExpiration;
 } // namespace
 
+// These two functions are used for testing the block download logic, see
+// DoS_tests.cpp
+
+// The number of blocks to keep in flight from a peer that delivered nSamples
+// blocks, nInterval microseconds apart on average, over a link with the given
+// latency (0 if unknown). The current target is kept until enough blocks have
+// arrived to measure the peer's rate.
+int GetBlocksInFlightTarget(int nCurrent, int nSamples, int64_t nInterval, int64_t nLatency)
+{
+    if (nSamples < MIN_BLOCK_DOWNLOAD_SAMPLES || nLatency <= 0 || nInterval <= 0)
+        return nCurrent;
+    // Keep enough blocks in flight to cover twice the round trip time. While the
+    // target is what limits the download, a batch of blocks arrives about once per
+    // round trip, so this doubles the target until the link itself is the limit.
+    int64_t nTarget = 2 * nLatency / nInterval + 1;
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER, nTarget));
+}
+
+// Whether a block that has been in flight for nInFlight microseconds from a peer
+// expected to deliver a block in nExpected should be requested from a peer
+// expected to take nOurExpected instead (both in microseconds, 0 if unknown).
+bool IsBlockDownloadLate(int64_t nInFlight, int64_t nExpected, int64_t nOurExpected)
+{
+    int64_t nDelay = nExpected ? std::max(BLOCK_REREQUEST_MIN_DELAY, BLOCK_REREQUEST_FACTOR * nExpected) : BLOCK_STALLING_TIMEOUT * 1000000;
+    if (nInFlight <= nDelay)
+        return false;
+    return nOurExpected != 0 && nOurExpected < nDelay;
+}
+
 namespace {
 
 struct CBlockReject {
@@ -185,6 +216,20 @@ struct CNodeState {
     int64_t nDownloadingSince;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! Smoothed size of the blocks this peer delivered, and of the time each of them took to arrive
+    //! after it was requested or after the previous block arrived (in microseconds). 0 until the first.
+    int64_t nBlockDownloadSize;
+    int64_t nBlockDownloadInterval;
+    //! The peer's minimum ping time when its last block arrived, in microseconds, or 0 if unknown.
+    int64_t nBlockDownloadLatency;
+    //! When the last block we requested from this peer arrived, in microseconds.
+    int64_t nLastBlockReceived;
+    //! Number of blocks we requested from this peer that arrived.
+    int nBlockDownloadSamples;
+    //! How many blocks we keep in flight from this peer during block download.
+    int nBlocksInFlightTarget;
+    //! Number of blocks requested from another peer instead, as this peer was late delivering them.
+    int nBlocksRerequested;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
     //! Whether this peer wants invs or headers (when possible) for block announcements.
@@ -252,6 +297,13 @@ struct CNodeState {
         nDownloadingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
+        nBlockDownloadSize = 0;
+        nBlockDownloadInterval = 0;
+        nBlockDownloadLatency = 0;
+        nLastBlockReceived = 0;
+        nBlockDownloadSamples = 0;
+        nBlocksInFlightTarget = MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+        nBlocksRerequested = 0;
         fPreferredDownload = false;
         fPreferHeaders = false;
         fPreferHeaderAndIDs = false;
@@ -352,7 +404,7 @@ bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const CBlockIndex*
     MarkBlockAsReceived(hash);
 
     std::list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(),
-            {hash, pindex, pindex != nullptr, std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : nullptr)});
+            {hash, pindex, pindex != nullptr, std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : nullptr), GetTimeMicros()});
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += it->fValidatedHeaders;
     if (state->nBlocksInFlight == 1) {
@@ -368,6 +420,63 @@ bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const CBlockIndex*
     return true;
 }
 
+// Requires cs_main.
+// Update a peer's block download statistics and in-flight target when a block
+// we requested from it arrives, before it is marked as received.
+void UpdateBlockDownloadStats(CNodeState* state, const QueuedBlock& queued, size_t nSize, int64_t nMinPing, int64_t nTimeReceived)
+{
+    int64_t nInterval = std::max<int64_t>(nTimeReceived - std::max(queued.nTimeRequested, state->nLastBlockReceived), 1);
+    if (state->nBlockDownloadInterval == 0) {
+        state->nBlockDownloadSize = nSize;
+        state->nBlockDownloadInterval = nInterval;
+    } else {
+        state->nBlockDownloadSize = (state->nBlockDownloadSize * 7 + (int64_t)nSize) / 8;
+        state->nBlockDownloadInterval = std::max<int64_t>((state->nBlockDownloadInterval * 7 + nInterval) / 8, 1);
+    }
+    state->nLastBlockReceived = nTimeReceived;
+    state->nBlockDownloadSamples++;
+    if (nMinPing > 0 && nMinPing < std::numeric_limits<int64_t>::max()) {
+        state->nBlockDownloadLatency = nMinPing;
+    }
+    state->nBlocksInFlightTarget = GetBlocksInFlightTarget(state->nBlocksInFlightTarget, state->nBlockDownloadSamples, state->nBlockDownloadInterval, state->nBlockDownloadLatency);
+}
+
+/** How long we expect a peer to take to deliver a block it was asked for, in microseconds, or 0 if unknown. */
+int64_t ExpectedBlockTime(const CNodeState* state)
+{
+    if (state->nBlockDownloadInterval == 0)
+        return 0;
+    return state->nBlockDownloadInterval + state->nBlockDownloadLatency;
+}
+
+// Requires cs_main.
+// Whether a block in flight from another peer should be requested from nodeid
+// instead, because that peer is late delivering it and nodeid is expected to be
+// faster.
+bool ShouldRerequestBlock(NodeId nodeid, NodeId owner, const QueuedBlock& queued, int64_t nNow)
+{
+    if (owner == nodeid || queued.partialBlock)
+        return false;
+    const CNodeState* ownerState = State(owner);
+    assert(ownerState != nullptr);
+    int64_t nInFlight = nNow - std::max(queued.nTimeRequested, ownerState->nLastBlockReceived);
+    return IsBlockDownloadLate(nInFlight, ExpectedBlockTime(ownerState), ExpectedBlockTime(State(nodeid)));
+}
+
+// Requires cs_main.
+// Called when a block that is late from owner is requested from nodeid instead.
+// As the owner is slower than its statistics suggest, its in-flight target is
+// halved and its expected time per block doubled.
+void MarkBlockAsLate(NodeId owner, NodeId nodeid, const uint256& hash)
+{
+    CNodeState* ownerState = State(owner);
+    assert(ownerState != nullptr);
+    ownerState->nBlocksInFlightTarget = std::max(MIN_BLOCKS_IN_TRANSIT_PER_PEER, ownerState->nBlocksInFlightTarget / 2);
+    ownerState->nBlockDownloadInterval *= 2;
+    ownerState->nBlocksRerequested++;
+    LogPrint(BCLog::NET, "Block %s is late from peer=%d, requesting it from peer=%d\n", hash.ToString(), owner, nodeid);
+}
+
 /** Check whether the last unknown block a peer advertised is not yet known. */
 void ProcessBlockAvailability(NodeId nodeid) {
     CNodeState *state = State(nodeid);
@@ -460,7 +569,8 @@ bool PeerHasHeader(CNodeState *state, const CBlockIndex *pindex)
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
+ *  at most count entries. The first blocks in flight from other peers are added too if those peers
+ *  are late delivering them, see ShouldRerequestBlock(). */
 void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<const CBlockIndex*>& vBlocks, NodeId& nodeStaller, const Consensus::Params& consensusParams) {
     if (count == 0)
         return;
@@ -497,6 +607,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<con
     int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
+    const int64_t nNow = GetTimeMicros();
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -540,8 +651,17 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<con
                     return;
                 }
             } else if (waitingfor == -1) {
-                // This is the first already-in-flight block.
-                waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                // This is the first already-in-flight block. Ask for it ourselves if it
+                // is late, as it may be holding up the download window.
+                const std::pair<NodeId, std::list<QueuedBlock>::iterator>& inFlight = mapBlocksInFlight[pindex->GetBlockHash()];
+                if (ShouldRerequestBlock(nodeid, inFlight.first, *inFlight.second, nNow)) {
+                    vBlocks.push_back(pindex);
+                    if (vBlocks.size() == count) {
+                        return;
+                    }
+                } else {
+                    waitingfor = inFlight.first;
+                }
             }
         }
     }
@@ -620,6 +740,9 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     stats.nMisbehavior = state->nMisbehavior;
     stats.nSyncHeight = state->pindexBestKnownBlock ? state->pindexBestKnownBlock->nHeight : -1;
     stats.nCommonHeight = state->pindexLastCommonBlock ? state->pindexLastCommonBlock->nHeight : -1;
+    stats.nBlocksInFlightTarget = state->nBlocksInFlightTarget;
+    stats.nBlockDownloadRate = state->nBlockDownloadInterval ? state->nBlockDownloadSize * 1000000 / state->nBlockDownloadInterval : 0;
+    stats.nBlocksRerequested = state->nBlocksRerequested;
     for (const QueuedBlock& queue : state->vBlocksInFlight) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
@@ -840,17 +963,10 @@ void PeerLogicValidation::BlockConnected(const std::shared_ptr<const CBlock>& pb
     g_last_tip_update = GetTime();
 }
 
-// All of the following cache a recent block, and are protected by cs_most_recent_block
-static CCriticalSection cs_most_recent_block;
-static std::shared_ptr<const CBlock> most_recent_block;
-static std::shared_ptr<const CBlockHeaderAndShortTxIDs> most_recent_compact_block;
-static uint256 most_recent_block_hash;
-static bool fWitnessesPresentInMostRecentCompactBlock;
+// The most recent blocks, and the messages relaying them
+static BlockRelayCache blockRelayCache;
 
 void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& pblock) {
-    std::shared_ptr<const CBlockHeaderAndShortTxIDs> pcmpctblock = std::make_shared<const CBlockHeaderAndShortTxIDs> (*pblock, true);
-    const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
-
     LOCK(cs_main);
 
     static int nHighestFastAnnounce = 0;
@@ -861,16 +977,9 @@ void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std:
     bool fWitnessEnabled = IsWitnessEnabled(pindex->pprev, Params().GetConsensus());
     uint256 hashBlock(pblock->GetHash());
 
-    {
-        LOCK(cs_most_recent_block);
-        most_recent_block_hash = hashBlock;
-        most_recent_block = pblock;
-        most_recent_compact_block = pcmpctblock;
-        fWitnessesPresentInMostRecentCompactBlock = fWitnessEnabled;
-    }
+    blockRelayCache.Add(pblock);
 
-    connman->ForEachNode([this, &pcmpctblock, pindex, &msgMaker, fWitnessEnabled, &hashBlock](CNode* pnode) {
-        // TODO: Avoid the repeated-serialization here
+    connman->ForEachNode([this, pindex, fWitnessEnabled, &hashBlock](CNode* pnode) {
         if (pnode->nVersion < INVALID_CB_NO_BAN_VERSION || pnode->fDisconnect)
             return;
         ProcessBlockAvailability(pnode->GetId());
@@ -882,7 +991,9 @@ void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std:
 
             LogPrint(BCLog::NET, "%s sending header-and-ids %s to peer=%d\n", "PeerLogicValidation::NewPoWValidBlock",
                     hashBlock.ToString(), pnode->GetId());
-            connman->PushMessage(pnode, msgMaker.Make(NetMsgType::CMPCTBLOCK, *pcmpctblock));
+            CSerializedNetMsg msg;
+            if (blockRelayCache.GetCompactBlockMsg(hashBlock, true, msg))
+                connman->PushMessage(pnode, std::move(msg));
             state.pindexBestHeaderSent = pindex;
         }
     });
@@ -1042,15 +1153,7 @@ static void RelayAddress(const CAddress& addr, bool fReachable, CConnman* connma
 void static ProcessGetBlockData(CNode* pfrom, const Consensus::Params& consensusParams, const CInv& inv, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
 {
     bool send = false;
-    std::shared_ptr<const CBlock> a_recent_block;
-    std::shared_ptr<const CBlockHeaderAndShortTxIDs> a_recent_compact_block;
-    bool fWitnessesPresentInARecentCompactBlock;
-    {
-        LOCK(cs_most_recent_block);
-        a_recent_block = most_recent_block;
-        a_recent_compact_block = most_recent_compact_block;
-        fWitnessesPresentInARecentCompactBlock = fWitnessesPresentInMostRecentCompactBlock;
-    }
+    std::shared_ptr<const CBlock> a_recent_block = blockRelayCache.GetBlock(inv.hash);
 
     bool need_activate_chain = false;
     {
@@ -1074,111 +1177,160 @@ void static ProcessGetBlockData(CNode* pfrom, const Consensus::Params& consensus
         ActivateBestChain(dummy, Params(), a_recent_block);
     }
 
-    LOCK(cs_main);
-    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-    if (mi != mapBlockIndex.end()) {
-        send = BlockRequestAllowed(mi->second, consensusParams);
-        if (!send) {
-            LogPrint(BCLog::NET, "%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
-        }
-    }
-    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
-    // disconnect node in case we have reached the outbound limit for serving historical blocks
-    // never disconnect whitelisted nodes
-    if (send && connman->OutboundTargetReached(true) && ( ((pindexBestHeader != nullptr) && (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > HISTORICAL_BLOCK_AGE)) || inv.type == MSG_FILTERED_BLOCK) && !pfrom->fWhitelisted)
+    // Decide whether and how to serve the block under cs_main, but read and
+    // serialize it afterwards so that other peers' processing isn't held up.
+    const CBlockIndex* pindex = nullptr;
+    CDiskBlockPos blockPos;
+    bool fPeerWantsWitness = false;
+    bool fSendCmpct = false;
+    uint256 hashTip;
     {
-        LogPrint(BCLog::NET, "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+        if (mi != mapBlockIndex.end()) {
+            pindex = mi->second;
+            send = BlockRequestAllowed(pindex, consensusParams);
+            if (!send) {
+                LogPrint(BCLog::NET, "%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+            }
+        }
+        // disconnect node in case we have reached the outbound limit for serving historical blocks
+        // never disconnect whitelisted nodes
+        if (send && connman->OutboundTargetReached(true) && ( ((pindexBestHeader != nullptr) && (pindexBestHeader->GetBlockTime() - pindex->GetBlockTime() > HISTORICAL_BLOCK_AGE)) || inv.type == MSG_FILTERED_BLOCK) && !pfrom->fWhitelisted)
+        {
+            LogPrint(BCLog::NET, "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
 
-        //disconnect node
-        pfrom->fDisconnect = true;
-        send = false;
-    }
-    // Avoid leaking prune-height by never sending blocks below the NODE_NETWORK_LIMITED threshold
-    if (send && !pfrom->fWhitelisted && (
-            (((pfrom->GetLocalServices() & NODE_NETWORK_LIMITED) == NODE_NETWORK_LIMITED) && ((pfrom->GetLocalServices() & NODE_NETWORK) != NODE_NETWORK) && (chainActive.Tip()->nHeight - mi->second->nHeight > (int)NODE_NETWORK_LIMITED_MIN_BLOCKS + 2 /* add two blocks buffer extension for possible races */) )
-       )) {
-        LogPrint(BCLog::NET, "Ignore block request below NODE_NETWORK_LIMITED threshold from peer=%d\n", pfrom->GetId());
+            //disconnect node
+            pfrom->fDisconnect = true;
+            send = false;
+        }
+        // Avoid leaking prune-height by never sending blocks below the NODE_NETWORK_LIMITED threshold
+        if (send && !pfrom->fWhitelisted && (
+                (((pfrom->GetLocalServices() & NODE_NETWORK_LIMITED) == NODE_NETWORK_LIMITED) && ((pfrom->GetLocalServices() & NODE_NETWORK) != NODE_NETWORK) && (chainActive.Tip()->nHeight - pindex->nHeight > (int)NODE_NETWORK_LIMITED_MIN_BLOCKS + 2 /* add two blocks buffer extension for possible races */) )
+           )) {
+            LogPrint(BCLog::NET, "Ignore block request below NODE_NETWORK_LIMITED threshold from peer=%d\n", pfrom->GetId());
 
-        //disconnect node and prevent it from stalling (would otherwise wait for the missing block)
-        pfrom->fDisconnect = true;
-        send = false;
+            //disconnect node and prevent it from stalling (would otherwise wait for the missing block)
+            pfrom->fDisconnect = true;
+            send = false;
+        }
+        // Pruned nodes may have deleted the block, so check whether
+        // it's available before trying to send.
+        if (send && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            send = false;
+        }
+        if (send) {
+            blockPos = pindex->GetBlockPos();
+            if (inv.type == MSG_CMPCT_BLOCK) {
+                fPeerWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
+                fSendCmpct = CanDirectFetch(consensusParams) && pindex->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+            }
+            hashTip = chainActive.Tip()->GetBlockHash();
+        }
+    } // release cs_main before reading and sending the block
+
+    if (!send) {
+        return;
     }
-    // Pruned nodes may have deleted the block, so check whether
-    // it's available before trying to send.
-    if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
-    {
-        std::shared_ptr<const CBlock> pblock;
-        if (a_recent_block && a_recent_block->GetHash() == (*mi).second->GetBlockHash()) {
-            pblock = a_recent_block;
+
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+    // Full blocks with witnesses are sent the way they are stored on disk,
+    // without deserializing and serializing them again.
+    const bool fSendRaw = inv.type == MSG_WITNESS_BLOCK || (inv.type == MSG_CMPCT_BLOCK && !fSendCmpct && fPeerWantsWitness);
+    std::shared_ptr<const CBlock> pblock;
+    CSerializedNetMsg blockMsg;
+    bool fHaveMsg = false;
+    if (a_recent_block) {
+        // Recent blocks are sent from the messages cached for them
+        pblock = a_recent_block;
+        if (inv.type == MSG_BLOCK || inv.type == MSG_WITNESS_BLOCK) {
+            fHaveMsg = blockRelayCache.GetBlockMsg(inv.hash, inv.type == MSG_WITNESS_BLOCK, blockMsg);
+        } else if (inv.type == MSG_CMPCT_BLOCK) {
+            if (fSendCmpct) {
+                fHaveMsg = blockRelayCache.GetCompactBlockMsg(inv.hash, fPeerWantsWitness, blockMsg);
+            } else {
+                fHaveMsg = blockRelayCache.GetBlockMsg(inv.hash, fPeerWantsWitness, blockMsg);
+            }
+        }
+    } else {
+        // Send block from disk
+        bool fRead;
+        if (fSendRaw) {
+            fRead = fHaveMsg = ReadRawBlockFromDisk(blockMsg.data, blockPos, inv.hash, Params().MessageStart());
+            blockMsg.command = NetMsgType::BLOCK;
         } else {
-            // Send block from disk
             std::shared_ptr<CBlock> pblockRead = std::make_shared<CBlock>();
-            if (!ReadBlockFromDisk(*pblockRead, (*mi).second, consensusParams))
-                assert(!"cannot load block from disk");
+            fRead = ReadBlockFromDisk(*pblockRead, blockPos, consensusParams) && pblockRead->GetHash() == inv.hash;
             pblock = pblockRead;
         }
-        if (inv.type == MSG_BLOCK)
-            connman->PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, *pblock));
-        else if (inv.type == MSG_WITNESS_BLOCK)
-            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, *pblock));
-        else if (inv.type == MSG_FILTERED_BLOCK)
-        {
-            bool sendMerkleBlock = false;
-            CMerkleBlock merkleBlock;
-            {
-                LOCK(pfrom->cs_filter);
-                if (pfrom->pfilter) {
-                    sendMerkleBlock = true;
-                    merkleBlock = CMerkleBlock(*pblock, *pfrom->pfilter);
-                }
-            }
-            if (sendMerkleBlock) {
-                connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::MERKLEBLOCK, merkleBlock));
-                // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                // This avoids hurting performance by pointlessly requiring a round-trip
-                // Note that there is currently no way for a node to request any single transactions we didn't send here -
-                // they must either disconnect and retry or request the full block.
-                // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                // however we MUST always provide at least what the remote peer needs
-                typedef std::pair<unsigned int, uint256> PairType;
-                for (PairType& pair : merkleBlock.vMatchedTxn)
-                    connman->PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, *pblock->vtx[pair.first]));
-            }
-            // else
-                // no response
-        }
-        else if (inv.type == MSG_CMPCT_BLOCK)
-        {
-            // If a peer is asking for old blocks, we're almost guaranteed
-            // they won't have a useful mempool to match against a compact block,
-            // and we don't feel like constructing the object for them, so
-            // instead we respond with the full, non-compact block.
-            bool fPeerWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
-            int nSendFlags = fPeerWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
-            if (CanDirectFetch(consensusParams) && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
-                if ((fPeerWantsWitness || !fWitnessesPresentInARecentCompactBlock) && a_recent_compact_block && a_recent_compact_block->header.GetHash() == mi->second->GetBlockHash()) {
-                    connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, *a_recent_compact_block));
-                } else {
-                    CBlockHeaderAndShortTxIDs cmpctblock(*pblock, fPeerWantsWitness);
-                    connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
-                }
-            } else {
-                connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCK, *pblock));
+        if (!fRead) {
+            // With cs_main released the block file may have been pruned
+            // underneath us; treat that as if we didn't have the block.
+            if (fPruneMode) {
+                LogPrint(BCLog::NET, "%s: block %s requested by peer=%d is no longer available\n", __func__, inv.hash.ToString(), pfrom->GetId());
+                return;
             }
+            assert(!"cannot load block from disk");
         }
-
-        // Trigger the peer node to send a getblocks request for the next batch of inventory
-        if (inv.hash == pfrom->hashContinue)
+    }
+    if (fHaveMsg)
+        connman->PushMessage(pfrom, std::move(blockMsg));
+    else if (inv.type == MSG_BLOCK)
+        connman->PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, *pblock));
+    else if (inv.type == MSG_WITNESS_BLOCK)
+        connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, *pblock));
+    else if (inv.type == MSG_FILTERED_BLOCK)
+    {
+        bool sendMerkleBlock = false;
+        CMerkleBlock merkleBlock;
         {
-            // Bypass PushInventory, this must send even if redundant,
-            // and we want it right after the last block so they don't
-            // wait for other stuff first.
-            std::vector<CInv> vInv;
-            vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::INV, vInv));
-            pfrom->hashContinue.SetNull();
+            LOCK(pfrom->cs_filter);
+            if (pfrom->pfilter) {
+                sendMerkleBlock = true;
+                merkleBlock = CMerkleBlock(*pblock, *pfrom->pfilter);
+            }
+        }
+        if (sendMerkleBlock) {
+            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::MERKLEBLOCK, merkleBlock));
+            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+            // This avoids hurting performance by pointlessly requiring a round-trip
+            // Note that there is currently no way for a node to request any single transactions we didn't send here -
+            // they must either disconnect and retry or request the full block.
+            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+            // however we MUST always provide at least what the remote peer needs
+            typedef std::pair<unsigned int, uint256> PairType;
+            for (PairType& pair : merkleBlock.vMatchedTxn)
+                connman->PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, *pblock->vtx[pair.first]));
+        }
+        // else
+            // no response
+    }
+    else if (inv.type == MSG_CMPCT_BLOCK)
+    {
+        // If a peer is asking for old blocks, we're almost guaranteed
+        // they won't have a useful mempool to match against a compact block,
+        // and we don't feel like constructing the object for them, so
+        // instead we respond with the full, non-compact block.
+        int nSendFlags = fPeerWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
+        if (fSendCmpct) {
+            CBlockHeaderAndShortTxIDs cmpctblock(*pblock, fPeerWantsWitness);
+            connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
+        } else {
+            connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCK, *pblock));
         }
     }
+
+    // Trigger the peer node to send a getblocks request for the next batch of inventory
+    if (inv.hash == pfrom->hashContinue)
+    {
+        // Bypass PushInventory, this must send even if redundant,
+        // and we want it right after the last block so they don't
+        // wait for other stuff first.
+        std::vector<CInv> vInv;
+        vInv.push_back(CInv(MSG_BLOCK, hashTip));
+        connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::INV, vInv));
+        pfrom->hashContinue.SetNull();
+    }
 }
 
 void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
@@ -1188,7 +1340,9 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
     std::vector<CInv> vNotFound;
     const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
-    {
+    // Only take cs_main (for mapRelay and the mempool) if there are
+    // transactions to serve, so block requests don't wait on it needlessly.
+    if (it != pfrom->vRecvGetData.end() && (it->type == MSG_TX || it->type == MSG_WITNESS_TX)) {
         LOCK(cs_main);
 
         while (it != pfrom->vRecvGetData.end() && (it->type == MSG_TX || it->type == MSG_WITNESS_TX)) {
@@ -1493,6 +1647,25 @@ bool static ProcessHeadersMessage(CNode *pfrom, CConnman *connman, const std::ve
     return true;
 }
 
+/**
+ * Messages whose handling never takes cs_main (other than to punish a
+ * misbehaving peer). These can be processed for different peers fully in
+ * parallel.
+ */
+static bool IsChainStateIndependentMessage(const std::string& strCommand)
+{
+    return strCommand == NetMsgType::PING ||
+           strCommand == NetMsgType::PONG ||
+           strCommand == NetMsgType::ADDR ||
+           strCommand == NetMsgType::GETADDR ||
+           strCommand == NetMsgType::FEEFILTER ||
+           strCommand == NetMsgType::FILTERLOAD ||
+           strCommand == NetMsgType::FILTERADD ||
+           strCommand == NetMsgType::FILTERCLEAR ||
+           strCommand == NetMsgType::REJECT ||
+           strCommand == NetMsgType::NOTFOUND;
+}
+
 bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
 {
     LogPrint(BCLog::NET, "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->GetId());
@@ -1951,11 +2124,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         // for getheaders requests, and there are no known nodes which support
         // compact blocks but still use getblocks to request blocks.
         {
-            std::shared_ptr<const CBlock> a_recent_block;
-            {
-                LOCK(cs_most_recent_block);
-                a_recent_block = most_recent_block;
-            }
+            std::shared_ptr<const CBlock> a_recent_block = blockRelayCache.GetLatestBlock();
             CValidationState dummy;
             ActivateBestChain(dummy, Params(), a_recent_block);
         }
@@ -2003,15 +2172,20 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         BlockTransactionsRequest req;
         vRecv >> req;
 
-        std::shared_ptr<const CBlock> recent_block;
+        bool fWantsWitness;
         {
-            LOCK(cs_most_recent_block);
-            if (most_recent_block_hash == req.blockhash)
-                recent_block = most_recent_block;
-            // Unlock cs_most_recent_block to avoid cs_main lock inversion
+            LOCK(cs_main);
+            fWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
         }
-        if (recent_block) {
-            SendBlockTransactions(*recent_block, req, pfrom, connman);
+        CSerializedNetMsg blockTxnMsg;
+        bool fOutOfBounds;
+        if (blockRelayCache.GetBlockTxnMsg(req, fWantsWitness, blockTxnMsg, fOutOfBounds)) {
+            connman->PushMessage(pfrom, std::move(blockTxnMsg));
+            return true;
+        }
+        if (fOutOfBounds) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 100, strprintf("Peer %d sent us a getblocktxn with out-of-bounds tx indices", pfrom->GetId()));
             return true;
         }
 
@@ -2129,6 +2303,19 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        // Verify the scripts before taking cs_main for AcceptToMemoryPool, so
+        // that other peers' messages and blocks don't wait on them. Don't
+        // bother for transactions we already have or recently rejected.
+        bool fAlreadyHave;
+        {
+            LOCK(cs_main);
+            fAlreadyHave = AlreadyHave(inv);
+        }
+        std::vector<COutPoint> coins_to_uncache;
+        if (!fAlreadyHave) {
+            PreVerifyTransactions({ptx}, coins_to_uncache);
+        }
+
         LOCK2(cs_main, g_cs_orphans);
 
         bool fMissingInputs = false;
@@ -2278,6 +2465,8 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
             }
         }
 
+        UncacheUnspentCoins(coins_to_uncache);
+
         for (const CTransactionRef& removedTx : lRemovedTxn)
             AddToCompactExtraTransactions(removedTx);
 
@@ -2621,6 +2810,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
     else if (strCommand == NetMsgType::BLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
     {
         std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+        const size_t nSize = vRecv.size();
         vRecv >> *pblock;
 
         LogPrint(BCLog::NET, "received block %s peer=%d\n", pblock->GetHash().ToString(), pfrom->GetId());
@@ -2629,6 +2819,10 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         const uint256 hash(pblock->GetHash());
         {
             LOCK(cs_main);
+            std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+            if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == pfrom->GetId()) {
+                UpdateBlockDownloadStats(State(pfrom->GetId()), *itInFlight->second.second, nSize, pfrom->nMinPingUsecTime, nTimeReceived);
+            }
             // Also always process if we requested the block explicitly, as we may
             // need it even though it is not a candidate for a new best tip.
             forceProcessing |= MarkBlockAsReceived(hash);
@@ -2667,7 +2861,10 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrSend);
+            pfrom->vAddrToSend.clear();
+        }
         std::vector<CAddress> vAddr = connman->GetAddresses();
         FastRandomContext insecure_rand;
         for (const CAddress &addr : vAddr)
@@ -3001,8 +3198,15 @@ bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& inter
         LogPrint(BCLog::NET, "%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->GetId());
     }
 
-    LOCK(cs_main);
-    SendRejectsAndCheckIfBanned(pfrom, connman);
+    if (fRet && IsChainStateIndependentMessage(strCommand)) {
+        // Don't make messages that never touch chain state wait for cs_main
+        // just to flush rejects and bans; SendMessages will do that otherwise.
+        TRY_LOCK(cs_main, lockMain);
+        if (lockMain) SendRejectsAndCheckIfBanned(pfrom, connman);
+    } else {
+        LOCK(cs_main);
+        SendRejectsAndCheckIfBanned(pfrom, connman);
+    }
 
     return fMoreWork;
 }
@@ -3214,6 +3418,7 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
         //
         if (pto->nNextAddrSend < nNow) {
             pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
+            LOCK(pto->cs_addrSend);
             std::vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             for (const CAddress& addr : pto->vAddrToSend)
@@ -3347,20 +3552,10 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
 
                     int nSendFlags = state.fWantsCmpctWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
 
-                    bool fGotBlockFromCache = false;
-                    {
-                        LOCK(cs_most_recent_block);
-                        if (most_recent_block_hash == pBestIndex->GetBlockHash()) {
-                            if (state.fWantsCmpctWitness || !fWitnessesPresentInMostRecentCompactBlock)
-                                connman->PushMessage(pto, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, *most_recent_compact_block));
-                            else {
-                                CBlockHeaderAndShortTxIDs cmpctblock(*most_recent_block, state.fWantsCmpctWitness);
-                                connman->PushMessage(pto, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
-                            }
-                            fGotBlockFromCache = true;
-                        }
-                    }
-                    if (!fGotBlockFromCache) {
+                    CSerializedNetMsg cmpctMsg;
+                    if (blockRelayCache.GetCompactBlockMsg(pBestIndex->GetBlockHash(), state.fWantsCmpctWitness, cmpctMsg)) {
+                        connman->PushMessage(pto, std::move(cmpctMsg));
+                    } else {
                         CBlock block;
                         bool ret = ReadBlockFromDisk(block, pBestIndex, consensusParams);
                         assert(ret);
@@ -3611,11 +3806,16 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
         // Message: getdata (blocks)
         //
         std::vector<CInv> vGetData;
-        if (!pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        if (!pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < state.nBlocksInFlightTarget) {
             std::vector<const CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller, consensusParams);
+            FindNextBlocksToDownload(pto->GetId(), state.nBlocksInFlightTarget - state.nBlocksInFlight, vToDownload, staller, consensusParams);
             for (const CBlockIndex *pindex : vToDownload) {
+                // Blocks still in flight from another peer were returned because that peer is late
+                std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::const_iterator itInFlight = mapBlocksInFlight.find(pindex->GetBlockHash());
+                if (itInFlight != mapBlocksInFlight.end()) {
+                    MarkBlockAsLate(itInFlight->second.first, pto->GetId(), pindex->GetBlockHash());
+                }
                 uint32_t nFetchFlags = GetFetchFlags(pto);
                 vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), pindex);
@@ -74,6 +74,9 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int nBlocksInFlightTarget;
+    int64_t nBlockDownloadRate;
+    int nBlocksRerequested;
 };
 
 /** Get statistics from node state */
@@ -16,6 +16,10 @@
 
 #ifndef WIN32
 #include <fcntl.h>
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
 #endif
 
 #include <boost/algorithm/string/case_conv.hpp> // for to_lower()
@@ -221,6 +225,36 @@ enum SOCKS5Atyp: uint8_t {
     IPV6 = 0x04,
 };
 
+/** Whether sockets are waited on with select(), which can't handle descriptors above FD_SETSIZE */
+#ifdef HAVE_POLL_H
+static constexpr bool NETBASE_USES_SELECT = false;
+#else
+static constexpr bool NETBASE_USES_SELECT = true;
+#endif
+
+/**
+ * Wait up to timeout milliseconds for a socket to become readable, or
+ * writable if want_send is set. Returns the number of ready sockets, 0 on
+ * timeout or SOCKET_ERROR. poll() is used where available so that
+ * descriptors above FD_SETSIZE can be waited on.
+ */
+static int WaitForSocket(const SOCKET& hSocket, bool want_send, int64_t timeout)
+{
+#ifdef HAVE_POLL_H
+    struct pollfd pfd;
+    pfd.fd = hSocket;
+    pfd.events = want_send ? POLLOUT : POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, timeout);
+#else
+    struct timeval tval = MillisToTimeval(timeout);
+    fd_set fdset;
+    FD_ZERO(&fdset);
+    FD_SET(hSocket, &fdset);
+    return select(hSocket + 1, want_send ? nullptr : &fdset, want_send ? &fdset : nullptr, nullptr, &tval);
+#endif
+}
+
 /** Status codes that can be returned by InterruptibleRecv */
 enum class IntrRecvError {
     OK,
@@ -245,7 +279,7 @@ static IntrRecvError InterruptibleRecv(uint8_t* data, size_t len, int timeout, c
 {
     int64_t curTime = GetTimeMillis();
     int64_t endTime = curTime + timeout;
-    // Maximum time to wait in one select call. It will take up until this time (in millis)
+    // Maximum time to wait in one poll or select call. It will take up until this time (in millis)
     // to break off in case of an interruption.
     const int64_t maxWait = 1000;
     while (len > 0 && curTime < endTime) {
@@ -258,14 +292,10 @@ static IntrRecvError InterruptibleRecv(uint8_t* data, size_t len, int timeout, c
         } else { // Other error or blocking
             int nErr = WSAGetLastError();
             if (nErr == WSAEINPROGRESS || nErr == WSAEWOULDBLOCK || nErr == WSAEINVAL) {
-                if (!IsSelectableSocket(hSocket)) {
+                if (!IsSelectableSocket(hSocket, NETBASE_USES_SELECT)) {
                     return IntrRecvError::NetworkError;
                 }
-                struct timeval tval = MillisToTimeval(std::min(endTime - curTime, maxWait));
-                fd_set fdset;
-                FD_ZERO(&fdset);
-                FD_SET(hSocket, &fdset);
-                int nRet = select(hSocket + 1, &fdset, nullptr, nullptr, &tval);
+                int nRet = WaitForSocket(hSocket, false, std::min(endTime - curTime, maxWait));
                 if (nRet == SOCKET_ERROR) {
                     return IntrRecvError::NetworkError;
                 }
@@ -445,7 +475,7 @@ SOCKET CreateSocket(const CService &addrConnect)
     if (hSocket == INVALID_SOCKET)
         return INVALID_SOCKET;
 
-    if (!IsSelectableSocket(hSocket)) {
+    if (!IsSelectableSocket(hSocket, NETBASE_USES_SELECT)) {
         CloseSocket(hSocket);
         LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
         return INVALID_SOCKET;
@@ -486,11 +516,7 @@ bool ConnectSocketDirectly(const CService &addrConnect, const SOCKET& hSocket, i
         // WSAEINVAL is here because some legacy version of winsock uses it
         if (nErr == WSAEINPROGRESS || nErr == WSAEWOULDBLOCK || nErr == WSAEINVAL)
         {
-            struct timeval timeout = MillisToTimeval(nTimeout);
-            fd_set fdset;
-            FD_ZERO(&fdset);
-            FD_SET(hSocket, &fdset);
-            int nRet = select(hSocket + 1, nullptr, &fdset, nullptr, &timeout);
+            int nRet = WaitForSocket(hSocket, true, nTimeout);
             if (nRet == 0)
             {
                 LogPrint(BCLog::NET, "connection to %s timeout\n", addrConnect.ToString());
@@ -498,7 +524,7 @@ bool ConnectSocketDirectly(const CService &addrConnect, const SOCKET& hSocket, i
             }
             if (nRet == SOCKET_ERROR)
             {
-                LogPrintf("select() for %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(WSAGetLastError()));
+                LogPrintf("Waiting for connection to %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(WSAGetLastError()));
                 return false;
             }
             socklen_t nRetSize = sizeof(nRet);
@@ -513,7 +539,7 @@ bool ConnectSocketDirectly(const CService &addrConnect, const SOCKET& hSocket, i
             }
             if (nRet != 0)
             {
-                LogPrintf("connect() to %s failed after select(): %s\n", addrConnect.ToString(), NetworkErrorString(nRet));
+                LogPrintf("connect() to %s failed after waiting: %s\n", addrConnect.ToString(), NetworkErrorString(nRet));
                 return false;
             }
         }
@@ -6,6 +6,7 @@
 #include <rpc/blockchain.h>
 
 #include <amount.h>
+#include <blockfilter.h>
 #include <chain.h>
 #include <chainparams.h>
 #include <checkpoints.h>
@@ -13,10 +14,13 @@
 #include <consensus/validation.h>
 #include <validation.h>
 #include <core_io.h>
+#include <index/blockfilterindex.h>
 #include <policy/feerate.h>
 #include <policy/policy.h>
 #include <primitives/transaction.h>
 #include <rpc/server.h>
+#include <script/sigcache.h>
+#include <snapshot.h>
 #include <streams.h>
 #include <sync.h>
 #include <txdb.h>
@@ -820,20 +824,14 @@ struct CCoinsStats
 
 static void ApplyStats(CCoinsStats &stats, CHashWriter& ss, const uint256& hash, const std::map<uint32_t, Coin>& outputs)
 {
-    assert(!outputs.empty());
-    ss << hash;
-    ss << VARINT(outputs.begin()->second.nHeight * 2 + outputs.begin()->second.fCoinBase);
+    HashUTXOSetTx(ss, hash, outputs);
     stats.nTransactions++;
     for (const auto output : outputs) {
-        ss << VARINT(output.first + 1);
-        ss << output.second.out.scriptPubKey;
-        ss << VARINT(output.second.out.nValue);
         stats.nTransactionOutputs++;
         stats.nTotalAmount += output.second.out.nValue;
         stats.nBogoSize += 32 /* txid */ + 4 /* vout index */ + 4 /* height + coinbase */ + 8 /* amount */ +
                            2 /* scriptPubKey len */ + output.second.out.scriptPubKey.size() /* scriptPubKey */;
     }
-    ss << VARINT(0);
 }
 
 //! Calculate statistics about the unspent transaction output set
@@ -1167,6 +1165,18 @@ UniValue getblockchaininfo(const JSONRPCRequest& request)
             "  \"pruneheight\": xxxxxx,        (numeric) lowest-height complete block stored (only present if pruning is enabled)\n"
             "  \"automatic_pruning\": xx,      (boolean) whether automatic pruning is enabled (only present if pruning is enabled)\n"
             "  \"prune_target_size\": xxxxxx,  (numeric) the target size used by pruning (only present if automatic pruning is enabled)\n"
+            "  \"coins_cache\": {               (object) state of the in-memory UTXO cache and its writes to the chainstate database\n"
+            "     \"usage\": xxxxxx,             (numeric) memory used by the cache in bytes\n"
+            "     \"limit\": xxxxxx,             (numeric) the cache size set by -dbcache, in bytes\n"
+            "     \"flushes\": xx,               (numeric) number of times all modified coins were written\n"
+            "     \"last_flush_time\": xxxxxx,   (numeric) the time of the last such flush in seconds since epoch (Jan 1 1970 GMT)\n"
+            "     \"last_flush_duration\": x.xx, (numeric) how long the last flush took, in seconds\n"
+            "     \"last_flush_coins\": xxxxxx,  (numeric) number of coins written by the last flush\n"
+            "     \"incremental_writes\": xx,    (numeric) number of times part of the modified coins were written ahead of a flush\n"
+            "     \"last_incremental_time\": xxxxxx,   (numeric) the time of the last incremental write\n"
+            "     \"last_incremental_duration\": x.xx, (numeric) how long the last incremental write took, in seconds\n"
+            "     \"last_incremental_coins\": xxxxxx   (numeric) number of coins written by the last incremental write\n"
+            "  },\n"
             "  \"softforks\": [                (array) status of softforks in progress\n"
             "     {\n"
             "        \"id\": \"xxxx\",           (string) name of softfork\n"
@@ -1230,6 +1240,19 @@ UniValue getblockchaininfo(const JSONRPCRequest& request)
         }
     }
 
+    UniValue coins_cache(UniValue::VOBJ);
+    coins_cache.pushKV("usage", (uint64_t)pcoinsTip->DynamicMemoryUsage());
+    coins_cache.pushKV("limit", (uint64_t)nCoinCacheUsage);
+    coins_cache.pushKV("flushes", g_coins_write_stats.flushes);
+    coins_cache.pushKV("last_flush_time", g_coins_write_stats.last_flush_time);
+    coins_cache.pushKV("last_flush_duration", g_coins_write_stats.last_flush_duration * 0.000001);
+    coins_cache.pushKV("last_flush_coins", g_coins_write_stats.last_flush_coins);
+    coins_cache.pushKV("incremental_writes", g_coins_write_stats.incremental_writes);
+    coins_cache.pushKV("last_incremental_time", g_coins_write_stats.last_incremental_time);
+    coins_cache.pushKV("last_incremental_duration", g_coins_write_stats.last_incremental_duration * 0.000001);
+    coins_cache.pushKV("last_incremental_coins", g_coins_write_stats.last_incremental_coins);
+    obj.pushKV("coins_cache", coins_cache);
+
     const Consensus::Params& consensusParams = Params().GetConsensus();
     CBlockIndex* tip = chainActive.Tip();
     UniValue softforks(UniValue::VARR);
@@ -1402,6 +1425,81 @@ UniValue getmempoolinfo(const JSONRPCRequest& request)
     return mempoolInfoToJSON();
 }
 
+static UniValue ValidationCacheStatsToJSON(const ValidationCacheStats& stats)
+{
+    UniValue ret(UniValue::VOBJ);
+    ret.pushKV("max_elements", (uint64_t)stats.max_elements);
+    ret.pushKV("block_hits", stats.block_hits);
+    ret.pushKV("block_misses", stats.block_misses);
+    ret.pushKV("mempool_hits", stats.mempool_hits);
+    ret.pushKV("mempool_misses", stats.mempool_misses);
+    ret.pushKV("evictions", stats.evictions);
+    return ret;
+}
+
+UniValue getvalidationcacheinfo(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 0)
+        throw std::runtime_error(
+            "getvalidationcacheinfo\n"
+            "\nReturns how the signature cache and the script execution cache have been used.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"signature_cache\": {          (object) the cache of valid signatures\n"
+            "     \"max_elements\": xxxxx,      (numeric) number of entries the cache can hold\n"
+            "     \"block_hits\": xxxxx,        (numeric) lookups when connecting blocks that found their entry\n"
+            "     \"block_misses\": xxxxx,      (numeric) lookups when connecting blocks that didn't\n"
+            "     \"mempool_hits\": xxxxx,      (numeric) other lookups (mempool acceptance, block templates) that found their entry\n"
+            "     \"mempool_misses\": xxxxx,    (numeric) other lookups that didn't\n"
+            "     \"evictions\": xxxxx          (numeric) entries dropped to make room for others without having been used\n"
+            "  },\n"
+            "  \"script_execution_cache\": {   (object) the cache of transactions whose scripts are valid, same fields as signature_cache\n"
+            "     ...\n"
+            "  },\n"
+            "  \"mempool_accepts\": xxxxx,      (numeric) number of transactions accepted to the mempool\n"
+            "  \"resizes\": xxxxx,              (numeric) number of times the caches were grown (see -maxadaptivesigcachesize)\n"
+            "  \"last_block\": {               (object) the use of the caches by the last block connected, if any\n"
+            "     \"hash\": \"hash\",            (string) the block hash\n"
+            "     \"height\": xxxxx,            (numeric) the block height\n"
+            "     \"signature_hits\": xxxxx,    (numeric) signature cache lookups that found their entry\n"
+            "     \"signature_misses\": xxxxx,  (numeric) signature cache lookups that didn't\n"
+            "     \"signature_evictions\": xxxxx, (numeric) entries evicted from the signature cache since the block before\n"
+            "     \"script_hits\": xxxxx,       (numeric) script execution cache lookups that found their entry\n"
+            "     \"script_misses\": xxxxx,     (numeric) script execution cache lookups that didn't\n"
+            "     \"script_evictions\": xxxxx,  (numeric) entries evicted from the script execution cache since the block before\n"
+            "     \"mempool_txs\": xxxxx,       (numeric) transactions of the block that were in the mempool\n"
+            "     \"mempool_txs_missed\": xxxxx (numeric) those of them whose scripts had to be verified again\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getvalidationcacheinfo", "")
+            + HelpExampleRpc("getvalidationcacheinfo", "")
+        );
+
+    LOCK(cs_main);
+    UniValue ret(UniValue::VOBJ);
+    ret.pushKV("signature_cache", ValidationCacheStatsToJSON(GetSignatureCacheStats()));
+    ret.pushKV("script_execution_cache", ValidationCacheStatsToJSON(GetScriptExecutionCacheStats()));
+    const ValidationCacheUsage& usage = g_validation_cache_usage;
+    ret.pushKV("mempool_accepts", usage.mempool_accepts);
+    ret.pushKV("resizes", usage.resizes);
+    if (usage.last_block_height >= 0) {
+        UniValue last_block(UniValue::VOBJ);
+        last_block.pushKV("hash", usage.last_block_hash.GetHex());
+        last_block.pushKV("height", usage.last_block_height);
+        last_block.pushKV("signature_hits", usage.last_block_sig_hits);
+        last_block.pushKV("signature_misses", usage.last_block_sig_misses);
+        last_block.pushKV("signature_evictions", usage.last_block_sig_evictions);
+        last_block.pushKV("script_hits", usage.last_block_script_hits);
+        last_block.pushKV("script_misses", usage.last_block_script_misses);
+        last_block.pushKV("script_evictions", usage.last_block_script_evictions);
+        last_block.pushKV("mempool_txs", usage.last_block_mempool_txs);
+        last_block.pushKV("mempool_txs_missed", usage.last_block_mempool_txs_missed);
+        ret.pushKV("last_block", last_block);
+    }
+    return ret;
+}
+
 UniValue preciousblock(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() != 1)
@@ -1615,6 +1713,166 @@ UniValue savemempool(const JSONRPCRequest& request)
     return NullUniValue;
 }
 
+UniValue getblockfilter(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2) {
+        throw std::runtime_error(
+            "getblockfilter \"blockhash\" ( \"filtertype\" )\n"
+            "\nRetrieve a BIP 157 content filter for a particular block.\n"
+            "\nArguments:\n"
+            "1. \"blockhash\"     (string, required) The hash of the block\n"
+            "2. \"filtertype\"    (string, optional, default=basic) The type name of the filter\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"filter\" : \"hex\",    (string) the hex-encoded filter data\n"
+            "  \"header\" : \"hash\",   (string) the hex-encoded filter header\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockfilter", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\" \"basic\"")
+            + HelpExampleRpc("getblockfilter", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\", \"basic\"")
+        );
+    }
+
+    uint256 block_hash = ParseHashV(request.params[0], "blockhash");
+    std::string filtertype_name = "basic";
+    if (!request.params[1].isNull()) {
+        filtertype_name = request.params[1].get_str();
+    }
+
+    BlockFilterType filtertype;
+    if (!BlockFilterTypeByName(filtertype_name, filtertype)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown filtertype");
+    }
+
+    BlockFilterIndex* index = GetBlockFilterIndex(filtertype);
+    if (!index) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Index is not enabled for filtertype " + filtertype_name);
+    }
+
+    const CBlockIndex* block_index;
+    bool block_was_connected;
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(block_hash);
+        if (it == mapBlockIndex.end()) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        }
+        block_index = it->second;
+        block_was_connected = block_index->IsValid(BLOCK_VALID_SCRIPTS);
+    }
+
+    bool index_ready = index->BlockUntilSyncedToCurrentChain();
+
+    BlockFilter filter;
+    uint256 filter_header;
+    if (!index->LookupFilter(block_index, filter) ||
+        !index->LookupFilterHeader(block_index, filter_header)) {
+        int err_code;
+        std::string errmsg = "Filter not found.";
+
+        if (!block_was_connected) {
+            err_code = RPC_INVALID_ADDRESS_OR_KEY;
+            errmsg += " Block was not connected to active chain.";
+        } else if (!index_ready) {
+            err_code = RPC_MISC_ERROR;
+            errmsg += " Block filters are still in the process of being indexed.";
+        } else {
+            err_code = RPC_INTERNAL_ERROR;
+            errmsg += " This error is unexpected and indicates index corruption.";
+        }
+
+        throw JSONRPCError(err_code, errmsg);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.pushKV("filter", HexStr(filter.GetEncodedFilter()));
+    ret.pushKV("header", filter_header.GetHex());
+    return ret;
+}
+
+UniValue dumptxoutset(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 1) {
+        throw std::runtime_error(
+            "dumptxoutset \"path\"\n"
+            "\nWrite the current UTXO set to a snapshot file, which can be loaded into a\n"
+            "new node with -loadutxosnapshot.\n"
+            "Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"path\"          (string, required) The file to write to. Relative paths are relative to the data directory.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"coins_written\": n,         (numeric) The number of coins written\n"
+            "  \"base_hash\": \"hash\",        (string) The hash of the block the snapshot was taken at\n"
+            "  \"base_height\": n,           (numeric) The height of that block\n"
+            "  \"path\": \"path\",             (string) The absolute path the snapshot was written to\n"
+            "  \"hash_serialized_2\": \"hash\" (string) The serialized hash of the UTXO set, as in gettxoutsetinfo\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("dumptxoutset", "\"utxo.dat\"")
+        );
+    }
+
+    fs::path path = fs::absolute(request.params[0].get_str(), GetDataDir());
+    // Write to a temporary path and then move into place, so that a partially
+    // written snapshot is never mistaken for a complete one.
+    fs::path temppath = path;
+    temppath += ".incomplete";
+
+    if (fs::exists(path)) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists. If you are sure this is what you want, move it out of the way first");
+    }
+
+    CAutoFile afile(fsbridge::fopen(temppath, "wb"), SER_DISK, CLIENT_VERSION);
+    if (afile.IsNull()) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Couldn't open file " + temppath.string() + " for writing.");
+    }
+
+    std::unique_ptr<CCoinsViewCursor> pcursor;
+    SnapshotMetadata metadata;
+    int base_height;
+    {
+        // The cursor iterates over a consistent view of the database, so the
+        // lock is only needed to flush and to collect the headers.
+        LOCK(cs_main);
+        FlushStateToDisk();
+        pcursor.reset(pcoinsdbview->Cursor());
+        assert(pcursor->GetBestBlock() == chainActive.Tip()->GetBlockHash());
+
+        memcpy(metadata.m_network_magic, Params().MessageStart(), sizeof(metadata.m_network_magic));
+        metadata.m_base_blockhash = chainActive.Tip()->GetBlockHash();
+        base_height = chainActive.Height();
+        metadata.m_headers.reserve(base_height);
+        for (int height = 1; height <= base_height; ++height) {
+            const CBlockIndex* pindex = chainActive[height];
+            metadata.m_headers.emplace_back(pindex->GetBlockHeader(), pindex->nTx);
+        }
+    }
+
+    SnapshotStats stats;
+    try {
+        afile << metadata;
+        if (!WriteSnapshotCoins(afile, *pcursor, stats)) {
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
+        }
+    } catch (const std::ios_base::failure& e) {
+        throw JSONRPCError(RPC_MISC_ERROR, strprintf("Failed to write UTXO snapshot: %s", e.what()));
+    }
+    afile.fclose();
+    if (!RenameOver(temppath, path)) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to move " + temppath.string() + " to " + path.string());
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.pushKV("coins_written", stats.coins);
+    result.pushKV("base_hash", metadata.m_base_blockhash.ToString());
+    result.pushKV("base_height", base_height);
+    result.pushKV("path", path.string());
+    result.pushKV("hash_serialized_2", stats.hash_serialized.ToString());
+    return result;
+}
+
 static const CRPCCommand commands[] =
 { //  category              name                      actor (function)         argNames
   //  --------------------- ------------------------  -----------------------  ----------
@@ -1625,6 +1883,7 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getblock",               &getblock,               {"blockhash","verbosity|verbose"} },
     { "blockchain",         "getblockhash",           &getblockhash,           {"height"} },
     { "blockchain",         "getblockheader",         &getblockheader,         {"blockhash","verbose"} },
+    { "blockchain",         "getblockfilter",         &getblockfilter,         {"blockhash", "filtertype"} },
     { "blockchain",         "getchaintips",           &getchaintips,           {} },
     { "blockchain",         "getdifficulty",          &getdifficulty,          {} },
     { "blockchain",         "getmempoolancestors",    &getmempoolancestors,    {"txid","verbose"} },
@@ -1634,6 +1893,8 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getrawmempool",          &getrawmempool,          {"verbose"} },
     { "blockchain",         "gettxout",               &gettxout,               {"txid","n","include_mempool"} },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        {} },
+    { "blockchain",         "getvalidationcacheinfo", &getvalidationcacheinfo, {} },
+    { "blockchain",         "dumptxoutset",           &dumptxoutset,           {"path"} },
     { "blockchain",         "pruneblockchain",        &pruneblockchain,        {"height"} },
     { "blockchain",         "savemempool",            &savemempool,            {} },
     { "blockchain",         "verifychain",            &verifychain,            {"checklevel","nblocks"} },
@@ -101,6 +101,9 @@ UniValue getpeerinfo(const JSONRPCRequest& request)
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
             "    ],\n"
+            "    \"inflight_target\": n,      (numeric) How many blocks we keep in flight from this peer during block download\n"
+            "    \"block_download_rate\": n,  (numeric) The measured rate at which this peer delivers requested blocks, in bytes per second\n"
+            "    \"blocks_rerequested\": n,   (numeric) The number of blocks requested from other peers instead because this peer was late\n"
             "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
             "    \"bytessent_per_msg\": {\n"
             "       \"addr\": n,              (numeric) The total bytes sent aggregated by message type\n"
@@ -167,6 +170,9 @@ UniValue getpeerinfo(const JSONRPCRequest& request)
                 heights.push_back(height);
             }
             obj.pushKV("inflight", heights);
+            obj.pushKV("inflight_target", statestats.nBlocksInFlightTarget);
+            obj.pushKV("block_download_rate", statestats.nBlockDownloadRate);
+            obj.pushKV("blocks_rerequested", statestats.nBlocksRerequested);
         }
         obj.pushKV("whitelisted", stats.fWhitelisted);
 
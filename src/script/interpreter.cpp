@@ -10,8 +10,12 @@
 #include <crypto/sha256.h>
 #include <pubkey.h>
 #include <script/script.h>
+#include <streams.h>
 #include <uint256.h>
 
+#include <atomic>
+#include <mutex>
+
 typedef std::vector<unsigned char> valtype;
 
 namespace {
@@ -1165,6 +1169,102 @@ uint256 GetOutputsHash(const CTransaction& txTo) {
 
 } // namespace
 
+/**
+ * The inputs of a transaction as serialized for the legacy signature hashes of
+ * its other inputs, i.e. with their scripts blanked out, together with the
+ * hasher state before each of them. The signature hash of an input then only
+ * needs to hash that input and what follows it.
+ */
+struct LegacySighashInputs
+{
+    std::atomic<bool> ready{false};
+    std::mutex mutex;
+    //! Serialized version, number of inputs and blanked inputs
+    std::vector<unsigned char> data;
+    //! Offset in data of each input, followed by the size of data
+    std::vector<size_t> offsets;
+    //! Hasher after the data before each input
+    std::vector<CHashWriter> midstates;
+    //! Serialized outputs, for SIGHASH_ALL
+    std::vector<unsigned char> outputs;
+};
+
+struct LegacySighashCache
+{
+    //! The inputs with their sequence numbers, for SIGHASH_ALL, and with
+    //! sequence numbers set to zero, for SIGHASH_NONE and SIGHASH_SINGLE.
+    LegacySighashInputs inputs[2];
+};
+
+namespace {
+
+const LegacySighashInputs& GetLegacySighashInputs(LegacySighashCache& cache, const CTransaction& txTo, bool fZeroSequence)
+{
+    LegacySighashInputs& inputs = cache.inputs[fZeroSequence];
+    if (inputs.ready.load(std::memory_order_acquire)) {
+        return inputs;
+    }
+    std::lock_guard<std::mutex> lock(inputs.mutex);
+    if (inputs.ready.load(std::memory_order_relaxed)) {
+        return inputs;
+    }
+
+    CVectorWriter s(SER_GETHASH, 0, inputs.data, 0);
+    ::Serialize(s, txTo.nVersion);
+    ::WriteCompactSize(s, txTo.vin.size());
+    for (const CTxIn& txin : txTo.vin) {
+        inputs.offsets.push_back(inputs.data.size());
+        ::Serialize(s, txin.prevout);
+        ::Serialize(s, CScript());
+        ::Serialize(s, fZeroSequence ? 0 : txin.nSequence);
+    }
+    inputs.offsets.push_back(inputs.data.size());
+
+    CHashWriter ss(SER_GETHASH, 0);
+    ss.write((const char*)inputs.data.data(), inputs.offsets[0]);
+    inputs.midstates.reserve(txTo.vin.size());
+    for (size_t i = 0; i < txTo.vin.size(); i++) {
+        inputs.midstates.push_back(ss);
+        ss.write((const char*)inputs.data.data() + inputs.offsets[i], inputs.offsets[i + 1] - inputs.offsets[i]);
+    }
+
+    if (!fZeroSequence) {
+        CVectorWriter(SER_GETHASH, 0, inputs.outputs, 0, txTo.vout);
+    }
+    inputs.ready.store(true, std::memory_order_release);
+    return inputs;
+}
+
+/**
+ * Compute the legacy signature hash of an input that doesn't use
+ * SIGHASH_ANYONECANPAY from the cached serialization of the other inputs. This
+ * hashes the same data as serializing a CTransactionSignatureSerializer.
+ */
+uint256 LegacySignatureHash(LegacySighashCache& cache, const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    const bool fHashSingle = (nHashType & 0x1f) == SIGHASH_SINGLE;
+    const bool fHashNone = (nHashType & 0x1f) == SIGHASH_NONE;
+    const LegacySighashInputs& inputs = GetLegacySighashInputs(cache, txTo, fHashSingle || fHashNone);
+    CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
+
+    CHashWriter ss(inputs.midstates[nIn]);
+    txTmp.SerializeInput(ss, nIn);
+    ss.write((const char*)inputs.data.data() + inputs.offsets[nIn + 1], inputs.data.size() - inputs.offsets[nIn + 1]);
+    if (fHashNone) {
+        ::WriteCompactSize(ss, 0);
+    } else if (fHashSingle) {
+        ::WriteCompactSize(ss, nIn + 1);
+        for (unsigned int nOutput = 0; nOutput <= nIn; nOutput++)
+            txTmp.SerializeOutput(ss, nOutput);
+    } else {
+        ss.write((const char*)inputs.outputs.data(), inputs.outputs.size());
+    }
+    ss << txTo.nLockTime << nHashType;
+    return ss.GetHash();
+}
+
+} // namespace
+
 PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
 {
     // Cache is calculated only for transactions with witness
@@ -1174,6 +1274,10 @@ PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
         hashOutputs = GetOutputsHash(txTo);
         ready = true;
     }
+    // Only legacy signature hashes of different inputs share work
+    if (txTo.vin.size() > 1) {
+        legacy = std::make_shared<LegacySighashCache>();
+    }
 }
 
 uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CAmount& amount, SigVersion sigversion, const PrecomputedTransactionData* cache)
@@ -1236,6 +1340,10 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
         }
     }
 
+    if (cache && cache->legacy && !(nHashType & SIGHASH_ANYONECANPAY)) {
+        return LegacySignatureHash(*cache->legacy, scriptCode, txTo, nIn, nHashType);
+    }
+
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
@@ -9,6 +9,7 @@
 #include <script/script_error.h>
 #include <primitives/transaction.h>
 
+#include <memory>
 #include <vector>
 #include <stdint.h>
 #include <string>
@@ -115,10 +116,15 @@ enum
 
 bool CheckSignatureEncoding(const std::vector<unsigned char> &vchSig, unsigned int flags, ScriptError* serror);
 
+struct LegacySighashCache;
+
 struct PrecomputedTransactionData
 {
     uint256 hashPrevouts, hashSequence, hashOutputs;
     bool ready = false;
+    //! Parts of the legacy (non-segwit) signature hashes that are the same
+    //! for every input, computed when they are first needed.
+    std::shared_ptr<LegacySighashCache> legacy;
 
     explicit PrecomputedTransactionData(const CTransaction& tx);
 };
@@ -28,9 +28,11 @@ private:
     typedef CuckooCache::cache<uint256, SignatureCacheHasher> map_type;
     map_type setValid;
     boost::shared_mutex cs_sigcache;
+    ValidationCacheCounters counters;
+    uint32_t max_elements;
 
 public:
-    CSignatureCache()
+    CSignatureCache() : max_elements(0)
     {
         GetRandBytes(nonce.begin(), 32);
     }
@@ -44,8 +46,13 @@ public:
     bool
     Get(const uint256& entry, const bool erase)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-        return setValid.contains(entry, erase);
+        bool found;
+        {
+            boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+            found = setValid.contains(entry, erase);
+        }
+        counters.Lookup(found, erase);
+        return found;
     }
 
     void Set(uint256& entry)
@@ -55,7 +62,24 @@ public:
     }
     uint32_t setup_bytes(size_t n)
     {
-        return setValid.setup_bytes(n);
+        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+        return max_elements = setValid.setup_bytes(n);
+    }
+
+    uint32_t resize_bytes(size_t n)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+        return max_elements = setValid.resize(n / sizeof(uint256));
+    }
+
+    ValidationCacheStats GetStats()
+    {
+        ValidationCacheStats stats;
+        counters.Get(stats);
+        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        stats.evictions = setValid.evictions();
+        stats.max_elements = max_elements;
+        return stats;
     }
 };
 
@@ -80,6 +104,16 @@ void InitSignatureCache()
             (nElems*sizeof(uint256)) >>20, (nMaxCacheSize*2)>>20, nElems);
 }
 
+ValidationCacheStats GetSignatureCacheStats()
+{
+    return signatureCache.GetStats();
+}
+
+uint32_t ResizeSignatureCache(size_t bytes)
+{
+    return signatureCache.resize_bytes(bytes);
+}
+
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
     uint256 entry;
@@ -8,6 +8,7 @@
 
 #include <script/interpreter.h>
 
+#include <atomic>
 #include <vector>
 
 // DoS prevention: limit cache size to 32MB (over 1000000 entries on 64-bit
@@ -16,6 +17,62 @@
 static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 32;
 // Maximum sig cache size allowed
 static const int64_t MAX_MAX_SIG_CACHE_SIZE = 16384;
+// The caches are grown up to this total size (in MiB) while connecting blocks
+// finds that the entries of transactions from the mempool have been evicted
+static const unsigned int DEFAULT_MAX_ADAPTIVE_SIG_CACHE_SIZE = 64;
+
+/**
+ * Lookups in and size of the signature cache or the script execution cache.
+ * Lookups that erase the entries they find are made when connecting blocks;
+ * the others (accepting transactions to the mempool, checking block
+ * templates) keep them.
+ */
+struct ValidationCacheStats
+{
+    uint64_t block_hits = 0;
+    uint64_t block_misses = 0;
+    uint64_t mempool_hits = 0;
+    uint64_t mempool_misses = 0;
+    //! Number of entries that were dropped or replaced without having been used
+    uint64_t evictions = 0;
+    uint32_t max_elements = 0;
+};
+
+/** Lookup counters of a validation cache, updated without locking */
+class ValidationCacheCounters
+{
+private:
+    std::atomic<uint64_t> hits[2];
+    std::atomic<uint64_t> misses[2];
+
+public:
+    ValidationCacheCounters()
+    {
+        for (int i = 0; i < 2; i++) {
+            hits[i] = 0;
+            misses[i] = 0;
+        }
+    }
+
+    void Lookup(bool found, bool erase)
+    {
+        (found ? hits : misses)[erase].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t Misses(bool erase) const
+    {
+        return misses[erase].load(std::memory_order_relaxed);
+    }
+
+    /** Fill in the lookup counts of stats */
+    void Get(ValidationCacheStats& stats) const
+    {
+        stats.block_hits = hits[true].load(std::memory_order_relaxed);
+        stats.block_misses = misses[true].load(std::memory_order_relaxed);
+        stats.mempool_hits = hits[false].load(std::memory_order_relaxed);
+        stats.mempool_misses = misses[false].load(std::memory_order_relaxed);
+    }
+};
 
 class CPubKey;
 
@@ -53,4 +110,12 @@ public:
 
 void InitSignatureCache();
 
+ValidationCacheStats GetSignatureCacheStats();
+
+/**
+ * Change the size of the signature cache to about the given number of bytes,
+ * keeping its entries if they fit. Returns the number of elements it can store.
+ */
+uint32_t ResizeSignatureCache(size_t bytes);
+
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
@@ -0,0 +1,125 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <snapshot.h>
+
+#include <coins.h>
+#include <hash.h>
+#include <streams.h>
+#include <tinyformat.h>
+#include <version.h>
+
+#include <boost/thread/thread.hpp> // boost::thread::interrupt
+
+void HashUTXOSetTx(CHashWriter& ss, const uint256& txid, const std::map<uint32_t, Coin>& outputs)
+{
+    assert(!outputs.empty());
+    ss << txid;
+    ss << VARINT(outputs.begin()->second.nHeight * 2 + outputs.begin()->second.fCoinBase);
+    for (const auto& output : outputs) {
+        ss << VARINT(output.first + 1);
+        ss << output.second.out.scriptPubKey;
+        ss << VARINT(output.second.out.nValue);
+    }
+    ss << VARINT(0);
+}
+
+static void WriteSnapshotTx(CAutoFile& file, CHashWriter& ss, const uint256& txid, const std::map<uint32_t, Coin>& outputs, SnapshotStats& stats)
+{
+    HashUTXOSetTx(ss, txid, outputs);
+    WriteCompactSize(file, outputs.size());
+    file << txid;
+    for (const auto& output : outputs) {
+        file << VARINT(output.first);
+        file << output.second;
+    }
+    stats.transactions++;
+    stats.coins += outputs.size();
+}
+
+bool WriteSnapshotCoins(CAutoFile& file, CCoinsViewCursor& cursor, SnapshotStats& stats)
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << cursor.GetBestBlock();
+    uint256 prevkey;
+    std::map<uint32_t, Coin> outputs;
+    while (cursor.Valid()) {
+        boost::this_thread::interruption_point();
+        COutPoint key;
+        Coin coin;
+        if (!cursor.GetKey(key) || !cursor.GetValue(coin)) {
+            return false;
+        }
+        if (!outputs.empty() && key.hash != prevkey) {
+            WriteSnapshotTx(file, ss, prevkey, outputs, stats);
+            outputs.clear();
+        }
+        prevkey = key.hash;
+        outputs[key.n] = std::move(coin);
+        cursor.Next();
+    }
+    if (!outputs.empty()) {
+        WriteSnapshotTx(file, ss, prevkey, outputs, stats);
+    }
+    stats.hash_serialized = ss.GetHash();
+
+    WriteCompactSize(file, 0);
+    file << stats.transactions << stats.coins << stats.hash_serialized;
+    return true;
+}
+
+bool ReadSnapshotCoins(CAutoFile& file, const uint256& base_blockhash, const std::function<bool(const COutPoint&, Coin&&)>& add_coin, SnapshotStats& stats, std::string& error)
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << base_blockhash;
+    uint256 prevkey;
+    std::map<uint32_t, Coin> outputs;
+    while (true) {
+        uint64_t count = ReadCompactSize(file);
+        if (count == 0) break;
+        uint256 txid;
+        file >> txid;
+        // Transactions appear in the order of the coins database, which makes
+        // the commitment match gettxoutsetinfo for the same set.
+        if (stats.transactions > 0 && !(prevkey < txid)) {
+            error = "UTXO snapshot transactions are not in order";
+            return false;
+        }
+        prevkey = txid;
+        outputs.clear();
+        for (uint64_t i = 0; i < count; ++i) {
+            uint32_t n;
+            Coin coin;
+            file >> VARINT(n);
+            file >> coin;
+            if (coin.IsSpent()) {
+                error = strprintf("UTXO snapshot contains spent output %s:%u", txid.ToString(), n);
+                return false;
+            }
+            if (!outputs.emplace(n, std::move(coin)).second) {
+                error = strprintf("UTXO snapshot contains output %s:%u twice", txid.ToString(), n);
+                return false;
+            }
+        }
+        HashUTXOSetTx(ss, txid, outputs);
+        for (auto& output : outputs) {
+            if (!add_coin(COutPoint(txid, output.first), std::move(output.second))) {
+                error = "Unable to add UTXO snapshot coins to the chainstate";
+                return false;
+            }
+        }
+        stats.transactions++;
+        stats.coins += count;
+    }
+    stats.hash_serialized = ss.GetHash();
+
+    SnapshotStats expected;
+    file >> expected.transactions >> expected.coins >> expected.hash_serialized;
+    if (stats.transactions != expected.transactions || stats.coins != expected.coins || stats.hash_serialized != expected.hash_serialized) {
+        error = strprintf("UTXO snapshot does not match its commitment (read %u coins with hash %s, expected %u coins with hash %s)",
+            stats.coins, stats.hash_serialized.ToString(), expected.coins, expected.hash_serialized.ToString());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,108 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SNAPSHOT_H
+#define BITCOIN_SNAPSHOT_H
+
+#include <primitives/block.h>
+#include <protocol.h>
+#include <serialize.h>
+#include <uint256.h>
+
+#include <functional>
+#include <ios>
+#include <map>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+class CAutoFile;
+class CCoinsViewCursor;
+class CHashWriter;
+class Coin;
+class COutPoint;
+
+/**
+ * UTXO set snapshots, as written by the dumptxoutset RPC and loaded with
+ * -loadutxosnapshot.
+ *
+ * A snapshot file consists of a SnapshotMetadata header, followed by the
+ * coins grouped by transaction in the order of the coins database, and a
+ * trailer with the coin counts and the hash_serialized_2 commitment of the
+ * set as reported by gettxoutsetinfo.
+ *
+ * Each group is written as the number of unspent outputs, the txid, and for
+ * each output its index and the Coin. A group with zero outputs ends the
+ * stream.
+ */
+static const unsigned char SNAPSHOT_MAGIC_BYTES[5] = {'u', 't', 'x', 'o', 0xff};
+
+class SnapshotMetadata
+{
+public:
+    static const uint16_t CURRENT_VERSION = 1;
+
+    uint16_t m_version{CURRENT_VERSION};
+    CMessageHeader::MessageStartChars m_network_magic;
+    //! The block the snapshot was taken at.
+    uint256 m_base_blockhash;
+    //! Headers and transaction counts of every block after the genesis block
+    //! up to and including the base block, so that the loading node can
+    //! build its block index without the block data.
+    std::vector<std::pair<CBlockHeader, uint32_t>> m_headers;
+
+    SnapshotMetadata()
+    {
+        memset(m_network_magic, 0, sizeof(m_network_magic));
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action)
+    {
+        unsigned char magic[sizeof(SNAPSHOT_MAGIC_BYTES)];
+        memcpy(magic, SNAPSHOT_MAGIC_BYTES, sizeof(magic));
+        READWRITE(FLATDATA(magic));
+        if (memcmp(magic, SNAPSHOT_MAGIC_BYTES, sizeof(magic))) {
+            throw std::ios_base::failure("Not a UTXO snapshot file");
+        }
+        READWRITE(m_version);
+        if (m_version != CURRENT_VERSION) {
+            throw std::ios_base::failure("Unsupported UTXO snapshot version");
+        }
+        READWRITE(FLATDATA(m_network_magic));
+        READWRITE(m_base_blockhash);
+        READWRITE(m_headers);
+    }
+};
+
+struct SnapshotStats
+{
+    uint64_t transactions = 0;
+    uint64_t coins = 0;
+    uint256 hash_serialized;
+};
+
+/** Add the unspent outputs of one transaction to a UTXO set hash, in the format of gettxoutsetinfo's hash_serialized_2. */
+void HashUTXOSetTx(CHashWriter& ss, const uint256& txid, const std::map<uint32_t, Coin>& outputs);
+
+/**
+ * Write all coins from the cursor to file, followed by the trailer. The
+ * metadata must have been written already. Returns false if the cursor could
+ * not be read; throws std::ios_base::failure on write errors.
+ */
+bool WriteSnapshotCoins(CAutoFile& file, CCoinsViewCursor& cursor, SnapshotStats& stats);
+
+/**
+ * Read the coins of a snapshot whose metadata has already been read, calling
+ * add_coin for each of them. Returns false with an error message if add_coin
+ * fails or if the coins do not match the commitment in the trailer; throws
+ * std::ios_base::failure on truncated or malformed input.
+ */
+bool ReadSnapshotCoins(CAutoFile& file, const uint256& base_blockhash, const std::function<bool(const COutPoint&, Coin&&)>& add_coin, SnapshotStats& stats, std::string& error);
+
+#endif // BITCOIN_SNAPSHOT_H
@@ -0,0 +1,298 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include <config/bitcoin-config.h>
+#endif
+
+#include <socketevents.h>
+
+#include <netbase.h>
+#include <util.h>
+
+#include <algorithm>
+#include <assert.h>
+#include <errno.h>
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+bool SocketEventsModeFromString(const std::string& str, SocketEventsMode& mode)
+{
+    if (str == "select") {
+        mode = SocketEventsMode::SELECT;
+    } else if (str == "poll") {
+        mode = SocketEventsMode::POLL;
+    } else if (str == "epoll") {
+        mode = SocketEventsMode::EPOLL;
+    } else {
+        return false;
+    }
+    return IsSocketEventsModeAvailable(mode);
+}
+
+std::string SocketEventsModeToString(SocketEventsMode mode)
+{
+    switch (mode) {
+    case SocketEventsMode::SELECT: return "select";
+    case SocketEventsMode::POLL: return "poll";
+    case SocketEventsMode::EPOLL: return "epoll";
+    }
+    assert(false);
+}
+
+bool IsSocketEventsModeAvailable(SocketEventsMode mode)
+{
+    switch (mode) {
+    case SocketEventsMode::SELECT:
+        return true;
+    case SocketEventsMode::POLL:
+#ifdef HAVE_POLL_H
+        return true;
+#else
+        return false;
+#endif
+    case SocketEventsMode::EPOLL:
+#ifdef HAVE_SYS_EPOLL_H
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+SocketEventsMode DefaultSocketEventsMode()
+{
+    if (IsSocketEventsModeAvailable(SocketEventsMode::EPOLL)) return SocketEventsMode::EPOLL;
+    if (IsSocketEventsModeAvailable(SocketEventsMode::POLL)) return SocketEventsMode::POLL;
+    return SocketEventsMode::SELECT;
+}
+
+std::string AvailableSocketEventsModes()
+{
+    std::string ret;
+    for (SocketEventsMode mode : {SocketEventsMode::SELECT, SocketEventsMode::POLL, SocketEventsMode::EPOLL}) {
+        if (!IsSocketEventsModeAvailable(mode)) continue;
+        if (!ret.empty()) ret += ", ";
+        ret += SocketEventsModeToString(mode);
+    }
+    return ret;
+}
+
+SocketEvents::SocketEvents(SocketEventsMode mode) : m_mode(mode)
+{
+    if (!IsSocketEventsModeAvailable(m_mode)) {
+        m_mode = SocketEventsMode::SELECT;
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    if (m_mode == SocketEventsMode::EPOLL) {
+        m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (m_epoll_fd == -1) {
+            LogPrintf("SocketEvents: epoll_create1 failed: %s, falling back to poll\n", NetworkErrorString(errno));
+            m_mode = IsSocketEventsModeAvailable(SocketEventsMode::POLL) ? SocketEventsMode::POLL : SocketEventsMode::SELECT;
+        }
+    }
+#endif
+}
+
+SocketEvents::~SocketEvents()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (m_epoll_fd != -1) {
+        close(m_epoll_fd);
+    }
+#endif
+}
+
+void SocketEvents::BeginUpdate()
+{
+    ++m_generation;
+}
+
+void SocketEvents::Update(SOCKET socket, int64_t token, bool want_recv, bool want_send)
+{
+    auto it = m_interest.find(socket);
+    if (it == m_interest.end()) {
+        Interest& interest = m_interest[socket];
+        interest = Interest{token, want_recv, want_send, m_generation};
+        if (m_mode == SocketEventsMode::EPOLL) EpollRegister(socket, interest, true);
+        return;
+    }
+
+    Interest& interest = it->second;
+    interest.generation = m_generation;
+    if (interest.token != token) {
+        // The descriptor was closed and reused by a different owner. The
+        // kernel dropped the old registration when the descriptor was closed,
+        // but make sure no stale one is left behind before adding it again.
+        if (m_mode == SocketEventsMode::EPOLL) EpollUnregister(socket);
+        interest = Interest{token, want_recv, want_send, m_generation};
+        if (m_mode == SocketEventsMode::EPOLL) EpollRegister(socket, interest, true);
+        return;
+    }
+    if (interest.recv != want_recv || interest.send != want_send) {
+        interest.recv = want_recv;
+        interest.send = want_send;
+        if (m_mode == SocketEventsMode::EPOLL) EpollRegister(socket, interest, false);
+    }
+}
+
+void SocketEvents::EndUpdate()
+{
+    for (auto it = m_interest.begin(); it != m_interest.end();) {
+        if (it->second.generation != m_generation) {
+            if (m_mode == SocketEventsMode::EPOLL) EpollUnregister(it->first);
+            it = m_interest.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool SocketEvents::Wait(int64_t timeout_ms, std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set)
+{
+    recv_set.clear();
+    send_set.clear();
+    error_set.clear();
+    switch (m_mode) {
+    case SocketEventsMode::SELECT: return WaitSelect(timeout_ms, recv_set, send_set, error_set);
+    case SocketEventsMode::POLL: return WaitPoll(timeout_ms, recv_set, send_set, error_set);
+    case SocketEventsMode::EPOLL: return WaitEpoll(timeout_ms, recv_set, send_set, error_set);
+    }
+    return false;
+}
+
+bool SocketEvents::WaitSelect(int64_t timeout_ms, std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set)
+{
+    struct timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+
+#ifdef WIN32
+    // select() without any descriptors fails immediately on Windows.
+    if (m_interest.empty()) return false;
+#endif
+
+    for (const auto& entry : m_interest) {
+        FD_SET(entry.first, &fdsetError);
+        if (entry.second.recv) FD_SET(entry.first, &fdsetRecv);
+        if (entry.second.send) FD_SET(entry.first, &fdsetSend);
+        hSocketMax = std::max(hSocketMax, entry.first);
+    }
+
+    int nSelect = select(m_interest.empty() ? 0 : hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    if (nSelect == SOCKET_ERROR) {
+        int nErr = WSAGetLastError();
+        if (nErr == WSAEINTR) return true;
+        LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+        return false;
+    }
+    if (nSelect == 0) return true;
+
+    for (const auto& entry : m_interest) {
+        if (FD_ISSET(entry.first, &fdsetRecv)) recv_set.insert(entry.first);
+        if (FD_ISSET(entry.first, &fdsetSend)) send_set.insert(entry.first);
+        if (FD_ISSET(entry.first, &fdsetError)) error_set.insert(entry.first);
+    }
+    return true;
+}
+
+bool SocketEvents::WaitPoll(int64_t timeout_ms, std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set)
+{
+#ifdef HAVE_POLL_H
+    std::vector<struct pollfd> vpollfd;
+    vpollfd.reserve(m_interest.size());
+    for (const auto& entry : m_interest) {
+        struct pollfd pfd;
+        pfd.fd = entry.first;
+        pfd.events = (entry.second.recv ? POLLIN : 0) | (entry.second.send ? POLLOUT : 0);
+        pfd.revents = 0;
+        vpollfd.push_back(pfd);
+    }
+
+    int nPoll = poll(vpollfd.data(), vpollfd.size(), timeout_ms);
+    if (nPoll < 0) {
+        if (errno == EINTR) return true;
+        LogPrintf("socket poll error %s\n", NetworkErrorString(errno));
+        return false;
+    }
+    if (nPoll == 0) return true;
+
+    for (const struct pollfd& pfd : vpollfd) {
+        if (pfd.revents & POLLIN) recv_set.insert(pfd.fd);
+        if (pfd.revents & POLLOUT) send_set.insert(pfd.fd);
+        if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) error_set.insert(pfd.fd);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool SocketEvents::WaitEpoll(int64_t timeout_ms, std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    // Level triggered, so anything that does not fit is reported next time.
+    std::vector<struct epoll_event> events(std::max<size_t>(m_interest.size(), 1));
+    int nEvents = epoll_wait(m_epoll_fd, events.data(), events.size(), timeout_ms);
+    if (nEvents < 0) {
+        if (errno == EINTR) return true;
+        LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+        return false;
+    }
+
+    for (int i = 0; i < nEvents; i++) {
+        const struct epoll_event& ev = events[i];
+        if (ev.events & EPOLLIN) recv_set.insert(ev.data.fd);
+        if (ev.events & EPOLLOUT) send_set.insert(ev.data.fd);
+        if (ev.events & (EPOLLERR | EPOLLHUP)) error_set.insert(ev.data.fd);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void SocketEvents::EpollRegister(SOCKET socket, const Interest& interest, bool add)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+    ev.events = (interest.recv ? EPOLLIN : 0) | (interest.send ? EPOLLOUT : 0);
+    ev.data.u64 = 0;
+    ev.data.fd = socket;
+    int op = add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(m_epoll_fd, op, socket, &ev) == 0) return;
+    // Recover if our view of the kernel's interest list went out of sync,
+    // e.g. because the descriptor was closed and reopened behind our back.
+    if (add && errno == EEXIST) {
+        if (epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, socket, &ev) == 0) return;
+    } else if (!add && errno == ENOENT) {
+        if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, socket, &ev) == 0) return;
+    }
+    LogPrint(BCLog::NET, "SocketEvents: epoll_ctl failed for socket %d: %s\n", socket, NetworkErrorString(errno));
+#endif
+}
+
+void SocketEvents::EpollUnregister(SOCKET socket)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    // Closed descriptors are removed from the interest list by the kernel, so
+    // EBADF and ENOENT are expected here.
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, socket, nullptr);
+#endif
+}
@@ -0,0 +1,98 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SOCKETEVENTS_H
+#define BITCOIN_SOCKETEVENTS_H
+
+#include <compat.h>
+
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/** Readiness notification mechanism used by the socket handler thread. */
+enum class SocketEventsMode {
+    SELECT,
+    POLL,
+    EPOLL,
+};
+
+/** Parse a -socketevents value. Returns false for unknown or unavailable modes. */
+bool SocketEventsModeFromString(const std::string& str, SocketEventsMode& mode);
+std::string SocketEventsModeToString(SocketEventsMode mode);
+/** Whether the given mode was compiled in on this platform. */
+bool IsSocketEventsModeAvailable(SocketEventsMode mode);
+/** The most scalable mode available on this platform. */
+SocketEventsMode DefaultSocketEventsMode();
+/** Comma-separated list of the modes available on this platform, for help messages. */
+std::string AvailableSocketEventsModes();
+
+/**
+ * Waits for readiness on a set of sockets.
+ *
+ * Callers describe the sockets they are interested in once per iteration,
+ * between BeginUpdate() and EndUpdate(), and then call Wait(). Interest is
+ * kept across iterations so that with epoll only sockets whose interest
+ * actually changed cost a system call; sockets that were not mentioned in
+ * the last update round are dropped.
+ *
+ * Every registered socket is reported in the error set when it has an error
+ * or hang-up pending, regardless of its recv/send interest.
+ *
+ * Not thread safe; owned and used by a single thread.
+ */
+class SocketEvents
+{
+public:
+    /** Falls back to SELECT if the requested mode cannot be set up. */
+    explicit SocketEvents(SocketEventsMode mode);
+    ~SocketEvents();
+
+    SocketEvents(const SocketEvents&) = delete;
+    SocketEvents& operator=(const SocketEvents&) = delete;
+
+    SocketEventsMode GetMode() const { return m_mode; }
+
+    void BeginUpdate();
+    /**
+     * Declare interest in a socket for the current update round. The token
+     * identifies the owner of the socket (e.g. a NodeId) so that a descriptor
+     * number reused by a new connection is re-registered.
+     */
+    void Update(SOCKET socket, int64_t token, bool want_recv, bool want_send);
+    void EndUpdate();
+
+    /** Number of sockets currently registered. */
+    size_t Size() const { return m_interest.size(); }
+
+    /**
+     * Wait up to timeout_ms milliseconds for any registered socket to become
+     * ready. Returns false on error, in which case the sets are left empty.
+     */
+    bool Wait(int64_t timeout_ms, std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set);
+
+private:
+    struct Interest {
+        int64_t token;
+        bool recv;
+        bool send;
+        uint64_t generation;
+    };
+
+    bool WaitSelect(int64_t timeout_ms, std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set);
+    bool WaitPoll(int64_t timeout_ms, std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set);
+    bool WaitEpoll(int64_t timeout_ms, std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set);
+
+    void EpollRegister(SOCKET socket, const Interest& interest, bool add);
+    void EpollUnregister(SOCKET socket);
+
+    SocketEventsMode m_mode;
+    std::unordered_map<SOCKET, Interest> m_interest;
+    uint64_t m_generation = 0;
+    int m_epoll_fd = -1;
+};
+
+#endif // BITCOIN_SOCKETEVENTS_H
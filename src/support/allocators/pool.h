@@ -0,0 +1,192 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+#define BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+
+#include <array>
+#include <assert.h>
+#include <cstddef>
+#include <list>
+#include <new>
+#include <type_traits>
+
+/**
+ * A memory resource for node based containers such as std::unordered_map,
+ * which allocate and free many objects of the same few sizes.
+ *
+ * Memory is taken from the system in large chunks and handed out in blocks
+ * of a multiple of ELEM_ALIGN_BYTES. Freed blocks are kept in a free list per
+ * size and reused for the next allocation of that size; chunks are only given
+ * back when the resource is destroyed. This saves a malloc call and its
+ * bookkeeping overhead per node, and makes the memory used by the container
+ * easy to account for.
+ *
+ * Allocations larger than MAX_BLOCK_SIZE_BYTES or with a stricter alignment
+ * than ALIGN_BYTES, such as a hash table's bucket array, are passed on to
+ * ::operator new.
+ *
+ * The resource is not thread safe. It must outlive every container using it.
+ */
+template <std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+class PoolResource
+{
+    static_assert(ALIGN_BYTES > 0 && (ALIGN_BYTES & (ALIGN_BYTES - 1)) == 0, "ALIGN_BYTES must be a power of two");
+
+    /** Freed blocks are linked through their first bytes. */
+    struct ListNode
+    {
+        ListNode* m_next;
+    };
+
+    /** Blocks are aligned to, and sized in multiples of, the larger of ALIGN_BYTES and a ListNode's alignment. */
+    static constexpr std::size_t ELEM_ALIGN_BYTES = ALIGN_BYTES > alignof(ListNode) ? ALIGN_BYTES : alignof(ListNode);
+    static_assert(ELEM_ALIGN_BYTES <= alignof(std::max_align_t), "chunks from ::operator new must be aligned enough");
+    static_assert(MAX_BLOCK_SIZE_BYTES >= sizeof(ListNode), "blocks must be able to hold a free list node");
+
+    /** Number of ELEM_ALIGN_BYTES units needed for an allocation of the given size. */
+    static constexpr std::size_t NumElemAlignBytes(std::size_t bytes)
+    {
+        return (bytes + ELEM_ALIGN_BYTES - 1) / ELEM_ALIGN_BYTES + (bytes == 0);
+    }
+
+    static constexpr bool IsFreeListUsable(std::size_t bytes, std::size_t alignment)
+    {
+        return alignment <= ELEM_ALIGN_BYTES && bytes <= MAX_BLOCK_SIZE_BYTES;
+    }
+
+    const std::size_t m_chunk_size_bytes;
+    std::list<char*> m_allocated_chunks;
+    /** Free lists, indexed by block size in units of ELEM_ALIGN_BYTES. */
+    std::array<ListNode*, MAX_BLOCK_SIZE_BYTES / ELEM_ALIGN_BYTES + 1> m_free_lists;
+    /** Not yet handed out part of the most recent chunk. */
+    char* m_available_memory_it = nullptr;
+    char* m_available_memory_end = nullptr;
+
+    void PushFree(void* p, std::size_t num_alignments)
+    {
+        m_free_lists[num_alignments] = new (p) ListNode{m_free_lists[num_alignments]};
+    }
+
+    void AllocateChunk()
+    {
+        // Whatever is left of the current chunk is too small for the request,
+        // but may still serve a smaller one.
+        std::size_t remaining = m_available_memory_end - m_available_memory_it;
+        if (remaining >= ELEM_ALIGN_BYTES) {
+            PushFree(m_available_memory_it, remaining / ELEM_ALIGN_BYTES);
+        }
+        m_available_memory_it = static_cast<char*>(::operator new(m_chunk_size_bytes));
+        m_available_memory_end = m_available_memory_it + m_chunk_size_bytes;
+        m_allocated_chunks.push_back(m_available_memory_it);
+    }
+
+public:
+    explicit PoolResource(std::size_t chunk_size_bytes) : m_chunk_size_bytes(NumElemAlignBytes(chunk_size_bytes) * ELEM_ALIGN_BYTES)
+    {
+        assert(m_chunk_size_bytes >= MAX_BLOCK_SIZE_BYTES);
+        m_free_lists.fill(nullptr);
+    }
+
+    PoolResource() : PoolResource(262144) {}
+
+    PoolResource(const PoolResource&) = delete;
+    PoolResource& operator=(const PoolResource&) = delete;
+
+    ~PoolResource()
+    {
+        for (char* chunk : m_allocated_chunks) {
+            ::operator delete(chunk);
+        }
+    }
+
+    void* Allocate(std::size_t bytes, std::size_t alignment)
+    {
+        if (!IsFreeListUsable(bytes, alignment)) {
+            return ::operator new(bytes);
+        }
+        const std::size_t num_alignments = NumElemAlignBytes(bytes);
+        if (m_free_lists[num_alignments] != nullptr) {
+            ListNode* node = m_free_lists[num_alignments];
+            m_free_lists[num_alignments] = node->m_next;
+            return node;
+        }
+        const std::size_t round_bytes = num_alignments * ELEM_ALIGN_BYTES;
+        if (round_bytes > static_cast<std::size_t>(m_available_memory_end - m_available_memory_it)) {
+            AllocateChunk();
+        }
+        void* p = m_available_memory_it;
+        m_available_memory_it += round_bytes;
+        return p;
+    }
+
+    void Deallocate(void* p, std::size_t bytes, std::size_t alignment) noexcept
+    {
+        if (!IsFreeListUsable(bytes, alignment)) {
+            ::operator delete(p);
+            return;
+        }
+        PushFree(p, NumElemAlignBytes(bytes));
+    }
+
+    std::size_t NumAllocatedChunks() const { return m_allocated_chunks.size(); }
+    std::size_t ChunkSizeBytes() const { return m_chunk_size_bytes; }
+};
+
+/**
+ * Allocator that takes memory from a PoolResource. Containers using it
+ * should be created with a pointer to the resource; moving or swapping them
+ * takes the resource along.
+ */
+template <class T, std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES = alignof(T)>
+class PoolAllocator
+{
+    template <class U, std::size_t M, std::size_t A>
+    friend class PoolAllocator;
+
+public:
+    typedef T value_type;
+    typedef PoolResource<MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> ResourceType;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    template <class U>
+    struct rebind {
+        typedef PoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> other;
+    };
+
+    PoolAllocator(ResourceType* resource) noexcept : m_resource(resource) {}
+
+    template <class U>
+    PoolAllocator(const PoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& other) noexcept : m_resource(other.m_resource) {}
+
+    T* allocate(std::size_t n)
+    {
+        return static_cast<T*>(m_resource->Allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept
+    {
+        m_resource->Deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    ResourceType* resource() const noexcept { return m_resource; }
+
+private:
+    ResourceType* m_resource;
+};
+
+template <class T1, class T2, std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+bool operator==(const PoolAllocator<T1, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& a, const PoolAllocator<T2, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& b) noexcept
+{
+    return a.resource() == b.resource();
+}
+
+template <class T1, class T2, std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+bool operator!=(const PoolAllocator<T1, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& a, const PoolAllocator<T2, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& b) noexcept
+{
+    return !(a == b);
+}
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_POOL_H
@@ -24,6 +24,8 @@
 extern bool AddOrphanTx(const CTransactionRef& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
 extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
+extern int GetBlocksInFlightTarget(int nCurrent, int nSamples, int64_t nInterval, int64_t nLatency);
+extern bool IsBlockDownloadLate(int64_t nInFlight, int64_t nExpected, int64_t nOurExpected);
 struct COrphanTx {
     CTransactionRef tx;
     NodeId fromPeer;
@@ -175,6 +177,46 @@ BOOST_AUTO_TEST_CASE(stale_tip_peer_management)
     CConnmanTest::ClearNodes();
 }
 
+BOOST_AUTO_TEST_CASE(block_download_target)
+{
+    // The fixed target is kept until enough blocks have arrived, however fast
+    // the first ones were.
+    for (int nSamples = 0; nSamples < MIN_BLOCK_DOWNLOAD_SAMPLES; nSamples++) {
+        BOOST_CHECK_EQUAL(GetBlocksInFlightTarget(MAX_BLOCKS_IN_TRANSIT_PER_PEER, nSamples, 1000000, 100000), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    }
+    // ... or as long as the latency is unknown.
+    BOOST_CHECK_EQUAL(GetBlocksInFlightTarget(MAX_BLOCKS_IN_TRANSIT_PER_PEER, MIN_BLOCK_DOWNLOAD_SAMPLES, 1000000, 0), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // Twice the round trip time worth of blocks, plus one.
+    BOOST_CHECK_EQUAL(GetBlocksInFlightTarget(MAX_BLOCKS_IN_TRANSIT_PER_PEER, MIN_BLOCK_DOWNLOAD_SAMPLES, 10000, 100000), 21);
+    BOOST_CHECK_EQUAL(GetBlocksInFlightTarget(MAX_BLOCKS_IN_TRANSIT_PER_PEER, MIN_BLOCK_DOWNLOAD_SAMPLES, 100000, 100000), 3);
+    // Within bounds for very slow and very fast peers.
+    BOOST_CHECK_EQUAL(GetBlocksInFlightTarget(MAX_BLOCKS_IN_TRANSIT_PER_PEER, MIN_BLOCK_DOWNLOAD_SAMPLES, 10000000, 100000), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(GetBlocksInFlightTarget(MAX_BLOCKS_IN_TRANSIT_PER_PEER, MIN_BLOCK_DOWNLOAD_SAMPLES, 100, 100000), MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER);
+}
+
+BOOST_AUTO_TEST_CASE(block_download_rerequest)
+{
+    const int64_t nExpected = 500000;
+    const int64_t nDelay = BLOCK_REREQUEST_FACTOR * nExpected;
+
+    // Not late until the block took BLOCK_REREQUEST_FACTOR times as long as expected.
+    BOOST_CHECK(!IsBlockDownloadLate(nDelay, nExpected, 100000));
+    BOOST_CHECK(IsBlockDownloadLate(nDelay + 1, nExpected, 100000));
+    // Only re-requested from a peer that is expected to deliver it sooner.
+    BOOST_CHECK(!IsBlockDownloadLate(nDelay + 1, nExpected, 0));
+    BOOST_CHECK(!IsBlockDownloadLate(nDelay + 1, nExpected, nDelay));
+    BOOST_CHECK(IsBlockDownloadLate(nDelay + 1, nExpected, nDelay - 1));
+
+    // Never before BLOCK_REREQUEST_MIN_DELAY, however fast the peer normally is.
+    BOOST_CHECK(!IsBlockDownloadLate(BLOCK_REREQUEST_MIN_DELAY, 1000, 1000));
+    BOOST_CHECK(IsBlockDownloadLate(BLOCK_REREQUEST_MIN_DELAY + 1, 1000, 1000));
+
+    // Blocks from a peer without statistics are late after the stalling timeout.
+    BOOST_CHECK(!IsBlockDownloadLate(BLOCK_STALLING_TIMEOUT * 1000000, 0, 1000));
+    BOOST_CHECK(IsBlockDownloadLate(BLOCK_STALLING_TIMEOUT * 1000000 + 1, 0, 1000));
+}
+
 BOOST_AUTO_TEST_CASE(DoS_banning)
 {
     std::atomic<bool> interruptDummy(false);
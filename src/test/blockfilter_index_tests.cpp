@@ -0,0 +1,129 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockfilter.h>
+#include <chainparams.h>
+#include <consensus/validation.h>
+#include <index/blockfilterindex.h>
+#include <script/standard.h>
+#include <test/test_bitcoin.h>
+#include <util.h>
+#include <utiltime.h>
+#include <validation.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockfilter_index_tests)
+
+static bool CheckFilterLookups(BlockFilterIndex& filter_index, const CBlockIndex* block_index,
+                               uint256& last_header)
+{
+    BlockFilter expected_filter;
+    {
+        CBlock block;
+        CBlockUndo block_undo;
+        if (!ReadBlockFromDisk(block, block_index, Params().GetConsensus())) {
+            BOOST_ERROR("ReadBlockFromDisk failed");
+            return false;
+        }
+        if (block_index->nHeight > 0 && !UndoReadFromDisk(block_undo, block_index)) {
+            BOOST_ERROR("UndoReadFromDisk failed");
+            return false;
+        }
+        expected_filter = BlockFilter(filter_index.GetFilterType(), block, block_undo);
+    }
+
+    BlockFilter filter;
+    uint256 filter_header;
+    BOOST_CHECK(filter_index.LookupFilter(block_index, filter));
+    BOOST_CHECK(filter_index.LookupFilterHeader(block_index, filter_header));
+
+    BOOST_CHECK(filter.GetBlockHash() == block_index->GetBlockHash());
+    BOOST_CHECK(filter.GetEncodedFilter() == expected_filter.GetEncodedFilter());
+    BOOST_CHECK(filter_header == expected_filter.ComputeHeader(last_header));
+
+    last_header = filter_header;
+    return true;
+}
+
+BOOST_FIXTURE_TEST_CASE(blockfilter_index_initial_sync, TestChain100Setup)
+{
+    BlockFilterIndex filter_index(BlockFilterType::BASIC, 1 << 20, true);
+
+    uint256 last_header;
+
+    // Filter should not be found in the index before it is started.
+    {
+        LOCK(cs_main);
+
+        BlockFilter filter;
+        uint256 filter_header;
+        for (const CBlockIndex* block_index = chainActive.Genesis();
+             block_index != nullptr;
+             block_index = chainActive.Next(block_index)) {
+            BOOST_CHECK(!filter_index.LookupFilter(block_index, filter));
+            BOOST_CHECK(!filter_index.LookupFilterHeader(block_index, filter_header));
+        }
+    }
+
+    // BlockUntilSyncedToCurrentChain should return false before index is started.
+    BOOST_CHECK(!filter_index.BlockUntilSyncedToCurrentChain());
+
+    filter_index.Start();
+
+    // Allow filter index to catch up with the block index.
+    constexpr int64_t timeout_ms = 10 * 1000;
+    int64_t time_start = GetTimeMillis();
+    while (!filter_index.BlockUntilSyncedToCurrentChain()) {
+        BOOST_REQUIRE(time_start + timeout_ms > GetTimeMillis());
+        MilliSleep(100);
+    }
+
+    // Check that filter index has all blocks that were in the chain before it started.
+    {
+        LOCK(cs_main);
+        for (const CBlockIndex* block_index = chainActive.Genesis();
+             block_index != nullptr;
+             block_index = chainActive.Next(block_index)) {
+            CheckFilterLookups(filter_index, block_index, last_header);
+        }
+    }
+
+    // Check that new blocks get indexed.
+    CScript coinbase_script_pub_key = GetScriptForDestination(coinbaseKey.GetPubKey().GetID());
+    for (int i = 0; i < 10; i++) {
+        std::vector<CMutableTransaction> no_txns;
+        const CBlock block = CreateAndProcessBlock(no_txns, coinbase_script_pub_key);
+
+        BOOST_CHECK(filter_index.BlockUntilSyncedToCurrentChain());
+
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(block.GetHash());
+        BOOST_REQUIRE(it != mapBlockIndex.end());
+        CheckFilterLookups(filter_index, it->second, last_header);
+    }
+
+    // Filters stay available for blocks that are no longer in the active chain.
+    const CBlockIndex* stale_tip;
+    {
+        LOCK(cs_main);
+        stale_tip = chainActive.Tip();
+    }
+    {
+        CValidationState state;
+        {
+            LOCK(cs_main);
+            BOOST_CHECK(InvalidateBlock(state, Params(), const_cast<CBlockIndex*>(stale_tip)));
+        }
+        BOOST_CHECK(ActivateBestChain(state, Params()));
+    }
+    BlockFilter stale_filter;
+    BOOST_CHECK(filter_index.LookupFilter(stale_tip, stale_filter));
+    BOOST_CHECK(stale_filter.GetBlockHash() == stale_tip->GetBlockHash());
+
+    filter_index.Interrupt();
+    filter_index.Stop();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,175 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockencodings.h>
+#include <blockrelaycache.h>
+#include <consensus/merkle.h>
+#include <netmessagemaker.h>
+#include <random.h>
+#include <streams.h>
+#include <version.h>
+
+#include <test/test_bitcoin.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockrelaycache_tests, BasicTestingSetup)
+
+static std::shared_ptr<const CBlock> BuildBlock()
+{
+    auto block = std::make_shared<CBlock>();
+    block->nVersion = 42;
+    block->hashPrevBlock = InsecureRand256();
+    for (int i = 0; i < 4; i++) {
+        CMutableTransaction tx;
+        tx.vin.emplace_back(COutPoint(InsecureRand256(), 0));
+        tx.vin[0].scriptWitness.stack.push_back(std::vector<unsigned char>(i + 1, 0x42));
+        tx.vout.emplace_back(42, CScript() << OP_TRUE);
+        block->vtx.push_back(MakeTransactionRef(std::move(tx)));
+    }
+    block->hashMerkleRoot = BlockMerkleRoot(*block);
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(relay_messages)
+{
+    BlockRelayCache cache;
+    std::shared_ptr<const CBlock> block = BuildBlock();
+    const uint256 hash = block->GetHash();
+    const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
+
+    CSerializedNetMsg msg;
+    BOOST_CHECK(!cache.GetBlockMsg(hash, true, msg));
+    BOOST_CHECK(!cache.GetLatestBlock());
+    cache.Add(block);
+    BOOST_CHECK(cache.GetBlock(hash) == block);
+    BOOST_CHECK(cache.GetLatestBlock() == block);
+
+    // Block messages are serialized the way CNetMsgMaker does
+    for (bool witness : {false, true}) {
+        int flags = witness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
+        BOOST_CHECK(cache.GetBlockMsg(hash, witness, msg));
+        BOOST_CHECK_EQUAL(msg.command, NetMsgType::BLOCK);
+        BOOST_CHECK(msg.GetPayload() == msgMaker.Make(flags, NetMsgType::BLOCK, *block).data);
+    }
+    CSerializedNetMsg witness_msg, stripped_msg;
+    cache.GetBlockMsg(hash, true, witness_msg);
+    cache.GetBlockMsg(hash, false, stripped_msg);
+    BOOST_CHECK(witness_msg.GetPayload().size() > stripped_msg.GetPayload().size());
+
+    // Compact blocks are built once, so every peer gets the same nonce
+    for (bool witness : {false, true}) {
+        CSerializedNetMsg first, second;
+        BOOST_CHECK(cache.GetCompactBlockMsg(hash, witness, first));
+        BOOST_CHECK(cache.GetCompactBlockMsg(hash, witness, second));
+        BOOST_CHECK_EQUAL(first.command, NetMsgType::CMPCTBLOCK);
+        BOOST_CHECK(first.shared_payload == second.shared_payload);
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        CDataStream(first.GetPayload(), SER_NETWORK, PROTOCOL_VERSION) >> cmpctblock;
+        BOOST_CHECK(cmpctblock.header.GetHash() == hash);
+        BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), block->vtx.size());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(relay_blocktxn)
+{
+    BlockRelayCache cache;
+    std::shared_ptr<const CBlock> block = BuildBlock();
+    cache.Add(block);
+    const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
+
+    BlockTransactionsRequest req;
+    req.blockhash = block->GetHash();
+    req.indexes = {1, 3};
+    BlockTransactions resp(req);
+    resp.txn = {block->vtx[1], block->vtx[3]};
+
+    CSerializedNetMsg msg;
+    bool out_of_bounds;
+    for (bool witness : {false, true}) {
+        int flags = witness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
+        for (int i = 0; i < 2; i++) {
+            BOOST_CHECK(cache.GetBlockTxnMsg(req, witness, msg, out_of_bounds));
+            BOOST_CHECK(!out_of_bounds);
+            BOOST_CHECK_EQUAL(msg.command, NetMsgType::BLOCKTXN);
+            BOOST_CHECK(msg.GetPayload() == msgMaker.Make(flags, NetMsgType::BLOCKTXN, resp).data);
+        }
+    }
+
+    req.indexes = {1, 4};
+    BOOST_CHECK(!cache.GetBlockTxnMsg(req, true, msg, out_of_bounds));
+    BOOST_CHECK(out_of_bounds);
+    req.blockhash = InsecureRand256();
+    BOOST_CHECK(!cache.GetBlockTxnMsg(req, true, msg, out_of_bounds));
+    BOOST_CHECK(!out_of_bounds);
+}
+
+BOOST_AUTO_TEST_CASE(relay_blocktxn_limit)
+{
+    std::shared_ptr<const CBlock> block = BuildBlock();
+    const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
+    auto request = [&block](std::vector<uint16_t> indexes) {
+        BlockTransactionsRequest req;
+        req.blockhash = block->GetHash();
+        req.indexes = std::move(indexes);
+        return req;
+    };
+    auto response_size = [&](const BlockTransactionsRequest& req) {
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            resp.txn[i] = block->vtx[req.indexes[i]];
+        }
+        return msgMaker.Make(NetMsgType::BLOCKTXN, resp).data.size();
+    };
+
+    // Room for the responses to the first two requests only
+    const BlockTransactionsRequest req_a = request({0}), req_b = request({1}), req_c = request({2, 3});
+    BlockRelayCache cache(2, response_size(req_a) + response_size(req_b));
+    cache.Add(block);
+
+    bool out_of_bounds;
+    const std::vector<BlockTransactionsRequest> reqs{req_a, req_b, req_c};
+    for (size_t i = 0; i < reqs.size(); i++) {
+        CSerializedNetMsg first, second;
+        BOOST_CHECK(cache.GetBlockTxnMsg(reqs[i], true, first, out_of_bounds));
+        BOOST_CHECK(cache.GetBlockTxnMsg(reqs[i], true, second, out_of_bounds));
+        BOOST_CHECK(first.GetPayload() == second.GetPayload());
+        // The third response doesn't fit, so it is built every time
+        BOOST_CHECK_EQUAL(first.shared_payload == second.shared_payload, i < 2);
+    }
+
+    // Evicting the block makes room again
+    cache.Add(BuildBlock());
+    cache.Add(BuildBlock());
+    block = BuildBlock();
+    cache.Add(block);
+    const BlockTransactionsRequest req_d = request({2, 3});
+    CSerializedNetMsg first, second;
+    BOOST_CHECK(cache.GetBlockTxnMsg(req_d, true, first, out_of_bounds));
+    BOOST_CHECK(cache.GetBlockTxnMsg(req_d, true, second, out_of_bounds));
+    BOOST_CHECK(first.shared_payload == second.shared_payload);
+}
+
+BOOST_AUTO_TEST_CASE(relay_eviction)
+{
+    BlockRelayCache cache(2);
+    std::vector<std::shared_ptr<const CBlock>> blocks;
+    for (int i = 0; i < 3; i++) {
+        blocks.push_back(BuildBlock());
+        cache.Add(blocks.back());
+    }
+    CSerializedNetMsg msg;
+    BOOST_CHECK(!cache.GetBlock(blocks[0]->GetHash()));
+    BOOST_CHECK(!cache.GetCompactBlockMsg(blocks[0]->GetHash(), true, msg));
+    BOOST_CHECK(cache.GetBlock(blocks[1]->GetHash()) == blocks[1]);
+    BOOST_CHECK(cache.GetBlock(blocks[2]->GetHash()) == blocks[2]);
+    BOOST_CHECK(cache.GetLatestBlock() == blocks[2]);
+
+    // Adding a cached block again doesn't evict anything
+    cache.Add(blocks[1]);
+    BOOST_CHECK(cache.GetBlock(blocks[2]->GetHash()) == blocks[2]);
+    BOOST_CHECK(cache.GetLatestBlock() == blocks[2]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -209,6 +209,34 @@ BOOST_AUTO_TEST_CASE(test_CheckQueue_Correct_Random)
     Correct_Queue_range(range);
 }
 
+/** Test that checks are still all run after workers have exited and others
+ * have taken their place
+ */
+BOOST_AUTO_TEST_CASE(test_CheckQueue_Restarted_Workers)
+{
+    auto queue = std::unique_ptr<Correct_Queue>(new Correct_Queue {QUEUE_BATCH_SIZE});
+    std::vector<FakeCheckCheckCompletion> vChecks;
+    for (int round = 0; round < 4; ++round) {
+        // One worker fewer each time, down to the master alone
+        boost::thread_group tg;
+        for (int x = 0; x < 3 - round; ++x) {
+            tg.create_thread([&]{queue->Thread();});
+        }
+        for (size_t i : {1, 10, 1000}) {
+            FakeCheckCheckCompletion::n_calls = 0;
+            CCheckQueueControl<FakeCheckCheckCompletion> control(queue.get());
+            for (size_t j = 0; j < i; ++j) {
+                vChecks.resize(1);
+                control.Add(vChecks);
+            }
+            BOOST_REQUIRE(control.Wait());
+            BOOST_REQUIRE_EQUAL(FakeCheckCheckCompletion::n_calls, i);
+        }
+        tg.interrupt_all();
+        tg.join_all();
+    }
+}
+
 
 /** Test that failing checks are caught */
 BOOST_AUTO_TEST_CASE(test_CheckQueue_Catches_Failure)
@@ -52,7 +52,7 @@ public:
 
     uint256 GetBestBlock() const override { return hashBestBlock_; }
 
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) override
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool partial) override
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
             if (it->second.flags & CCoinsCacheEntry::DIRTY) {
@@ -65,7 +65,7 @@ public:
             }
             mapCoins.erase(it++);
         }
-        if (!hashBlock.IsNull())
+        if (!hashBlock.IsNull() && !partial)
             hashBestBlock_ = hashBlock;
         return true;
     }
@@ -586,9 +586,10 @@ void GetCoinsMapEntry(const CCoinsMap& map, CAmount& value, char& flags)
 
 void WriteCoinsViewEntry(CCoinsView& view, CAmount value, char flags)
 {
-    CCoinsMap map;
+    CCoinsMapMemoryResource resource;
+    CCoinsMap map(0, SaltedOutpointHasher(), CCoinsMap::key_equal(), &resource);
     InsertCoinsMapEntry(map, value, flags);
-    view.BatchWrite(map, {});
+    view.BatchWrite(map, {}, false);
 }
 
 class SingleEntryCacheTest
@@ -855,4 +856,119 @@ BOOST_AUTO_TEST_CASE(ccoins_write)
                     CheckWriteCoins(parent_value, child_value, parent_value, parent_flags, child_flags, parent_flags);
 }
 
+
+BOOST_AUTO_TEST_CASE(ccoins_add_fetched)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+    const COutPoint fetched(InsecureRand256(), 0);
+    const COutPoint modified(InsecureRand256(), 0);
+    const COutPoint spent(InsecureRand256(), 0);
+
+    // A fetched coin is cached unmodified.
+    cache.AddFetchedCoin(fetched, Coin(CTxOut(1, CScript()), 1, false));
+    BOOST_CHECK(cache.HaveCoinInCache(fetched));
+    BOOST_CHECK_EQUAL(cache.map().at(fetched).flags, 0);
+
+    // It never replaces what is in the cache already, including spends.
+    cache.AddCoin(modified, Coin(CTxOut(2, CScript()), 2, false), false);
+    cache.AddFetchedCoin(modified, Coin(CTxOut(3, CScript()), 1, false));
+    BOOST_CHECK_EQUAL(cache.AccessCoin(modified).out.nValue, 2);
+    BOOST_CHECK(cache.SpendCoin(fetched));
+    cache.AddFetchedCoin(fetched, Coin(CTxOut(1, CScript()), 1, false));
+    BOOST_CHECK(!cache.HaveCoin(fetched));
+
+    // Coins the base did not have are not cached.
+    cache.AddFetchedCoin(spent, Coin());
+    BOOST_CHECK(!cache.map().count(spent));
+    cache.SelfTest();
+}
+
+BOOST_AUTO_TEST_CASE(ccoins_sync)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+    const uint256 best = InsecureRand256();
+    cache.SetBestBlock(best);
+
+    std::vector<COutPoint> outpoints;
+    for (int height = 1; height <= 100; ++height) {
+        COutPoint outpoint(InsecureRand256(), 0);
+        Coin coin;
+        coin.out.nValue = height;
+        coin.out.scriptPubKey.assign(25, uint8_t{0});
+        coin.nHeight = height;
+        cache.AddCoin(outpoint, std::move(coin), false);
+        outpoints.push_back(outpoint);
+    }
+
+    auto base_has = [&](const COutPoint& outpoint) {
+        Coin coin;
+        return base.GetCoin(outpoint, coin) && !coin.IsSpent();
+    };
+
+    // Incremental writes take a bounded number of the old enough coins at a
+    // time, keep them cached, and leave the base partially written.
+    size_t written = 0;
+    size_t total = 0;
+    do {
+        BOOST_CHECK(cache.SyncPartial(10, 50, written));
+        BOOST_CHECK(written <= 15);
+        total += written;
+    } while (written > 0);
+    BOOST_CHECK_EQUAL(total, 50U);
+    BOOST_CHECK(base.GetBestBlock().IsNull());
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 100U);
+    for (int i = 0; i < 100; ++i) {
+        BOOST_CHECK_EQUAL(base_has(outpoints[i]), i < 50);
+        BOOST_CHECK_EQUAL(cache.map().at(outpoints[i]).flags, i < 50 ? 0 : CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH);
+    }
+    cache.SelfTest();
+
+    // Sync writes the rest, including the spend of a coin already written,
+    // and completes the transition to the best block.
+    BOOST_CHECK(cache.SpendCoin(outpoints[0]));
+    BOOST_CHECK(cache.SpendCoin(outpoints[99]));
+    BOOST_CHECK(cache.Sync(&written));
+    BOOST_CHECK_EQUAL(written, 50U);
+    BOOST_CHECK(base.GetBestBlock() == best);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 98U);
+    for (int i = 0; i < 100; ++i) {
+        BOOST_CHECK_EQUAL(base_has(outpoints[i]), i != 0 && i != 99);
+    }
+    for (const auto& entry : cache.map()) {
+        BOOST_CHECK_EQUAL(entry.second.flags, 0);
+    }
+    cache.SelfTest();
+
+    // Trimming drops the oldest coins first, and never modified ones. The
+    // cache's memory comes in chunks, so it needs enough coins to span a few.
+    for (int height = 101; height <= 20100; ++height) {
+        cache.AddCoin(COutPoint(InsecureRand256(), 0), Coin(CTxOut(height, CScript()), height, false), false);
+    }
+    BOOST_CHECK(cache.Sync());
+    cache.AddCoin(COutPoint(InsecureRand256(), 0), Coin(CTxOut(1, CScript()), 1, false), false);
+    size_t usage = cache.DynamicMemoryUsage();
+    CCoinsMapMemoryResource* resource = cache.map().get_allocator().resource();
+    BOOST_CHECK(resource->NumAllocatedChunks() > 4);
+    cache.Trim(usage / 2);
+    // The remaining coins are moved to a new resource, of which at most the
+    // last chunk is not filled.
+    BOOST_CHECK(cache.map().get_allocator().resource() != resource);
+    BOOST_CHECK(cache.DynamicMemoryUsage() <= usage / 2 + memusage::MallocUsage(cache.map().get_allocator().resource()->ChunkSizeBytes()));
+    BOOST_CHECK(cache.GetCacheSize() < 20099U / 2 + 1);
+    uint32_t lowest_clean = std::numeric_limits<uint32_t>::max();
+    size_t modified = 0;
+    for (const auto& entry : cache.map()) {
+        if (entry.second.flags != 0) {
+            modified++;
+        } else {
+            lowest_clean = std::min<uint32_t>(lowest_clean, entry.second.coin.nHeight);
+        }
+    }
+    BOOST_CHECK_EQUAL(modified, 1U);
+    BOOST_CHECK_EQUAL(lowest_clean, 20101U - (cache.GetCacheSize() - 1));
+    cache.SelfTest();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -377,4 +377,36 @@ BOOST_AUTO_TEST_CASE(cuckoocache_generations)
     test_cache_generations<CuckooCache::cache<uint256, SignatureCacheHasher>>();
 }
 
+/* Test that resizing a cache keeps the elements that weren't erased, and that
+ * the elements evicted by inserts are counted.
+ */
+BOOST_AUTO_TEST_CASE(cuckoocache_resize)
+{
+    local_rand_ctx = FastRandomContext(true);
+    CuckooCache::cache<uint256, SignatureCacheHasher> cc{};
+    uint32_t n = cc.setup(1 << 12);
+    std::vector<uint256> hashes(n / 2);
+    for (uint256& h : hashes) {
+        insecure_GetRandHash(h);
+        cc.insert(h);
+    }
+    for (size_t i = 0; i < hashes.size(); i += 2) {
+        BOOST_CHECK(cc.contains(hashes[i], true));
+    }
+
+    BOOST_CHECK_EQUAL(cc.resize(n * 4), n * 4);
+    for (size_t i = 0; i < hashes.size(); ++i) {
+        BOOST_CHECK_EQUAL(cc.contains(hashes[i], false), i % 2 == 1);
+    }
+    BOOST_CHECK_EQUAL(cc.evictions(), 0U);
+
+    // Inserting more elements than fit evicts some
+    uint256 h;
+    for (uint32_t i = 0; i < n * 8; ++i) {
+        insecure_GetRandHash(h);
+        cc.insert(h);
+    }
+    BOOST_CHECK(cc.evictions() > 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END();
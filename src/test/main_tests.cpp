@@ -3,6 +3,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <chainparams.h>
+#include <clientversion.h>
+#include <streams.h>
 #include <validation.h>
 #include <net.h>
 
@@ -74,4 +76,87 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     Test.disconnect(&ReturnTrue);
     BOOST_CHECK(Test());
 }
+BOOST_FIXTURE_TEST_CASE(read_block_from_disk, TestChain100Setup)
+{
+    const CChainParams& chainparams = Params();
+    CBlockIndex* pindex;
+    CDiskBlockPos pos;
+    {
+        LOCK(cs_main);
+        pindex = chainActive[50];
+        pos = pindex->GetBlockPos();
+    }
+    CMessageHeader::MessageStartChars wrong_start;
+    memcpy(wrong_start, chainparams.MessageStart(), CMessageHeader::MESSAGE_START_SIZE);
+    wrong_start[0] ^= 1;
+
+    // Reading with file I/O and from mapped block files gives the same block and bytes
+    for (bool mmap : {false, true}) {
+        fBlockMmap = mmap;
+        CBlock block;
+        BOOST_CHECK(ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()));
+        BOOST_CHECK(block.GetHash() == pindex->GetBlockHash());
+
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << block;
+        std::vector<uint8_t> raw;
+        BOOST_CHECK(ReadRawBlockFromDisk(raw, pos, chainparams.MessageStart()));
+        BOOST_CHECK(raw == std::vector<uint8_t>(ss.begin(), ss.end()));
+        BOOST_CHECK(!ReadRawBlockFromDisk(raw, pos, wrong_start));
+        BOOST_CHECK(!ReadRawBlockFromDisk(raw, CDiskBlockPos(pos.nFile, 0), chainparams.MessageStart()));
+        BOOST_CHECK(ReadRawBlockFromDisk(raw, pos, pindex->GetBlockHash(), chainparams.MessageStart()));
+        BOOST_CHECK(raw == std::vector<uint8_t>(ss.begin(), ss.end()));
+        BOOST_CHECK(!ReadRawBlockFromDisk(raw, pos, pindex->pprev->GetBlockHash(), chainparams.MessageStart()));
+    }
+
+    // Blocks appended to a mapped block file can be read too
+    CBlock block = CreateAndProcessBlock({}, CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG);
+    {
+        LOCK(cs_main);
+        pindex = chainActive.Tip();
+    }
+    BOOST_CHECK(pindex->GetBlockHash() == block.GetHash());
+    CBlock read;
+    BOOST_CHECK(ReadBlockFromDisk(read, pindex, chainparams.GetConsensus()));
+    BOOST_CHECK(read.GetHash() == block.GetHash());
+
+    fBlockMmap = DEFAULT_BLOCK_MMAP;
+}
+
+BOOST_FIXTURE_TEST_CASE(block_writer, TestChain100Setup)
+{
+    const CChainParams& chainparams = Params();
+    const CScript script_pub = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    std::vector<std::pair<CDiskBlockPos, CBlock>> blocks;
+    for (int i = 0; i < 20; ++i) {
+        CBlock block = CreateAndProcessBlock({}, script_pub);
+        LOCK(cs_main);
+        BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+        blocks.emplace_back(chainActive.Tip()->GetBlockPos(), block);
+    }
+
+    // New blocks can be read whether or not the block writer thread wrote them yet
+    for (const auto& block : blocks) {
+        CBlock read;
+        BOOST_CHECK(ReadBlockFromDisk(read, block.first, chainparams.GetConsensus()));
+        BOOST_CHECK(read.GetHash() == block.second.GetHash());
+
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << block.second;
+        std::vector<uint8_t> raw;
+        BOOST_CHECK(ReadRawBlockFromDisk(raw, block.first, block.second.GetHash(), chainparams.MessageStart()));
+        BOOST_CHECK(raw == std::vector<uint8_t>(ss.begin(), ss.end()));
+    }
+
+    // Once the state is flushed, they are all in the block files
+    FlushStateToDisk();
+    for (const auto& block : blocks) {
+        CAutoFile file(OpenBlockFile(block.first, true), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!file.IsNull());
+        CBlock read;
+        file >> read;
+        BOOST_CHECK(read.GetHash() == block.second.GetHash());
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
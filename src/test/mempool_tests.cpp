@@ -417,6 +417,254 @@ BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
     CheckSort<ancestor_score>(pool, sortedOrder);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolUpdateFromBlockTest)
+{
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+
+    // A block with txA and its child txB is disconnected, while txC (spending
+    // txA) and txD (spending txA, txB and txC) are in the mempool.
+    CMutableTransaction txA = CMutableTransaction();
+    txA.vin.resize(1);
+    txA.vin[0].scriptSig = CScript() << OP_11;
+    txA.vout.resize(3);
+    for (int i = 0; i < 3; i++) {
+        txA.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txA.vout[i].nValue = 10 * COIN;
+    }
+
+    CMutableTransaction txB = CMutableTransaction();
+    txB.vin.resize(1);
+    txB.vin[0].prevout = COutPoint(txA.GetHash(), 0);
+    txB.vin[0].scriptSig = CScript() << OP_11;
+    txB.vout.resize(1);
+    txB.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txB.vout[0].nValue = 10 * COIN;
+
+    CMutableTransaction txC = CMutableTransaction();
+    txC.vin.resize(1);
+    txC.vin[0].prevout = COutPoint(txA.GetHash(), 1);
+    txC.vin[0].scriptSig = CScript() << OP_11;
+    txC.vout.resize(1);
+    txC.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txC.vout[0].nValue = 10 * COIN;
+
+    CMutableTransaction txD = CMutableTransaction();
+    txD.vin.resize(3);
+    txD.vin[0].prevout = COutPoint(txB.GetHash(), 0);
+    txD.vin[0].scriptSig = CScript() << OP_11;
+    txD.vin[1].prevout = COutPoint(txC.GetHash(), 0);
+    txD.vin[1].scriptSig = CScript() << OP_11;
+    txD.vin[2].prevout = COutPoint(txA.GetHash(), 2);
+    txD.vin[2].scriptSig = CScript() << OP_11;
+    txD.vout.resize(1);
+    txD.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txD.vout[0].nValue = 30 * COIN;
+
+    pool.addUnchecked(txC.GetHash(), entry.Fee(1000LL).FromTx(txC));
+    pool.addUnchecked(txD.GetHash(), entry.Fee(1000LL).FromTx(txD));
+    pool.addUnchecked(txA.GetHash(), entry.Fee(1000LL).FromTx(txA));
+    pool.addUnchecked(txB.GetHash(), entry.Fee(1000LL).FromTx(txB));
+
+    // Before the update, txD only knows about txC.
+    CTxMemPool::txiter itA = pool.mapTx.find(txA.GetHash());
+    CTxMemPool::txiter itD = pool.mapTx.find(txD.GetHash());
+    BOOST_CHECK_EQUAL(itA->GetCountWithDescendants(), 2U);
+    BOOST_CHECK_EQUAL(itD->GetCountWithAncestors(), 2U);
+
+    pool.UpdateTransactionsFromBlock({txA.GetHash(), txB.GetHash()});
+
+    // txD is a descendant of txA along three paths, but must be counted once.
+    BOOST_CHECK_EQUAL(itA->GetCountWithDescendants(), 4U);
+    BOOST_CHECK_EQUAL(itA->GetModFeesWithDescendants(), 4000);
+    BOOST_CHECK_EQUAL(itD->GetCountWithAncestors(), 4U);
+    BOOST_CHECK_EQUAL(itD->GetModFeesWithAncestors(), 4000);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txB.GetHash())->GetCountWithDescendants(), 2U);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txC.GetHash())->GetCountWithAncestors(), 2U);
+
+    CTxMemPool::setEntries setAncestors;
+    std::string dummy;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(*itD, setAncestors, 100, 1000000, 1000, 1000000, dummy, false));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 3U);
+
+    CTxMemPool::setEntries setDescendants;
+    pool.CalculateDescendants(itA, setDescendants);
+    BOOST_CHECK_EQUAL(setDescendants.size(), 4U);
+
+    // An ancestor limit that txD's three ancestors exceed is still enforced.
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(*itD, setAncestors, 3, 1000000, 1000, 1000000, dummy, false));
+}
+
+
+BOOST_AUTO_TEST_CASE(MempoolClusterTest)
+{
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+    LOCK(pool.cs);
+
+    // A parent paying a low fee, with a child paying a low and one paying a
+    // high fee, which arrive in that order.
+    CMutableTransaction txParent = CMutableTransaction();
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(2);
+    for (int i = 0; i < 2; i++) {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 10 * COIN;
+    }
+    CMutableTransaction txLow = CMutableTransaction();
+    txLow.vin.resize(1);
+    txLow.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txLow.vin[0].scriptSig = CScript() << OP_11;
+    txLow.vout.resize(1);
+    txLow.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txLow.vout[0].nValue = 10 * COIN;
+    CMutableTransaction txHigh = txLow;
+    txHigh.vin[0].prevout = COutPoint(txParent.GetHash(), 1);
+
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(1000LL).FromTx(txParent));
+    pool.addUnchecked(txLow.GetHash(), entry.Fee(2000LL).FromTx(txLow));
+    pool.addUnchecked(txHigh.GetHash(), entry.Fee(50000LL).FromTx(txHigh));
+    BOOST_CHECK_EQUAL(pool.GetClusters().size(), 1U);
+
+    // The high fee child is paid for first, together with its parent.
+    CTxMemPool::txiter itParent = pool.mapTx.find(txParent.GetHash());
+    const CTxMemPool::Cluster* cluster = &pool.GetCluster(itParent);
+    BOOST_CHECK_EQUAL(cluster->vTxs.size(), 3U);
+    BOOST_CHECK(cluster->vTxs[0]->GetTx().GetHash() == txParent.GetHash());
+    BOOST_CHECK(cluster->vTxs[1]->GetTx().GetHash() == txHigh.GetHash());
+    BOOST_CHECK(cluster->vTxs[2]->GetTx().GetHash() == txLow.GetHash());
+    BOOST_CHECK_EQUAL(cluster->vChunks.size(), 2U);
+    BOOST_CHECK_EQUAL(cluster->vChunks[0].nEnd, 2U);
+    BOOST_CHECK_EQUAL(cluster->vChunks[0].nModFees, 51000);
+
+    // Prioritising the low fee child reorders the cluster.
+    pool.PrioritiseTransaction(txLow.GetHash(), 100000LL);
+    cluster = &pool.GetCluster(itParent);
+    BOOST_CHECK(cluster->vTxs[1]->GetTx().GetHash() == txLow.GetHash());
+    BOOST_CHECK(cluster->vTxs[2]->GetTx().GetHash() == txHigh.GetHash());
+    pool.PrioritiseTransaction(txLow.GetHash(), -100000LL);
+
+    // Two unrelated transactions and a child spending both join one cluster,
+    // which splits again when the child goes.
+    CMutableTransaction txX = CMutableTransaction();
+    txX.vin.resize(1);
+    txX.vin[0].scriptSig = CScript() << OP_1;
+    txX.vout.resize(1);
+    txX.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    txX.vout[0].nValue = 10 * COIN;
+    CMutableTransaction txY = txX;
+    txY.vin[0].scriptSig = CScript() << OP_2;
+    CMutableTransaction txJoin = CMutableTransaction();
+    txJoin.vin.resize(2);
+    txJoin.vin[0].prevout = COutPoint(txX.GetHash(), 0);
+    txJoin.vin[0].scriptSig = CScript() << OP_1;
+    txJoin.vin[1].prevout = COutPoint(txY.GetHash(), 0);
+    txJoin.vin[1].scriptSig = CScript() << OP_2;
+    txJoin.vout.resize(1);
+    txJoin.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    txJoin.vout[0].nValue = 20 * COIN;
+
+    pool.addUnchecked(txX.GetHash(), entry.Fee(10000LL).FromTx(txX));
+    pool.addUnchecked(txY.GetHash(), entry.Fee(10000LL).FromTx(txY));
+    BOOST_CHECK_EQUAL(pool.GetClusters().size(), 3U);
+    pool.addUnchecked(txJoin.GetHash(), entry.Fee(10000LL).FromTx(txJoin));
+    BOOST_CHECK_EQUAL(pool.GetClusters().size(), 2U);
+    BOOST_CHECK_EQUAL(pool.GetCluster(pool.mapTx.find(txJoin.GetHash())).vTxs.size(), 3U);
+    pool.removeRecursive(txJoin);
+    BOOST_CHECK_EQUAL(pool.GetClusters().size(), 3U);
+    BOOST_CHECK_EQUAL(pool.GetCluster(pool.mapTx.find(txX.GetHash())).vTxs.size(), 1U);
+
+    // Eviction removes the last chunk paying the lowest feerate: the low fee
+    // child, not its parent that the high fee child pays for.
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(!pool.exists(txLow.GetHash()));
+    BOOST_CHECK(pool.exists(txParent.GetHash()));
+    BOOST_CHECK(pool.exists(txHigh.GetHash()));
+    BOOST_CHECK_EQUAL(pool.GetCluster(itParent).vTxs.size(), 2U);
+    BOOST_CHECK_EQUAL(pool.GetCluster(itParent).vChunks.size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolClusterLimitTest)
+{
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+    LOCK(pool.cs);
+
+    // A parent with nine children, and an unrelated transaction.
+    CMutableTransaction txParent = CMutableTransaction();
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(10);
+    for (int i = 0; i < 10; i++) {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = COIN;
+    }
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(1000LL).FromTx(txParent));
+    for (int i = 0; i < 9; i++) {
+        CMutableTransaction txChild = CMutableTransaction();
+        txChild.vin.resize(1);
+        txChild.vin[0].prevout = COutPoint(txParent.GetHash(), i);
+        txChild.vin[0].scriptSig = CScript() << OP_11;
+        txChild.vout.resize(1);
+        txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txChild.vout[0].nValue = COIN;
+        pool.addUnchecked(txChild.GetHash(), entry.Fee(1000LL).FromTx(txChild));
+    }
+    CMutableTransaction txOther = CMutableTransaction();
+    txOther.vin.resize(1);
+    txOther.vin[0].scriptSig = CScript() << OP_1;
+    txOther.vout.resize(1);
+    txOther.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    txOther.vout[0].nValue = COIN;
+    pool.addUnchecked(txOther.GetHash(), entry.Fee(1000LL).FromTx(txOther));
+
+    CTxMemPool::txiter itParent = pool.mapTx.find(txParent.GetHash());
+    BOOST_CHECK_EQUAL(pool.GetCluster(itParent).vTxs.size(), 10U);
+    int64_t nClusterSize = 0;
+    for (const CTxMemPool::txiter& it : pool.GetCluster(itParent).vTxs) {
+        nClusterSize += it->GetTxSize();
+    }
+
+    // A tenth child would make the cluster eleven transactions.
+    CMutableTransaction txNew = CMutableTransaction();
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout = COutPoint(txParent.GetHash(), 9);
+    txNew.vin[0].scriptSig = CScript() << OP_11;
+    txNew.vout.resize(1);
+    txNew.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txNew.vout[0].nValue = COIN;
+    CTxMemPoolEntry newEntry = entry.Fee(1000LL).FromTx(txNew);
+    CTxMemPool::setEntries setAncestors, setRemoved;
+    std::string errString;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(newEntry, setAncestors, 100, 1000000, 100, 1000000, errString));
+    BOOST_CHECK(pool.CheckClusterLimits(setAncestors, setRemoved, newEntry.GetTxSize(), 11, nClusterSize + newEntry.GetTxSize(), errString));
+    BOOST_CHECK(!pool.CheckClusterLimits(setAncestors, setRemoved, newEntry.GetTxSize(), 10, 1000000, errString));
+    BOOST_CHECK(!pool.CheckClusterLimits(setAncestors, setRemoved, newEntry.GetTxSize(), 100, nClusterSize + newEntry.GetTxSize() - 1, errString));
+
+    // Unless it replaces a transaction of the cluster; replacing one outside
+    // of it doesn't help.
+    setRemoved.insert(pool.mapTx.find(txOther.GetHash()));
+    BOOST_CHECK(!pool.CheckClusterLimits(setAncestors, setRemoved, newEntry.GetTxSize(), 10, 1000000, errString));
+    CTxMemPool::txiter itChild = pool.GetCluster(itParent).vTxs.back();
+    BOOST_CHECK(itChild != itParent);
+    setRemoved.insert(itChild);
+    BOOST_CHECK(pool.CheckClusterLimits(setAncestors, setRemoved, newEntry.GetTxSize(), 10, 1000000, errString));
+    BOOST_CHECK(pool.CheckClusterLimits(setAncestors, setRemoved, newEntry.GetTxSize(), 100, nClusterSize + newEntry.GetTxSize() - itChild->GetTxSize(), errString));
+    BOOST_CHECK(!pool.CheckClusterLimits(setAncestors, setRemoved, newEntry.GetTxSize(), 100, nClusterSize + newEntry.GetTxSize() - itChild->GetTxSize() - 1, errString));
+    setRemoved.clear();
+
+    // Also spending the unrelated transaction joins its cluster too.
+    txNew.vin.resize(2);
+    txNew.vin[1].prevout = COutPoint(txOther.GetHash(), 0);
+    txNew.vin[1].scriptSig = CScript() << OP_1;
+    CTxMemPoolEntry joinEntry = entry.Fee(1000LL).FromTx(txNew);
+    setAncestors.clear();
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(joinEntry, setAncestors, 100, 1000000, 100, 1000000, errString));
+    BOOST_CHECK(pool.CheckClusterLimits(setAncestors, setRemoved, joinEntry.GetTxSize(), 12, 1000000, errString));
+    BOOST_CHECK(!pool.CheckClusterLimits(setAncestors, setRemoved, joinEntry.GetTxSize(), 11, 1000000, errString));
+}
 
 BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
 {
@@ -523,23 +771,26 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     pool.addUnchecked(tx6.GetHash(), entry.Fee(1100LL).FromTx(tx6));
     pool.addUnchecked(tx7.GetHash(), entry.Fee(9000LL).FromTx(tx7));
 
-    // we only require this remove, at max, 2 txn, because its not clear what we're really optimizing for aside from that
+    // tx7 pays for both tx5 and tx6, which makes them one chunk after tx4,
+    // and the chunk is evicted as a whole
     pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
     BOOST_CHECK(pool.exists(tx4.GetHash()));
-    BOOST_CHECK(pool.exists(tx6.GetHash()));
+    BOOST_CHECK(!pool.exists(tx5.GetHash()));
+    BOOST_CHECK(!pool.exists(tx6.GetHash()));
     BOOST_CHECK(!pool.exists(tx7.GetHash()));
 
-    if (!pool.exists(tx5.GetHash()))
-        pool.addUnchecked(tx5.GetHash(), entry.Fee(1000LL).FromTx(tx5));
+    pool.addUnchecked(tx5.GetHash(), entry.Fee(1000LL).FromTx(tx5));
+    pool.addUnchecked(tx6.GetHash(), entry.Fee(1100LL).FromTx(tx6));
     pool.addUnchecked(tx7.GetHash(), entry.Fee(9000LL).FromTx(tx7));
 
-    pool.TrimToSize(pool.DynamicMemoryUsage() / 2); // should maximize mempool size by only removing 5/7
+    pool.TrimToSize(pool.DynamicMemoryUsage() / 2); // should keep tx4, which pays the most
     BOOST_CHECK(pool.exists(tx4.GetHash()));
     BOOST_CHECK(!pool.exists(tx5.GetHash()));
-    BOOST_CHECK(pool.exists(tx6.GetHash()));
+    BOOST_CHECK(!pool.exists(tx6.GetHash()));
     BOOST_CHECK(!pool.exists(tx7.GetHash()));
 
     pool.addUnchecked(tx5.GetHash(), entry.Fee(1000LL).FromTx(tx5));
+    pool.addUnchecked(tx6.GetHash(), entry.Fee(1100LL).FromTx(tx6));
     pool.addUnchecked(tx7.GetHash(), entry.Fee(9000LL).FromTx(tx7));
 
     std::vector<CTransactionRef> vtx;
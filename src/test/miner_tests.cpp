@@ -11,7 +11,9 @@
 #include <validation.h>
 #include <miner.h>
 #include <policy/policy.h>
+#include <pow.h>
 #include <pubkey.h>
+#include <script/interpreter.h>
 #include <script/standard.h>
 #include <txmempool.h>
 #include <uint256.h>
@@ -520,4 +522,95 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+static std::set<uint256> SelectedTransactions(const CBlockTemplate& blocktemplate)
+{
+    std::set<uint256> selected;
+    for (size_t i = 1; i < blocktemplate.block.vtx.size(); ++i) {
+        selected.insert(blocktemplate.block.vtx[i]->GetHash());
+    }
+    return selected;
+}
+
+BOOST_FIXTURE_TEST_CASE(BlockTemplateManager_updates, TestChain100Setup)
+{
+    const CChainParams& chainparams = Params();
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    CAmount nSubsidy = GetBlockSubsidy(chainActive.Height() + 1, chainparams.GetConsensus());
+    BlockTemplateManager manager(chainparams);
+    TestMemPoolEntryHelper entry;
+
+    std::unique_ptr<CBlockTemplate> pblocktemplate = manager.GetBlockTemplate(scriptPubKey);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1U);
+
+    // A parent with two outputs, spending a mature coinbase
+    CMutableTransaction parent;
+    parent.vin.resize(1);
+    parent.vin[0].prevout = COutPoint(coinbaseTxns[0].GetHash(), 0);
+    parent.vout.resize(2);
+    parent.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    parent.vout[0].nValue = 20 * COIN;
+    parent.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    parent.vout[1].nValue = coinbaseTxns[0].vout[0].nValue - parent.vout[0].nValue - 10000;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(coinbaseTxns[0].vout[0].scriptPubKey, parent, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    parent.vin[0].scriptSig << vchSig;
+    mempool.addUnchecked(parent.GetHash(), entry.Fee(10000).SpendsCoinbase(true).FromTx(parent));
+
+    pblocktemplate = manager.GetBlockTemplate(scriptPubKey);
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 2U);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == parent.GetHash());
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx[0]->vout[0].nValue, nSubsidy + 10000);
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], -10000);
+
+    // A child paying enough is appended after its parent; one that doesn't
+    // pay the minimum feerate is left out.
+    CMutableTransaction child;
+    child.vin.resize(1);
+    child.vin[0].prevout = COutPoint(parent.GetHash(), 0);
+    child.vout.resize(1);
+    child.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    child.vout[0].nValue = parent.vout[0].nValue - 50000;
+    mempool.addUnchecked(child.GetHash(), entry.Fee(50000).SpendsCoinbase(false).FromTx(child));
+    CMutableTransaction freeChild = child;
+    freeChild.vin[0].prevout = COutPoint(parent.GetHash(), 1);
+    freeChild.vout[0].nValue = parent.vout[1].nValue;
+    mempool.addUnchecked(freeChild.GetHash(), entry.Fee(0).FromTx(freeChild));
+
+    pblocktemplate = manager.GetBlockTemplate(scriptPubKey);
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 3U);
+    BOOST_CHECK(pblocktemplate->block.vtx[2]->GetHash() == child.GetHash());
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx[0]->vout[0].nValue, nSubsidy + 60000);
+    BOOST_CHECK(SelectedTransactions(*pblocktemplate) == SelectedTransactions(*BlockAssembler(chainparams).CreateNewBlock(scriptPubKey)));
+
+    // Removed transactions are dropped from the selection.
+    mempool.removeRecursive(child, MemPoolRemovalReason::CONFLICT);
+    pblocktemplate = manager.GetBlockTemplate(scriptPubKey);
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 2U);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == parent.GetHash());
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx[0]->vout[0].nValue, nSubsidy + 10000);
+
+    // Prioritising a transaction is picked up as well.
+    mempool.PrioritiseTransaction(freeChild.GetHash(), 100000);
+    pblocktemplate = manager.GetBlockTemplate(scriptPubKey);
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 3U);
+    BOOST_CHECK(SelectedTransactions(*pblocktemplate) == SelectedTransactions(*BlockAssembler(chainparams).CreateNewBlock(scriptPubKey)));
+
+    // The template is a valid block, and mining it starts a new selection.
+    CBlock block = pblocktemplate->block;
+    unsigned int extraNonce = 0;
+    {
+        LOCK(cs_main);
+        IncrementExtraNonce(&block, chainActive.Tip(), extraNonce);
+    }
+    while (!CheckProofOfWork(block.GetHash(), block.nBits, chainparams.GetConsensus())) ++block.nNonce;
+    BOOST_CHECK(ProcessNewBlock(chainparams, std::make_shared<const CBlock>(block), true, nullptr));
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+
+    pblocktemplate = manager.GetBlockTemplate(scriptPubKey);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1U);
+    BOOST_CHECK(pblocktemplate->block.hashPrevBlock == block.GetHash());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
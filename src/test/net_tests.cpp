@@ -13,6 +13,11 @@
 #include <chainparams.h>
 #include <util.h>
 
+#ifndef WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
 class CAddrManSerializationMock : public CAddrMan
 {
 public:
@@ -185,4 +190,68 @@ BOOST_AUTO_TEST_CASE(cnode_simple_test)
     BOOST_CHECK(pnode2->fFeeler == false);
 }
 
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(send_shared_payload)
+{
+    CConnman connman(0x1337, 0x1337);
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CAddress addr(CService(ipv4Addr, 7777), NODE_NETWORK);
+    CNode node(0, NODE_NETWORK, 0, fds[0], addr, 0, 0, CAddress());
+    CNode idle(1, NODE_NETWORK, 0, INVALID_SOCKET, addr, 1, 1, CAddress());
+
+    // A payload larger than the socket buffer, queued twice for both peers
+    std::vector<unsigned char> data(2000000);
+    for (unsigned char& c : data) c = InsecureRandBits(8);
+    auto payload = std::make_shared<const CSharedNetPayload>(std::move(data));
+    std::vector<unsigned char> expected;
+    for (int i = 0; i < 3; i++) {
+        CSerializedNetMsg msg;
+        if (i == 1) {
+            msg.command = NetMsgType::PING;
+            msg.data = {1, 2, 3, 4, 5, 6, 7, 8};
+        } else {
+            msg.command = NetMsgType::BLOCK;
+            msg.shared_payload = payload;
+        }
+        const std::vector<unsigned char> body = msg.GetPayload();
+        CMessageHeader hdr(Params().MessageStart(), msg.command.c_str(), body.size());
+        uint256 hash = Hash(body.begin(), body.end());
+        memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+        CVectorWriter(SER_NETWORK, INIT_PROTO_VERSION, expected, expected.size(), hdr);
+        expected.insert(expected.end(), body.begin(), body.end());
+
+        if (msg.shared_payload) {
+            CSerializedNetMsg copy;
+            copy.command = msg.command;
+            copy.shared_payload = msg.shared_payload;
+            connman.PushMessage(&idle, std::move(copy));
+        }
+        connman.PushMessage(&node, std::move(msg));
+    }
+
+    // The queues refer to the payload instead of copying it
+    BOOST_REQUIRE_EQUAL(idle.vSendMsg.size(), 4U);
+    BOOST_CHECK(idle.vSendMsg[1].get() == &payload->data);
+    BOOST_CHECK(idle.vSendMsg[3].get() == &payload->data);
+    BOOST_CHECK(!node.vSendMsg.empty());
+
+    // The messages arrive in order, however much the socket takes at a time
+    std::vector<unsigned char> received;
+    for (int i = 0; i < 100000 && received.size() < expected.size(); i++) {
+        CConnmanTest::SocketSendData(connman, node);
+        unsigned char buf[50000];
+        ssize_t n = recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT);
+        if (n > 0) received.insert(received.end(), buf, buf + n);
+    }
+    BOOST_CHECK(received == expected);
+    BOOST_CHECK(node.vSendMsg.empty());
+    BOOST_CHECK_EQUAL(node.nSendSize, 0U);
+    BOOST_CHECK_EQUAL(node.nSendOffset, 0U);
+    close(fds[1]);
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,90 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <memusage.h>
+#include <support/allocators/pool.h>
+
+#include <test/test_bitcoin.h>
+
+#include <boost/test/unit_test.hpp>
+
+#include <unordered_map>
+#include <vector>
+
+BOOST_FIXTURE_TEST_SUITE(pool_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(pool_resource_reuse)
+{
+    PoolResource<64, 8> resource(1024);
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 0U);
+
+    void* a = resource.Allocate(24, 8);
+    void* b = resource.Allocate(24, 8);
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 1U);
+    BOOST_CHECK_EQUAL(static_cast<char*>(b) - static_cast<char*>(a), 24);
+
+    // A freed block is handed out again for the next allocation of its size,
+    // but not for other sizes.
+    resource.Deallocate(a, 24, 8);
+    void* c = resource.Allocate(16, 8);
+    BOOST_CHECK(c != a);
+    BOOST_CHECK(resource.Allocate(20, 8) == a);
+
+    // Too large or too strictly aligned allocations bypass the pool.
+    void* large = resource.Allocate(65, 8);
+    void* aligned = resource.Allocate(8, 16);
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 1U);
+    resource.Deallocate(large, 65, 8);
+    resource.Deallocate(aligned, 8, 16);
+
+    // Running out of the chunk takes a new one.
+    std::vector<void*> blocks;
+    for (int i = 0; i < 1024 / 64; ++i) {
+        blocks.push_back(resource.Allocate(64, 8));
+    }
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 2U);
+    BOOST_CHECK_EQUAL(resource.ChunkSizeBytes(), 1024U);
+    for (void* p : blocks) {
+        resource.Deallocate(p, 64, 8);
+    }
+    resource.Deallocate(b, 24, 8);
+    resource.Deallocate(c, 16, 8);
+}
+
+BOOST_AUTO_TEST_CASE(pool_allocator_unordered_map)
+{
+    typedef PoolAllocator<std::pair<const uint64_t, uint64_t>, 64, alignof(void*)> Alloc;
+    typedef std::unordered_map<uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>, Alloc> Map;
+
+    Alloc::ResourceType resource(4096);
+    Map map(0, std::hash<uint64_t>(), std::equal_to<uint64_t>(), &resource);
+    for (uint64_t i = 0; i < 1000; ++i) {
+        map[i] = i * 2;
+    }
+    BOOST_CHECK_EQUAL(map.size(), 1000U);
+    BOOST_CHECK_EQUAL(map[500], 1000U);
+    size_t chunks = resource.NumAllocatedChunks();
+    BOOST_CHECK(chunks > 1);
+    size_t usage = memusage::DynamicUsage(map);
+    BOOST_CHECK(usage >= chunks * resource.ChunkSizeBytes());
+
+    // Erased nodes are reused rather than taking new chunks.
+    for (uint64_t i = 0; i < 1000; ++i) {
+        map.erase(i);
+    }
+    for (uint64_t i = 1000; i < 2000; ++i) {
+        map[i] = i;
+    }
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), chunks);
+
+    // Moving a map takes its resource along.
+    Alloc::ResourceType resource2(4096);
+    Map map2(0, std::hash<uint64_t>(), std::equal_to<uint64_t>(), &resource2);
+    map2 = std::move(map);
+    BOOST_CHECK(map2.get_allocator().resource() == &resource);
+    BOOST_CHECK_EQUAL(map2.size(), 1000U);
+    BOOST_CHECK_EQUAL(map2[1999], 1999U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -206,6 +206,32 @@ BOOST_AUTO_TEST_CASE(sighash_from_data)
 
         sh = SignatureHash(scriptCode, *tx, nIn, nHashType, 0, SIGVERSION_BASE);
         BOOST_CHECK_MESSAGE(sh.GetHex() == sigHashHex, strTest);
+        PrecomputedTransactionData txdata(*tx);
+        sh = SignatureHash(scriptCode, *tx, nIn, nHashType, 0, SIGVERSION_BASE, &txdata);
+        BOOST_CHECK_MESSAGE(sh.GetHex() == sigHashHex, strTest);
+    }
+}
+
+// Goal: check that the legacy signature hashes of all inputs and hash types
+// computed with the same precomputed data are correct
+BOOST_AUTO_TEST_CASE(sighash_legacy_cache)
+{
+    SeedInsecureRand(false);
+
+    for (int i = 0; i < 500; i++) {
+        CMutableTransaction txTo;
+        RandomTransaction(txTo, InsecureRandBool());
+        const CTransaction tx(txTo);
+        PrecomputedTransactionData txdata(tx);
+        for (int j = 0; j < 20; j++) {
+            int nHashType = InsecureRand32();
+            CScript scriptCode;
+            RandomScript(scriptCode);
+            for (unsigned int nIn = 0; nIn < tx.vin.size(); nIn++) {
+                uint256 sh = SignatureHash(scriptCode, tx, nIn, nHashType, 0, SIGVERSION_BASE, &txdata);
+                BOOST_CHECK(sh == SignatureHashOld(scriptCode, txTo, nIn, nHashType));
+            }
+        }
     }
 }
 BOOST_AUTO_TEST_SUITE_END()
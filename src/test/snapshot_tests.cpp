@@ -0,0 +1,102 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chainparams.h>
+#include <coins.h>
+#include <snapshot.h>
+#include <streams.h>
+#include <txdb.h>
+#include <validation.h>
+
+#include <test/test_bitcoin.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(snapshot_tests)
+
+BOOST_FIXTURE_TEST_CASE(snapshot_metadata, BasicTestingSetup)
+{
+    SnapshotMetadata metadata;
+    memcpy(metadata.m_network_magic, Params().MessageStart(), sizeof(metadata.m_network_magic));
+    metadata.m_base_blockhash = Params().GenesisBlock().GetHash();
+    metadata.m_headers.emplace_back(Params().GenesisBlock().GetBlockHeader(), 1);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << metadata;
+    SnapshotMetadata read;
+    CDataStream ss2(ss);
+    ss2 >> read;
+    BOOST_CHECK(read.m_base_blockhash == metadata.m_base_blockhash);
+    BOOST_CHECK(memcmp(read.m_network_magic, metadata.m_network_magic, sizeof(read.m_network_magic)) == 0);
+    BOOST_REQUIRE_EQUAL(read.m_headers.size(), 1U);
+    BOOST_CHECK(read.m_headers[0].first.GetHash() == Params().GenesisBlock().GetHash());
+    BOOST_CHECK_EQUAL(read.m_headers[0].second, 1U);
+
+    // Anything but a snapshot file is rejected up front.
+    ss[0] ^= 1;
+    BOOST_CHECK_THROW(ss >> read, std::ios_base::failure);
+}
+
+BOOST_FIXTURE_TEST_CASE(snapshot_coins_roundtrip, TestChain100Setup)
+{
+    FlushStateToDisk();
+    uint256 base_hash;
+    {
+        LOCK(cs_main);
+        base_hash = chainActive.Tip()->GetBlockHash();
+    }
+    std::unique_ptr<CCoinsViewCursor> cursor(pcoinsdbview->Cursor());
+    BOOST_CHECK(cursor->GetBestBlock() == base_hash);
+
+    const fs::path path = GetDataDir() / "snapshot.dat";
+    SnapshotStats written;
+    {
+        CAutoFile file(fsbridge::fopen(path, "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(WriteSnapshotCoins(file, *cursor, written));
+    }
+    // One spendable coinbase output per block; the genesis block's is not part of the set.
+    BOOST_CHECK_EQUAL(written.transactions, 100U);
+    BOOST_CHECK_EQUAL(written.coins, 100U);
+
+    std::map<COutPoint, Coin> coins;
+    auto add_coin = [&](const COutPoint& outpoint, Coin&& coin) {
+        coins.emplace(outpoint, std::move(coin));
+        return true;
+    };
+
+    SnapshotStats read;
+    std::string error;
+    {
+        CAutoFile file(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(ReadSnapshotCoins(file, base_hash, add_coin, read, error));
+    }
+    BOOST_CHECK(read.hash_serialized == written.hash_serialized);
+    BOOST_CHECK_EQUAL(read.coins, written.coins);
+    BOOST_REQUIRE_EQUAL(coins.size(), 100U);
+    for (const auto& entry : coins) {
+        Coin coin;
+        BOOST_REQUIRE(pcoinsdbview->GetCoin(entry.first, coin));
+        BOOST_CHECK(coin.out == entry.second.out);
+        BOOST_CHECK_EQUAL(coin.nHeight, entry.second.nHeight);
+        BOOST_CHECK(entry.second.IsCoinBase());
+    }
+
+    // The commitment covers the base block.
+    {
+        CAutoFile file(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+        SnapshotStats stats;
+        BOOST_CHECK(!ReadSnapshotCoins(file, Params().GenesisBlock().GetHash(), add_coin, stats, error));
+        BOOST_CHECK(error.find("does not match its commitment") != std::string::npos);
+    }
+
+    // A truncated file is an I/O error.
+    fs::resize_file(path, fs::file_size(path) - 1);
+    {
+        CAutoFile file(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+        SnapshotStats stats;
+        BOOST_CHECK_THROW(ReadSnapshotCoins(file, base_hash, add_coin, stats, error), std::ios_base::failure);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,110 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <socketevents.h>
+
+#include <test/test_bitcoin.h>
+
+#include <set>
+
+#ifndef WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(socketevents_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(socketevents_mode_names)
+{
+    SocketEventsMode mode;
+    BOOST_CHECK(SocketEventsModeFromString("select", mode));
+    BOOST_CHECK(mode == SocketEventsMode::SELECT);
+    BOOST_CHECK(!SocketEventsModeFromString("kqueue", mode));
+    BOOST_CHECK(!SocketEventsModeFromString("", mode));
+    BOOST_CHECK(IsSocketEventsModeAvailable(DefaultSocketEventsMode()));
+    for (SocketEventsMode m : {SocketEventsMode::SELECT, SocketEventsMode::POLL, SocketEventsMode::EPOLL}) {
+        BOOST_CHECK_EQUAL(SocketEventsModeFromString(SocketEventsModeToString(m), mode), IsSocketEventsModeAvailable(m));
+    }
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(socketevents_readiness)
+{
+    for (SocketEventsMode mode : {SocketEventsMode::SELECT, SocketEventsMode::POLL, SocketEventsMode::EPOLL}) {
+        if (!IsSocketEventsModeAvailable(mode)) continue;
+        SocketEvents events(mode);
+        BOOST_CHECK(events.GetMode() == mode);
+
+        int a[2], b[2];
+        BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, a) == 0);
+        BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, b) == 0);
+        std::set<SOCKET> recv_set, send_set, error_set;
+
+        // Nothing readable yet; both sockets are writable.
+        events.BeginUpdate();
+        events.Update(a[0], 1, true, false);
+        events.Update(b[0], 2, false, true);
+        events.EndUpdate();
+        BOOST_CHECK_EQUAL(events.Size(), 2U);
+        BOOST_CHECK(events.Wait(0, recv_set, send_set, error_set));
+        BOOST_CHECK(recv_set.empty());
+        BOOST_CHECK(send_set == std::set<SOCKET>({(SOCKET)b[0]}));
+
+        // Data pending on a[0] is reported until it is consumed.
+        char c = 'x';
+        BOOST_CHECK_EQUAL(send(a[1], &c, 1, 0), 1);
+        for (int i = 0; i < 2; ++i) {
+            events.BeginUpdate();
+            events.Update(a[0], 1, true, false);
+            events.Update(b[0], 2, false, true);
+            events.EndUpdate();
+            BOOST_CHECK(events.Wait(0, recv_set, send_set, error_set));
+            BOOST_CHECK(recv_set == std::set<SOCKET>({(SOCKET)a[0]}));
+        }
+
+        // Changing interest takes effect without re-adding the socket.
+        events.BeginUpdate();
+        events.Update(a[0], 1, false, false);
+        events.Update(b[0], 2, false, false);
+        events.EndUpdate();
+        BOOST_CHECK(events.Wait(0, recv_set, send_set, error_set));
+        BOOST_CHECK(recv_set.empty());
+        BOOST_CHECK(send_set.empty());
+
+        // Sockets left out of an update round are dropped.
+        events.BeginUpdate();
+        events.Update(a[0], 1, true, false);
+        events.EndUpdate();
+        BOOST_CHECK_EQUAL(events.Size(), 1U);
+
+        // A hang-up of the peer is reported.
+        close(b[1]);
+        close(a[1]);
+        events.BeginUpdate();
+        events.Update(a[0], 1, true, false);
+        events.EndUpdate();
+        BOOST_CHECK(events.Wait(0, recv_set, send_set, error_set));
+        BOOST_CHECK(recv_set.count(a[0]) || error_set.count(a[0]));
+
+        // A descriptor number reused by a new owner is picked up.
+        close(a[0]);
+        int c2[2];
+        BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, c2) == 0);
+        BOOST_CHECK_EQUAL(send(c2[1], &c, 1, 0), 1);
+        events.BeginUpdate();
+        events.Update(c2[0], 3, true, false);
+        events.EndUpdate();
+        BOOST_CHECK(events.Wait(0, recv_set, send_set, error_set));
+        BOOST_CHECK(recv_set.count(c2[0]));
+
+        close(b[0]);
+        close(c2[0]);
+        close(c2[1]);
+    }
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
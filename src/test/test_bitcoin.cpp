@@ -34,6 +34,12 @@ void CConnmanTest::ClearNodes()
     g_connman->vNodes.clear();
 }
 
+size_t CConnmanTest::SocketSendData(CConnman& connman, CNode& node)
+{
+    LOCK(node.cs_vSend);
+    return connman.SocketSendData(&node);
+}
+
 uint256 insecure_rand_seed = GetRandHash();
 FastRandomContext insecure_rand_ctx(insecure_rand_seed);
 
@@ -93,6 +99,11 @@ TestingSetup::TestingSetup(const std::string& chainName) : BasicTestingSetup(cha
         nScriptCheckThreads = 3;
         for (int i=0; i < nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i < nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadCoinsPrefetch);
+        for (int i=0; i < nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadTxScriptCheck);
+        threadGroup.create_thread(&ThreadBlockWriter);
         g_connman = std::unique_ptr<CConnman>(new CConnman(0x1337, 0x1337)); // Deterministic randomness for tests.
         connman = g_connman.get();
         peerLogic.reset(new PeerLogicValidation(connman, scheduler));
@@ -10,6 +10,7 @@
 #include <txmempool.h>
 #include <random.h>
 #include <script/standard.h>
+#include <script/sigcache.h>
 #include <script/sign.h>
 #include <test/test_bitcoin.h>
 #include <utiltime.h>
@@ -17,6 +18,8 @@
 #include <keystore.h>
 #include <policy/policy.h>
 
+#include <algorithm>
+
 #include <boost/test/unit_test.hpp>
 
 bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheSigStore, bool cacheFullScriptStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks);
@@ -91,6 +94,89 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
     BOOST_CHECK_EQUAL(mempool.size(), 0);
 }
 
+// Spend prevout, paying to scriptPubKey like it, into nOutputs outputs of nValue
+static CMutableTransaction SignSpend(const COutPoint& prevout, const CKey& key, const CScript& scriptPubKey, CAmount nValue, int nOutputs = 1)
+{
+    CMutableTransaction spend;
+    spend.nVersion = 1;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = prevout;
+    spend.vout.resize(nOutputs);
+    for (CTxOut& out : spend.vout) {
+        out.nValue = nValue;
+        out.scriptPubKey = scriptPubKey;
+    }
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+    return spend;
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_mempool_block_cache_usage, TestChain100Setup)
+{
+    // Connecting a block records how many of its transactions from the
+    // mempool still had their scripts cached.
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction spend = SignSpend(COutPoint(coinbaseTxns[0].GetHash(), 0), coinbaseKey, scriptPubKey, 11*CENT);
+
+    uint64_t nAccepts = g_validation_cache_usage.mempool_accepts;
+    BOOST_CHECK(ToMemPool(spend));
+    BOOST_CHECK_EQUAL(g_validation_cache_usage.mempool_accepts, nAccepts + 1);
+
+    CBlock block = CreateAndProcessBlock({spend}, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+    const ValidationCacheUsage& usage = g_validation_cache_usage;
+    BOOST_CHECK(usage.last_block_hash == block.GetHash());
+    BOOST_CHECK_EQUAL(usage.last_block_height, chainActive.Height());
+    BOOST_CHECK_EQUAL(usage.last_block_mempool_txs, 1U);
+    BOOST_CHECK_EQUAL(usage.last_block_mempool_txs_missed, 0U);
+    BOOST_CHECK_EQUAL(usage.last_block_script_hits, 1U);
+    BOOST_CHECK_EQUAL(usage.last_block_script_misses, 0U);
+    BOOST_CHECK_EQUAL(usage.last_block_sig_hits + usage.last_block_sig_misses, 0U);
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_mempool_block_cache_growth, TestChain100Setup)
+{
+    // Caches too small to keep the scripts of the mempool transactions until
+    // they are mined are grown.
+    gArgs.ForceSetArg("-maxsigcachesize", "0");
+    gArgs.ForceSetArg("-maxadaptivesigcachesize", "2");
+    InitSignatureCache();
+    {
+        LOCK(cs_main);
+        InitScriptExecutionCache();
+        BOOST_CHECK_EQUAL(GetScriptExecutionCacheStats().max_elements, 2U);
+    }
+
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction fanout = SignSpend(COutPoint(coinbaseTxns[0].GetHash(), 0), coinbaseKey, scriptPubKey, 10*CENT, 4);
+    CreateAndProcessBlock({fanout}, scriptPubKey);
+    std::vector<CMutableTransaction> spends;
+    for (uint32_t i = 0; i < 4; i++) {
+        spends.push_back(SignSpend(COutPoint(fanout.GetHash(), i), coinbaseKey, scriptPubKey, 9*CENT));
+        BOOST_CHECK(ToMemPool(spends.back()));
+    }
+    uint64_t nResizes = g_validation_cache_usage.resizes;
+    CBlock block = CreateAndProcessBlock(spends, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(g_validation_cache_usage.last_block_mempool_txs, 4U);
+    BOOST_CHECK(g_validation_cache_usage.last_block_mempool_txs_missed >= 2);
+    BOOST_CHECK_EQUAL(g_validation_cache_usage.resizes, nResizes + 1);
+    {
+        LOCK(cs_main);
+        BOOST_CHECK_EQUAL(GetScriptExecutionCacheStats().max_elements, (1U << 20) / 32);
+    }
+    BOOST_CHECK_EQUAL(GetSignatureCacheStats().max_elements, (1U << 20) / 32);
+
+    gArgs.ForceSetArg("-maxsigcachesize", std::to_string(DEFAULT_MAX_SIG_CACHE_SIZE));
+    gArgs.ForceSetArg("-maxadaptivesigcachesize", std::to_string(DEFAULT_MAX_ADAPTIVE_SIG_CACHE_SIZE));
+    InitSignatureCache();
+    LOCK(cs_main);
+    InitScriptExecutionCache();
+}
+
 // Run CheckInputs (using pcoinsTip) on the given transaction, for all script
 // flags.  Test that CheckInputs passes for all flags that don't overlap with
 // the failing_flags argument, but otherwise fails.
@@ -368,4 +454,89 @@ BOOST_FIXTURE_TEST_CASE(checkinputs_test, TestChain100Setup)
     }
 }
 
+BOOST_FIXTURE_TEST_CASE(tx_pre_verify, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    auto make_spend = [&](const COutPoint& prevout, CAmount value) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = prevout;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = value - 10000;
+        tx.vout[0].scriptPubKey = scriptPubKey;
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, tx, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        tx.vin[0].scriptSig << vchSig;
+        return tx;
+    };
+
+    CMutableTransaction parent = make_spend(COutPoint(coinbaseTxns[0].GetHash(), 0), coinbaseTxns[0].vout[0].nValue);
+    // Spends an output of the batch's first transaction
+    CMutableTransaction child = make_spend(COutPoint(parent.GetHash(), 0), parent.vout[0].nValue);
+    // Mature the second coinbase, so that bad_sig only fails on its script.
+    CreateAndProcessBlock({}, scriptPubKey);
+    CMutableTransaction bad_sig = make_spend(COutPoint(coinbaseTxns[1].GetHash(), 0), coinbaseTxns[1].vout[0].nValue);
+    bad_sig.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72, 0x30);
+    CMutableTransaction orphan = make_spend(COutPoint(InsecureRand256(), 0), COIN);
+
+    std::vector<CTransactionRef> batch{MakeTransactionRef(parent), MakeTransactionRef(child), MakeTransactionRef(bad_sig), MakeTransactionRef(orphan)};
+    {
+        // Start from an empty coins cache, so that the inputs are fetched.
+        LOCK(cs_main);
+        pcoinsTip->Flush();
+    }
+    std::vector<COutPoint> coins_to_uncache;
+    BOOST_CHECK_EQUAL(PreVerifyTransactions(batch, coins_to_uncache), 2U);
+    // The fetched coins are kept for AcceptToMemoryPool.
+    BOOST_CHECK(!coins_to_uncache.empty());
+    for (const COutPoint& outpoint : {parent.vin[0].prevout, bad_sig.vin[0].prevout}) {
+        BOOST_CHECK(std::count(coins_to_uncache.begin(), coins_to_uncache.end(), outpoint));
+        BOOST_CHECK(pcoinsTip->HaveCoinInCache(outpoint));
+    }
+
+    // The verified scripts are in the script execution cache now.
+    {
+        LOCK(cs_main);
+        for (const CMutableTransaction& tx : {parent, bad_sig}) {
+            CValidationState state;
+            PrecomputedTransactionData txdata(tx);
+            std::vector<CScriptCheck> scriptchecks;
+            BOOST_CHECK(CheckInputs(tx, state, *pcoinsTip, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, true, txdata, &scriptchecks));
+            BOOST_CHECK_EQUAL(scriptchecks.size(), tx.GetHash() == parent.GetHash() ? 0U : 1U);
+        }
+    }
+
+    LOCK(cs_main);
+    CValidationState bad_sig_state;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        CValidationState state;
+        bool accepted = AcceptToMemoryPool(mempool, state, batch[i], nullptr, nullptr, false, 0);
+        BOOST_CHECK_EQUAL(accepted, i < 2);
+        if (i == 2) bad_sig_state = state;
+    }
+    BOOST_CHECK_EQUAL(mempool.size(), 2U);
+
+    // AcceptToMemoryPool rejected bad_sig the way it does when it verifies
+    // the scripts itself.
+    {
+        CValidationState state;
+        BOOST_CHECK(!AcceptToMemoryPool(mempool, state, batch[2], nullptr, nullptr, false, 0));
+        BOOST_CHECK_EQUAL(bad_sig_state.GetRejectReason(), state.GetRejectReason());
+        BOOST_CHECK_EQUAL(bad_sig_state.GetRejectCode(), state.GetRejectCode());
+        BOOST_CHECK_EQUAL(bad_sig_state.CorruptionPossible(), state.CorruptionPossible());
+        int nDoS = 0, nDoSExpected = 0;
+        BOOST_CHECK(bad_sig_state.IsInvalid(nDoS) && state.IsInvalid(nDoSExpected));
+        BOOST_CHECK_EQUAL(nDoS, nDoSExpected);
+        BOOST_CHECK_EQUAL(nDoS, 100);
+        BOOST_CHECK_EQUAL(state.GetRejectReason().find("mandatory-script-verify-flag-failed"), 0U);
+    }
+
+    // Only the inputs of the rejected transaction are uncached.
+    UncacheUnspentCoins(coins_to_uncache);
+    BOOST_CHECK(pcoinsTip->HaveCoinInCache(parent.vin[0].prevout));
+    BOOST_CHECK(!pcoinsTip->HaveCoinInCache(bad_sig.vin[0].prevout));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
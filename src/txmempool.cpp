@@ -22,7 +22,7 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFe
                                  int64_t _nTime, unsigned int _entryHeight,
                                  bool _spendsCoinbase, int64_t _sigOpsCost, LockPoints lp):
     tx(_tx), nFee(_nFee), nTime(_nTime), entryHeight(_entryHeight),
-    spendsCoinbase(_spendsCoinbase), sigOpCost(_sigOpsCost), lockPoints(lp)
+    spendsCoinbase(_spendsCoinbase), sigOpCost(_sigOpsCost), lockPoints(lp), m_epoch(0)
 {
     nTxWeight = GetTransactionWeight(*tx);
     nUsageSize = RecursiveDynamicUsage(tx);
@@ -61,39 +61,48 @@ size_t CTxMemPoolEntry::GetTxSize() const
 // descendants.
 void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendants, const std::set<uint256> &setExclude)
 {
-    setEntries stageEntries, setAllDescendants;
-    stageEntries = GetMemPoolChildren(updateIt);
-
-    while (!stageEntries.empty()) {
-        const txiter cit = *stageEntries.begin();
-        setAllDescendants.insert(cit);
-        stageEntries.erase(cit);
-        const setEntries &setChildren = GetMemPoolChildren(cit);
-        for (const txiter childEntry : setChildren) {
-            cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
-            if (cacheIt != cachedDescendants.end()) {
-                // We've already calculated this one, just add the entries for this set
-                // but don't traverse again.
-                for (const txiter cacheEntry : cacheIt->second) {
-                    setAllDescendants.insert(cacheEntry);
+    std::vector<txiter> vAllDescendants;
+    {
+        const EpochGuard guard(*this);
+        std::vector<txiter> stageEntries;
+        for (const txiter childEntry : GetMemPoolChildren(updateIt)) {
+            visited(childEntry);
+            stageEntries.push_back(childEntry);
+        }
+
+        while (!stageEntries.empty()) {
+            const txiter cit = stageEntries.back();
+            stageEntries.pop_back();
+            vAllDescendants.push_back(cit);
+            const setEntries &setChildren = GetMemPoolChildren(cit);
+            for (const txiter childEntry : setChildren) {
+                cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
+                if (cacheIt != cachedDescendants.end()) {
+                    // We've already calculated this one, just add the entries for this set
+                    // but don't traverse again.
+                    for (const txiter cacheEntry : cacheIt->second) {
+                        if (!visited(cacheEntry)) {
+                            vAllDescendants.push_back(cacheEntry);
+                        }
+                    }
+                } else if (!visited(childEntry)) {
+                    // Schedule for later processing
+                    stageEntries.push_back(childEntry);
                 }
-            } else if (!setAllDescendants.count(childEntry)) {
-                // Schedule for later processing
-                stageEntries.insert(childEntry);
             }
         }
     }
-    // setAllDescendants now contains all in-mempool descendants of updateIt.
+    // vAllDescendants now contains all in-mempool descendants of updateIt.
     // Update and add to cached descendant map
     int64_t modifySize = 0;
     CAmount modifyFee = 0;
     int64_t modifyCount = 0;
-    for (txiter cit : setAllDescendants) {
+    for (txiter cit : vAllDescendants) {
         if (!setExclude.count(cit->GetTx().GetHash())) {
             modifySize += cit->GetTxSize();
             modifyFee += cit->GetModifiedFee();
             modifyCount++;
-            cachedDescendants[updateIt].insert(cit);
+            cachedDescendants[updateIt].push_back(cit);
             // Update ancestor state for each descendant
             mapTx.modify(cit, update_ancestor_state(updateIt->GetTxSize(), updateIt->GetModifiedFee(), 1, updateIt->GetSigOpCost()));
         }
@@ -118,42 +127,70 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
     // accounted for in the state of their ancestors)
     std::set<uint256> setAlreadyIncluded(vHashesToUpdate.begin(), vHashesToUpdate.end());
 
+    // Clusters joined with those of in-mempool children, to be linearized
+    // once all transactions are updated
+    std::vector<ClusterRef> vMergedClusters;
+
     // Iterate in reverse, so that whenever we are looking at a transaction
     // we are sure that all in-mempool descendants have already been processed.
     // This maximizes the benefit of the descendant cache and guarantees that
     // setMemPoolChildren will be updated, an assumption made in
     // UpdateForDescendants.
     for (const uint256 &hash : reverse_iterate(vHashesToUpdate)) {
-        // we cache the in-mempool children to avoid duplicate updates
-        setEntries setChildren;
         // calculate children from mapNextTx
         txiter it = mapTx.find(hash);
         if (it == mapTx.end()) {
             continue;
         }
         auto iter = mapNextTx.lower_bound(COutPoint(hash, 0));
+        std::vector<ClusterRef> vClusters{mapLinks[it].cluster};
         // First calculate the children, and update setMemPoolChildren to
         // include them, and update their setMemPoolParents to include this tx.
-        for (; iter != mapNextTx.end() && iter->first->hash == hash; ++iter) {
-            const uint256 &childHash = iter->second->GetHash();
-            txiter childIter = mapTx.find(childHash);
-            assert(childIter != mapTx.end());
-            // We can skip updating entries we've encountered before or that
-            // are in the block (which are already accounted for).
-            if (setChildren.insert(childIter).second && !setAlreadyIncluded.count(childHash)) {
-                UpdateChild(it, childIter, true);
-                UpdateParent(childIter, it, true);
+        {
+            // we mark the in-mempool children to avoid duplicate updates
+            const EpochGuard guard(*this);
+            for (; iter != mapNextTx.end() && iter->first->hash == hash; ++iter) {
+                const uint256 &childHash = iter->second->GetHash();
+                txiter childIter = mapTx.find(childHash);
+                assert(childIter != mapTx.end());
+                // We can skip updating entries we've encountered before or that
+                // are in the block (which are already accounted for).
+                if (!visited(childIter) && !setAlreadyIncluded.count(childHash)) {
+                    UpdateChild(it, childIter, true);
+                    UpdateParent(childIter, it, true);
+                    const ClusterRef& cluster = mapLinks[childIter].cluster;
+                    if (std::find(vClusters.begin(), vClusters.end(), cluster) == vClusters.end()) {
+                        vClusters.push_back(cluster);
+                    }
+                }
             }
         }
+        // The children's clusters join this transaction's, after it.
+        if (vClusters.size() > 1) {
+            vMergedClusters.push_back(MergeClusters(vClusters));
+        }
         UpdateForDescendants(it, mapMemPoolDescendantsToUpdate, setAlreadyIncluded);
     }
+
+    // Now that the ancestor state is complete, order the joined clusters.
+    // Sorting by ancestor count puts every transaction after its ancestors.
+    for (const ClusterRef& cluster : vMergedClusters) {
+        // Skip clusters that were joined into another one later
+        if (cluster->vTxs.empty()) continue;
+        std::stable_sort(cluster->vTxs.begin(), cluster->vTxs.end(), [](const txiter& a, const txiter& b) {
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        });
+        UpdateCluster(cluster);
+    }
 }
 
 bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents /* = true */) const
 {
     LOCK(cs);
+    const EpochGuard guard(*this);
 
-    setEntries parentHashes;
+    // Ancestors found but not walked yet
+    std::vector<txiter> parentHashes;
     const CTransaction &tx = entry.GetTx();
 
     if (fSearchForParents) {
@@ -162,8 +199,8 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // iterate mapTx to find parents.
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             txiter piter = mapTx.find(tx.vin[i].prevout.hash);
-            if (piter != mapTx.end()) {
-                parentHashes.insert(piter);
+            if (piter != mapTx.end() && !visited(piter)) {
+                parentHashes.push_back(piter);
                 if (parentHashes.size() + 1 > limitAncestorCount) {
                     errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
                     return false;
@@ -174,16 +211,19 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // If we're not searching for parents, we require this to be an
         // entry in the mempool already.
         txiter it = mapTx.iterator_to(entry);
-        parentHashes = GetMemPoolParents(it);
+        for (const txiter& piter : GetMemPoolParents(it)) {
+            visited(piter);
+            parentHashes.push_back(piter);
+        }
     }
 
     size_t totalSizeWithAncestors = entry.GetTxSize();
 
     while (!parentHashes.empty()) {
-        txiter stageit = *parentHashes.begin();
+        txiter stageit = parentHashes.back();
+        parentHashes.pop_back();
 
         setAncestors.insert(stageit);
-        parentHashes.erase(stageit);
         totalSizeWithAncestors += stageit->GetTxSize();
 
         if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
@@ -200,8 +240,8 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         const setEntries & setMemPoolParents = GetMemPoolParents(stageit);
         for (const txiter &phash : setMemPoolParents) {
             // If this is a new ancestor, add it.
-            if (setAncestors.count(phash) == 0) {
-                parentHashes.insert(phash);
+            if (!visited(phash)) {
+                parentHashes.push_back(phash);
             }
             if (parentHashes.size() + setAncestors.size() + 1 > limitAncestorCount) {
                 errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
@@ -213,6 +253,38 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
     return true;
 }
 
+bool CTxMemPool::CheckClusterLimits(const setEntries &setAncestors, const setEntries &setRemoved, int64_t nTxSize, uint64_t limitClusterCount, uint64_t limitClusterSize, std::string &errString) const
+{
+    LOCK(cs);
+    // A new transaction has no in-mempool children, so it only joins the
+    // clusters of its ancestors.
+    std::set<const Cluster*> setJoined;
+    uint64_t nCount = 1;
+    uint64_t nSize = nTxSize;
+    for (const txiter& ancestorIt : setAncestors) {
+        const Cluster& cluster = GetCluster(ancestorIt);
+        if (!setJoined.insert(&cluster).second) continue;
+        nCount += cluster.vTxs.size();
+        for (const ClusterChunk& chunk : cluster.vChunks) {
+            nSize += chunk.nSize;
+        }
+    }
+    for (const txiter& removedIt : setRemoved) {
+        if (!setJoined.count(&GetCluster(removedIt))) continue;
+        nCount--;
+        nSize -= removedIt->GetTxSize();
+    }
+    if (nCount > limitClusterCount) {
+        errString = strprintf("too many transactions in cluster [limit: %u]", limitClusterCount);
+        return false;
+    }
+    if (nSize > limitClusterSize) {
+        errString = strprintf("exceeds cluster size limit [limit: %u]", limitClusterSize);
+        return false;
+    }
+    return true;
+}
+
 void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, setEntries &setAncestors)
 {
     setEntries parentIters = GetMemPoolParents(it);
@@ -328,8 +400,19 @@ void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee,
     assert(int(nSigOpCostWithAncestors) >= 0);
 }
 
+// Clusters up to this size are linearized anew whenever they change. Larger
+// ones keep the order they were given, which is only split into chunks again.
+// At most 64, as the ancestors of a transaction are kept in a 64 bit mask.
+static const size_t MAX_CLUSTER_RELINEARIZE_SIZE = 64;
+
+static size_t ClusterUsage(const CTxMemPool::Cluster& cluster)
+{
+    return memusage::MallocUsage(sizeof(CTxMemPool::Cluster)) + memusage::MallocUsage(sizeof(memusage::stl_shared_counter)) +
+           memusage::DynamicUsage(cluster.vTxs) + memusage::DynamicUsage(cluster.vChunks);
+}
+
 CTxMemPool::CTxMemPool(CBlockPolicyEstimator* estimator) :
-    nTransactionsUpdated(0), minerPolicyEstimator(estimator)
+    nTransactionsUpdated(0), minerPolicyEstimator(estimator), m_epoch(0), m_has_epoch_guard(false)
 {
     _clear(); //lock free clear
 
@@ -406,6 +489,19 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     UpdateAncestorsOf(true, newit, setAncestors);
     UpdateEntryForAncestors(newit, setAncestors);
 
+    // Join the clusters of the in-mempool parents and append this transaction
+    std::vector<ClusterRef> vClusters;
+    for (const txiter& pit : GetMemPoolParents(newit)) {
+        const ClusterRef& cluster = mapLinks[pit].cluster;
+        if (std::find(vClusters.begin(), vClusters.end(), cluster) == vClusters.end()) {
+            vClusters.push_back(cluster);
+        }
+    }
+    ClusterRef cluster = MergeClusters(vClusters);
+    cluster->vTxs.push_back(newit);
+    mapLinks[newit].cluster = cluster;
+    UpdateCluster(cluster);
+
     nTransactionsUpdated++;
     totalTxSize += entry.GetTxSize();
     if (minerPolicyEstimator) {minerPolicyEstimator->processTransaction(entry, validFeeEstimate);}
@@ -449,27 +545,43 @@ void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
 // can save time by not iterating over those entries.
 void CTxMemPool::CalculateDescendants(txiter entryit, setEntries &setDescendants)
 {
-    setEntries stage;
+    const EpochGuard guard(*this);
+    std::vector<txiter> stage;
     if (setDescendants.count(entryit) == 0) {
-        stage.insert(entryit);
+        visited(entryit);
+        stage.push_back(entryit);
     }
     // Traverse down the children of entry, only adding children that are not
     // accounted for in setDescendants already (because those children have either
     // already been walked, or will be walked in this iteration).
     while (!stage.empty()) {
-        txiter it = *stage.begin();
+        txiter it = stage.back();
+        stage.pop_back();
         setDescendants.insert(it);
-        stage.erase(it);
 
         const setEntries &setChildren = GetMemPoolChildren(it);
         for (const txiter &childiter : setChildren) {
-            if (!setDescendants.count(childiter)) {
-                stage.insert(childiter);
+            if (!visited(childiter) && !setDescendants.count(childiter)) {
+                stage.push_back(childiter);
             }
         }
     }
 }
 
+CTxMemPool::EpochGuard::EpochGuard(const CTxMemPool& in) : pool(in)
+{
+    assert(!pool.m_has_epoch_guard);
+    ++pool.m_epoch;
+    pool.m_has_epoch_guard = true;
+}
+
+CTxMemPool::EpochGuard::~EpochGuard()
+{
+    // prevents stale results being used
+    ++pool.m_epoch;
+    pool.m_has_epoch_guard = false;
+}
+
 void CTxMemPool::removeRecursive(const CTransaction &origTx, MemPoolRemovalReason reason)
 {
     // Remove transaction from memory pool
@@ -590,6 +702,7 @@ void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigne
 
 void CTxMemPool::_clear()
 {
+    setClusters.clear();
     mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
@@ -734,6 +847,40 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
         assert(&tx == it->second);
     }
 
+    // Every transaction is in one cluster, after its in-mempool parents, and
+    // the chunks of each cluster don't increase in feerate.
+    size_t nClusterTxs = 0;
+    {
+        const EpochGuard guard(*this);
+        for (const Cluster* cluster : setClusters) {
+            assert(cluster->fIndexed);
+            assert(cluster->nUsage == ClusterUsage(*cluster));
+            innerUsage += cluster->nUsage;
+            assert(!cluster->vChunks.empty() && cluster->vChunks.back().nEnd == cluster->vTxs.size());
+            for (size_t i = 0; i < cluster->vChunks.size(); ++i) {
+                const ClusterChunk& chunk = cluster->vChunks[i];
+                CAmount nFees = 0;
+                int64_t nSize = 0;
+                for (size_t j = cluster->ChunkBegin(i); j < chunk.nEnd; ++j) {
+                    txiter it = cluster->vTxs[j];
+                    nFees += it->GetModifiedFee();
+                    nSize += it->GetTxSize();
+                    assert(mapLinks.find(it)->second.cluster.get() == cluster);
+                    for (const txiter& parent : GetMemPoolParents(it)) {
+                        bool fParentBefore = visited(parent);
+                        assert(fParentBefore);
+                    }
+                    bool fDuplicate = visited(it);
+                    assert(!fDuplicate);
+                }
+                assert(chunk.nModFees == nFees && chunk.nSize == nSize);
+                assert(i == 0 || !chunk.HigherFeeRate(cluster->vChunks[i - 1]));
+            }
+            nClusterTxs += cluster->vTxs.size();
+        }
+    }
+    assert(nClusterTxs == mapTx.size());
+
     assert(totalTxSize == checkTotal);
     assert(innerUsage == cachedInnerUsage);
 }
@@ -856,7 +1003,12 @@ void CTxMemPool::PrioritiseTransaction(const uint256& hash, const CAmount& nFeeD
             for (txiter descendantIt : setDescendants) {
                 mapTx.modify(descendantIt, update_ancestor_state(0, nFeeDelta, 0, 0));
             }
+            // The cluster's linearization may no longer be the best one
+            ClusterRef cluster = mapLinks[it].cluster;
+            UnindexCluster(*cluster);
+            UpdateCluster(cluster);
             ++nTransactionsUpdated;
+            NotifyEntryPrioritised(hash);
         }
     }
     LogPrintf("PrioritiseTransaction: %s feerate += %s\n", hash.ToString(), FormatMoney(nFeeDelta));
@@ -907,15 +1059,175 @@ bool CCoinsViewMemPool::GetCoin(const COutPoint &outpoint, Coin &coin) const {
 size_t CTxMemPool::DynamicMemoryUsage() const {
     LOCK(cs);
     // Estimate the overhead of mapTx to be 12 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + memusage::DynamicUsage(setClusters) + cachedInnerUsage;
 }
 
 void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants, MemPoolRemovalReason reason) {
     AssertLockHeld(cs);
     UpdateForRemoveFromMempool(stage, updateDescendants);
+    // Keep what is left of the clusters the transactions are removed from
+    std::vector<std::vector<txiter>> vRemaining;
+    for (const txiter& it : stage) {
+        Cluster& cluster = *mapLinks[it].cluster;
+        // Already taken out for another transaction of the cluster
+        if (!cluster.fIndexed) continue;
+        UnindexCluster(cluster);
+        vRemaining.emplace_back();
+        for (const txiter& clusterit : cluster.vTxs) {
+            if (!stage.count(clusterit)) {
+                vRemaining.back().push_back(clusterit);
+            }
+        }
+    }
     for (const txiter& it : stage) {
         removeUnchecked(it, reason);
     }
+    for (const std::vector<txiter>& vTxs : vRemaining) {
+        SplitCluster(vTxs);
+    }
+}
+
+void CTxMemPool::UpdateCluster(const ClusterRef& cluster)
+{
+    assert(!cluster->fIndexed && !cluster->vTxs.empty());
+    std::vector<txiter>& vTxs = cluster->vTxs;
+
+    if (vTxs.size() > 1 && vTxs.size() <= MAX_CLUSTER_RELINEARIZE_SIZE) {
+        // The transactions come in an order valid for a block, so the
+        // ancestors of each, as a mask of positions, follow from those of its
+        // parents.
+        const size_t nTxs = vTxs.size();
+        std::map<txiter, size_t, CompareIteratorByHash> mapPosition;
+        for (size_t i = 0; i < nTxs; ++i) {
+            mapPosition.emplace(vTxs[i], i);
+        }
+        std::vector<uint64_t> vAncestors(nTxs);
+        for (size_t i = 0; i < nTxs; ++i) {
+            vAncestors[i] = uint64_t{1} << i;
+            for (const txiter& parent : GetMemPoolParents(vTxs[i])) {
+                size_t pos = mapPosition.at(parent);
+                assert(pos < i);
+                vAncestors[i] |= vAncestors[pos];
+            }
+        }
+        // Fees and sizes of each transaction with its ancestors not picked yet
+        std::vector<CAmount> vFees(nTxs, 0);
+        std::vector<int64_t> vSizes(nTxs, 0);
+        for (size_t i = 0; i < nTxs; ++i) {
+            for (size_t j = 0; j <= i; ++j) {
+                if ((vAncestors[i] >> j) & 1) {
+                    vFees[i] += vTxs[j]->GetModifiedFee();
+                    vSizes[i] += vTxs[j]->GetTxSize();
+                }
+            }
+        }
+
+        // Repeatedly pick the transaction with the highest feerate including
+        // its ancestors that are not picked yet, and append those.
+        std::vector<txiter> vLinearized;
+        vLinearized.reserve(nTxs);
+        uint64_t nRemaining = nTxs == 64 ? ~uint64_t{0} : (uint64_t{1} << nTxs) - 1;
+        while (nRemaining) {
+            size_t best = nTxs;
+            for (size_t i = 0; i < nTxs; ++i) {
+                if (!((nRemaining >> i) & 1)) continue;
+                if (best == nTxs || double(vFees[i]) * vSizes[best] > double(vFees[best]) * vSizes[i]) {
+                    best = i;
+                }
+            }
+            const uint64_t nPackage = vAncestors[best] & nRemaining;
+            for (size_t i = 0; i < nTxs; ++i) {
+                if (!((nPackage >> i) & 1)) continue;
+                vLinearized.push_back(vTxs[i]);
+                for (size_t j = i + 1; j < nTxs; ++j) {
+                    if ((vAncestors[j] >> i) & 1) {
+                        vFees[j] -= vTxs[i]->GetModifiedFee();
+                        vSizes[j] -= vTxs[i]->GetTxSize();
+                    }
+                }
+            }
+            nRemaining &= ~nPackage;
+        }
+        vTxs.swap(vLinearized);
+    }
+
+    // Each transaction starts a chunk, which absorbs the chunks before it
+    // while it pays a higher feerate than them.
+    cluster->vChunks.clear();
+    for (size_t i = 0; i < vTxs.size(); ++i) {
+        ClusterChunk chunk{i + 1, vTxs[i]->GetModifiedFee(), (int64_t)vTxs[i]->GetTxSize(), vTxs[i]->GetSigOpCost()};
+        while (!cluster->vChunks.empty() && chunk.HigherFeeRate(cluster->vChunks.back())) {
+            chunk.nModFees += cluster->vChunks.back().nModFees;
+            chunk.nSize += cluster->vChunks.back().nSize;
+            chunk.nSigOpCost += cluster->vChunks.back().nSigOpCost;
+            cluster->vChunks.pop_back();
+        }
+        cluster->vChunks.push_back(chunk);
+    }
+
+    cluster->nUsage = ClusterUsage(*cluster);
+    cachedInnerUsage += cluster->nUsage;
+    setClusters.insert(cluster.get());
+    cluster->fIndexed = true;
+}
+
+void CTxMemPool::UnindexCluster(Cluster& cluster)
+{
+    if (!cluster.fIndexed) return;
+    setClusters.erase(&cluster);
+    cachedInnerUsage -= cluster.nUsage;
+    cluster.fIndexed = false;
+}
+
+CTxMemPool::ClusterRef CTxMemPool::MergeClusters(const std::vector<ClusterRef>& vClusters)
+{
+    if (vClusters.size() == 1) {
+        UnindexCluster(*vClusters[0]);
+        return vClusters[0];
+    }
+    ClusterRef merged = std::make_shared<Cluster>();
+    for (const ClusterRef& cluster : vClusters) {
+        UnindexCluster(*cluster);
+        for (const txiter& it : cluster->vTxs) {
+            merged->vTxs.push_back(it);
+            mapLinks[it].cluster = merged;
+        }
+        cluster->vTxs.clear();
+    }
+    return merged;
+}
+
+void CTxMemPool::SplitCluster(const std::vector<txiter>& vRemaining)
+{
+    for (const txiter& it : vRemaining) {
+        mapLinks[it].cluster.reset();
+    }
+    std::vector<ClusterRef> vClusters;
+    std::vector<txiter> stage;
+    auto assign = [&](const txiter& it) {
+        ClusterRef& cluster = mapLinks[it].cluster;
+        if (!cluster) {
+            cluster = vClusters.back();
+            stage.push_back(it);
+        }
+    };
+    for (const txiter& it : vRemaining) {
+        if (!mapLinks[it].cluster) {
+            // Start a new cluster with everything still connected to this transaction
+            vClusters.push_back(std::make_shared<Cluster>());
+            assign(it);
+            while (!stage.empty()) {
+                const TxLinks& links = mapLinks[stage.back()];
+                stage.pop_back();
+                for (const txiter& parent : links.parents) assign(parent);
+                for (const txiter& child : links.children) assign(child);
+            }
+        }
+        mapLinks[it].cluster->vTxs.push_back(it);
+    }
+    for (const ClusterRef& cluster : vClusters) {
+        UpdateCluster(cluster);
+    }
 }
 
 int CTxMemPool::Expire(int64_t time) {
@@ -972,6 +1284,14 @@ const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
     return it->second.parents;
 }
 
+const CTxMemPool::Cluster& CTxMemPool::GetCluster(txiter entry) const
+{
+    assert (entry != mapTx.end());
+    txlinksMap::const_iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    return *it->second.cluster;
+}
+
 const CTxMemPool::setEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
 {
     assert (entry != mapTx.end());
@@ -1018,19 +1338,23 @@ void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpends
     unsigned nTxnRemoved = 0;
     CFeeRate maxFeeRateRemoved(0);
     while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
-        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+        // Evict the chunk paying the lowest feerate among the last chunks of
+        // all clusters, which are the ones that would be mined last. All
+        // in-mempool descendants of its transactions come after them in the
+        // cluster's linearization, so they are part of the chunk.
+        const Cluster& cluster = **setClusters.begin();
+        const ClusterChunk& chunk = cluster.vChunks.back();
 
         // We set the new mempool min fee to the feerate of the removed set, plus the
         // "minimum reasonable fee rate" (ie some value under which we consider txn
         // to have 0 fee). This way, we don't allow txn to enter mempool with feerate
         // equal to txn which were removed with no block in between.
-        CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
+        CFeeRate removed(chunk.nModFees, chunk.nSize);
         removed += incrementalRelayFee;
         trackPackageRemoved(removed);
         maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
 
-        setEntries stage;
-        CalculateDescendants(mapTx.project<0>(it), stage);
+        setEntries stage(cluster.vTxs.begin() + cluster.ChunkBegin(cluster.vChunks.size() - 1), cluster.vTxs.end());
         nTxnRemoved += stage.size();
 
         std::vector<CTransaction> txn;
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
+#include <algorithm>
 #include <memory>
 #include <set>
 #include <map>
@@ -128,6 +129,7 @@ public:
     int64_t GetSigOpCostWithAncestors() const { return nSigOpCostWithAncestors; }
 
     mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable uint64_t m_epoch; //!< Epoch in which a graph traversal last visited the entry, see CTxMemPool::EpochGuard
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -498,12 +500,56 @@ public:
 
     const setEntries & GetMemPoolParents(txiter entry) const;
     const setEntries & GetMemPoolChildren(txiter entry) const;
+
+    /** A run of transactions in a cluster's linearization that are mined or evicted together */
+    struct ClusterChunk {
+        size_t nEnd; //!< Position in the linearization after the chunk's last transaction
+        CAmount nModFees;
+        int64_t nSize;
+        int64_t nSigOpCost;
+
+        bool HigherFeeRate(const ClusterChunk& other) const
+        {
+            return double(nModFees) * other.nSize > double(other.nModFees) * nSize;
+        }
+    };
+
+    /**
+     * A connected component of the mempool's transaction graph. Its
+     * transactions are kept in a linearization, an order in which every
+     * transaction follows its in-mempool ancestors, which is split into chunks
+     * of non-increasing feerate. Mining takes a cluster's chunks from the
+     * front, and eviction removes them from the back.
+     */
+    struct Cluster {
+        std::vector<txiter> vTxs;
+        std::vector<ClusterChunk> vChunks;
+        bool fIndexed = false; //!< Whether the cluster is in setClusters
+        size_t nUsage = 0; //!< Memory usage counted in cachedInnerUsage while indexed
+
+        size_t ChunkBegin(size_t nChunk) const { return nChunk == 0 ? 0 : vChunks[nChunk - 1].nEnd; }
+    };
+    typedef std::shared_ptr<Cluster> ClusterRef;
+
+    struct CompareClusterByWorstChunk {
+        bool operator()(const Cluster* a, const Cluster* b) const {
+            if (b->vChunks.back().HigherFeeRate(a->vChunks.back())) return true;
+            if (a->vChunks.back().HigherFeeRate(b->vChunks.back())) return false;
+            return a < b;
+        }
+    };
+    typedef std::set<const Cluster*, CompareClusterByWorstChunk> clusterSet;
+
+    /** All clusters, starting with the one whose last chunk pays the lowest feerate */
+    const clusterSet& GetClusters() const { AssertLockHeld(cs); return setClusters; }
+    const Cluster& GetCluster(txiter entry) const;
 private:
-    typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
+    typedef std::map<txiter, std::vector<txiter>, CompareIteratorByHash> cacheMap;
 
     struct TxLinks {
         setEntries parents;
         setEntries children;
+        ClusterRef cluster;
     };
 
     typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
@@ -512,6 +558,11 @@ private:
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
 
+    clusterSet setClusters;
+
+    mutable uint64_t m_epoch;
+    mutable bool m_has_epoch_guard;
+
     std::vector<indexed_transaction_set::const_iterator> GetSortedDepthAndScore() const;
 
 public:
@@ -597,6 +648,16 @@ public:
      */
     bool CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents = true) const;
 
+    /** Check the cluster a new transaction would form with the clusters of
+     *  its in-mempool ancestors, as calculated by CalculateMemPoolAncestors().
+     *  setRemoved = in-mempool transactions removed before it is added, such
+     *    as the ones it replaces; they don't count towards the limits
+     *  limitClusterCount = max number of transactions in the cluster
+     *  limitClusterSize = max size of the transactions in the cluster
+     *  errString = populated with error reason if any limits are hit
+     */
+    bool CheckClusterLimits(const setEntries &setAncestors, const setEntries &setRemoved, int64_t nTxSize, uint64_t limitClusterCount, uint64_t limitClusterSize, std::string &errString) const;
+
     /** Populate setDescendants with all in-mempool descendants of hash.
      *  Assumes that setDescendants includes all in-mempool descendants of anything
      *  already in it.  */
@@ -648,6 +709,30 @@ public:
 
     boost::signals2::signal<void (CTransactionRef)> NotifyEntryAdded;
     boost::signals2::signal<void (CTransactionRef, MemPoolRemovalReason)> NotifyEntryRemoved;
+    boost::signals2::signal<void (const uint256&)> NotifyEntryPrioritised;
+
+    /**
+     * Starts a new epoch for a walk of the transaction graph, in which
+     * visited() marks entries in place instead of the walk collecting them in
+     * a set. Only one guard may exist at a time, and cs must be held while it
+     * does.
+     */
+    class EpochGuard
+    {
+        const CTxMemPool& pool;
+    public:
+        explicit EpochGuard(const CTxMemPool& in);
+        ~EpochGuard();
+    };
+
+    /** Mark an entry as visited in the current epoch. Returns whether it already was. */
+    bool visited(txiter it) const
+    {
+        assert(m_has_epoch_guard);
+        bool ret = it->m_epoch >= m_epoch;
+        it->m_epoch = std::max(it->m_epoch, m_epoch);
+        return ret;
+    }
 
 private:
     /** UpdateForDescendants is used by UpdateTransactionsFromBlock to update
@@ -677,6 +762,17 @@ private:
     /** Sever link between specified transaction and direct children. */
     void UpdateChildrenForRemoval(txiter entry);
 
+    /** Linearize a cluster that is not indexed and split it into chunks, then index it */
+    void UpdateCluster(const ClusterRef& cluster);
+    /** Take a cluster out of setClusters, before it is changed */
+    void UnindexCluster(Cluster& cluster);
+    /** Join clusters that have become connected into a new cluster, keeping
+     *  their transactions in the given order, which is not indexed yet */
+    ClusterRef MergeClusters(const std::vector<ClusterRef>& vClusters);
+    /** Assign what is left of a cluster after removals, in linearization
+     *  order, to new clusters for the connected components it now forms */
+    void SplitCluster(const std::vector<txiter>& vRemaining);
+
     /** Before calling removeUnchecked for a given transaction,
      *  UpdateForRemoveFromMempool must be called on the entire (dependent) set
      *  of transactions being removed at the same time.  We use each
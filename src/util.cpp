@@ -32,6 +32,7 @@
 
 #include <algorithm>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
 
@@ -817,6 +818,55 @@ void AllocateFileRange(FILE *file, unsigned int offset, unsigned int length) {
 #endif
 }
 
+std::unique_ptr<const MappedFile> MappedFile::Open(const fs::path& path)
+{
+#ifdef WIN32
+    HANDLE hFile = CreateFileW(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return nullptr;
+    LARGE_INTEGER nFileSize;
+    if (!GetFileSizeEx(hFile, &nFileSize) || nFileSize.QuadPart <= 0 || (uint64_t)nFileSize.QuadPart > std::numeric_limits<size_t>::max()) {
+        CloseHandle(hFile);
+        return nullptr;
+    }
+    HANDLE hMapping = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(hFile);
+    if (!hMapping)
+        return nullptr;
+    // The view keeps the mapping and the file open
+    void* addr = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hMapping);
+    if (!addr)
+        return nullptr;
+    return std::unique_ptr<const MappedFile>(new MappedFile(static_cast<const unsigned char*>(addr), nFileSize.QuadPart));
+#else
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || (uint64_t)st.st_size > std::numeric_limits<size_t>::max()) {
+        close(fd);
+        return nullptr;
+    }
+    // The mapping keeps the file open
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return nullptr;
+    return std::unique_ptr<const MappedFile>(new MappedFile(static_cast<const unsigned char*>(addr), st.st_size));
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef WIN32
+    UnmapViewOfFile(m_data);
+#else
+    munmap(const_cast<unsigned char*>(m_data), m_size);
+#endif
+}
+
 void ShrinkDebugFile()
 {
     // Amount of debug.log to save at end when shrinking (must fit in memory)
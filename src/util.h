@@ -23,6 +23,7 @@
 #include <atomic>
 #include <exception>
 #include <map>
+#include <memory>
 #include <stdint.h>
 #include <string>
 #include <vector>
@@ -172,6 +173,31 @@ void FileCommit(FILE *file);
 bool TruncateFile(FILE *file, unsigned int length);
 int RaiseFileDescriptorLimit(int nMinFD);
 void AllocateFileRange(FILE *file, unsigned int offset, unsigned int length);
+
+/**
+ * A read-only mapping of a whole file into memory. The file may grow while it
+ * is mapped, but must not be truncated below the mapped size.
+ */
+class MappedFile
+{
+private:
+    const unsigned char* const m_data;
+    const size_t m_size;
+
+    MappedFile(const unsigned char* data, size_t size) : m_data(data), m_size(size) {}
+
+public:
+    /** Map the file at path, or return nullptr if it can't be opened or mapped */
+    static std::unique_ptr<const MappedFile> Open(const fs::path& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const unsigned char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+};
+
 bool RenameOver(fs::path src, fs::path dest);
 bool LockDirectory(const fs::path& directory, const std::string lockfile_name, bool probe_only=false);
 
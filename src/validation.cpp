@@ -14,8 +14,10 @@
 #include <consensus/merkle.h>
 #include <consensus/tx_verify.h>
 #include <consensus/validation.h>
+#include <crypto/common.h>
 #include <cuckoocache.h>
 #include <hash.h>
+#include <index/txindex.h>
 #include <init.h>
 #include <policy/fees.h>
 #include <policy/policy.h>
@@ -28,6 +30,7 @@
 #include <script/script.h>
 #include <script/sigcache.h>
 #include <script/standard.h>
+#include <snapshot.h>
 #include <timedata.h>
 #include <tinyformat.h>
 #include <txdb.h>
@@ -40,7 +43,10 @@
 #include <validationinterface.h>
 #include <warnings.h>
 
+#include <atomic>
+#include <deque>
 #include <future>
+#include <limits>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
@@ -144,6 +150,13 @@ private:
       */
     std::set<CBlockIndex*> g_failed_blocks;
 
+    /**
+     * Serializes calls to ActivateBestChain, so that concurrent callers
+     * (e.g. several message handler threads) can't interleave tip updates
+     * and deliver UpdatedBlockTip notifications out of order.
+     */
+    CCriticalSection m_cs_chainstate;
+
 public:
     CChain chainActive;
     BlockMap mapBlockIndex;
@@ -172,6 +185,7 @@ public:
 
     bool ReplayBlocks(const CChainParams& params, CCoinsView* view);
     bool RewindBlockIndex(const CChainParams& params);
+    bool LoadUTXOSnapshot(const fs::path& path, const CChainParams& chainparams, std::string& error);
     bool LoadGenesisBlock(const CChainParams& chainparams);
 
     void PruneBlockIndexCandidates();
@@ -207,14 +221,24 @@ CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
 std::atomic_bool fImporting(false);
 std::atomic_bool fReindex(false);
-bool fTxIndex = false;
 bool fHavePruned = false;
 bool fPruneMode = false;
 bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
 bool fRequireStandard = true;
 bool fCheckBlockIndex = false;
 bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED;
+bool fBlockMmap = DEFAULT_BLOCK_MMAP;
 size_t nCoinCacheUsage = 5000 * 300;
+CoinsWriteStats g_coins_write_stats;
+ValidationCacheUsage g_validation_cache_usage;
+
+/**
+ * The tip at the last incremental write of the coins cache, while the
+ * chainstate database is only partially written. Everything written since it
+ * was last consistent is on the path to this block, which is what allows
+ * ReplayBlocks() to recover after a crash; see DisconnectTip().
+ */
+static const CBlockIndex* pindexCoinsPartialWrite = nullptr;
 uint64_t nPruneTarget = 0;
 int64_t nMaxTipAge = DEFAULT_MAX_TIP_AGE;
 bool fEnableReplacement = DEFAULT_ENABLE_REPLACEMENT;
@@ -540,6 +564,43 @@ static bool CheckInputsFromMempoolAndCache(const CTransaction& tx, CValidationSt
     return CheckInputs(tx, state, view, true, flags, cacheSigStore, true, txdata);
 }
 
+/** Script verification flags transactions entering the mempool are checked with */
+static unsigned int GetMempoolScriptFlags(const CChainParams& chainparams)
+{
+    unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS;
+    if (!chainparams.RequireStandard()) {
+        flags = gArgs.GetArg("-promiscuousmempoolflags", flags);
+    }
+    return flags;
+}
+
+//! Maximum number of script failures PreVerifyTransactions() keeps for AcceptToMemoryPool
+static const size_t MAX_PREVERIFY_FAILURES = 100;
+/**
+ * How AcceptToMemoryPool is to reject transactions whose scripts
+ * PreVerifyTransactions() found to be invalid, by witness hash, together with
+ * the script verification flags they were checked with. Protected by cs_main.
+ */
+static std::map<uint256, std::pair<unsigned int, CValidationState>> mapPreVerifyFailures;
+
+/**
+ * If PreVerifyTransactions() found tx's scripts to be invalid with flags, set
+ * state to the rejection AcceptToMemoryPool would have found and return true.
+ */
+static bool TakePreVerifyFailure(const CTransaction& tx, unsigned int flags, CValidationState& state)
+{
+    AssertLockHeld(cs_main);
+    auto it = mapPreVerifyFailures.find(tx.GetWitnessHash());
+    if (it == mapPreVerifyFailures.end())
+        return false;
+    bool fFound = it->second.first == flags;
+    if (fFound) {
+        state = it->second.second;
+    }
+    mapPreVerifyFailures.erase(it);
+    return fFound;
+}
+
 static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx,
                               bool* pfMissingInputs, int64_t nAcceptTime, std::list<CTransactionRef>* plTxnReplaced,
                               bool bypass_limits, const CAmount& nAbsurdFee, std::vector<COutPoint>& coins_to_uncache)
@@ -879,13 +940,24 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
             }
         }
 
-        unsigned int scriptVerifyFlags = STANDARD_SCRIPT_VERIFY_FLAGS;
-        if (!chainparams.RequireStandard()) {
-            scriptVerifyFlags = gArgs.GetArg("-promiscuousmempoolflags", scriptVerifyFlags);
+        // Bound the clusters, as mining and removing transactions for a block
+        // take time that grows with the size of their clusters. The
+        // transactions this one replaces leave the clusters it joins.
+        size_t nLimitClusterCount = gArgs.GetArg("-limitclustercount", DEFAULT_CLUSTER_LIMIT);
+        size_t nLimitClusterSize = gArgs.GetArg("-limitclustersize", DEFAULT_CLUSTER_SIZE_LIMIT)*1000;
+        if (!pool.CheckClusterLimits(setAncestors, allConflicting, entry.GetTxSize(), nLimitClusterCount, nLimitClusterSize, errString)) {
+            return state.DoS(0, false, REJECT_NONSTANDARD, "too-large-cluster", false, errString);
         }
 
+        unsigned int scriptVerifyFlags = GetMempoolScriptFlags(chainparams);
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
+        // PreVerifyTransactions() already found out how to reject transactions
+        // with invalid scripts.
+        if (TakePreVerifyFailure(tx, scriptVerifyFlags, state)) {
+            return false;
+        }
         PrecomputedTransactionData txdata(tx);
         if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true, false, txdata)) {
             // SCRIPT_VERIFY_CLEANSTACK requires SCRIPT_VERIFY_WITNESS, so we
@@ -965,6 +1037,7 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         }
     }
 
+    g_validation_cache_usage.mempool_accepts++;
     GetMainSignals().TransactionAddedToMempool(ptx);
 
     return true;
@@ -1012,28 +1085,8 @@ bool GetTransaction(const uint256& hash, CTransactionRef& txOut, const Consensus
             return true;
         }
 
-        if (fTxIndex) {
-            CDiskTxPos postx;
-            if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-                if (file.IsNull())
-                    return error("%s: OpenBlockFile failed", __func__);
-                CBlockHeader header;
-                try {
-                    file >> header;
-                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
-                } catch (const std::exception& e) {
-                    return error("%s: Deserialize or I/O error - %s", __func__, e.what());
-                }
-                hashBlock = header.GetHash();
-                if (txOut->GetHash() != hash)
-                    return error("%s: txid mismatch", __func__);
-                return true;
-            }
-
-            // transaction not found in index, nothing more can be done
-            return false;
+        if (g_txindex) {
+            return g_txindex->FindTx(hash, hashBlock, txOut);
         }
 
         if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
@@ -1089,21 +1142,317 @@ static bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMes
     return true;
 }
 
+/** Maximum number of block files kept mapped into memory with -blockmmap */
+static const size_t MAX_MAPPED_BLOCK_FILES = 1024;
+
+/**
+ * Block files mapped into memory for reading blocks with -blockmmap. Readers
+ * share the mappings, so a file is only unmapped once no block is being read
+ * from it anymore.
+ */
+class BlockFileMaps
+{
+private:
+    struct MappedBlockFile
+    {
+        std::shared_ptr<const MappedFile> file;
+        uint64_t nLastUsed;
+    };
+
+    CCriticalSection cs;
+    std::map<int, MappedBlockFile> mapFiles;
+    uint64_t nCounter = 0;
+
+public:
+    /** Return a mapping of block file nFile with at least its first nEnd bytes, or nullptr */
+    std::shared_ptr<const MappedFile> Get(int nFile, uint64_t nEnd)
+    {
+        LOCK(cs);
+        auto it = mapFiles.find(nFile);
+        if (it != mapFiles.end() && it->second.file->size() >= nEnd) {
+            it->second.nLastUsed = ++nCounter;
+            return it->second.file;
+        }
+
+        // Not mapped yet, or the file has grown since it was mapped
+        std::shared_ptr<const MappedFile> file = MappedFile::Open(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk"));
+        if (!file || file->size() < nEnd)
+            return nullptr;
+        if (it == mapFiles.end() && mapFiles.size() >= MAX_MAPPED_BLOCK_FILES) {
+            auto oldest = std::min_element(mapFiles.begin(), mapFiles.end(),
+                [](const std::pair<const int, MappedBlockFile>& a, const std::pair<const int, MappedBlockFile>& b) {
+                    return a.second.nLastUsed < b.second.nLastUsed;
+                });
+            mapFiles.erase(oldest);
+        }
+        mapFiles[nFile] = MappedBlockFile{file, ++nCounter};
+        return file;
+    }
+
+    /** Drop the mapping of a block file that is about to be truncated or deleted */
+    void Forget(int nFile)
+    {
+        LOCK(cs);
+        mapFiles.erase(nFile);
+    }
+
+    void Clear()
+    {
+        LOCK(cs);
+        mapFiles.clear();
+    }
+};
+
+static BlockFileMaps blockFileMaps;
+
+/**
+ * Find the block stored at pos in its mapped block file, and the size of the
+ * block from the header before it. Leaves file null if the block file can't
+ * be mapped, in which case it has to be read with file I/O instead.
+ */
+static bool MapBlockFromDisk(std::shared_ptr<const MappedFile>& file, unsigned int& nSize, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars* pchMessageStart)
+{
+    file.reset();
+    if (pos.IsNull() || pos.nPos < CMessageHeader::MESSAGE_START_SIZE + sizeof(nSize))
+        return error("%s: Invalid block position %s", __func__, pos.ToString());
+    std::shared_ptr<const MappedFile> mapped = blockFileMaps.Get(pos.nFile, pos.nPos);
+    if (!mapped)
+        return true;
+
+    const unsigned char* header = mapped->data() + pos.nPos - CMessageHeader::MESSAGE_START_SIZE - sizeof(nSize);
+    if (pchMessageStart && memcmp(header, *pchMessageStart, CMessageHeader::MESSAGE_START_SIZE))
+        return error("%s: Block magic mismatch at %s", __func__, pos.ToString());
+    nSize = ReadLE32(header + CMessageHeader::MESSAGE_START_SIZE);
+    if (nSize > MAX_BLOCK_SERIALIZED_SIZE)
+        return error("%s: Invalid block size %u at %s", __func__, nSize, pos.ToString());
+    if (mapped->size() - pos.nPos < nSize) {
+        mapped = blockFileMaps.Get(pos.nFile, (uint64_t)pos.nPos + nSize);
+        if (!mapped)
+            return error("%s: Block at %s extends beyond the end of its file", __func__, pos.ToString());
+    }
+    file = std::move(mapped);
+    return true;
+}
+
+/** Maximum number of new blocks queued for the block writer thread before validation waits for it */
+static const size_t MAX_BLOCK_WRITE_QUEUE = 16;
+
+namespace {
+bool AbortNode(const std::string& strMessage, const std::string& userMessage);
+} // namespace
+
+/**
+ * Writes new blocks to disk on the block writer thread, so that validating and
+ * relaying them doesn't wait for block file I/O. Positions are assigned before
+ * blocks are queued, and blocks that are still queued are read from memory.
+ * Jobs run in the order they were queued, so a finished block file is only
+ * truncated and synced after its last block was written. Without a writer
+ * thread, before it starts and after it stopped, jobs run right away on the
+ * calling thread.
+ */
+class BlockWriter
+{
+private:
+    struct Job
+    {
+        //! Position of the block data, or of the start of a finished block file
+        CDiskBlockPos pos;
+        //! The block to write, or null to truncate and sync the file to nFileSize
+        std::shared_ptr<const CBlock> block;
+        unsigned int nFileSize;
+        CMessageHeader::MessageStartChars messageStart;
+    };
+
+    boost::mutex mutex;
+    //! Signalled when a job is queued
+    boost::condition_variable condWork;
+    //! Signalled when a job is done, or the writer thread stops
+    boost::condition_variable condDone;
+    std::deque<Job> queue;
+    //! The queued blocks, by position
+    std::map<std::pair<int, unsigned int>, std::shared_ptr<const CBlock>> mapPending;
+    //! Whether the writer thread is running, and whether it is running a job
+    bool fRunning = false;
+    bool fBusy = false;
+    bool fFailed = false;
+
+    static std::pair<int, unsigned int> Key(const CDiskBlockPos& pos)
+    {
+        return std::make_pair(pos.nFile, pos.nPos);
+    }
+
+    static bool Run(const Job& job)
+    {
+        if (job.block) {
+            CDiskBlockPos pos(job.pos.nFile, job.pos.nPos - CMessageHeader::MESSAGE_START_SIZE - sizeof(unsigned int));
+            if (!WriteBlockToDisk(*job.block, pos, job.messageStart))
+                return false;
+            if (pos != job.pos)
+                return error("%s: Block written to %s instead of %s", __func__, pos.ToString(), job.pos.ToString());
+            return true;
+        }
+
+        blockFileMaps.Forget(job.pos.nFile);
+        FILE* file = OpenBlockFile(job.pos);
+        if (file) {
+            TruncateFile(file, job.nFileSize);
+            FileCommit(file);
+            fclose(file);
+        }
+        return true;
+    }
+
+    /** Queue a job, or run it right away if there is no writer thread */
+    bool Add(Job&& job)
+    {
+        {
+            boost::this_thread::disable_interruption no_interrupt;
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (fRunning && queue.size() >= MAX_BLOCK_WRITE_QUEUE)
+                condDone.wait(lock);
+            if (fRunning) {
+                if (job.block)
+                    mapPending[Key(job.pos)] = job.block;
+                queue.push_back(std::move(job));
+                condWork.notify_one();
+                return true;
+            }
+        }
+        return Run(job);
+    }
+
+    /** Run the job at the front of the queue, with the lock held when called */
+    void RunFront(boost::unique_lock<boost::mutex>& lock)
+    {
+        Job job = std::move(queue.front());
+        queue.pop_front();
+        fBusy = true;
+        lock.unlock();
+        bool fOk = Run(job);
+        if (!fOk)
+            AbortNode(job.block ? "Failed to write block" : "Failed to flush block file", "");
+        lock.lock();
+        if (job.block)
+            mapPending.erase(Key(job.pos));
+        if (!fOk)
+            fFailed = true;
+        fBusy = false;
+        condDone.notify_all();
+    }
+
+public:
+    /** Write block to the block file position pos, which its header precedes */
+    bool Write(const CDiskBlockPos& pos, const std::shared_ptr<const CBlock>& block, const CMessageHeader::MessageStartChars& messageStart)
+    {
+        Job job{pos, block, 0, {}};
+        memcpy(job.messageStart, messageStart, sizeof(job.messageStart));
+        return Add(std::move(job));
+    }
+
+    /** Truncate block file nFile to nSize and sync it, once the blocks queued for it are written */
+    bool Finalize(int nFile, unsigned int nSize)
+    {
+        return Add(Job{CDiskBlockPos(nFile, 0), nullptr, nSize, {}});
+    }
+
+    /** Wait until everything queued so far is on disk. Returns false if any write failed. */
+    bool Flush()
+    {
+        boost::this_thread::disable_interruption no_interrupt;
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (fRunning && (fBusy || !queue.empty()))
+            condDone.wait(lock);
+        return !fFailed;
+    }
+
+    /** Wait until the block at pos is on disk, if it is queued */
+    void Wait(const CDiskBlockPos& pos)
+    {
+        boost::this_thread::disable_interruption no_interrupt;
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (fRunning && mapPending.count(Key(pos)))
+            condDone.wait(lock);
+    }
+
+    /** Return the block at pos if it is queued, or nullptr */
+    std::shared_ptr<const CBlock> GetPending(const CDiskBlockPos& pos)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        auto it = mapPending.find(Key(pos));
+        return it == mapPending.end() ? nullptr : it->second;
+    }
+
+    void Thread()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fRunning = true;
+        try {
+            while (true) {
+                while (queue.empty())
+                    condWork.wait(lock);
+                RunFront(lock);
+            }
+        } catch (const boost::thread_interrupted&) {
+            // Finish the queue, after which jobs run on the threads adding them
+            boost::this_thread::disable_interruption no_interrupt;
+            while (!queue.empty())
+                RunFront(lock);
+            fRunning = false;
+            condDone.notify_all();
+            throw;
+        }
+    }
+};
+
+static BlockWriter blockWriter;
+
+void ThreadBlockWriter()
+{
+    RenameThread("bitcoin-blkwrite");
+    blockWriter.Thread();
+}
+
+void WaitForBlockWrite(const CDiskBlockPos& pos)
+{
+    blockWriter.Wait(pos);
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
-
-    // Read block
-    try {
-        filein >> block;
+    std::shared_ptr<const CBlock> pending = blockWriter.GetPending(pos);
+    if (pending) {
+        block = *pending;
+        return true;
     }
-    catch (const std::exception& e) {
-        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+
+    std::shared_ptr<const MappedFile> file;
+    unsigned int nSize = 0;
+    if (fBlockMmap && !MapBlockFromDisk(file, nSize, pos, nullptr))
+        return false;
+
+    if (file) {
+        // Deserialize straight from the mapped file
+        try {
+            SpanReader(SER_DISK, CLIENT_VERSION, file->data() + pos.nPos, nSize) >> block;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize error - %s at %s", __func__, e.what(), pos.ToString());
+        }
+    } else {
+        // Open history file to read
+        CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+
+        // Read block
+        try {
+            filein >> block;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        }
     }
 
     // Check the header
@@ -1129,6 +1478,62 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
     return true;
 }
 
+bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& message_start)
+{
+    block.clear();
+
+    std::shared_ptr<const CBlock> pending = blockWriter.GetPending(pos);
+    if (pending) {
+        CVectorWriter(SER_DISK, CLIENT_VERSION, block, 0, *pending);
+        return true;
+    }
+
+    std::shared_ptr<const MappedFile> file;
+    unsigned int nSize = 0;
+    if (fBlockMmap && !MapBlockFromDisk(file, nSize, pos, &message_start))
+        return false;
+
+    if (file) {
+        block.assign(file->data() + pos.nPos, file->data() + pos.nPos + nSize);
+        return true;
+    }
+
+    if (pos.IsNull() || pos.nPos < CMessageHeader::MESSAGE_START_SIZE + sizeof(nSize))
+        return error("%s: Invalid block position %s", __func__, pos.ToString());
+    CDiskBlockPos posHeader(pos.nFile, pos.nPos - CMessageHeader::MESSAGE_START_SIZE - sizeof(nSize));
+    CAutoFile filein(OpenBlockFile(posHeader, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+
+    try {
+        CMessageHeader::MessageStartChars blk_start;
+        filein >> FLATDATA(blk_start) >> nSize;
+        if (memcmp(blk_start, message_start, CMessageHeader::MESSAGE_START_SIZE))
+            return error("%s: Block magic mismatch at %s", __func__, pos.ToString());
+        if (nSize > MAX_BLOCK_SERIALIZED_SIZE)
+            return error("%s: Invalid block size %u at %s", __func__, nSize, pos.ToString());
+        block.resize(nSize);
+        filein.read((char*)block.data(), nSize);
+    }
+    catch (const std::exception& e) {
+        return error("%s: Read error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+    return true;
+}
+
+bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CDiskBlockPos& pos, const uint256& hash, const CMessageHeader::MessageStartChars& message_start)
+{
+    if (!ReadRawBlockFromDisk(block, pos, message_start))
+        return false;
+    // The block hash only covers the 80-byte header, which comes first
+    static const size_t nHeaderSize = 80;
+    if (block.size() < nHeaderSize)
+        return error("%s: Block at %s is too short for its header", __func__, pos.ToString());
+    if (Hash(block.data(), block.data() + nHeaderSize) != hash)
+        return error("%s: Block at %s doesn't match hash %s", __func__, pos.ToString(), hash.ToString());
+    return true;
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     int halvings = nHeight / consensusParams.nSubsidyHalvingInterval;
@@ -1324,6 +1729,24 @@ int GetSpendHeight(const CCoinsViewCache& inputs)
 
 static CuckooCache::cache<uint256, SignatureCacheHasher> scriptExecutionCache;
 static uint256 scriptExecutionCacheNonce(GetRandHash());
+static ValidationCacheCounters scriptExecutionCacheCounters;
+static uint32_t nScriptExecutionCacheElements = 0;
+/** Size of each of the signature and script execution caches, and up to which they may grow, in bytes */
+static size_t nValidationCacheSize = 0;
+static size_t nMaxValidationCacheSize = 0;
+/** Grow the caches when more than one in this many transactions of a block that were in the mempool missed them */
+static const uint64_t VALIDATION_CACHE_GROWTH_MISS_RATIO = 20;
+
+/** Key of the script execution cache entry for tx's scripts passing with the given flags */
+static uint256 GetScriptExecutionCacheEntry(const CTransaction& tx, unsigned int flags)
+{
+    uint256 hashCacheEntry;
+    // We only use the first 19 bytes of nonce to avoid a second SHA
+    // round - giving us 19 + 32 + 4 = 55 bytes (+ 8 + 1 = 64)
+    static_assert(55 - sizeof(flags) - 32 >= 128/8, "Want at least 128 bits of nonce for script execution cache");
+    CSHA256().Write(scriptExecutionCacheNonce.begin(), 55 - sizeof(flags) - 32).Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+    return hashCacheEntry;
+}
 
 void InitScriptExecutionCache() {
     // nMaxCacheSize is unsigned. If -maxsigcachesize is set to zero,
@@ -1332,6 +1755,90 @@ void InitScriptExecutionCache() {
     size_t nElems = scriptExecutionCache.setup_bytes(nMaxCacheSize);
     LogPrintf("Using %zu MiB out of %zu/2 requested for script execution cache, able to store %zu elements\n",
             (nElems*sizeof(uint256)) >>20, (nMaxCacheSize*2)>>20, nElems);
+    nScriptExecutionCacheElements = nElems;
+    nValidationCacheSize = nMaxCacheSize;
+    nMaxValidationCacheSize = std::min(std::max((int64_t)0, gArgs.GetArg("-maxadaptivesigcachesize", DEFAULT_MAX_ADAPTIVE_SIG_CACHE_SIZE) / 2), MAX_MAX_SIG_CACHE_SIZE) * ((size_t) 1 << 20);
+}
+
+ValidationCacheStats GetScriptExecutionCacheStats()
+{
+    AssertLockHeld(cs_main);
+    ValidationCacheStats stats;
+    scriptExecutionCacheCounters.Get(stats);
+    stats.evictions = scriptExecutionCache.evictions();
+    stats.max_elements = nScriptExecutionCacheElements;
+    return stats;
+}
+
+/**
+ * Record how connecting a block used the signature and script execution
+ * caches, given their stats from before it was connected. If too many of its
+ * transactions that were in the mempool had to have their scripts verified
+ * again, the caches evicted them before the block arrived, and are grown.
+ */
+static void UpdateValidationCacheUsage(const CBlockIndex* pindex, const ValidationCacheStats& sig_before, const ValidationCacheStats& script_before,
+                                       uint64_t nMempoolTxs, uint64_t nMempoolTxsMissed)
+{
+    AssertLockHeld(cs_main);
+    static uint64_t nLastSigEvictions = 0;
+    static uint64_t nLastScriptEvictions = 0;
+    const ValidationCacheStats sig = GetSignatureCacheStats();
+    const ValidationCacheStats script = GetScriptExecutionCacheStats();
+    ValidationCacheUsage& usage = g_validation_cache_usage;
+    usage.last_block_hash = pindex->GetBlockHash();
+    usage.last_block_height = pindex->nHeight;
+    usage.last_block_sig_hits = sig.block_hits - sig_before.block_hits;
+    usage.last_block_sig_misses = sig.block_misses - sig_before.block_misses;
+    usage.last_block_script_hits = script.block_hits - script_before.block_hits;
+    usage.last_block_script_misses = script.block_misses - script_before.block_misses;
+    usage.last_block_sig_evictions = sig.evictions - std::min(nLastSigEvictions, sig.evictions);
+    usage.last_block_script_evictions = script.evictions - std::min(nLastScriptEvictions, script.evictions);
+    usage.last_block_mempool_txs = nMempoolTxs;
+    usage.last_block_mempool_txs_missed = nMempoolTxsMissed;
+    nLastSigEvictions = sig.evictions;
+    nLastScriptEvictions = script.evictions;
+    LogPrint(BCLog::BENCH, "    - Validation caches: %u/%u signature and %u/%u script execution cache hits, %u/%u mempool transactions missed, %u/%u evicted\n",
+        usage.last_block_sig_hits, usage.last_block_sig_hits + usage.last_block_sig_misses,
+        usage.last_block_script_hits, usage.last_block_script_hits + usage.last_block_script_misses,
+        nMempoolTxsMissed, nMempoolTxs, usage.last_block_sig_evictions, usage.last_block_script_evictions);
+
+    if (nMempoolTxsMissed < 2 || nMempoolTxsMissed * VALIDATION_CACHE_GROWTH_MISS_RATIO <= nMempoolTxs) return;
+    size_t nNewSize = std::min(std::max(nValidationCacheSize * 2, (size_t)1 << 20), nMaxValidationCacheSize);
+    if (nNewSize <= nValidationCacheSize) return;
+    nValidationCacheSize = nNewSize;
+    size_t nSigElems = ResizeSignatureCache(nNewSize);
+    nScriptExecutionCacheElements = scriptExecutionCache.resize(nNewSize / sizeof(uint256));
+    usage.resizes++;
+    LogPrintf("%u of %u mempool transactions in block %s were evicted from the validation caches, growing them to %zu MiB (%zu and %u elements)\n",
+        nMempoolTxsMissed, nMempoolTxs, pindex->GetBlockHash().ToString(), (nNewSize * 2) >> 20, nSigElems, nScriptExecutionCacheElements);
+}
+
+/**
+ * Fill in state for a transaction whose input nIn, spending spent, failed its
+ * script check with the given flags and error. Always returns false.
+ */
+static bool InvalidScript(CValidationState& state, const CTransaction& tx, unsigned int nIn, const CTxOut& spent, unsigned int flags, bool cacheSigStore, PrecomputedTransactionData& txdata, ScriptError error)
+{
+    if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
+        // Check whether the failure was caused by a
+        // non-mandatory script verification check, such as
+        // non-standard DER encodings or non-null dummy
+        // arguments; if so, don't trigger DoS protection to
+        // avoid splitting the network between upgraded and
+        // non-upgraded nodes.
+        CScriptCheck check2(spent, tx, nIn,
+                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheSigStore, &txdata);
+        if (check2())
+            return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(error)));
+    }
+    // Failures of other flags indicate a transaction that is
+    // invalid in new blocks, e.g. an invalid P2SH. We DoS ban
+    // such nodes as they are not following the protocol. That
+    // said during an upgrade careful thought should be taken
+    // as to the correct behavior - we may want to continue
+    // peering with non-upgraded nodes even after soft-fork
+    // super-majority signaling has occurred.
+    return state.DoS(100,false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(error)));
 }
 
 /**
@@ -1370,13 +1877,15 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
             // correct (ie that the transaction hash which is in tx's prevouts
             // properly commits to the scriptPubKey in the inputs view of that
             // transaction).
-            uint256 hashCacheEntry;
-            // We only use the first 19 bytes of nonce to avoid a second SHA
-            // round - giving us 19 + 32 + 4 = 55 bytes (+ 8 + 1 = 64)
-            static_assert(55 - sizeof(flags) - 32 >= 128/8, "Want at least 128 bits of nonce for script execution cache");
-            CSHA256().Write(scriptExecutionCacheNonce.begin(), 55 - sizeof(flags) - 32).Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+            uint256 hashCacheEntry = GetScriptExecutionCacheEntry(tx, flags);
             AssertLockHeld(cs_main); //TODO: Remove this requirement by making CuckooCache not require external locks
-            if (scriptExecutionCache.contains(hashCacheEntry, !cacheFullScriptStore)) {
+            bool fCached = scriptExecutionCache.contains(hashCacheEntry, !cacheFullScriptStore);
+            // Lookups with flags whose results are never stored (when checking
+            // standardness for the mempool) aren't counted.
+            if (cacheFullScriptStore || !cacheSigStore) {
+                scriptExecutionCacheCounters.Lookup(fCached, !cacheFullScriptStore);
+            }
+            if (fCached) {
                 return true;
             }
 
@@ -1397,26 +1906,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
                 } else if (!check()) {
-                    if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
-                        // Check whether the failure was caused by a
-                        // non-mandatory script verification check, such as
-                        // non-standard DER encodings or non-null dummy
-                        // arguments; if so, don't trigger DoS protection to
-                        // avoid splitting the network between upgraded and
-                        // non-upgraded nodes.
-                        CScriptCheck check2(coin.out, tx, i,
-                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheSigStore, &txdata);
-                        if (check2())
-                            return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
-                    }
-                    // Failures of other flags indicate a transaction that is
-                    // invalid in new blocks, e.g. an invalid P2SH. We DoS ban
-                    // such nodes as they are not following the protocol. That
-                    // said during an upgrade careful thought should be taken
-                    // as to the correct behavior - we may want to continue
-                    // peering with non-upgraded nodes even after soft-fork
-                    // super-majority signaling has occurred.
-                    return state.DoS(100,false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
+                    return InvalidScript(state, tx, i, coin.out, flags, cacheSigStore, txdata, check.GetScriptError());
                 }
             }
 
@@ -1431,6 +1921,204 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
     return true;
 }
 
+/** Outcome of the script check of one input in PreVerifyTransactions() */
+struct CTxPreVerifyResult
+{
+    bool fChecked = false;
+    bool fValid = false;
+    ScriptError error = SCRIPT_ERR_UNKNOWN_ERROR;
+};
+
+/**
+ * Script check for PreVerifyTransactions(). A failure only marks its
+ * transaction, so that the other transactions in the batch are still checked.
+ * Once an input of a transaction has failed, its remaining inputs are skipped.
+ */
+class CTxPreVerifyCheck
+{
+private:
+    CScriptCheck check;
+    std::atomic<bool>* pfFailed;
+    CTxPreVerifyResult* pResult;
+
+public:
+    CTxPreVerifyCheck() : pfFailed(nullptr), pResult(nullptr) {}
+    CTxPreVerifyCheck(CScriptCheck& checkIn, std::atomic<bool>& fFailed, CTxPreVerifyResult& result) : pfFailed(&fFailed), pResult(&result) { check.swap(checkIn); }
+
+    bool operator()() {
+        if (!*pfFailed) {
+            pResult->fChecked = true;
+            pResult->fValid = check();
+            pResult->error = check.GetScriptError();
+            if (!pResult->fValid) {
+                *pfFailed = true;
+            }
+        }
+        return true;
+    }
+
+    void swap(CTxPreVerifyCheck& other) {
+        check.swap(other.check);
+        std::swap(pfFailed, other.pfFailed);
+        std::swap(pResult, other.pResult);
+    }
+};
+
+
+static CCheckQueue<CTxPreVerifyCheck> txscriptcheckqueue(128);
+
+void ThreadTxScriptCheck() {
+    RenameThread("bitcoin-txscript");
+    txscriptcheckqueue.Thread();
+}
+
+size_t PreVerifyTransactions(const std::vector<CTransactionRef>& txs, std::vector<COutPoint>& coins_to_uncache)
+{
+    if (!nScriptCheckThreads || txs.empty()) return 0;
+    const CChainParams& chainparams = Params();
+    const unsigned int flags = GetMempoolScriptFlags(chainparams);
+
+    // Look up the spent outputs, and leave out transactions that
+    // AcceptToMemoryPool rejects before verifying scripts, so that they don't
+    // cost more CPU time here than they would there.
+    std::vector<CTransactionRef> vtx;
+    std::vector<std::vector<CTxOut>> vspent;
+    {
+        LOCK2(cs_main, mempool.cs);
+        const bool witnessEnabled = IsWitnessEnabled(chainActive.Tip(), chainparams.GetConsensus());
+        CCoinsViewMemPool viewMemPool(pcoinsTip.get(), mempool);
+        // Outputs of earlier transactions in the batch can be spent by later ones.
+        CCoinsViewCache view(&viewMemPool);
+        for (const CTransactionRef& ptx : txs) {
+            const CTransaction& tx = *ptx;
+            CValidationState state;
+            std::string reason;
+            if (!CheckTransaction(tx, state) || tx.IsCoinBase()) continue;
+            if (tx.HasWitness() && !witnessEnabled) continue;
+            if (fRequireStandard && !IsStandardTx(tx, reason, witnessEnabled)) continue;
+            if (mempool.exists(tx.GetHash())) continue;
+
+            bool fMissingInputs = false;
+            for (const CTxIn& txin : tx.vin) {
+                if (!pcoinsTip->HaveCoinInCache(txin.prevout)) {
+                    coins_to_uncache.push_back(txin.prevout);
+                }
+                if (!view.HaveCoin(txin.prevout)) {
+                    fMissingInputs = true;
+                    break;
+                }
+            }
+            if (fMissingInputs) continue;
+
+            CAmount nFees = 0;
+            if (!Consensus::CheckTxInputs(tx, state, view, chainActive.Height() + 1, nFees)) continue;
+            if (fRequireStandard && !AreInputsStandard(tx, view)) continue;
+            if (tx.HasWitness() && fRequireStandard && !IsWitnessStandard(tx, view)) continue;
+            int64_t nSigOpsCost = GetTransactionSigOpCost(tx, view, STANDARD_SCRIPT_VERIFY_FLAGS);
+            if (nSigOpsCost > MAX_STANDARD_TX_SIGOPS_COST) continue;
+            CAmount nModifiedFees = nFees;
+            mempool.ApplyDelta(tx.GetHash(), nModifiedFees);
+            unsigned int nSize = GetVirtualTransactionSize(tx, nSigOpsCost);
+            CAmount mempoolRejectFee = mempool.GetMinFee(gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+            if (nModifiedFees < mempoolRejectFee || nModifiedFees < ::minRelayTxFee.GetFee(nSize)) continue;
+
+            vtx.push_back(ptx);
+            vspent.emplace_back();
+            for (const CTxIn& txin : tx.vin) {
+                vspent.back().push_back(view.AccessCoin(txin.prevout).out);
+            }
+            AddCoins(view, tx, MEMPOOL_HEIGHT, true);
+        }
+    }
+    if (vtx.empty()) return 0;
+
+    // Verify the scripts, without holding cs_main
+    std::vector<PrecomputedTransactionData> vtxdata;
+    vtxdata.reserve(vtx.size());
+    std::unique_ptr<std::atomic<bool>[]> vfailed(new std::atomic<bool>[vtx.size()]);
+    std::vector<std::vector<CTxPreVerifyResult>> vresults(vtx.size());
+    std::vector<CTxPreVerifyCheck> vchecks;
+    for (size_t i = 0; i < vtx.size(); ++i) {
+        vtxdata.emplace_back(*vtx[i]);
+        vfailed[i] = false;
+        vresults[i].resize(vtx[i]->vin.size());
+        for (unsigned int j = 0; j < vtx[i]->vin.size(); ++j) {
+            CScriptCheck check(vspent[i][j], *vtx[i], j, flags, true, &vtxdata[i]);
+            vchecks.emplace_back(check, vfailed[i], vresults[i][j]);
+        }
+    }
+    if (vchecks.size() == 1) {
+        // Not worth waking up the queue, which only serves one batch at a time.
+        vchecks[0]();
+    } else {
+        CCheckQueueControl<CTxPreVerifyCheck> control(&txscriptcheckqueue);
+        control.Add(vchecks);
+        control.Wait();
+    }
+
+    // Work out how AcceptToMemoryPool would reject the transactions that
+    // failed, as it does in CheckInputs(): by the first input in order that
+    // fails, and whether only their witness may be missing. Inputs that were
+    // already checked aren't verified again.
+    std::vector<std::pair<size_t, CValidationState>> vrejected;
+    for (size_t i = 0; i < vtx.size(); ++i) {
+        if (!vfailed[i]) continue;
+        const CTransaction& tx = *vtx[i];
+        auto fnScriptsPass = [&](unsigned int flagsIn) {
+            for (unsigned int j = 0; j < tx.vin.size(); ++j) {
+                if (!CScriptCheck(vspent[i][j], tx, j, flagsIn, true, &vtxdata[i])())
+                    return false;
+            }
+            return true;
+        };
+        CValidationState state;
+        for (unsigned int j = 0; j < tx.vin.size(); ++j) {
+            CTxPreVerifyResult& result = vresults[i][j];
+            if (!result.fChecked) {
+                CScriptCheck check(vspent[i][j], tx, j, flags, true, &vtxdata[i]);
+                result.fValid = check();
+                result.error = check.GetScriptError();
+            }
+            if (!result.fValid) {
+                InvalidScript(state, tx, j, vspent[i][j], flags, true, vtxdata[i], result.error);
+                break;
+            }
+        }
+        if (!tx.HasWitness() && fnScriptsPass(flags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK)) &&
+            !fnScriptsPass(flags & ~SCRIPT_VERIFY_CLEANSTACK)) {
+            state.SetCorruptionPossible();
+        }
+        vrejected.emplace_back(i, state);
+    }
+
+    size_t nVerified = 0;
+    LOCK(cs_main);
+    for (size_t i = 0; i < vtx.size(); ++i) {
+        if (vfailed[i]) continue;
+        scriptExecutionCache.insert(GetScriptExecutionCacheEntry(*vtx[i], flags));
+        ++nVerified;
+    }
+    for (const auto& rejected : vrejected) {
+        if (mapPreVerifyFailures.size() >= MAX_PREVERIFY_FAILURES) {
+            mapPreVerifyFailures.erase(mapPreVerifyFailures.begin());
+        }
+        mapPreVerifyFailures[vtx[rejected.first]->GetWitnessHash()] = std::make_pair(flags, rejected.second);
+    }
+    return nVerified;
+}
+
+void UncacheUnspentCoins(const std::vector<COutPoint>& coins_to_uncache)
+{
+    AssertLockHeld(cs_main);
+    // As in AcceptToMemoryPool, don't let rejected transactions fill the
+    // cache with coins they may never get to spend.
+    for (const COutPoint& outpoint : coins_to_uncache) {
+        if (!mempool.isSpent(outpoint)) {
+            pcoinsTip->Uncache(outpoint);
+        }
+    }
+}
+
 namespace {
 
 bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart)
@@ -1460,7 +2148,9 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
     return true;
 }
 
-static bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex *pindex)
+} // namespace
+
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex *pindex)
 {
     CDiskBlockPos pos = pindex->GetUndoPos();
     if (pos.IsNull()) {
@@ -1491,6 +2181,8 @@ static bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex *pindex)
     return true;
 }
 
+namespace {
+
 /** Abort with a message */
 bool AbortNode(const std::string& strMessage, const std::string& userMessage="")
 {
@@ -1610,12 +2302,17 @@ void static FlushBlockFile(bool fFinalize = false)
 
     CDiskBlockPos posOld(nLastBlockFile, 0);
 
-    FILE *fileOld = OpenBlockFile(posOld);
-    if (fileOld) {
-        if (fFinalize)
-            TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nSize);
-        FileCommit(fileOld);
-        fclose(fileOld);
+    FILE *fileOld;
+    if (fFinalize) {
+        // Truncated and synced by the block writer after the blocks queued for it
+        if (!blockWriter.Finalize(nLastBlockFile, vinfoBlockFile[nLastBlockFile].nSize))
+            AbortNode("Failed to flush block file", "");
+    } else {
+        fileOld = OpenBlockFile(posOld);
+        if (fileOld) {
+            FileCommit(fileOld);
+            fclose(fileOld);
+        }
     }
 
     fileOld = OpenUndoFile(posOld);
@@ -1648,31 +2345,95 @@ static bool WriteUndoDataForBlock(const CBlockUndo& blockundo, CValidationState&
     return true;
 }
 
-static bool WriteTxIndexDataForBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex)
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck() {
+    RenameThread("bitcoin-scriptch");
+    scriptcheckqueue.Thread();
+}
+
+/**
+ * Closure reading one coin from the coins database for PrefetchBlockInputs().
+ * Read errors are left for ConnectBlock, which reads the coin again through
+ * the usual error handling if it is missing from the cache.
+ */
+class CCoinsPrefetchCheck
 {
-    if (!fTxIndex) return true;
+private:
+    const CCoinsView* view;
+    COutPoint outpoint;
+    Coin* coin;
 
-    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
-    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
-    vPos.reserve(block.vtx.size());
-    for (const CTransactionRef& tx : block.vtx)
-    {
-        vPos.push_back(std::make_pair(tx->GetHash(), pos));
-        pos.nTxOffset += ::GetSerializeSize(*tx, SER_DISK, CLIENT_VERSION);
+public:
+    CCoinsPrefetchCheck() : view(nullptr), coin(nullptr) {}
+    CCoinsPrefetchCheck(const CCoinsView& viewIn, const COutPoint& outpointIn, Coin& coinIn) : view(&viewIn), outpoint(outpointIn), coin(&coinIn) {}
+
+    bool operator()() {
+        try {
+            view->GetCoin(outpoint, *coin);
+        } catch (const std::runtime_error&) {
+            coin->Clear();
+        }
+        return true;
     }
 
-    if (!pblocktree->WriteTxIndex(vPos)) {
-        return AbortNode(state, "Failed to write transaction index");
+    void swap(CCoinsPrefetchCheck& check) {
+        std::swap(view, check.view);
+        std::swap(outpoint, check.outpoint);
+        std::swap(coin, check.coin);
     }
+};
 
-    return true;
+// Coin reads wait on I/O rather than the CPU, so hand them out in small batches.
+static CCheckQueue<CCoinsPrefetchCheck> coinsprefetchqueue(16);
+
+void ThreadCoinsPrefetch() {
+    RenameThread("bitcoin-prefetch");
+    coinsprefetchqueue.Thread();
 }
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+/**
+ * Read the coins spent by a block that are not in pcoinsTip yet from the
+ * coins database, concurrently on the prefetch threads, and add them to
+ * pcoinsTip. The cache misses ConnectBlock would otherwise hit one at a
+ * time then overlap, so a block connected on a cold cache waits for the
+ * combined throughput of the reads rather than for each read in turn.
+ * Returns the number of coins read.
+ */
+static size_t PrefetchBlockInputs(const CBlock& block)
+{
+    AssertLockHeld(cs_main);
+    if (!nScriptCheckThreads) return 0;
 
-void ThreadScriptCheck() {
-    RenameThread("bitcoin-scriptch");
-    scriptcheckqueue.Thread();
+    std::set<uint256> txids;
+    for (const auto& tx : block.vtx) {
+        txids.insert(tx->GetHash());
+    }
+    std::vector<COutPoint> outpoints;
+    for (const auto& tx : block.vtx) {
+        if (tx->IsCoinBase()) continue;
+        for (const CTxIn& txin : tx->vin) {
+            // Outputs created within the block are not in the database.
+            if (txids.count(txin.prevout.hash) || pcoinsTip->HaveCoinInCache(txin.prevout)) continue;
+            outpoints.push_back(txin.prevout);
+        }
+    }
+    if (outpoints.empty()) return 0;
+
+    std::vector<Coin> coins(outpoints.size());
+    std::vector<CCoinsPrefetchCheck> checks;
+    checks.reserve(outpoints.size());
+    for (size_t i = 0; i < outpoints.size(); ++i) {
+        checks.emplace_back(*pcoinsdbview, outpoints[i], coins[i]);
+    }
+    CCheckQueueControl<CCoinsPrefetchCheck> control(&coinsprefetchqueue);
+    control.Add(checks);
+    control.Wait();
+
+    for (size_t i = 0; i < outpoints.size(); ++i) {
+        pcoinsTip->AddFetchedCoin(outpoints[i], std::move(coins[i]));
+    }
+    return outpoints.size();
 }
 
 // Protected by cs_main
@@ -1891,6 +2652,16 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
 
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : nullptr);
 
+    // Keep track of how well the validation caches kept the results of
+    // verifying the transactions from the mempool
+    const bool fCacheUsage = fScriptChecks && !fJustCheck;
+    ValidationCacheStats sig_cache_before, script_cache_before;
+    uint64_t nMempoolTxs = 0, nMempoolTxsMissed = 0;
+    if (fCacheUsage) {
+        sig_cache_before = GetSignatureCacheStats();
+        script_cache_before = GetScriptExecutionCacheStats();
+    }
+
     std::vector<int> prevheights;
     CAmount nFees = 0;
     int nInputs = 0;
@@ -1944,9 +2715,14 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
         {
             std::vector<CScriptCheck> vChecks;
             bool fCacheResults = fJustCheck; /* Don't cache results if we're actually connecting blocks (still consult the cache, though) */
+            const uint64_t nScriptMissesBefore = scriptExecutionCacheCounters.Misses(true);
             if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, fCacheResults, txdata[i], nScriptCheckThreads ? &vChecks : nullptr))
                 return error("ConnectBlock(): CheckInputs on %s failed with %s",
                     tx.GetHash().ToString(), FormatStateMessage(state));
+            if (fCacheUsage && mempool.exists(tx.GetHash())) {
+                nMempoolTxs++;
+                if (scriptExecutionCacheCounters.Misses(true) != nScriptMissesBefore) nMempoolTxsMissed++;
+            }
             control.Add(vChecks);
         }
 
@@ -1974,6 +2750,10 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
     if (fJustCheck)
         return true;
 
+    if (fCacheUsage) {
+        UpdateValidationCacheUsage(pindex, sig_cache_before, script_cache_before, nMempoolTxs, nMempoolTxsMissed);
+    }
+
     if (!WriteUndoDataForBlock(blockundo, state, pindex, chainparams))
         return false;
 
@@ -1982,9 +2762,6 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
         setDirtyBlockIndex.insert(pindex);
     }
 
-    if (!WriteTxIndexDataForBlock(block, state, pindex))
-        return false;
-
     assert(pindex->phashBlock);
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
@@ -2010,6 +2787,7 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState &
     static int64_t nLastWrite = 0;
     static int64_t nLastFlush = 0;
     static int64_t nLastSetChain = 0;
+    static int64_t nLastIncrementalWrite = 0;
     std::set<int> setFilesToPrune;
     bool fFlushForPrune = false;
     bool fDoFullFlush = false;
@@ -2043,6 +2821,9 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState &
         if (nLastSetChain == 0) {
             nLastSetChain = nNow;
         }
+        if (nLastIncrementalWrite == 0) {
+            nLastIncrementalWrite = nNow;
+        }
         int64_t nMempoolSizeMax = gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
         int64_t cacheSize = pcoinsTip->DynamicMemoryUsage();
         int64_t nTotalSpace = nCoinCacheUsage + std::max<int64_t>(nMempoolSizeMax - nMempoolUsage, 0);
@@ -2052,16 +2833,28 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState &
         bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nTotalSpace;
         // It's been a while since we wrote the block index to disk. Do this frequently, so we don't need to redownload after a crash.
         bool fPeriodicWrite = mode == FLUSH_STATE_PERIODIC && nNow > nLastWrite + (int64_t)DATABASE_WRITE_INTERVAL * 1000000;
-        // It's been very long since we flushed the cache. Do this infrequently, to optimize cache usage.
+        // It's been very long since we wrote all modified coins. Do this infrequently, to keep the amount of replaying needed after a crash bounded.
         bool fPeriodicFlush = mode == FLUSH_STATE_PERIODIC && nNow > nLastFlush + (int64_t)DATABASE_FLUSH_INTERVAL * 1000000;
         // Combine all conditions that result in a full cache flush.
         fDoFullFlush = (mode == FLUSH_STATE_ALWAYS) || fCacheLarge || fCacheCritical || fPeriodicFlush || fFlushForPrune;
-        // Write blocks and block index to disk.
-        if (fDoFullFlush || fPeriodicWrite) {
+        // Once the cache is half full, write some of the modified coins every
+        // now and then, so that less is left to do when it needs flushing.
+        const CBlockIndex* pindexCoins = nullptr;
+        BlockMap::const_iterator itCoins = mapBlockIndex.find(pcoinsTip->GetBestBlock());
+        if (itCoins != mapBlockIndex.end()) {
+            pindexCoins = itCoins->second;
+        }
+        bool fIncrementalWrite = !fDoFullFlush && mode == FLUSH_STATE_PERIODIC && pindexCoins &&
+            cacheSize > nTotalSpace / 2 && nNow > nLastIncrementalWrite + (int64_t)DATABASE_INCREMENTAL_WRITE_INTERVAL * 1000000;
+        // Write blocks and block index to disk. Replaying a partially written
+        // chainstate after a crash needs them too.
+        if (fDoFullFlush || fPeriodicWrite || fIncrementalWrite) {
             // Depend on nMinDiskSpace to ensure we can write block index
             if (!CheckDiskSpace(0))
                 return state.Error("out of disk space");
             // First make sure all block and undo data is flushed to disk.
+            if (!blockWriter.Flush())
+                return AbortNode(state, "Failed to write block");
             FlushBlockFile();
             // Then update all block file information (which may refer to block and undo files).
             {
@@ -2081,9 +2874,6 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState &
                     return AbortNode(state, "Failed to write to block index database");
                 }
             }
-            // Finally remove any pruned files
-            if (fFlushForPrune)
-                UnlinkPrunedFiles(setFilesToPrune);
             nLastWrite = nNow;
         }
         // Flush best chain related state. This can only be done if the blocks / block index write was also done.
@@ -2096,10 +2886,46 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState &
             if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
                 return state.Error("out of disk space");
             // Flush the chainstate (which may refer to block index entries).
-            if (!pcoinsTip->Flush())
+            // The cache is kept, unless it has to make room, in which case
+            // only the coins least likely to be needed soon are dropped.
+            int64_t nStart = GetTimeMicros();
+            size_t nWritten = 0;
+            if (!pcoinsTip->Sync(&nWritten))
                 return AbortNode(state, "Failed to write to coin database");
+            if (fCacheLarge || fCacheCritical) {
+                pcoinsTip->Trim(nTotalSpace / 2);
+            }
+            int64_t nDuration = GetTimeMicros() - nStart;
+            LogPrint(BCLog::BENCH, "  - Flush %u coins to chainstate: %.2fms (cache now %.1fMiB)\n", nWritten, nDuration * 0.001, pcoinsTip->DynamicMemoryUsage() * (1.0 / 1024 / 1024));
+            g_coins_write_stats.flushes++;
+            g_coins_write_stats.last_flush_time = GetTime();
+            g_coins_write_stats.last_flush_duration = nDuration;
+            g_coins_write_stats.last_flush_coins = nWritten;
+            pindexCoinsPartialWrite = nullptr;
             nLastFlush = nNow;
+            nLastIncrementalWrite = nNow;
+        } else if (fIncrementalWrite) {
+            if (!CheckDiskSpace(48 * 2 * 2 * MAX_INCREMENTAL_WRITE_COINS))
+                return state.Error("out of disk space");
+            int64_t nStart = GetTimeMicros();
+            size_t nWritten = 0;
+            if (!pcoinsTip->SyncPartial(MAX_INCREMENTAL_WRITE_COINS, pindexCoins->nHeight - INCREMENTAL_WRITE_MIN_COIN_DEPTH, nWritten))
+                return AbortNode(state, "Failed to write to coin database");
+            int64_t nDuration = GetTimeMicros() - nStart;
+            LogPrint(BCLog::BENCH, "  - Incremental write of %u coins to chainstate: %.2fms\n", nWritten, nDuration * 0.001);
+            g_coins_write_stats.incremental_writes++;
+            g_coins_write_stats.last_incremental_time = GetTime();
+            g_coins_write_stats.last_incremental_duration = nDuration;
+            g_coins_write_stats.last_incremental_coins = nWritten;
+            if (nWritten > 0) {
+                pindexCoinsPartialWrite = pindexCoins;
+            }
+            nLastIncrementalWrite = nNow;
         }
+        // Finally remove any pruned files. This is done after writing the
+        // chainstate, as replaying a partially written one may need them.
+        if (fFlushForPrune)
+            UnlinkPrunedFiles(setFilesToPrune);
     }
     if (fDoFullFlush || ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000)) {
         // Update best block in wallet (so we can detect restored wallets).
@@ -2201,6 +3027,10 @@ bool CChainState::DisconnectTip(CValidationState& state, const CChainParams& cha
 {
     CBlockIndex *pindexDelete = chainActive.Tip();
     assert(pindexDelete);
+    // A partially written chainstate can only be completed towards a
+    // descendant of where it was written, so complete it before going back.
+    if (pindexCoinsPartialWrite && !FlushStateToDisk(chainparams, state, FLUSH_STATE_ALWAYS))
+        return false;
     // Read block from disk.
     std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
     CBlock& block = *pblock;
@@ -2244,6 +3074,7 @@ bool CChainState::DisconnectTip(CValidationState& state, const CChainParams& cha
 }
 
 static int64_t nTimeReadFromDisk = 0;
+static int64_t nTimePrefetch = 0;
 static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
 static int64_t nTimeChainState = 0;
@@ -2339,6 +3170,10 @@ bool CChainState::ConnectTip(CValidationState& state, const CChainParams& chainp
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
     LogPrint(BCLog::BENCH, "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * MILLI, nTimeReadFromDisk * MICRO);
+    size_t nPrefetched = PrefetchBlockInputs(blockConnecting);
+    int64_t nTimePrefetched = GetTimeMicros(); nTimePrefetch += nTimePrefetched - nTime2;
+    LogPrint(BCLog::BENCH, "  - Prefetch %u inputs: %.2fms [%.2fs]\n", (unsigned)nPrefetched, (nTimePrefetched - nTime2) * MILLI, nTimePrefetch * MICRO);
+    nTime2 = nTimePrefetched;
     {
         CCoinsViewCache view(pcoinsTip.get());
         bool rv = ConnectBlock(blockConnecting, state, pindexNew, view, chainparams);
@@ -2563,6 +3398,8 @@ bool CChainState::ActivateBestChain(CValidationState &state, const CChainParams&
     // sanely for performance or correctness!
     AssertLockNotHeld(cs_main);
 
+    LOCK(m_cs_chainstate);
+
     CBlockIndex *pindexMostWork = nullptr;
     CBlockIndex *pindexNewTip = nullptr;
     int nStopAtHeight = gArgs.GetArg("-stopatheight", DEFAULT_STOPATHEIGHT);
@@ -3296,7 +4133,8 @@ bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, CValidatio
 }
 
 /** Store block on disk. If dbp is non-nullptr, the file is known to already reside on disk */
-static CDiskBlockPos SaveBlockToDisk(const CBlock& block, int nHeight, const CChainParams& chainparams, const CDiskBlockPos* dbp) {
+static CDiskBlockPos SaveBlockToDisk(const std::shared_ptr<const CBlock>& pblock, int nHeight, const CChainParams& chainparams, const CDiskBlockPos* dbp) {
+    const CBlock& block = *pblock;
     unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
     CDiskBlockPos blockPos;
     if (dbp != nullptr)
@@ -3306,7 +4144,9 @@ static CDiskBlockPos SaveBlockToDisk(const CBlock& block, int nHeight, const CCh
         return CDiskBlockPos();
     }
     if (dbp == nullptr) {
-        if (!WriteBlockToDisk(block, blockPos, chainparams.MessageStart())) {
+        // The block data follows the message start and size
+        blockPos.nPos += CMessageHeader::MESSAGE_START_SIZE + sizeof(nBlockSize);
+        if (!blockWriter.Write(blockPos, pblock, chainparams.MessageStart())) {
             AbortNode("Failed to write block");
             return CDiskBlockPos();
         }
@@ -3377,7 +4217,7 @@ bool CChainState::AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CVali
 
     // Write block to history file
     try {
-        CDiskBlockPos blockPos = SaveBlockToDisk(block, pindex->nHeight, chainparams, dbp);
+        CDiskBlockPos blockPos = SaveBlockToDisk(pblock, pindex->nHeight, chainparams, dbp);
         if (blockPos.IsNull()) {
             state.Error(strprintf("%s: Failed to find position to write new block to disk", __func__));
             return false;
@@ -3507,6 +4347,7 @@ void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune)
 {
     for (std::set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        blockFileMaps.Forget(*it);
         fs::remove(GetBlockPosFilename(pos, "blk"));
         fs::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -3773,10 +4614,6 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
     pblocktree->ReadReindexing(fReindexing);
     if(fReindexing) fReindex = true;
 
-    // Check whether we have a transaction index
-    pblocktree->ReadFlag("txindex", fTxIndex);
-    LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
-
     return true;
 }
 
@@ -4107,6 +4944,140 @@ bool RewindBlockIndex(const CChainParams& params) {
     return true;
 }
 
+bool CChainState::LoadUTXOSnapshot(const fs::path& path, const CChainParams& chainparams, std::string& error)
+{
+    CAutoFile file(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        error = strprintf(_("Unable to open UTXO snapshot %s"), path.string());
+        return false;
+    }
+
+    SnapshotMetadata metadata;
+    try {
+        file >> metadata;
+    } catch (const std::exception& e) {
+        error = strprintf(_("Unable to read UTXO snapshot %s: %s"), path.string(), e.what());
+        return false;
+    }
+    if (memcmp(metadata.m_network_magic, chainparams.MessageStart(), sizeof(metadata.m_network_magic))) {
+        error = _("The UTXO snapshot was created for a different network");
+        return false;
+    }
+
+    {
+        LOCK(cs_main);
+        // When restarting with the same -loadutxosnapshot, the snapshot was
+        // already loaded on a previous run; there is nothing left to do.
+        BlockMap::const_iterator it = mapBlockIndex.find(metadata.m_base_blockhash);
+        if (it != mapBlockIndex.end() && chainActive.Contains(it->second)) {
+            LogPrintf("UTXO snapshot at block %s is already loaded, skipping\n", metadata.m_base_blockhash.ToString());
+            return true;
+        }
+        if (chainActive.Height() > 0) {
+            error = _("A UTXO snapshot can only be loaded into an empty chainstate");
+            return false;
+        }
+    }
+    // On a new data directory the genesis block has not been connected yet.
+    if (!::LoadChainTip(chainparams)) {
+        error = _("Error initializing block database");
+        return false;
+    }
+
+    // Accept the headers first. This checks their proof of work and that they
+    // connect to our genesis block, so the snapshot's base block is known to
+    // be on a valid header chain.
+    std::vector<CBlockHeader> headers;
+    headers.reserve(metadata.m_headers.size());
+    for (const auto& entry : metadata.m_headers) {
+        if (entry.second == 0) {
+            error = _("The UTXO snapshot contains a block without transactions");
+            return false;
+        }
+        headers.push_back(entry.first);
+    }
+    if (headers.empty() || headers.front().hashPrevBlock != chainparams.GetConsensus().hashGenesisBlock ||
+        headers.back().GetHash() != metadata.m_base_blockhash) {
+        error = _("The UTXO snapshot headers do not lead from the genesis block to its base block");
+        return false;
+    }
+    CValidationState state;
+    if (!ProcessNewBlockHeaders(headers, state, chainparams)) {
+        error = strprintf(_("The UTXO snapshot contains invalid headers: %s"), FormatStateMessage(state));
+        return false;
+    }
+
+    LOCK(cs_main);
+    BlockMap::iterator it = mapBlockIndex.find(metadata.m_base_blockhash);
+    assert(it != mapBlockIndex.end());
+    CBlockIndex* base = it->second;
+    if (base->nStatus & BLOCK_FAILED_MASK) {
+        error = _("The UTXO snapshot's base block is marked invalid");
+        return false;
+    }
+
+    LogPrintf("Loading UTXO snapshot at block %s (height %d)\n", base->GetBlockHash().ToString(), base->nHeight);
+    int64_t nStart = GetTimeMillis();
+
+    // If we stop before the load has completed, the coins database is left
+    // with only part of the set; make sure it is never used like that.
+    pblocktree->WriteFlag("utxosnapshotloading", true);
+
+    pcoinsTip->SetBestBlock(base->GetBlockHash());
+    SnapshotStats stats;
+    auto add_coin = [&](const COutPoint& outpoint, Coin&& coin) {
+        pcoinsTip->AddCoin(outpoint, std::move(coin), false);
+        if (pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage) {
+            return pcoinsTip->Flush();
+        }
+        return true;
+    };
+    try {
+        if (!ReadSnapshotCoins(file, base->GetBlockHash(), add_coin, stats, error)) {
+            return false;
+        }
+    } catch (const std::exception& e) {
+        error = strprintf(_("Unable to read UTXO snapshot %s: %s"), path.string(), e.what());
+        return false;
+    }
+
+    // The blocks up to the base are treated as if they had been validated and
+    // pruned: we know how many transactions they have but not their data.
+    for (size_t i = 0; i < metadata.m_headers.size(); ++i) {
+        CBlockIndex* pindex = base->GetAncestor(i + 1);
+        pindex->nTx = metadata.m_headers[i].second;
+        pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
+        if (IsWitnessEnabled(pindex->pprev, chainparams.GetConsensus())) {
+            pindex->nStatus |= BLOCK_OPT_WITNESS;
+        }
+        pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
+        setDirtyBlockIndex.insert(pindex);
+    }
+
+    chainActive.SetTip(base);
+    setBlockIndexCandidates.insert(base);
+    PruneBlockIndexCandidates();
+    if (!fHavePruned) {
+        pblocktree->WriteFlag("prunedblockfiles", true);
+        fHavePruned = true;
+    }
+
+    if (!FlushStateToDisk(chainparams, state, FLUSH_STATE_ALWAYS)) {
+        error = strprintf(_("Unable to write the UTXO snapshot to the chainstate: %s"), FormatStateMessage(state));
+        return false;
+    }
+    pblocktree->WriteFlag("utxosnapshotloading", false);
+
+    LogPrintf("Loaded UTXO snapshot: %u coins in %u transactions, hash_serialized_2=%s (%dms)\n",
+        stats.coins, stats.transactions, stats.hash_serialized.ToString(), GetTimeMillis() - nStart);
+    CheckBlockIndex(chainparams.GetConsensus());
+    return true;
+}
+
+bool LoadUTXOSnapshot(const fs::path& path, const CChainParams& chainparams, std::string& error) {
+    return g_chainstate.LoadUTXOSnapshot(path, chainparams, error);
+}
+
 void CChainState::UnloadBlockIndex() {
     nBlockSequenceId = 1;
     g_failed_blocks.clear();
@@ -4126,6 +5097,7 @@ void UnloadBlockIndex()
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
     nLastBlockFile = 0;
+    blockFileMaps.Clear();
     setDirtyBlockIndex.clear();
     setDirtyFileInfo.clear();
     versionbitscache.Clear();
@@ -4160,9 +5132,6 @@ bool LoadBlockIndex(const CChainParams& chainparams)
         // needs_init.
 
         LogPrintf("Initializing databases...\n");
-        // Use the provided setting for -txindex in the new database
-        fTxIndex = gArgs.GetBoolArg("-txindex", DEFAULT_TXINDEX);
-        pblocktree->WriteFlag("txindex", fTxIndex);
     }
     return true;
 }
@@ -4180,7 +5149,7 @@ bool CChainState::LoadGenesisBlock(const CChainParams& chainparams)
 
     try {
         CBlock &block = const_cast<CBlock&>(chainparams.GenesisBlock());
-        CDiskBlockPos blockPos = SaveBlockToDisk(block, 0, chainparams, nullptr);
+        CDiskBlockPos blockPos = SaveBlockToDisk(std::make_shared<const CBlock>(block), 0, chainparams, nullptr);
         if (blockPos.IsNull())
             return error("%s: writing genesis block to disk failed", __func__);
         CBlockIndex *pindex = AddToBlockIndex(block);
@@ -4199,115 +5168,149 @@ bool LoadGenesisBlock(const CChainParams& chainparams)
     return g_chainstate.LoadGenesisBlock(chainparams);
 }
 
-bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
+/**
+ * Scan fileIn for blocks and pass each of them to fnBlock, with its serialized
+ * size and, if dbp is set, its position in block file dbp->nFile. Stops early
+ * if fnBlock returns false. Takes over fileIn and closes it.
+ */
+static void ReadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp,
+                                  const std::function<bool(const std::shared_ptr<CBlock>&, unsigned int, CDiskBlockPos*)>& fnBlock)
 {
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
-    int64_t nStart = GetTimeMillis();
+    // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+    CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE+8, SER_DISK, CLIENT_VERSION);
+    uint64_t nRewind = blkdat.GetPos();
+    while (!blkdat.eof()) {
+        boost::this_thread::interruption_point();
 
-    int nLoaded = 0;
+        blkdat.SetPos(nRewind);
+        nRewind++; // start one byte further next time, in case of failure
+        blkdat.SetLimit(); // remove former limit
+        unsigned int nSize = 0;
+        try {
+            // locate a header
+            unsigned char buf[CMessageHeader::MESSAGE_START_SIZE];
+            blkdat.FindByte(chainparams.MessageStart()[0]);
+            nRewind = blkdat.GetPos()+1;
+            blkdat >> FLATDATA(buf);
+            if (memcmp(buf, chainparams.MessageStart(), CMessageHeader::MESSAGE_START_SIZE))
+                continue;
+            // read size
+            blkdat >> nSize;
+            if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
+                continue;
+        } catch (const std::exception&) {
+            // no valid block header found; don't complain
+            break;
+        }
+        std::shared_ptr<CBlock> pblock;
+        try {
+            // read block
+            uint64_t nBlockPos = blkdat.GetPos();
+            if (dbp)
+                dbp->nPos = nBlockPos;
+            blkdat.SetLimit(nBlockPos + nSize);
+            blkdat.SetPos(nBlockPos);
+            pblock = std::make_shared<CBlock>();
+            blkdat >> *pblock;
+            nRewind = blkdat.GetPos();
+        } catch (const std::exception& e) {
+            LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+            continue;
+        }
+        if (!fnBlock(pblock, nSize, dbp))
+            break;
+    }
+}
+
+namespace {
+// Map of disk positions for blocks with unknown parent (only used for reindex)
+std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+} // namespace
+
+/**
+ * Accept a block read from a block file or an external file, and the blocks
+ * with unknown parents found before it that descend from it. Returns false
+ * if loading should stop.
+ */
+static bool LoadExternalBlock(const CChainParams& chainparams, const std::shared_ptr<CBlock>& pblock, CDiskBlockPos *dbp, int& nLoaded)
+{
     try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
-            boost::this_thread::interruption_point();
+        const CBlock& block = *pblock;
+
+        // detect out of order blocks, and store them for later
+        uint256 hash = block.GetHash();
+        if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+            LogPrint(BCLog::REINDEX, "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                    block.hashPrevBlock.ToString());
+            if (dbp)
+                mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+            return true;
+        }
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[CMessageHeader::MESSAGE_START_SIZE];
-                blkdat.FindByte(chainparams.MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, chainparams.MessageStart(), CMessageHeader::MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
-                break;
+        // process in case the block isn't known yet
+        if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+            LOCK(cs_main);
+            CValidationState state;
+            if (g_chainstate.AcceptBlock(pblock, state, chainparams, nullptr, true, dbp, nullptr))
+                nLoaded++;
+            if (state.IsError())
+                return false;
+        } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+            LogPrint(BCLog::REINDEX, "Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+        }
+
+        // Activate the genesis block so normal node progress can continue
+        if (hash == chainparams.GetConsensus().hashGenesisBlock) {
+            CValidationState state;
+            if (!ActivateBestChain(state, chainparams)) {
+                return false;
             }
-            try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
-                CBlock& block = *pblock;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint(BCLog::REINDEX, "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                            block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
-                }
+        }
 
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+        NotifyHeaderTip();
+
+        // Recursively process earlier encountered successors of this block
+        std::deque<uint256> queue;
+        queue.push_back(hash);
+        while (!queue.empty()) {
+            uint256 head = queue.front();
+            queue.pop_front();
+            std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+            while (range.first != range.second) {
+                std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+                std::shared_ptr<CBlock> pblockrecursive = std::make_shared<CBlock>();
+                if (ReadBlockFromDisk(*pblockrecursive, it->second, chainparams.GetConsensus()))
+                {
+                    LogPrint(BCLog::REINDEX, "%s: Processing out of order child %s of %s\n", __func__, pblockrecursive->GetHash().ToString(),
+                            head.ToString());
                     LOCK(cs_main);
-                    CValidationState state;
-                    if (g_chainstate.AcceptBlock(pblock, state, chainparams, nullptr, true, dbp, nullptr))
+                    CValidationState dummy;
+                    if (g_chainstate.AcceptBlock(pblockrecursive, dummy, chainparams, nullptr, true, &it->second, nullptr))
+                    {
                         nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrint(BCLog::REINDEX, "Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
-                }
-
-                // Activate the genesis block so normal node progress can continue
-                if (hash == chainparams.GetConsensus().hashGenesisBlock) {
-                    CValidationState state;
-                    if (!ActivateBestChain(state, chainparams)) {
-                        break;
+                        queue.push_back(pblockrecursive->GetHash());
                     }
                 }
-
+                range.first++;
+                mapBlocksUnknownParent.erase(it);
                 NotifyHeaderTip();
-
-                // Recursively process earlier encountered successors of this block
-                std::deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        std::shared_ptr<CBlock> pblockrecursive = std::make_shared<CBlock>();
-                        if (ReadBlockFromDisk(*pblockrecursive, it->second, chainparams.GetConsensus()))
-                        {
-                            LogPrint(BCLog::REINDEX, "%s: Processing out of order child %s of %s\n", __func__, pblockrecursive->GetHash().ToString(),
-                                    head.ToString());
-                            LOCK(cs_main);
-                            CValidationState dummy;
-                            if (g_chainstate.AcceptBlock(pblockrecursive, dummy, chainparams, nullptr, true, &it->second, nullptr))
-                            {
-                                nLoaded++;
-                                queue.push_back(pblockrecursive->GetHash());
-                            }
-                        }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                        NotifyHeaderTip();
-                    }
-                }
-            } catch (const std::exception& e) {
-                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
             }
         }
+    } catch (const std::exception& e) {
+        LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+    }
+    return true;
+}
+
+bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
+{
+    int64_t nStart = GetTimeMillis();
+
+    int nLoaded = 0;
+    try {
+        ReadExternalBlockFile(chainparams, fileIn, dbp, [&](const std::shared_ptr<CBlock>& pblock, unsigned int nSize, CDiskBlockPos* dbpBlock) {
+            return LoadExternalBlock(chainparams, pblock, dbpBlock, nLoaded);
+        });
     } catch (const std::runtime_error& e) {
         AbortNode(std::string("System error: ") + e.what());
     }
@@ -4316,6 +5319,193 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
     return nLoaded > 0;
 }
 
+/**
+ * Reads the block files for -reindex on several threads. Each reader takes the
+ * next block file, deserializes its blocks and runs the context-free checks on
+ * them, and queues them for the thread loading them, which takes the blocks of
+ * one file after another, in order. Readers don't start on files more than
+ * one per reader ahead of the one being loaded, and only the reader of that
+ * file may queue more blocks once MAX_REINDEX_QUEUE_BYTES of them are queued.
+ */
+class BlockFileReaders
+{
+private:
+    struct QueuedBlock
+    {
+        std::shared_ptr<CBlock> block;
+        CDiskBlockPos pos;
+        unsigned int nSize;
+    };
+
+    struct File
+    {
+        std::deque<QueuedBlock> blocks;
+        bool fDone = false;
+    };
+
+    const CChainParams& chainparams;
+    const int nReaders;
+    boost::thread_group threads;
+    boost::mutex mutex;
+    //! Signalled when a block file may be read or more blocks may be queued
+    boost::condition_variable condRead;
+    //! Signalled when a block is queued or a file is done
+    boost::condition_variable condLoad;
+    //! Block files being read or waiting to be loaded
+    std::map<int, File> mapFiles;
+    //! The next file to be read, the file being loaded, and the first missing file
+    int nReadFile = 0;
+    int nLoadFile = 0;
+    int nEndFile = std::numeric_limits<int>::max();
+    size_t nQueuedBytes = 0;
+    bool fStop = false;
+
+    /**
+     * Queue a block of file nFile, waiting for room. Returns false if the
+     * readers are stopping, or loading the file was given up.
+     */
+    bool Queue(int nFile, QueuedBlock&& queued)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fStop && nFile != nLoadFile && nQueuedBytes >= MAX_REINDEX_QUEUE_BYTES)
+            condRead.wait(lock);
+        if (fStop || nFile < nLoadFile) return false;
+        nQueuedBytes += queued.nSize;
+        mapFiles[nFile].blocks.push_back(std::move(queued));
+        condLoad.notify_all();
+        return true;
+    }
+
+    void ReadFile(int nFile)
+    {
+        CDiskBlockPos pos(nFile, 0);
+        FILE* file = nullptr;
+        if (fs::exists(GetBlockPosFilename(pos, "blk")))
+            file = OpenBlockFile(pos, true); // Errors are logged in OpenBlockFile
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (file) {
+                mapFiles[nFile];
+            } else {
+                nEndFile = std::min(nEndFile, nFile);
+            }
+            condLoad.notify_all();
+        }
+        if (!file) return;
+        try {
+            ReadExternalBlockFile(chainparams, file, &pos, [&](const std::shared_ptr<CBlock>& pblock, unsigned int nSize, CDiskBlockPos* dbp) {
+                // Blocks that pass are marked as checked, so that AcceptBlock
+                // doesn't check them again; failures are found there.
+                CValidationState state;
+                CheckBlock(*pblock, state, chainparams.GetConsensus());
+                return Queue(nFile, QueuedBlock{pblock, *dbp, nSize});
+            });
+        } catch (const std::runtime_error& e) {
+            AbortNode(std::string("System error: ") + e.what());
+        }
+        boost::unique_lock<boost::mutex> lock(mutex);
+        auto it = mapFiles.find(nFile);
+        if (it != mapFiles.end()) {
+            it->second.fDone = true;
+            condLoad.notify_all();
+        }
+    }
+
+    void Thread()
+    {
+        RenameThread("bitcoin-reindex");
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (true) {
+            while (!fStop && nReadFile < nEndFile && nReadFile > nLoadFile + nReaders)
+                condRead.wait(lock);
+            if (fStop || nReadFile >= nEndFile) return;
+            int nFile = nReadFile++;
+            lock.unlock();
+            ReadFile(nFile);
+            lock.lock();
+        }
+    }
+
+public:
+    BlockFileReaders(const CChainParams& chainparamsIn, int nReadersIn) : chainparams(chainparamsIn), nReaders(nReadersIn)
+    {
+        for (int i = 0; i < nReaders; i++)
+            threads.create_thread([this] { Thread(); });
+    }
+
+    ~BlockFileReaders()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+            condRead.notify_all();
+        }
+        threads.interrupt_all();
+        threads.join_all();
+    }
+
+    /**
+     * Move on to loading block file nFile, dropping the blocks left queued for
+     * the file loaded before. Returns false if nFile doesn't exist.
+     */
+    bool Start(int nFile)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        auto it = mapFiles.find(nLoadFile);
+        if (it != mapFiles.end()) {
+            for (const QueuedBlock& queued : it->second.blocks)
+                nQueuedBytes -= queued.nSize;
+            mapFiles.erase(it);
+        }
+        nLoadFile = nFile;
+        condRead.notify_all();
+        while (nFile < nEndFile && !mapFiles.count(nFile))
+            condLoad.wait(lock);
+        return mapFiles.count(nFile);
+    }
+
+    /** Wait for the next block of the file being loaded. Returns false if there are no more. */
+    bool Next(std::shared_ptr<CBlock>& block, CDiskBlockPos& pos)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        File& file = mapFiles[nLoadFile];
+        while (file.blocks.empty() && !file.fDone)
+            condLoad.wait(lock);
+        if (file.blocks.empty())
+            return false;
+        QueuedBlock& queued = file.blocks.front();
+        block = std::move(queued.block);
+        pos = queued.pos;
+        nQueuedBytes -= queued.nSize;
+        file.blocks.pop_front();
+        condRead.notify_all();
+        return true;
+    }
+};
+
+bool ReindexBlockFiles(const CChainParams& chainparams)
+{
+    BlockFileReaders readers(chainparams, std::max(1, std::min(GetNumCores(), MAX_REINDEX_READ_THREADS)));
+    bool fLoaded = false;
+    for (int nFile = 0; readers.Start(nFile); nFile++) {
+        LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
+        int64_t nStart = GetTimeMillis();
+        int nLoaded = 0;
+        std::shared_ptr<CBlock> pblock;
+        CDiskBlockPos pos;
+        while (readers.Next(pblock, pos)) {
+            boost::this_thread::interruption_point();
+            if (!LoadExternalBlock(chainparams, pblock, &pos, nLoaded))
+                break;
+        }
+        if (nLoaded > 0) {
+            LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
+            fLoaded = true;
+        }
+    }
+    return fLoaded;
+}
+
 void CChainState::CheckBlockIndex(const Consensus::Params& consensusParams)
 {
     if (!fCheckBlockIndex) {
@@ -4531,6 +5721,8 @@ int VersionBitsTipStateSinceHeight(const Consensus::Params& params, Consensus::D
 }
 
 static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+/** Number of transactions LoadMempool reads ahead to verify together */
+static const size_t MEMPOOL_LOAD_BATCH_SIZE = 1000;
 
 bool LoadMempool(void)
 {
@@ -4557,22 +5749,39 @@ bool LoadMempool(void)
         }
         uint64_t num;
         file >> num;
-        while (num--) {
-            CTransactionRef tx;
-            int64_t nTime;
-            int64_t nFeeDelta;
-            file >> tx;
-            file >> nTime;
-            file >> nFeeDelta;
-
-            CAmount amountdelta = nFeeDelta;
-            if (amountdelta) {
-                mempool.PrioritiseTransaction(tx->GetHash(), amountdelta);
+        while (num) {
+            // Read transactions in batches, so that their scripts can be
+            // verified in parallel before they are accepted one by one.
+            std::vector<CTransactionRef> vtx;
+            std::vector<int64_t> vtime;
+            while (num && vtx.size() < MEMPOOL_LOAD_BATCH_SIZE) {
+                --num;
+                CTransactionRef tx;
+                int64_t nTime;
+                int64_t nFeeDelta;
+                file >> tx;
+                file >> nTime;
+                file >> nFeeDelta;
+
+                CAmount amountdelta = nFeeDelta;
+                if (amountdelta) {
+                    mempool.PrioritiseTransaction(tx->GetHash(), amountdelta);
+                }
+                if (nTime + nExpiryTimeout > nNow) {
+                    vtx.push_back(tx);
+                    vtime.push_back(nTime);
+                } else {
+                    ++expired;
+                }
             }
-            CValidationState state;
-            if (nTime + nExpiryTimeout > nNow) {
+            std::vector<COutPoint> coins_to_uncache;
+            PreVerifyTransactions(vtx, coins_to_uncache);
+
+            for (size_t i = 0; i < vtx.size(); ++i) {
+                const CTransactionRef& tx = vtx[i];
+                CValidationState state;
                 LOCK(cs_main);
-                AcceptToMemoryPoolWithTime(chainparams, mempool, state, tx, nullptr /* pfMissingInputs */, nTime,
+                AcceptToMemoryPoolWithTime(chainparams, mempool, state, tx, nullptr /* pfMissingInputs */, vtime[i],
                                            nullptr /* plTxnReplaced */, false /* bypass_limits */, 0 /* nAbsurdFee */);
                 if (state.IsValid()) {
                     ++count;
@@ -4587,8 +5796,10 @@ bool LoadMempool(void)
                         ++failed;
                     }
                 }
-            } else {
-                ++expired;
+            }
+            {
+                LOCK(cs_main);
+                UncacheUnspentCoins(coins_to_uncache);
             }
             if (ShutdownRequested())
                 return false;
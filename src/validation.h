@@ -32,6 +32,7 @@
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CBlockUndo;
 class CChainParams;
 class CCoinsViewDB;
 class CInv;
@@ -65,6 +66,10 @@ static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
 static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
 /** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
 static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -limitclustercount, max number of transactions in an in-mempool cluster */
+static const unsigned int DEFAULT_CLUSTER_LIMIT = 64;
+/** Default for -limitclustersize, maximum kilobytes of the transactions in an in-mempool cluster */
+static const unsigned int DEFAULT_CLUSTER_SIZE_LIMIT = 101;
 /** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
 static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 336;
 /** Maximum kilobytes for transactions to store for processing during reorg */
@@ -75,13 +80,26 @@ static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** The maximum number of threads reading block files during -reindex */
+static const int MAX_REINDEX_READ_THREADS = 4;
+/** The maximum size of the blocks read ahead of the one being loaded during -reindex */
+static const size_t MAX_REINDEX_QUEUE_BYTES = 2 * MAX_BLOCKFILE_SIZE;
 
-/** Maximum number of script-checking threads allowed */
-static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
+/** Number of blocks that can be requested at any given time from a single peer, unless its
+ *  block download target has been adapted to its measured rate and latency. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds for the adaptive number of blocks in flight from a single peer during block download. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER = 128;
+/** Number of blocks a peer must have delivered before its in-flight target is adapted to them. */
+static const int MIN_BLOCK_DOWNLOAD_SAMPLES = 8;
+/** A block that holds up the download window is requested from another peer once it has taken
+ *  this many times as long as its peer is expected to take to deliver a block... */
+static const int BLOCK_REREQUEST_FACTOR = 4;
+/** ...but not before it has been in flight for this long (in microseconds). */
+static const int64_t BLOCK_REREQUEST_MIN_DELAY = 1000000;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -101,6 +119,12 @@ static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
 static const unsigned int DATABASE_FLUSH_INTERVAL = 24 * 60 * 60;
+/** Time to wait (in seconds) between incremental writes of modified coins, once the coins cache is half full. */
+static const unsigned int DATABASE_INCREMENTAL_WRITE_INTERVAL = 10;
+/** Maximum number of modified coins written to the chainstate by one incremental write. */
+static const unsigned int MAX_INCREMENTAL_WRITE_COINS = 200000;
+/** Incremental writes leave coins created in the last this many blocks in the cache, as they are the most likely to be spent soon. */
+static const int INCREMENTAL_WRITE_MIN_COIN_DEPTH = 100;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 /** Average delay between local address broadcasts in seconds. */
@@ -130,6 +154,8 @@ static const int64_t MAX_FEE_ESTIMATION_TIP_AGE = 3 * 60 * 60;
 static const bool DEFAULT_PERMIT_BAREMULTISIG = true;
 static const bool DEFAULT_CHECKPOINTS_ENABLED = true;
 static const bool DEFAULT_TXINDEX = false;
+/** Default for -blockmmap */
+static const bool DEFAULT_BLOCK_MMAP = false;
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 /** Default for -persistmempool */
 static const bool DEFAULT_PERSIST_MEMPOOL = true;
@@ -168,12 +194,51 @@ extern CConditionVariable cvBlockChange;
 extern std::atomic_bool fImporting;
 extern std::atomic_bool fReindex;
 extern int nScriptCheckThreads;
-extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern bool fCheckBlockIndex;
 extern bool fCheckpointsEnabled;
+/** Whether blocks are read from block files mapped into memory */
+extern bool fBlockMmap;
 extern size_t nCoinCacheUsage;
+
+/** Statistics about writes of the coins cache to the chainstate database, guarded by cs_main. */
+struct CoinsWriteStats
+{
+    //! Number of full writes, after which the database is consistent with the tip
+    uint64_t flushes = 0;
+    int64_t last_flush_time = 0;
+    int64_t last_flush_duration = 0; //!< in microseconds
+    uint64_t last_flush_coins = 0;
+    //! Number of incremental writes of part of the modified coins
+    uint64_t incremental_writes = 0;
+    int64_t last_incremental_time = 0;
+    int64_t last_incremental_duration = 0; //!< in microseconds
+    uint64_t last_incremental_coins = 0;
+};
+extern CoinsWriteStats g_coins_write_stats;
+/** Use of the signature and script execution caches, guarded by cs_main */
+struct ValidationCacheUsage
+{
+    //! Number of transactions accepted to the mempool
+    uint64_t mempool_accepts = 0;
+    //! Number of times the caches grew because entries of mempool transactions were evicted before they were mined
+    uint64_t resizes = 0;
+    uint256 last_block_hash;
+    int last_block_height = -1;
+    //! Lookups made while connecting the last block
+    uint64_t last_block_sig_hits = 0;
+    uint64_t last_block_sig_misses = 0;
+    uint64_t last_block_script_hits = 0;
+    uint64_t last_block_script_misses = 0;
+    //! Entries evicted between the block before and the last block
+    uint64_t last_block_sig_evictions = 0;
+    uint64_t last_block_script_evictions = 0;
+    //! Transactions of the last block that were in the mempool, and those whose scripts weren't cached any more
+    uint64_t last_block_mempool_txs = 0;
+    uint64_t last_block_mempool_txs_missed = 0;
+};
+extern ValidationCacheUsage g_validation_cache_usage;
 /** A fee rate smaller than this is considered zero fee (for relaying, mining and transaction creation) */
 extern CFeeRate minRelayTxFee;
 /** Absolute maximum transaction fee (in satoshis) used by wallet and mempool (rejects high fee in sendrawtransaction) */
@@ -261,6 +326,8 @@ FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 fs::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp = nullptr);
+/** Import the blocks of all block files, reading them on several threads, for -reindex */
+bool ReindexBlockFiles(const CChainParams& chainparams);
 /** Ensures we have a genesis block in the block tree, possibly writing one to disk. */
 bool LoadGenesisBlock(const CChainParams& chainparams);
 /** Load the block tree and coins database from disk,
@@ -272,6 +339,12 @@ bool LoadChainTip(const CChainParams& chainparams);
 void UnloadBlockIndex();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the thread reading block inputs from the coins database ahead of ConnectBlock */
+void ThreadCoinsPrefetch();
+/** Run an instance of the thread verifying scripts for PreVerifyTransactions */
+void ThreadTxScriptCheck();
+/** Run the thread writing new blocks to disk */
+void ThreadBlockWriter();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
@@ -309,6 +382,29 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                         bool* pfMissingInputs, std::list<CTransactionRef>* plTxnReplaced,
                         bool bypass_limits, const CAmount nAbsurdFee);
 
+/**
+ * Verify the scripts of a batch of transactions about to be passed to
+ * AcceptToMemoryPool, on the transaction script check threads and without
+ * holding cs_main. Transactions whose scripts pass are recorded in the script
+ * execution cache, so AcceptToMemoryPool doesn't verify them again while
+ * holding it. For transactions whose scripts fail, the rejection is kept for
+ * AcceptToMemoryPool, which returns it without running the scripts again.
+ * Transactions that it would reject before verifying scripts are skipped.
+ * Returns the number of transactions verified.
+ *
+ * Coins that had to be fetched into the coins cache are left there for
+ * AcceptToMemoryPool and appended to coins_to_uncache, to be passed to
+ * UncacheUnspentCoins() once the batch has been through it.
+ */
+size_t PreVerifyTransactions(const std::vector<CTransactionRef>& txs, std::vector<COutPoint>& coins_to_uncache);
+
+/**
+ * Remove coins fetched by PreVerifyTransactions() from the coins cache again,
+ * unless a mempool transaction spends them, so that rejected transactions
+ * don't fill the cache.
+ */
+void UncacheUnspentCoins(const std::vector<COutPoint>& coins_to_uncache);
+
 /** Convert CValidationState to a human-readable message for logging */
 std::string FormatStateMessage(const CValidationState &state);
 
@@ -392,10 +488,22 @@ public:
 /** Initializes the script-execution cache */
 void InitScriptExecutionCache();
 
+struct ValidationCacheStats;
+/** Lookups in and size of the script execution cache. Requires cs_main. */
+ValidationCacheStats GetScriptExecutionCacheStats();
+
 
 /** Functions for disk access for blocks */
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/** Read the serialized block at pos, checking the message start and size stored before it */
+bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& message_start);
+/** Read the serialized block at pos, and check that it is the block with the given hash */
+bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CDiskBlockPos& pos, const uint256& hash, const CMessageHeader::MessageStartChars& message_start);
+/** Wait until the block at pos is on disk, if it is still queued for writing */
+void WaitForBlockWrite(const CDiskBlockPos& pos);
+
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex* pindex);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -428,6 +536,9 @@ public:
 /** Replay blocks that aren't fully applied to the database. */
 bool ReplayBlocks(const CChainParams& params, CCoinsView* view);
 
+/** Fill an empty chainstate from a UTXO snapshot written by dumptxoutset, and make the block it was taken at the tip. */
+bool LoadUTXOSnapshot(const fs::path& path, const CChainParams& chainparams, std::string& error);
+
 /** Find the last common block between the parameter chain and a locator. */
 CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& locator);
 
@@ -7,10 +7,15 @@
 - Start a single node and generate 3 blocks.
 - Stop the node and restart it with -reindex. Verify that the node has reindexed up to block 3.
 - Stop the node and restart it with -reindex-chainstate. Verify that the node has reindexed up to block 3.
+- Generate more blocks, rewrite the chain into several block files with the
+  blocks out of order, and verify that -reindex reaches the same tip.
 """
 
+from test_framework.mininode import MAGIC_BYTES
 from test_framework.test_framework import BitcoinTestFramework
-from test_framework.util import assert_equal
+from test_framework.util import assert_equal, hex_str_to_bytes, wait_until
+import os
+import struct
 import time
 
 class ReindexTest(BitcoinTestFramework):
@@ -30,11 +35,39 @@ class ReindexTest(BitcoinTestFramework):
         assert_equal(self.nodes[0].getblockcount(), blockcount)
         self.log.info("Success")
 
+    def reindex_out_of_order(self):
+        self.nodes[0].generatetoaddress(30, 'mneYUmWYsuk7kySiURxCi3AGxrAqZxLgPZ')
+        blockcount = self.nodes[0].getblockcount()
+        tip = self.nodes[0].getbestblockhash()
+        blocks = [hex_str_to_bytes(self.nodes[0].getblock(self.nodes[0].getblockhash(height), False)) for height in range(blockcount + 1)]
+        self.stop_nodes()
+
+        # Keep the genesis block at the start of the first file, and spread the
+        # others over three files, each with its blocks in reverse order, so
+        # that most parents are only found in a later file.
+        files = [[blocks[0]], [], []]
+        for height in reversed(range(1, blockcount + 1)):
+            files[height % 3].append(blocks[height])
+        blocks_dir = os.path.join(self.nodes[0].datadir, "regtest", "blocks")
+        for name in os.listdir(blocks_dir):
+            if name.startswith(("blk", "rev")):
+                os.remove(os.path.join(blocks_dir, name))
+        for n, file_blocks in enumerate(files):
+            with open(os.path.join(blocks_dir, "blk%05d.dat" % n), "wb") as f:
+                for block in file_blocks:
+                    f.write(MAGIC_BYTES["regtest"] + struct.pack("<I", len(block)) + block)
+
+        self.start_nodes([["-reindex", "-checkblockindex=1"]])
+        wait_until(lambda: self.nodes[0].getblockcount() == blockcount, timeout=60)
+        assert_equal(self.nodes[0].getbestblockhash(), tip)
+        self.log.info("Success")
+
     def run_test(self):
         self.reindex(False)
         self.reindex(True)
         self.reindex(False)
         self.reindex(True)
+        self.reindex_out_of_order()
 
 if __name__ == '__main__':
     ReindexTest().main()